@@ -0,0 +1,132 @@
+//
+//  Irondomo CURVE I/O thread benchmark
+//  For 1, 2, 4 and 8 CURVE I/O threads, starts a broker in a fresh
+//  process, a pool of echo workers on the CLEAR socket, and as many
+//  concurrent clients on each socket in turn, then reports CLEAR and
+//  CURVE round trips per second. Each run needs its own process because
+//  the I/O thread count is fixed once the first socket is created.
+//
+//  g++ -std=c++11 -O2 -I ../include bench_curve_threads.cpp -lczmq -lzmq -lpthread -o bench_curve_threads
+//
+
+//  Lets us build this source without creating a library
+#include "idpwrkapi.cpp"
+#include "idpbroker.h"
+#include <thread>
+#include <atomic>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CLIENTS 16
+#define WORKERS 8
+#define SECONDS 5
+#define PAYLOAD 512
+
+class echo_worker : public IDP::IDPWorker
+{
+  public:
+    echo_worker(const std::string &zmqHost, const std::string &service) : IDP::IDPWorker(zmqHost, service) {}
+
+  private:
+    std::vector<std::pair<unsigned char *, size_t>> callback(const std::vector<std::pair<unsigned char *, size_t>> &parts) override
+    {
+        std::vector<std::pair<unsigned char *, size_t>> reply_vector;
+        for (auto it = parts.begin(); it != parts.end(); it++)
+            reply_vector.push_back(*it);
+        return reply_vector;
+    }
+};
+
+static std::atomic<bool> s_running;
+static std::atomic<uint64_t> s_replies;
+
+//  Client speaking IDPC01 over a bare REQ socket, so all of its time goes
+//  on the wire and in the broker rather than in the client API
+
+static void
+s_client(const char *endpoint, const char *server_key)
+{
+    zsock_t *client = zsock_new(ZMQ_REQ);
+    zcert_t *cert = NULL;
+    if (server_key)
+    {
+        cert = zcert_new();
+        zcert_apply(cert, client);
+        zsock_set_curve_serverkey(client, server_key);
+    }
+    zsock_connect(client, "%s", endpoint);
+    byte payload[PAYLOAD] = {0};
+
+    while (s_running)
+    {
+        zmsg_t *request = zmsg_new();
+        zmsg_addstr(request, IDPC_CLIENT);
+        zmsg_addstr(request, "echo");
+        zmsg_addmem(request, payload, sizeof(payload));
+        zmsg_send(&request, client);
+        zmsg_t *reply = zmsg_recv(client);
+        if (!reply)
+            break; //  Interrupted
+        zmsg_destroy(&reply);
+        s_replies++;
+    }
+    zsock_destroy(&client);
+    zcert_destroy(&cert);
+}
+
+static double
+s_measure(const char *endpoint, const char *server_key)
+{
+    s_replies = 0;
+    s_running = true;
+    std::vector<std::thread> clients;
+    for (int index = 0; index < CLIENTS; index++)
+        clients.push_back(std::thread(s_client, endpoint, server_key));
+    zclock_sleep(SECONDS * 1000);
+    s_running = false;
+    for (auto it = clients.begin(); it != clients.end(); it++)
+        it->join();
+    return (double)s_replies / SECONDS;
+}
+
+static void
+s_run(int io_threads)
+{
+    zcert_t *server = zcert_new();
+    std::pair<std::string, std::string> credentials(zcert_public_txt(server), zcert_secret_txt(server));
+
+    //  The broker must create the first sockets in the process
+    IDP::IDPBroker *broker = new IDP::IDPBroker("tcp://127.0.0.1:5600", "tcp://127.0.0.1:5601", &credentials, "", false, false, io_threads);
+    std::thread(&IDP::IDPBroker::loop, broker).detach();
+
+    for (int index = 0; index < WORKERS; index++)
+        std::thread([]() {
+            echo_worker worker("tcp://127.0.0.1:5600", "echo");
+            worker.startWorker();
+            worker.loop();
+        }).detach();
+    zclock_sleep(500);
+
+    double clear = s_measure("tcp://127.0.0.1:5600", NULL);
+    double curve = s_measure("tcp://127.0.0.1:5601", zcert_public_txt(server));
+    printf("%d CURVE I/O threads: CLEAR %9.1f req/s CURVE %9.1f req/s (%5.1f%%)\n",
+           io_threads, clear, curve, 100.0 * curve / clear);
+    fflush(stdout);
+
+    //  Workers and broker loop forever; the process exit tears them down
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int io_threads[] = {1, 2, 4, 8};
+    printf("%d clients, %d workers, %d byte requests, %d seconds per run\n", CLIENTS, WORKERS, PAYLOAD, SECONDS);
+    for (size_t index = 0; index < sizeof(io_threads) / sizeof(io_threads[0]); index++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            s_run(io_threads[index]);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
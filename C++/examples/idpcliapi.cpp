@@ -16,6 +16,9 @@ IDP::IDPClient::IDPClient(const std::string &zmqHost, const std::string &identit
     _verbose = verbose;
     _timeout = timeout;
     _retries = retries;
+    _sendTtl = false;
+    _priority = IDP_PRIORITY_NORMAL;
+    _idempotent = false;
     _clientCert = nullptr;
     _client = nullptr;
     _poller = nullptr;
@@ -94,6 +97,22 @@ void IDP::IDPClient::setRetries(int retries)
     _retries = retries;
 }
 
+void IDP::IDPClient::setSendTtl(bool sendTtl)
+{
+    _sendTtl = sendTtl;
+}
+
+void IDP::IDPClient::setPriority(int priority)
+{
+    assert(priority >= 0 && priority < IDP_PRIORITY_CLASSES);
+    _priority = priority;
+}
+
+void IDP::IDPClient::setIdempotent(bool idempotent)
+{
+    _idempotent = idempotent;
+}
+
 std::vector<std::string> IDP::IDPClient::send(const std::string &service, const std::vector<std::string> &parts)
 {
     std::vector<std::string> result;
@@ -107,8 +126,22 @@ std::vector<std::string> IDP::IDPClient::send(const std::string &service, const
     //  Prefix request with protocol frames
     //  Frame 1: "IDPCxy" (six bytes, IDP/Client x.y)
     //  Frame 2: Service name (printable string)
+    //  Frame 3: Properties, with IDPC02 only
+    IDP::IDPProps props;
+    if (_sendTtl)
+        props.put_uint(IDP_PROP_TTL, _timeout);
+    if (_priority != IDP_PRIORITY_NORMAL)
+        props.put_uint(IDP_PROP_PRIORITY, _priority);
+    if (_idempotent)
+    {
+        zuuid_t *key = zuuid_new();
+        props.put(IDP_PROP_IDEMPOTENCY_KEY, zuuid_data(key), zuuid_size(key));
+        zuuid_destroy(&key);
+    }
+    if (props.size())
+        zmsg_push(request, props.frame());
     zmsg_pushstr(request, service.c_str());
-    zmsg_pushstr(request, IDPC_CLIENT);
+    zmsg_pushstr(request, props.size() ? IDPC_CLIENT_PROPS : IDPC_CLIENT);
     if (_verbose)
     {
         zclock_log("I: send request to '%s' service:", service.c_str());
@@ -150,7 +183,8 @@ std::vector<std::string> IDP::IDPClient::send(const std::string &service, const
             assert(zmsg_size(msg) >= 3);
 
             zframe_t *header = zmsg_pop(msg);
-            assert(zframe_streq(header, IDPC_CLIENT));
+            bool has_props = zframe_streq(header, IDPC_CLIENT_PROPS);
+            assert(has_props || zframe_streq(header, IDPC_CLIENT));
             zframe_destroy(&header);
 
             zframe_t *reply_service = zmsg_pop(msg);
@@ -158,6 +192,21 @@ std::vector<std::string> IDP::IDPClient::send(const std::string &service, const
             zframe_destroy(&reply_service);
 
             zmsg_destroy(&request);
+            //  The broker refuses a request with a status property
+            if (has_props)
+            {
+                zframe_t *props = zmsg_pop(msg);
+                uint64_t status = 0;
+                IDP::IDPProps::get_uint(props, IDP_PROP_STATUS, &status);
+                zframe_destroy(&props);
+                if (status)
+                {
+                    if (_verbose)
+                        zclock_log("W: request refused with status %d", (int)status);
+                    zmsg_destroy(&msg);
+                    throw IDP::statusException((int)status);
+                }
+            }
             char *popstr = zmsg_popstr(msg);
             while (popstr != nullptr)
             {
@@ -210,8 +259,22 @@ std::vector<std::string> IDP::IDPClient::sendraw(const std::string &service, con
     //  Prefix request with protocol frames
     //  Frame 1: "IDPCxy" (six bytes, IDP/Client x.y)
     //  Frame 2: Service name (printable string)
+    //  Frame 3: Properties, with IDPC02 only
+    IDP::IDPProps props;
+    if (_sendTtl)
+        props.put_uint(IDP_PROP_TTL, _timeout);
+    if (_priority != IDP_PRIORITY_NORMAL)
+        props.put_uint(IDP_PROP_PRIORITY, _priority);
+    if (_idempotent)
+    {
+        zuuid_t *key = zuuid_new();
+        props.put(IDP_PROP_IDEMPOTENCY_KEY, zuuid_data(key), zuuid_size(key));
+        zuuid_destroy(&key);
+    }
+    if (props.size())
+        zmsg_push(request, props.frame());
     zmsg_pushstr(request, service.c_str());
-    zmsg_pushstr(request, IDPC_CLIENT);
+    zmsg_pushstr(request, props.size() ? IDPC_CLIENT_PROPS : IDPC_CLIENT);
     if (_verbose)
     {
         zclock_log("I: send request to '%s' service:", service.c_str());
@@ -238,7 +301,8 @@ std::vector<std::string> IDP::IDPClient::sendraw(const std::string &service, con
             assert(zmsg_size(msg) >= 3);
 
             zframe_t *header = zmsg_pop(msg);
-            assert(zframe_streq(header, IDPC_CLIENT));
+            bool has_props = zframe_streq(header, IDPC_CLIENT_PROPS);
+            assert(has_props || zframe_streq(header, IDPC_CLIENT));
             zframe_destroy(&header);
 
             zframe_t *reply_service = zmsg_pop(msg);
@@ -246,6 +310,21 @@ std::vector<std::string> IDP::IDPClient::sendraw(const std::string &service, con
             zframe_destroy(&reply_service);
 
             zmsg_destroy(&request);
+            //  The broker refuses a request with a status property
+            if (has_props)
+            {
+                zframe_t *props = zmsg_pop(msg);
+                uint64_t status = 0;
+                IDP::IDPProps::get_uint(props, IDP_PROP_STATUS, &status);
+                zframe_destroy(&props);
+                if (status)
+                {
+                    if (_verbose)
+                        zclock_log("W: request refused with status %d", (int)status);
+                    zmsg_destroy(&msg);
+                    throw IDP::statusException((int)status);
+                }
+            }
             char *popstr = zmsg_popstr(msg);
             while (popstr != nullptr)
             {
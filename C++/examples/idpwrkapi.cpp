@@ -73,7 +73,10 @@ IDP::IDPWorker::IDPWorker(const std::string &zmqHost, const std::string &service
     _workerCert = nullptr;
     _worker = nullptr;
     _poller = nullptr;
-    _expect_reply = 0;
+    _deadline = 0;
+    _maxAge = 0;
+    _credit = 1;
+    _brokerProps = false;
 }
 
 IDP::IDPWorker::~IDPWorker()
@@ -138,7 +141,15 @@ void IDP::IDPWorker::startWorker()
     if (_verbose)
         zclock_log("I: connecting to broker at %s...", _zmqHost.c_str());
 
-    this->send_to_broker(IDPW_READY, (char *)_service.c_str(), NULL);
+    //  Register service with broker, asking for request properties and
+    //  telling it our credit
+    IDP::IDPProps props;
+    props.put_uint(IDP_PROP_CREDIT, _credit);
+    zmsg_t *ready = zmsg_new();
+    zmsg_push(ready, props.frame());
+    this->send_to_broker(IDPW_READY, (char *)_service.c_str(), ready);
+    zmsg_destroy(&ready);
+    _brokerProps = false;
 
     _liveness = _retries;
     _heartbeat_at = zclock_time() + _heartbeat;
@@ -159,6 +170,17 @@ void IDP::IDPWorker::setReconnectTimeout(int reconnect_timeout)
     _reconnect_timeout = reconnect_timeout;
 }
 
+void IDP::IDPWorker::setCredit(int credit)
+{
+    _credit = credit > 0 ? credit : 1;
+    if (_worker != nullptr && _brokerProps)
+    {
+        IDP::IDPProps props;
+        props.put_uint(IDP_PROP_CREDIT, _credit);
+        this->send_to_broker_props(IDPW_HEARTBEAT, props.frame(), NULL);
+    }
+}
+
 void IDP::IDPWorker::send_to_broker(char const *command, char const *option, zmsg_t *msg)
 {
     msg = msg ? zmsg_dup(msg) : zmsg_new();
@@ -180,38 +202,62 @@ void IDP::IDPWorker::send_to_broker(char const *command, char const *option, zms
 }
 
 //  ---------------------------------------------------------------------
-//  Send reply, if any, to broker and wait for next request.
+//  Send an IDPW02 message, with a properties frame after the command.
+//  Takes ownership of the properties frame.
 
-zmsg_t *IDP::IDPWorker::receive(zmsg_t **reply_p)
+void IDP::IDPWorker::send_to_broker_props(char const *command, zframe_t *props, zmsg_t *msg)
 {
-    //  Format and send the reply if we were provided one
-    assert(reply_p);
-    zmsg_t *reply = *reply_p;
-    assert(reply || !_expect_reply);
-    if (reply)
+    msg = msg ? zmsg_dup(msg) : zmsg_new();
+    zmsg_push(msg, props);
+    zmsg_pushstr(msg, command);
+    zmsg_pushstr(msg, IDPW_WORKER_PROPS);
+    zmsg_pushstr(msg, "");
+
+    if (_verbose)
     {
-        if (_reply_to_clear)
-        {
-            zmsg_wrap(reply, _reply_to_clear);
-            this->send_to_broker(IDPW_REPLY, NULL, reply);
-        }
-        else if (_reply_to_curve)
-        {
-            zmsg_wrap(reply, _reply_to_curve);
-            this->send_to_broker(IDPW_REPLY_CURVE, NULL, reply);
-        }
-        else
-        {
-            zclock_log("E: MISSING REPLY!");
-        }
+        zclock_log("I: sending %s to broker",
+                   idps_commands[(int)*command]);
+        zmsg_dump(msg);
+    }
+    zmsg_send(&msg, _worker);
+}
+
+//  ---------------------------------------------------------------------
+//  Send the reply to a request and destroy its envelope. Takes ownership
+//  of the reply message.
 
-        zmsg_destroy(reply_p);
+void IDP::IDPWorker::send_reply(envelope_t **envelope_p, zmsg_t **reply_p)
+{
+    assert(envelope_p && *envelope_p);
+    assert(reply_p && *reply_p);
+    envelope_t *envelope = *envelope_p;
+    char const *command = envelope->curve ? IDPW_REPLY_CURVE : IDPW_REPLY;
+
+    zmsg_wrap(*reply_p, envelope->address);
+    if (envelope->props)
+    {
+        IDP::IDPProps props;
+        props.put_uint(IDP_PROP_REQUEST_ID, envelope->id);
+        if (envelope->max_age)
+            props.put_uint(IDP_PROP_MAX_AGE, envelope->max_age);
+        this->send_to_broker_props(command, props.frame(), *reply_p);
     }
-    _expect_reply = 1;
+    else
+        this->send_to_broker(command, NULL, *reply_p);
+    zmsg_destroy(reply_p);
+    delete envelope;
+    *envelope_p = NULL;
+}
 
+//  ---------------------------------------------------------------------
+//  Wait for the next request, sending heartbeats while we wait. Returns
+//  the request and its reply envelope, or NULL if interrupted.
+
+zmsg_t *IDP::IDPWorker::receive(envelope_t **envelope_p)
+{
+    assert(envelope_p);
     while (true)
     {
-
         zsock_t *which = (zsock_t *)zpoller_wait(_poller, _heartbeat * ZMQ_POLL_MSEC);
 
         if (which == NULL)
@@ -242,17 +288,37 @@ zmsg_t *IDP::IDPWorker::receive(zmsg_t **reply_p)
             zframe_destroy(&empty);
 
             zframe_t *header = zmsg_pop(msg);
-            assert(zframe_streq(header, IDPW_WORKER));
+            bool props = zframe_streq(header, IDPW_WORKER_PROPS);
+            assert(props || zframe_streq(header, IDPW_WORKER));
             zframe_destroy(&header);
+            if (props)
+                _brokerProps = true;
 
             zframe_t *command = zmsg_pop(msg);
             if (zframe_streq(command, IDPW_REQUEST) || zframe_streq(command, IDPW_REQUEST_CURVE))
             {
+                envelope_t *envelope = new envelope_t();
+                envelope->curve = zframe_streq(command, IDPW_REQUEST_CURVE);
+                envelope->props = props;
+
+                //  IDPW02 requests carry properties before the client
+                //  envelope: the request id, and a TTL that tells us when
+                //  the client gives up
+                if (props)
+                {
+                    zframe_t *props_frame = zmsg_pop(msg);
+                    uint64_t value;
+                    if (IDP::IDPProps::get_uint(props_frame, IDP_PROP_REQUEST_ID, &value))
+                        envelope->id = (uint32_t)value;
+                    if (IDP::IDPProps::get_uint(props_frame, IDP_PROP_TTL, &value))
+                        envelope->deadline = zclock_time() + (int64_t)(value < INT32_MAX ? value : INT32_MAX);
+                    zframe_destroy(&props_frame);
+                }
                 //  We should pop and save as many addresses as there are
                 //  up to a null part, but for now, just save one...
-                _reply_to_clear = zframe_streq(command, IDPW_REQUEST) ? zmsg_unwrap(msg) : NULL;
-                _reply_to_curve = zframe_streq(command, IDPW_REQUEST_CURVE) ? zmsg_unwrap(msg) : NULL;
+                envelope->address = zmsg_unwrap(msg);
                 zframe_destroy(&command);
+                *envelope_p = envelope;
                 //  .split process message
                 //  Here is where we actually have a message to process; we
                 //  return it to the caller application:
@@ -290,16 +356,31 @@ zmsg_t *IDP::IDPWorker::receive(zmsg_t **reply_p)
     return NULL;
 }
 
+int64_t IDP::IDPWorker::remaining() const
+{
+    if (!_deadline)
+        return -1;
+    int64_t remaining = _deadline - zclock_time();
+    return remaining > 0 ? remaining : 0;
+}
+
+void IDP::IDPWorker::setMaxAge(int64_t max_age)
+{
+    _maxAge = max_age > 0 ? max_age : 0;
+}
+
 void IDP::IDPWorker::loop(void)
 {
-    zmsg_t *reply = NULL;
     while (true)
     {
         std::vector<std::pair<unsigned char *, size_t>> request_vector;
         std::vector<zframe_t *> request_parts;
-        zmsg_t *request = this->receive(&reply);
+        envelope_t *envelope = NULL;
+        zmsg_t *request = this->receive(&envelope);
         if (request == NULL)
             break; //  Worker was interrupted
+        _deadline = envelope->deadline;
+        _maxAge = 0;
 
         zframe_t *part = zmsg_pop(request);
         unsigned char *frame_data = NULL;
@@ -315,11 +396,13 @@ void IDP::IDPWorker::loop(void)
         }
         zmsg_destroy(&request);
         std::vector<std::pair<unsigned char *, size_t>> reply_vector = this->callback(request_vector);
-        reply = zmsg_new();
+        zmsg_t *reply = zmsg_new();
         for (auto it = reply_vector.begin(); it != reply_vector.end(); it++)
         {
             zmsg_pushmem(reply, it->first, it->second);
         }
+        envelope->max_age = _maxAge;
+        this->send_reply(&envelope, &reply);
         for (auto it = request_parts.begin(); it != request_parts.end(); it++)
         {
             zframe_destroy(&(*it));
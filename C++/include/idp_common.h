@@ -35,6 +35,37 @@
 //  This is the version of IDP/Worker we implement
 #define IDPW_WORKER         "IDPW01"
 
+//  Same protocols with a properties frame: IDPC02 requests carry one
+//  after the service name, IDPW02 messages one after the command. A
+//  worker asks for IDPW02 by sending a properties frame after its
+//  service name in READY, and answers IDPW02 requests in IDPW02.
+//  Worker replies to clients use IDPC01. An IDPC02 request the broker
+//  refuses gets an IDPC02 reply with IDP_PROP_STATUS and no body, so a
+//  client never takes the refusal for data; an IDPC01 one gets no reply.
+#define IDPC_CLIENT_PROPS   "IDPC02"
+#define IDPW_WORKER_PROPS   "IDPW02"
+
+//  Properties are a run of tag, length, value entries, one byte each for
+//  tag and length. Integer values are unsigned, in network byte order.
+#define IDP_PROP_TTL        1   //  Msecs the client will wait for a reply
+#define IDP_PROP_PRIORITY   2   //  Priority class, one of IDP_PRIORITY_*
+#define IDP_PROP_CREDIT     3   //  Requests a worker will take at once
+#define IDP_PROP_REQUEST_ID 4   //  Request a worker reply answers
+#define IDP_PROP_MAX_AGE    5   //  Msecs a broker may answer the same request with this reply
+#define IDP_PROP_IDEMPOTENCY_KEY 6 //  Client key that is the same on every resend of a request
+#define IDP_PROP_STATUS     7   //  Why the broker refused a request, one of IDP_STATUS_*
+
+//  Statuses the broker refuses requests with, as in HTTP
+#define IDP_STATUS_RATE_LIMITED 429 //  Client is over its rate limit
+#define IDP_STATUS_UNAVAILABLE  503 //  Service is full, overloaded or failing
+
+//  Priority classes, served highest first; requests that do not say
+//  are IDP_PRIORITY_NORMAL
+#define IDP_PRIORITY_HIGH       0
+#define IDP_PRIORITY_NORMAL     1
+#define IDP_PRIORITY_LOW        2
+#define IDP_PRIORITY_CLASSES    3
+
 //  IDP/Server commands, as strings
 #define IDPW_READY          "\001"
 #define IDPW_REQUEST        "\002"
@@ -66,6 +97,20 @@ class sendFailedException: public std::exception
   }
 };
 
+//  The broker refused the request; status() is one of IDP_STATUS_*
+class statusException: public std::exception
+{
+public:
+  explicit statusException(int status): _status(status) {}
+  int status() const { return _status; }
+  virtual const char* what() const throw()
+  {
+    return _status == IDP_STATUS_RATE_LIMITED ? "Request Rate Limited" : "Service Unavailable";
+  }
+private:
+  int _status;
+};
+
 }
 
 
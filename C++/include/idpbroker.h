@@ -10,10 +10,60 @@
 
 #include "czmq.h"
 #include "idp_common.h"
+#include "idptable.h"
+#include "idplist.h"
+#include "idpheap.h"
+#include "idptimer.h"
+#include "idppool.h"
+#include "idpprops.h"
 
 #define HEARTBEAT_LIVENESS 3    //  3-5 is reasonable
 #define HEARTBEAT_INTERVAL 2500 //  msecs
 #define HEARTBEAT_EXPIRY HEARTBEAT_INTERVAL *HEARTBEAT_LIVENESS
+#define BATCH_BUDGET 64         //  Messages per socket per wakeup
+#define TIMER_INTERVAL 100      //  msecs, longest wait between timer checks
+#define MAX_CURVE_IO_THREADS 30 //  czmq takes ZMQ_AFFINITY as an int, bit 0 is CLEAR
+#define SERVICE_MAX_REQUESTS 0  //  Default queued requests per service, 0 = no limit
+#define SERVICE_MAX_BYTES 0     //  Default queued bytes per service, 0 = no limit
+#define SERVICE_CODEL_TARGET 0  //  Default msecs of acceptable queue wait, 0 = no CoDel
+#define SERVICE_CODEL_INTERVAL 100 //  Default msecs wait may exceed target before dropping
+#define PRIORITY_MAX_PASSED 8   //  Dispatches a waiting priority class may be passed over
+#define REQUEST_MAX_TTL INT32_MAX //  Longest TTL we honour, in msecs; longer ones are cut to it
+#define SERVICE_WAIT_BUCKETS 16 //  Queue wait histogram buckets, log2 msecs
+#define WORKER_MAX_CREDIT 256   //  Most requests we keep in flight to one worker
+#define WORKER_EWMA_WEIGHT 8    //  Service time samples in the worker moving average
+#define SERVICE_IDEMPOTENCY_KEYS 1024   //  Default idempotency keys per service, 0 = ignore them
+#define SERVICE_IDEMPOTENCY_WINDOW 10000 //  Default msecs a reply stays recorded under its key
+#define SERVICE_MAX_ATTEMPTS 1  //  Default workers a request may be sent to, 1 = never reassigned
+#define SERVICE_LATENCY_BUCKETS 32   //  Service time histogram buckets, log2 usecs
+#define SERVICE_LATENCY_WINDOW 1024  //  Service time samples before the histogram is halved
+#define SERVICE_LATENCY_MIN_SAMPLES 20 //  Service time samples needed before we trust percentiles
+#define SERVICE_HEDGE_BURST 10       //  Hedges a service may save up budget for
+#define SERVICE_OUTLIER_BACKOFF 1000      //  Default msecs of a first ejection, doubling with each strike
+#define SERVICE_OUTLIER_MAX_BACKOFF 60000 //  Longest ejection, in msecs
+#define SERVICE_OUTLIER_MIN_SAMPLES 5     //  Replies a worker gives before we judge its service time
+#define SERVICE_OUTLIER_MEMORY 300000     //  Msecs the strikes of a lost worker are remembered
+#define SERVICE_OUTLIERS 1024             //  Most lost workers a service remembers strikes for
+#define SERVICE_PROBE_REQUESTS 5          //  Good replies that end a worker's probation
+#define SERVICE_PROBE_INTERVAL 100        //  Msecs between requests to a worker on probation
+#define SERVICE_BREAKER_MIN_REQUESTS 20   //  Outcomes needed before the error rate can open the breaker
+#define SERVICE_BREAKER_WINDOW 100        //  Outcomes before the error counts are halved
+#define SERVICE_BREAKER_COOLDOWN 5000     //  Msecs the error rate keeps the breaker open
+#define SERVICE_IDLE_TIMEOUT 600000       //  Default msecs a service without workers or clients is kept
+#define SERVICE_MAX_IDLE 0                //  Default services without workers kept at once, 0 = no limit
+#define CLIENT_MAX_BUCKETS 65536          //  Most clients we keep a rate limit and counters for
+
+//  How a service picks among its waiting workers
+#define BALANCE_ROUND_ROBIN 0       //  Longest idle first, spreads work evenly
+#define BALANCE_LIFO 1              //  Most recently idle first, caches still warm
+#define BALANCE_LEAST_OUTSTANDING 2 //  Fewest requests in flight first
+#define BALANCE_EWMA 3              //  Lowest service time times requests in flight
+#define BALANCE_STRATEGIES 4
+
+//  How far a service trusts a worker
+#define WORKER_HEALTHY 0 //  Takes its full credit
+#define WORKER_EJECTED 1 //  Takes nothing until its ejection ends
+#define WORKER_PROBING 2 //  Takes one request at a time, now and then
 
 namespace IDP
 {
@@ -21,39 +71,342 @@ namespace IDP
   class IDPBroker
   {
 
+    struct worker_t;
+    struct cache_entry_t;
+    struct idempotency_entry_t;
+    struct outlier_t;
+    struct flow_t;
+
+    //  .split request class structure
+    //  A client request queued on a service until a worker is free, then
+    //  kept on the worker's in flight list until the worker replies. With
+    //  single flight, identical requests park on it meanwhile, and so do
+    //  client resends that carry its idempotency key. A hedged request
+    //  has a twin, a copy sent to a second worker; whichever answers
+    //  first answers the client:
+
+    struct request_t
+    {
+      IDPListLink<request_t> link; //  Hook for service->requests, worker->in_flight or a leader's followers
+      IDPHeapLink<request_t> queue_link; //  Hook for service->queues or our flow, keyed by deadline
+      zmsg_t *msg;                 //  Request, wrapped in the client envelope
+      size_t size;                 //  Bytes of msg, counted against the service
+      int64_t enqueued;            //  When the request was queued, in msecs
+      int64_t deadline;            //  When the client stops waiting, 0 if never
+      int priority;                //  Priority class
+      zframe_t *key;               //  Request frames, if the service caches or coalesces
+      IDPList<request_t> followers; //  Identical requests waiting for our reply
+      bool leads;                  //  We are in service->flights
+      idempotency_entry_t *idempotency; //  Where to record our reply, if the client sent a key
+      uint32_t id;                 //  Request id, once sent to a worker
+      int64_t dispatched;          //  When we sent it to a worker, in msecs
+      int64_t sent;                //  Same, in usecs, to measure service time
+      int attempts;                //  Workers we have sent it to
+      worker_t *worker;            //  Worker that has it, while in flight
+      IDPTimer hedge_timer;        //  When to hedge, if the service hedges
+      request_t *twin;             //  Other copy of a hedged request, while both are in flight
+      bool hedge;                  //  We are the copy sent to hedge
+      bool discard;                //  Our twin was answered; drop our reply
+      flow_t *flow;                //  Client queue we wait in, while queued in fair queuing mode
+      zframe_t *client;            //  CURVE public key of the client, once fair queuing looked for it
+      bool clear;                  //  Came in on the CLEAR socket
+      bool props;                  //  Came as IDPC02, so a refusal gets a status reply
+    };
+
+  public:
+    //  .split service limits
+    //  How a service queues and dispatches its requests. Past either queue
+    //  limit new requests get a status 503 reply at once. Each setting has a
+    //  setter, for services without settings of their own and for one
+    //  service, that tells what it does:
+
+    typedef struct
+    {
+      size_t max_requests;    //  Queued requests, 0 = no limit
+      size_t max_bytes;       //  Queued request bytes, 0 = no limit
+      int64_t codel_target;   //  Acceptable queue wait in msecs, 0 = no CoDel
+      int64_t codel_interval; //  Msecs wait may stay above target
+      int balance;            //  Balancing strategy, one of BALANCE_*
+      size_t cache_max_bytes; //  Bytes of cached replies, 0 = no cache
+      bool coalesce;          //  Single flight for identical requests
+      size_t idempotency_keys;    //  Idempotency keys remembered, 0 = ignore them
+      int64_t idempotency_window; //  Msecs a reply stays recorded under its key
+      int max_attempts;       //  Workers a request may be sent to, 1 = never reassigned
+      int hedge_budget;       //  Hedges per hundred requests, 0 = no hedging
+      int outlier_factor;     //  Eject workers this many times slower than the median, 0 = never
+      int64_t outlier_backoff; //  Msecs of a first ejection
+      int64_t breaker_grace;  //  Msecs without workers before the breaker opens, 0 = never
+      int breaker_error_rate; //  Percent of requests lost with their worker that opens it, 0 = never
+      bool fair;              //  Queue per client and serve clients in turn
+    } service_limits_t;
+
+    typedef struct
+    {
+      size_t queued;       //  Requests waiting for a worker
+      size_t queued_bytes; //  Bytes of those requests
+      size_t workers;      //  Workers registered for the service
+      size_t waiting;      //  Workers free for a request
+      uint64_t rejected;   //  Requests refused with status 503 by the queue limits
+      uint64_t dropped;    //  Requests dropped with status 503 by CoDel
+      uint64_t expired;    //  Requests dropped unanswered past their deadline
+      uint64_t cache_hits;   //  Requests answered from the reply cache
+      uint64_t cache_misses; //  Requests the cache had no fresh reply for
+      size_t cache_entries;  //  Replies in the cache
+      size_t cache_bytes;    //  Bytes of those replies and their keys
+      uint64_t flights;      //  Requests sent on to a worker in single flight mode
+      uint64_t coalesced;    //  Requests that shared the reply of such a flight
+      size_t idempotency_keys; //  Idempotency keys remembered
+      uint64_t resends;      //  Requests whose idempotency key was already known
+      uint64_t reassigned;   //  Requests requeued because their worker was lost
+      uint64_t hedged;       //  Copies of slow requests sent to a second worker
+      uint64_t hedge_wins;   //  Hedged requests the copy answered first
+      int64_t service_time_p95; //  Usecs under which 95% of recent requests were answered, 0 if unknown
+      size_t ejected;        //  Workers ejected or on probation
+      uint64_t ejections;    //  Times a worker was ejected
+      bool breaker_open;     //  Requests are refused with status 503 at once
+      uint64_t short_circuited; //  Requests refused or flushed by the open breaker
+      size_t fair_queues;    //  Client queues with requests in them, in fair queuing mode
+      size_t queued_class[IDP_PRIORITY_CLASSES]; //  Queued requests by priority class
+      //  Dispatched requests by priority class and time spent queued.
+      //  Bucket 0 counts waits under 1 msec, bucket n waits of 2^(n-1)
+      //  up to 2^n msecs; the last bucket also counts anything longer.
+      uint64_t wait[IDP_PRIORITY_CLASSES][SERVICE_WAIT_BUCKETS];
+    } service_stats_t;
+
+    //  Requests one client sent past the rate limit check
+
+    typedef struct
+    {
+      uint64_t admitted; //  Requests let through
+      uint64_t rejected; //  Requests refused with status 429
+      int rate;          //  Requests per second it may send, 0 = no limit
+      int burst;         //  Requests it may send at once
+    } client_stats_t;
+
+  private:
+
     //  .split service class structure
     //  The service class defines a single service instance:
 
+    struct service_t
+    {
+      IDP::IDPBroker *broker;      //  Broker instance
+      char *name;                  //  Service name
+      uint32_t hash;               //  Hash of name, our key in broker->_services
+      zframe_t *name_frame;        //  Service name, prebuilt for replies
+      zframe_t *header_frame;      //  IDPC_CLIENT header, prebuilt for replies
+      IDPList<request_t> requests; //  List of client requests, oldest first
+      IDPHeap<request_t> queues[IDP_PRIORITY_CLASSES]; //  Same requests by class, earliest deadline first
+      size_t queued[IDP_PRIORITY_CLASSES];             //  Queued requests by class
+      IDPTable<flow_t> *flows[IDP_PRIORITY_CLASSES];   //  In fair queuing mode, same requests by class and client, NULL until the first
+      IDPList<flow_t> fair[IDP_PRIORITY_CLASSES];      //  Those clients by class, in the order they take turns
+      uint32_t passed[IDP_PRIORITY_CLASSES];           //  Dispatches each class was passed over
+      uint64_t wait[IDP_PRIORITY_CLASSES][SERVICE_WAIT_BUCKETS]; //  Queue wait histograms
+      IDPList<worker_t> waiting;   //  List of waiting workers, longest idle first
+      size_t workers;              //  How many workers we have
+      service_limits_t limits;     //  How we queue and dispatch requests
+      size_t queued_bytes;         //  Bytes of queued requests
+      uint64_t rejected;           //  Requests refused because of limits
+      uint64_t dropped;            //  Requests dropped by CoDel
+      uint64_t expired;            //  Requests dropped past their deadline
+      IDPTable<cache_entry_t> *cache;     //  Cached replies by request key, NULL until the first
+      IDPList<cache_entry_t> cache_lru;   //  Same replies, least recently used first
+      size_t cache_bytes;          //  Bytes of cached replies and their keys
+      uint64_t cache_hits;         //  Requests answered from the cache
+      uint64_t cache_misses;       //  Requests the cache could not answer
+      IDPTable<request_t> *flights; //  Requests others may follow, by key, NULL until the first
+      uint64_t flights_started;    //  Requests that led a flight
+      uint64_t coalesced;          //  Requests that followed one
+      IDPTable<idempotency_entry_t> *idempotency; //  Requests and replies by idempotency key, NULL until the first
+      IDPList<idempotency_entry_t> idempotency_age; //  Same entries, oldest first
+      uint64_t resends;            //  Requests whose key was already known
+      uint64_t reassigned;         //  Requests requeued from lost workers
+      uint64_t latency[SERVICE_LATENCY_BUCKETS]; //  Recent service times, log2 usecs
+      uint64_t latency_samples;    //  Samples in latency
+      int64_t hedge_credit;        //  Hedge budget saved up, in hundredths of a hedge
+      uint64_t hedged;             //  Hedges sent
+      uint64_t hedge_wins;         //  Hedges that answered first
+      IDPTable<outlier_t> *outliers; //  Workers with strikes, by routing id, NULL until the first
+      IDPList<outlier_t> outliers_lost; //  Those whose worker is gone, earliest lost first
+      size_t ejected;              //  Workers ejected or on probation
+      uint64_t ejections;          //  Times a worker was ejected
+      IDPTimer breaker_timer;      //  End of the grace period, or of the cooldown
+      bool breaker_open;           //  Refusing requests with status 503
+      uint64_t breaker_requests;   //  Recent requests answered or lost by workers
+      uint64_t breaker_errors;     //  Those lost
+      uint64_t short_circuited;    //  Requests refused or flushed by the open breaker
+      int64_t first_above;         //  When wait may count as too long, 0 if under target
+      int64_t drop_next;           //  When CoDel drops again
+      uint32_t drop_count;         //  Drops since CoDel started dropping
+      bool dropping;               //  CoDel is dropping
+      IDPListLink<service_t> idle_link; //  Hook for broker->_idle_services while we have no workers
+      int64_t idle_since;          //  When a client last asked for us without workers, in msecs
+    };
+
+    //  .split cache entry structure
+    //  A reply a worker marked cacheable, kept until it expires or the
+    //  service needs its bytes for fresher replies:
+
+    struct cache_entry_t
+    {
+      IDPListLink<cache_entry_t> link; //  Hook for service->cache_lru
+      zframe_t *key;                   //  Request frames, each prefixed by its size
+      uint32_t hash;                   //  Hash of key, our key in service->cache
+      zmsg_t *reply;                   //  Reply frames, without any envelope
+      size_t size;                     //  Bytes of key and reply
+      int64_t expires;                 //  When the reply goes stale, in msecs
+    };
+
+    //  .split idempotency entry structure
+    //  A client idempotency key, with the request that carried it until a
+    //  worker answers, then with the reply until the window closes. A key
+    //  with neither is stale, its request was lost or dropped:
+
+    struct idempotency_entry_t
+    {
+      IDPListLink<idempotency_entry_t> link; //  Hook for service->idempotency_age
+      zframe_t *key;                         //  Key as the client sent it
+      uint32_t hash;                         //  Hash of key, our key in service->idempotency
+      request_t *request;                    //  Request being worked on, or NULL
+      zmsg_t *reply;                         //  Reply frames, without any envelope, or NULL
+      int64_t expires;                       //  When the reply is forgotten, in msecs
+    };
+
+    //  .split outlier structure
+    //  The strikes against a worker, kept by routing id so they outlive
+    //  the worker if it is lost and registers again:
+
+    struct outlier_t
+    {
+      IDPListLink<outlier_t> link; //  Hook for service->outliers_lost
+      service_t *service;          //  Owning service
+      zframe_t *address;           //  Routing id of the worker
+      uint32_t hash;               //  Hash of address, our key in service->outliers
+      worker_t *worker;            //  Worker with that routing id, NULL if lost
+      uint32_t strikes;            //  Ejections since the worker last passed probation
+      int64_t until;               //  When the last ejection ends, in msecs
+      int64_t lost;                //  When the worker was lost, in msecs
+    };
+
+    //  .split flow structure
+    //  In fair queuing mode, the requests one client has queued in one
+    //  priority class. A flow lasts as long as it has requests queued:
+
+    struct flow_t
+    {
+      IDPListLink<flow_t> link;    //  Hook for service->fair
+      service_t *service;          //  Owning service
+      zframe_t *client;            //  Routing id or CURVE public key of the client
+      uint32_t hash;               //  Hash of client, our key in service->flows
+      IDPHeap<request_t> queue;    //  Our requests, earliest deadline first
+      uint32_t weight;             //  Requests we send per turn
+      uint32_t deficit;            //  Requests we may still send this turn
+    };
+
+    //  .split bucket structure
+    //  The token bucket and counters of one client, by routing id or CURVE
+    //  public key. Tokens are kept in thousandths of a request:
+
+    struct bucket_t
+    {
+      IDPListLink<bucket_t> link;  //  Hook for broker->_buckets_lru
+      IDP::IDPBroker *broker;      //  Broker instance
+      zframe_t *client;            //  Routing id or CURVE public key of the client
+      uint32_t hash;               //  Hash of client, our key in broker->_buckets
+      int rate;                    //  Requests per second, 0 = no limit
+      int burst;                   //  Requests the bucket holds
+      int64_t tokens;              //  Thousandths of a request left
+      int64_t refilled;            //  When tokens were last added, in msecs
+      uint64_t admitted;           //  Requests let through
+      uint64_t rejected;           //  Requests refused
+      uint64_t generation;         //  Limits in force when rate and burst were set
+    };
+
+    //  Rate limit set for a named client
+
     typedef struct
     {
-      IDP::IDPBroker *broker; //  Broker instance
-      char *name;             //  Service name
-      zlist_t *requests;      //  List of client requests
-      zlist_t *waiting;       //  List of waiting workers
-      size_t workers;         //  How many workers we have
-    } service_t;
+      int rate;
+      int burst;
+    } rate_limit_t;
 
     //  .split worker class structure
     //  The worker class defines a single worker, idle or active:
 
-    typedef struct
+    struct worker_t
     {
       IDP::IDPBroker *broker; //  Broker instance
       void **socket;          //  Worker socket
-      char *identity;         //  Identity of worker
+      uint32_t hash;          //  Hash of routing id, our key in broker->_workers
       zframe_t *address;      //  Address frame to route to
       service_t *service;     //  Owning service, if known
-      int64_t expiry;         //  Expires at unless heartbeat
-    } worker_t;
+      bool props;             //  Takes IDPW02 requests, with properties
+      uint32_t credit;        //  Requests the worker will take at once
+      uint32_t next_id;       //  Id of the next request we send it
+      int64_t service_time;   //  Moving average usecs from request to reply, 0 until measured
+      uint32_t answered;      //  Replies measured since registering or probation
+      int health;             //  One of WORKER_*
+      outlier_t *outlier;     //  Strikes against us, if any
+      IDPList<request_t> in_flight;       //  Requests sent and not answered, oldest first
+      IDPListLink<worker_t> service_link; //  Hook for service->waiting
+      IDPTimer expiry_timer;              //  Idle worker expires unless heartbeat
+      IDPTimer heartbeat_timer;           //  Next HEARTBEAT to idle worker
+      IDPTimer request_timer;             //  Deadline for the request in flight
+      IDPTimer outlier_timer;             //  End of ejection, or next probe
+    };
 
   public:
-    IDPBroker(const std::string &clear_endpoint, const std::string &curve_endpoint, std::pair<std::string, std::string> *credentials = NULL, const std::string &credentials_path = "", bool authenticate = false, bool verbose = false)
+    //  .split reactor statistics
+    //  Counters describing how much work each wakeup of the loop did:
+
+    typedef struct
+    {
+      uint64_t wakeups;  //  Wakeups that had input pending
+      uint64_t messages; //  Messages handled over all wakeups
+      size_t last_batch; //  Messages handled by the last wakeup
+      size_t max_batch;  //  Largest batch handled by a single wakeup
+    } reactor_stats_t;
+
+    //  Occupancy of the record pools
+
+    typedef struct
     {
+      IDPPoolStats workers;
+      IDPPoolStats services;
+      IDPPoolStats requests;
+      IDPPoolStats cache_entries;
+      IDPPoolStats idempotency_entries;
+      IDPPoolStats outliers;
+      IDPPoolStats flows;
+      IDPPoolStats buckets;
+    } pool_stats_t;
+
+    //  .split broker constructor
+    //  CURVE encryption runs on the ZeroMQ I/O threads, not in loop(). With
+    //  curve_io_threads > 0 the context gets that many extra I/O threads and
+    //  the CURVE socket is bound to them alone, while the CLEAR socket keeps
+    //  I/O thread 0 to itself. io_cpus, if given, pins the I/O threads to
+    //  those CPUs. Both only work if the broker is created before any other
+    //  czmq socket in the process, since the I/O thread pool is fixed once
+    //  the first socket exists.
+
+    IDPBroker(const std::string &clear_endpoint, const std::string &curve_endpoint, std::pair<std::string, std::string> *credentials = NULL, const std::string &credentials_path = "", bool authenticate = false, bool verbose = false, int curve_io_threads = 0, const std::vector<int> &io_cpus = std::vector<int>())
+    {
+      if (curve_endpoint == "")
+        curve_io_threads = 0;
+      if (curve_io_threads > MAX_CURVE_IO_THREADS)
+        curve_io_threads = MAX_CURVE_IO_THREADS;
+      if (curve_io_threads > 0)
+        zsys_set_io_threads(1 + curve_io_threads);
+      for (size_t index = 0; index < io_cpus.size(); index++)
+        zsys_thread_affinity_cpu_add(io_cpus[index]);
 
       //  Initialize broker state
       _clear_endpoint = strdup(clear_endpoint.c_str());
       //_clear_socket = zsock_new_router(_clear_endpoint); //(ZMQ_ROUTER);
       _clear_socket = zsock_new(ZMQ_ROUTER); //(ZMQ_ROUTER);
+      if (curve_io_threads > 0)
+        zsock_set_affinity((zsock_t *)_clear_socket, 1);
       _credentials = credentials;
       zclock_log("I: IDP broker/0.2.0 clear socket active at %s", _clear_endpoint);
       if (curve_endpoint != "")
@@ -61,6 +414,12 @@ namespace IDP
         _curve_endpoint = strdup(curve_endpoint.c_str());
         _curve_socket = zsock_new(ZMQ_ROUTER); //(ZMQ_ROUTER);
         zclock_log("I: IDP broker/0.2.0 CURVE socket active at %s", _curve_endpoint);
+        if (curve_io_threads > 0)
+        {
+          //  Connections on the CURVE socket spread over I/O threads 1..n
+          zsock_set_affinity((zsock_t *)_curve_socket, ((1 << curve_io_threads) - 1) << 1);
+          zclock_log("I: CURVE socket using %d dedicated I/O threads", curve_io_threads);
+        }
         if (_credentials)
         {
           zclock_log("I: Setting up CURVE credentials for socket active at %s", _curve_endpoint);
@@ -92,394 +451,2659 @@ namespace IDP
       }
       zsock_bind((zsock_t *)_clear_socket, "%s", _clear_endpoint);
 
-      _verbose = verbose;
       _authenticate = authenticate;
-      _services = zhash_new();
-      _workers = zhash_new();
-      _waiting = zlist_new();
+      _pipe = NULL;
+      _shard_count = 1;
+      broker_init(verbose);
+    }
+
+  private:
+    //  .split shard constructor
+    //  A shard is a broker whose two sockets are inproc pipes to the
+    //  frontend instead of ROUTER sockets; it is created inside its own
+    //  thread and takes its configuration from the frontend broker:
+
+    IDPBroker(const IDPBroker *parent, int index, zsock_t *pipe)
+    {
+      _clear_endpoint = NULL;
+      _curve_endpoint = NULL;
+      _credentials = NULL;
+      _authenticate = false;
+      _clear_socket = shard_pipe(parent, index, "clear", true);
+      _curve_socket = parent->_curve_socket ? shard_pipe(parent, index, "curve", true) : NULL;
+      _pipe = pipe;
+      _shard_count = 1;
+      broker_init(parent->_verbose);
+      _batch_budget = parent->_batch_budget;
+      _request_timeout = parent->_request_timeout;
+      _heartbeat_interval = parent->_heartbeat_interval;
+      _service_idle_timeout = parent->_service_idle_timeout;
+      _max_idle_services = parent->_max_idle_services;
+      _service_defaults = parent->_service_defaults;
+      service_limits_t *limits = (service_limits_t *)zhash_first(parent->_service_limits);
+      while (limits)
+      {
+        *service_limits_require(zhash_cursor(parent->_service_limits)) = *limits;
+        limits = (service_limits_t *)zhash_next(parent->_service_limits);
+      }
+      uint32_t *weight = (uint32_t *)zhash_first(parent->_client_weights);
+      while (weight)
+      {
+        setClientWeight(zhash_cursor(parent->_client_weights), *weight);
+        weight = (uint32_t *)zhash_next(parent->_client_weights);
+      }
+
+      //  The frontend tells us to stop over the actor pipe
+      int rc = zpoller_add(_poller, _pipe);
+      assert(rc == 0);
+    }
+
+    void broker_init(bool verbose)
+    {
+      _verbose = verbose;
+      _services = new IDPTable<service_t>();
+      _service_limits = zhash_new();
+      _client_weights = zhash_new();
+      _client_rates = zhash_new();
+      _buckets = new IDPTable<bucket_t>();
+      _client_rate.rate = 0;
+      _client_rate.burst = 0;
+      _rate_generation = 0;
+      _service_defaults.max_requests = SERVICE_MAX_REQUESTS;
+      _service_defaults.max_bytes = SERVICE_MAX_BYTES;
+      _service_defaults.codel_target = SERVICE_CODEL_TARGET;
+      _service_defaults.codel_interval = SERVICE_CODEL_INTERVAL;
+      _service_defaults.balance = BALANCE_ROUND_ROBIN;
+      _service_defaults.cache_max_bytes = 0;
+      _service_defaults.coalesce = false;
+      _service_defaults.idempotency_keys = SERVICE_IDEMPOTENCY_KEYS;
+      _service_defaults.idempotency_window = SERVICE_IDEMPOTENCY_WINDOW;
+      _service_defaults.max_attempts = SERVICE_MAX_ATTEMPTS;
+      _service_defaults.hedge_budget = 0;
+      _service_defaults.outlier_factor = 0;
+      _service_defaults.outlier_backoff = SERVICE_OUTLIER_BACKOFF;
+      _service_defaults.breaker_grace = 0;
+      _service_defaults.breaker_error_rate = 0;
+      _service_defaults.fair = false;
+      _workers = new IDPTable<worker_t>();
       _heartbeat_interval = HEARTBEAT_INTERVAL;
       _heartbeat_liveness = HEARTBEAT_LIVENESS;
-      _heartbeat_at = zclock_time() + _heartbeat_interval;
+      _now = zclock_time();
+      _timers = new IDPTimerWheel(_now);
+      _request_timeout = 0;
+      _service_idle_timeout = SERVICE_IDLE_TIMEOUT;
+      _max_idle_services = SERVICE_MAX_IDLE;
+      _idle_timer.init(services_reap, this);
+
+      //  One poll set for the lifetime of the broker
+      _poller = zpoller_new(_clear_socket, NULL);
+      assert(_poller);
+      if (_curve_socket)
+      {
+        int rc = zpoller_add(_poller, _curve_socket);
+        assert(rc == 0);
+      }
+      _batch_budget = BATCH_BUDGET;
+      memset(&_reactor_stats, 0, sizeof(_reactor_stats));
     }
+
+  public:
     ~IDPBroker()
     {
+      zpoller_destroy(&_poller);
       if (_clear_socket)
         zsock_destroy((zsock_t **)&_clear_socket);
 
       if (_curve_socket)
         zsock_destroy((zsock_t **)&_curve_socket);
 
-      zhash_destroy(&_services);
-      zhash_destroy(&_workers);
-      zlist_destroy(&_waiting);
+      _services->foreach(service_destroy);
+      delete _services;
+      zhash_destroy(&_service_limits);
+      zhash_destroy(&_client_weights);
+      zhash_destroy(&_client_rates);
+      _buckets->foreach(bucket_destroy);
+      delete _buckets;
+      _workers->foreach(worker_destroy);
+      delete _workers;
+      delete _timers;
       if (_clear_endpoint)
         delete _clear_endpoint;
       if (_curve_endpoint)
         delete _curve_endpoint;
     }
 
-    int loop(void)
+    //  .split reactor configuration
+    //  On every wakeup the loop drains both sockets without blocking, one
+    //  message per socket per round, for at most budget rounds. A budget of
+    //  1 gives the classic one-message-per-wakeup behaviour:
+
+    void setBatchBudget(size_t budget)
     {
-      while (true)
-      {
+      _batch_budget = budget ? budget : 1;
+    }
 
-        zpoller_t *poller = zpoller_new(NULL);
-        assert(poller);
+    const reactor_stats_t &reactorStats() const
+    {
+      return _reactor_stats;
+    }
 
-        // Add a reader to the existing poller
-        int rc = zpoller_add(poller, _clear_socket);
-        assert(rc == 0);
-        if (_curve_socket)
-        {
-          rc = zpoller_add(poller, _curve_socket);
-          assert(rc == 0);
-        }
+    pool_stats_t poolStats() const
+    {
+      pool_stats_t stats;
+      stats.workers = _worker_pool.stats();
+      stats.services = _service_pool.stats();
+      stats.requests = _request_pool.stats();
+      stats.cache_entries = _cache_pool.stats();
+      stats.idempotency_entries = _idempotency_pool.stats();
+      stats.outliers = _outlier_pool.stats();
+      stats.flows = _flow_pool.stats();
+      stats.buckets = _bucket_pool.stats();
+      return stats;
+    }
 
-        zsock_t *which = (zsock_t *)zpoller_wait(poller, HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
+    //  By default a worker may hold a request for as long as it likes;
+    //  worker APIs send no heartbeats while a request runs, so busy
+    //  workers do not expire. A request timeout makes the broker drop
+    //  workers that sit on a request for longer than that, in msecs, which
+    //  is also how the requests of a worker that died busy get requeued.
+    //  With credit, that is the oldest of the requests the worker holds:
 
-        //int rc = zmq_poll (items, 1, HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
-        if (which == NULL)
-        {
-          if (zpoller_terminated(poller))
-          {
-            break; //  Interrupted
-          }
-        }
+    void setRequestTimeout(int timeout)
+    {
+      _request_timeout = timeout > 0 ? timeout : 0;
+    }
 
-        bool clear = (which == _clear_socket);
+    //  Every name a client sends creates a service, typos included. A
+    //  service that has no workers is forgotten once no client has asked
+    //  for it for the idle timeout, in msecs, unless requests are still
+    //  queued on it; 0 keeps services forever. With a limit on services
+    //  without workers, creating one more forgets the one clients asked for
+    //  least recently, refusing its queued requests with status 503. Each shard
+    //  counts its own services.
 
-        //  Process next input message, if any
-        if (which)
-        {
-          zmsg_t *msg = zmsg_recv(which);
-          if (!msg)
-            break; //  Interrupted
-          if (_verbose)
-          {
-            zclock_log("I: received message:");
-            zmsg_dump(msg);
-          }
-          zframe_t *sender = zmsg_pop(msg);
-          zframe_t *empty = zmsg_pop(msg);
-          zframe_t *header = zmsg_pop(msg);
-
-          if (zframe_streq(header, IDPC_CLIENT))
-            broker_client_msg(sender, msg, clear);
-          else if (zframe_streq(header, IDPW_WORKER))
-            broker_worker_msg(sender, msg, clear);
-          else
-          {
-            zclock_log("E: invalid message:");
-            zmsg_dump(msg);
-            zmsg_destroy(&msg);
-          }
-          zframe_destroy(&sender);
-          zframe_destroy(&empty);
-          zframe_destroy(&header);
-        }
-        //  Disconnect and delete any expired workers
-        //  Send heartbeats to idle workers if needed
-        if (zclock_time() > _heartbeat_at)
-        {
-          broker_purge();
-          worker_t *worker = (worker_t *)zlist_first(_waiting);
-          while (worker)
-          {
-            worker_send(worker, IDPW_HEARTBEAT, NULL, NULL);
-            worker = (worker_t *)zlist_next(_waiting);
-          }
-          _heartbeat_at = zclock_time() + HEARTBEAT_INTERVAL;
-        }
-      }
-      if (zctx_interrupted)
-        printf("W: interrupt received, shutting down...\n");
+    void setServiceIdleTimeout(int64_t timeout)
+    {
+      _service_idle_timeout = timeout > 0 ? timeout : 0;
+    }
 
-      return 0;
+    void setMaxIdleServices(size_t max_services)
+    {
+      _max_idle_services = max_services;
     }
 
-  private:
-    //  .split broker worker_msg method
-    //  The worker_msg method processes one READY, REPLY, HEARTBEAT or
-    //  DISCONNECT message sent to the broker by a worker:
+    //  Set the queue limits for services that have none of their own. This
+    //  applies to services created from now on.
 
-    void broker_worker_msg(zframe_t *sender, zmsg_t *msg, bool clear)
+    void setDefaultServiceLimits(size_t max_requests, size_t max_bytes)
     {
-      assert(zmsg_size(msg) >= 1); //  At least, command
+      _service_defaults.max_requests = max_requests;
+      _service_defaults.max_bytes = max_bytes;
+    }
 
-      zframe_t *command = zmsg_pop(msg);
-      char *identity = zframe_strhex(sender);
-      int worker_ready = (zhash_lookup(_workers, identity) != NULL);
-      free(identity);
-      worker_t *worker = worker_require(sender, clear);
+    //  Set the queue limits for one service, whether or not it exists yet
 
-      if (zframe_streq(command, IDPW_READY))
-      {
-        if (worker_ready) //  Not first command in session
-          worker_delete(worker, 1);
-        else if (zframe_size(sender) >= 4 //  Reserved service name
-                 && memcmp(zframe_data(sender), "mmi.", 4) == 0)
-          worker_delete(worker, 1);
-        else
-        {
-          //  Attach worker to service and mark as idle
-          zframe_t *service_frame = zmsg_pop(msg);
-          worker->service = service_require(service_frame);
-          worker->service->workers++;
-          worker_waiting(worker);
-          zframe_destroy(&service_frame);
-        }
-      }
-      else if (zframe_streq(command, IDPW_REPLY) || zframe_streq(command, IDPW_REPLY_CURVE))
-      {
-        if (worker_ready)
-        {
-          //  Remove & save client return envelope and insert the
-          //  protocol header and service name, then rewrap envelope.
-          zframe_t *client = zmsg_unwrap(msg);
-          zmsg_pushstr(msg, worker->service->name);
-          zmsg_pushstr(msg, IDPC_CLIENT);
-          zmsg_wrap(msg, client);
-          zmsg_send(&msg, zframe_streq(command, IDPW_REPLY) ? _clear_socket : _curve_socket);
-          worker_waiting(worker);
-        }
-        else
-          worker_delete(worker, 1);
-      }
-      else if (zframe_streq(command, IDPW_HEARTBEAT))
-      {
-        if (worker_ready)
-          worker->expiry = zclock_time() + HEARTBEAT_EXPIRY;
-        else
-          worker_delete(worker, 1);
-      }
-      else if (zframe_streq(command, IDPW_DISCONNECT))
-        worker_delete(worker, 0);
-      else
-      {
-        zclock_log("E: invalid input message");
-        zmsg_dump(msg);
-      }
-      free(command);
-      zmsg_destroy(&msg);
+    void setServiceLimits(const std::string &name, size_t max_requests, size_t max_bytes)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->max_requests = max_requests;
+      limits->max_bytes = max_bytes;
+      service_limits_apply(name, limits);
     }
 
-    //  .split broker client_msg method
-    //  Process a request coming from a client. We implement MMI requests
-    //  directly here (at present, we implement only the mmi.service request):
+    //  Set the CoDel target and interval, in msecs, for services that have
+    //  none of their own, or for one service. Requests CoDel drops get a
+    //  status 503 reply. A target of 0 turns CoDel off.
 
-    void broker_client_msg(zframe_t *sender, zmsg_t *msg, bool clear)
+    void setDefaultServiceCodel(int64_t target, int64_t interval)
     {
-      assert(zmsg_size(msg) >= 2); //  Service name + body
+      _service_defaults.codel_target = target > 0 ? target : 0;
+      _service_defaults.codel_interval = interval > 0 ? interval : SERVICE_CODEL_INTERVAL;
+    }
 
-      zframe_t *service_frame = zmsg_pop(msg);
-      service_t *service = service_require(service_frame);
+    void setServiceCodel(const std::string &name, int64_t target, int64_t interval)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->codel_target = target > 0 ? target : 0;
+      limits->codel_interval = interval > 0 ? interval : SERVICE_CODEL_INTERVAL;
+      service_limits_apply(name, limits);
+    }
 
-      //  Set reply return address to client sender
-      zmsg_wrap(msg, zframe_dup(sender));
+    //  Set the balancing strategy, one of BALANCE_*, for services that have
+    //  none of their own, or for one service. A service that exists
+    //  switches strategy from its next dispatch on.
 
-      //  If we got a MMI service request, process that internally
-      if (zframe_size(service_frame) >= 4 && memcmp(zframe_data(service_frame), "mmi.", 4) == 0)
-      {
-        char const *return_code;
-        if (zframe_streq(service_frame, "mmi.service"))
-        {
-          char *name = zframe_strdup(zmsg_last(msg));
-          service_t *service =
-              (service_t *)zhash_lookup(_services, name);
-          return_code = service && service->workers ? "200" : "404";
-          free(name);
-        }
-        else
-          return_code = "501";
+    void setDefaultServiceBalance(int balance)
+    {
+      _service_defaults.balance = balance >= 0 && balance < BALANCE_STRATEGIES ? balance : BALANCE_ROUND_ROBIN;
+    }
 
-        zframe_reset(zmsg_last(msg), return_code, strlen(return_code));
+    void setServiceBalance(const std::string &name, int balance)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->balance = balance >= 0 && balance < BALANCE_STRATEGIES ? balance : BALANCE_ROUND_ROBIN;
+      service_limits_apply(name, limits);
+    }
 
-        //  Remove & save client return envelope and insert the
-        //  protocol header and service name, then rewrap envelope.
-        zframe_t *client = zmsg_unwrap(msg);
-        zmsg_push(msg, zframe_dup(service_frame));
-        zmsg_pushstr(msg, IDPC_CLIENT);
-        zmsg_wrap(msg, client);
-        zmsg_send(&msg, clear ? _clear_socket : _curve_socket);
-      }
-      else
-        //  Else dispatch the message to the requested service
-        service_dispatch(service, msg, clear);
-      zframe_destroy(&service_frame);
+    //  Let services that have no setting of their own, or one service,
+    //  cache replies their workers mark cacheable, up to max_bytes of
+    //  replies and request keys. 0 turns the cache off. Shrinking the
+    //  cache of a service evicts its least recently used replies at once.
+
+    void setDefaultServiceCache(size_t max_bytes)
+    {
+      _service_defaults.cache_max_bytes = max_bytes;
+    }
+
+    void setServiceCache(const std::string &name, size_t max_bytes)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->cache_max_bytes = max_bytes;
+      service_limits_apply(name, limits);
     }
 
-    //  .split broker purge method
-    //  The purge method deletes any idle workers that haven't pinged us in a
-    //  while. We hold workers from oldest to most recent, so we can stop
-    //  scanning whenever we find a live worker. This means we'll mainly stop
-    //  at the first worker, which is essential when we have large numbers of
-    //  workers (since we call this method in our critical path):
+    //  Turn single flight on or off for services that have no setting of
+    //  their own, or for one service. While a request is queued or with a
+    //  worker, identical requests wait for its reply instead of queueing.
+    //  Only for services whose replies depend on the request alone.
 
-    void broker_purge()
+    void setDefaultServiceCoalesce(bool coalesce)
     {
-      worker_t *worker = (worker_t *)zlist_first(_waiting);
-      while (worker)
-      {
-        if (zclock_time() < worker->expiry)
-          break; //  Worker is alive, we're done here
-        if (_verbose)
-          zclock_log("I: deleting expired worker: %s",
-                     worker->identity);
+      _service_defaults.coalesce = coalesce;
+    }
 
-        worker_delete(worker, 0);
-        worker = (worker_t *)zlist_first(_waiting);
-      }
+    void setServiceCoalesce(const std::string &name, bool coalesce)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->coalesce = coalesce;
+      service_limits_apply(name, limits);
     }
 
-    //  .split service methods
-    //  Here is the implementation of the methods that work on a service:
+    //  Set how many idempotency keys services that have no setting of
+    //  their own, or one service, remember, and for how many msecs after
+    //  the reply. 0 keys makes the service ignore them. Past the limit the
+    //  oldest keys are forgotten, answered or not.
 
-    //  Lazy constructor that locates a service by name, or creates a new
-    //  service if there is no service already with that name.
+    void setDefaultServiceIdempotency(size_t max_keys, int64_t window)
+    {
+      _service_defaults.idempotency_keys = max_keys;
+      _service_defaults.idempotency_window = window > 0 ? window : 0;
+    }
 
-    service_t *service_require(zframe_t *service_frame)
+    void setServiceIdempotency(const std::string &name, size_t max_keys, int64_t window)
     {
-      assert(service_frame);
-      char *name = zframe_strdup(service_frame);
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->idempotency_keys = max_keys;
+      limits->idempotency_window = window > 0 ? window : 0;
+      service_limits_apply(name, limits);
+    }
 
-      service_t *service =
-          (service_t *)zhash_lookup(_services, name);
-      if (service == NULL)
-      {
-        service = (service_t *)zmalloc(sizeof(service_t));
-        service->broker = this;
-        service->name = name;
-        service->requests = zlist_new();
-        service->waiting = zlist_new();
-        zhash_insert(_services, name, service);
-        zhash_freefn(_services, name, service_destroy);
-        if (_verbose)
-          zclock_log("I: added service: %s", name);
-      }
-      else
-        free(name);
+    //  Set how many workers a request may be sent to, for services that
+    //  have no setting of their own, or for one service. When a worker
+    //  holding a request disconnects, expires or passes the request
+    //  timeout, the request goes back to the front of the queue until it
+    //  has been sent this many times. Above 1, the broker keeps a copy of
+    //  each request while a worker has it.
 
-      return service;
+    void setDefaultServiceAttempts(int attempts)
+    {
+      _service_defaults.max_attempts = attempts > 1 ? attempts : 1;
     }
 
-    //  Service destructor is called automatically whenever the service is
-    //  removed from broker->services.
+    void setServiceAttempts(const std::string &name, int attempts)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->max_attempts = attempts > 1 ? attempts : 1;
+      service_limits_apply(name, limits);
+    }
 
-    static void service_destroy(void *argument)
+    //  Let services that have no setting of their own, or one service,
+    //  hedge up to budget requests in a hundred: a request with a worker
+    //  for longer than 95% of recent requests took gets a copy sent to an
+    //  idle worker, and the first reply wins. 0 turns hedging off. Only
+    //  for services whose requests may safely run twice; the broker keeps
+    //  a copy of each request while a worker has it.
+
+    void setDefaultServiceHedge(int budget)
     {
-      service_t *service = (service_t *)argument;
-      while (zlist_size(service->requests))
-      {
-        std::pair<zmsg_t *, bool> *request = (std::pair<zmsg_t *, bool> *)zlist_pop(service->requests);
-        zmsg_t *msg = request->first;
-        zmsg_destroy(&msg);
-        delete request;
-      }
-      zlist_destroy(&service->requests);
-      zlist_destroy(&service->waiting);
-      free(service->name);
-      free(service);
+      _service_defaults.hedge_budget = budget > 0 ? budget : 0;
     }
 
-    //  .split service dispatch method
-    //  The dispatch method sends requests to waiting workers:
+    void setServiceHedge(const std::string &name, int budget)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->hedge_budget = budget > 0 ? budget : 0;
+      service_limits_apply(name, limits);
+    }
+
+    //  Let services that have no setting of their own, or one service,
+    //  eject workers whose average service time grows to factor times the
+    //  median of the service, or that are lost to the heartbeat or request
+    //  timeout. An ejected worker gets no requests for backoff msecs,
+    //  doubling with each strike, then one request at a time until it has
+    //  answered SERVICE_PROBE_REQUESTS of them in time. At most half of
+    //  the workers of a service are ejected at once. 0 turns ejection off.
 
-    void service_dispatch(service_t *service, zmsg_t *msg, bool clear)
+    void setDefaultServiceOutliers(int factor, int64_t backoff = SERVICE_OUTLIER_BACKOFF)
     {
-      assert(service);
-      if (msg) //  Queue message if any
-      {
-        std::pair<zmsg_t *, bool> *request = new std::pair<zmsg_t *, bool>(msg, clear);
-        zlist_append(service->requests, request);
-      }
+      _service_defaults.outlier_factor = factor > 0 ? factor : 0;
+      _service_defaults.outlier_backoff = backoff > 0 ? backoff : SERVICE_OUTLIER_BACKOFF;
+    }
 
-      broker_purge();
-      while (zlist_size(service->waiting) && zlist_size(service->requests))
-      {
-        worker_t *worker = (worker_t *)zlist_pop(service->waiting);
-        zlist_remove(service->broker->_waiting, worker);
-        std::pair<zmsg_t *, bool> *request = (std::pair<zmsg_t *, bool> *)zlist_pop(service->requests);
-        zmsg_t *msg = request->first;
-        worker_send(worker, (request->second ? IDPW_REQUEST : IDPW_REQUEST_CURVE), NULL, msg);
-        zmsg_destroy(&msg);
-        delete request;
-      }
+    void setServiceOutliers(const std::string &name, int factor, int64_t backoff = SERVICE_OUTLIER_BACKOFF)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->outlier_factor = factor > 0 ? factor : 0;
+      limits->outlier_backoff = backoff > 0 ? backoff : SERVICE_OUTLIER_BACKOFF;
+      service_limits_apply(name, limits);
     }
 
-    //  .split worker methods
-    //  Here is the implementation of the methods that work on a worker:
+    //  Give services that have no setting of their own, or one service, a
+    //  circuit breaker. It opens once the service has had no workers for
+    //  grace msecs, and stays open until a worker registers. With an error
+    //  rate, it also opens when that percent of the requests workers took
+    //  were lost with them, for SERVICE_BREAKER_COOLDOWN msecs or until a
+    //  worker registers. While open, queued requests and new ones get
+    //  status 503 at once instead of waiting out the client timeout. 0 turns
+    //  either trigger off.
 
-    //  Lazy constructor that locates a worker by identity, or creates a new
-    //  worker if there is no worker already with that identity.
+    void setDefaultServiceBreaker(int64_t grace, int error_rate = 0)
+    {
+      _service_defaults.breaker_grace = grace > 0 ? grace : 0;
+      _service_defaults.breaker_error_rate = error_rate > 0 ? error_rate : 0;
+    }
 
-    worker_t *worker_require(zframe_t *address, bool clear)
+    void setServiceBreaker(const std::string &name, int64_t grace, int error_rate = 0)
     {
-      assert(address);
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->breaker_grace = grace > 0 ? grace : 0;
+      limits->breaker_error_rate = error_rate > 0 ? error_rate : 0;
+      service_limits_apply(name, limits);
+    }
 
-      //  self->workers is keyed off worker identity
-      char *identity = zframe_strhex(address);
-      worker_t *worker =
-          (worker_t *)zhash_lookup(_workers, identity);
+    //  Turn fair queuing on or off for services that have no setting of
+    //  their own, or for one service. Each client gets a queue of its own
+    //  in every priority class, and clients take turns. Requests already
+    //  queued move to the new queues, oldest first.
 
-      if (worker == NULL)
+    void setDefaultServiceFairQueuing(bool fair)
+    {
+      _service_defaults.fair = fair;
+    }
+
+    void setServiceFairQueuing(const std::string &name, bool fair)
+    {
+      service_limits_t *limits = service_limits_require(name.c_str());
+      limits->fair = fair;
+      service_limits_apply(name, limits);
+    }
+
+    //  In fair queuing mode a client sends as many requests per turn as its
+    //  weight, 1 unless set here. A client is named by its identity, or on
+    //  the CURVE socket by its public key in Z85 if the broker authenticates
+    //  clients. Weights apply to client queues created from now on; a
+    //  weight of 0 or less goes back to 1.
+
+    void setClientWeight(const std::string &client, int weight)
+    {
+      zhash_delete(_client_weights, client.c_str());
+      if (weight > 1)
       {
-        worker = (worker_t *)zmalloc(sizeof(worker_t));
-        worker->broker = this;
-        worker->identity = identity;
-        worker->address = zframe_dup(address);
-        worker->socket = clear ? &_clear_socket : &_curve_socket;
-        zhash_insert(_workers, identity, worker);
-        zhash_freefn(_workers, identity, worker_destroy);
-        if (_verbose)
-          zclock_log("I: registering new worker: %s", identity);
+        uint32_t *value = (uint32_t *)zmalloc(sizeof(uint32_t));
+        *value = (uint32_t)weight;
+        zhash_insert(_client_weights, client.c_str(), value);
+        zhash_freefn(_client_weights, client.c_str(), free);
       }
-      else
-        free(identity);
-      return worker;
     }
 
-    //  The delete method deletes the current worker.
-
-    void worker_delete(worker_t *worker, int disconnect)
+    //  Limit how many requests each client may send, in requests per
+    //  second, with bursts of up to burst requests, which defaults to one
+    //  second's worth. Requests past the limit get status 429 before we look at
+    //  the service they name. A client is its identity on the CLEAR
+    //  socket, and its public key in Z85 on the CURVE socket if the broker
+    //  authenticates clients, else its identity there too. A rate of 0
+    //  turns the limit off, for every client or for the one named; limits
+    //  apply from each client's next request, with a full bucket. In
+    //  sharded mode the frontend checks them.
+
+    void setDefaultClientRateLimit(int rate, int burst = 0)
     {
-      assert(worker);
-      if (disconnect)
-        worker_send(worker, IDPW_DISCONNECT, NULL, NULL);
+      _rate_generation++;
+      _client_rate.rate = rate > 0 ? rate : 0;
+      _client_rate.burst = burst > 0 ? burst : _client_rate.rate;
+    }
 
-      if (worker->service)
+    void setClientRateLimit(const std::string &client, int rate, int burst = 0)
+    {
+      _rate_generation++;
+      rate_limit_t *limit = (rate_limit_t *)zhash_lookup(_client_rates, client.c_str());
+      if (!limit)
       {
-        zlist_remove(worker->service->waiting, worker);
-        worker->service->workers--;
+        limit = (rate_limit_t *)zmalloc(sizeof(rate_limit_t));
+        zhash_insert(_client_rates, client.c_str(), limit);
+        zhash_freefn(_client_rates, client.c_str(), free);
       }
-      zlist_remove(worker->broker->_waiting, worker);
-      //  This implicitly calls s_worker_destroy
-      zhash_delete(worker->broker->_workers, worker->identity);
+      limit->rate = rate > 0 ? rate : 0;
+      limit->burst = burst > 0 ? burst : limit->rate;
     }
 
-    //  Worker destructor is called automatically whenever the worker is
-    //  removed from broker->workers.
+    //  Rate limit counters for a client, named as for setClientRateLimit;
+    //  returns false if we have not seen it or forgot it. We remember the
+    //  CLIENT_MAX_BUCKETS clients seen most recently.
 
-    static void worker_destroy(void *worker)
+    bool clientStats(const std::string &client, client_stats_t *stats) const
     {
-      worker_t *self = (worker_t *)worker;
-      zframe_destroy(&self->address);
-      free(self->identity);
-      free(self);
+      bucket_t *bucket = _buckets->lookup((const byte *)client.data(), client.size(),
+                                          IDPTable<bucket_t>::hash((const byte *)client.data(), client.size()));
+      if (!bucket)
+        return false;
+      stats->admitted = bucket->admitted;
+      stats->rejected = bucket->rejected;
+      stats->rate = bucket->rate;
+      stats->burst = bucket->burst;
+      return true;
     }
 
-    //  .split worker send method
-    //  The send method formats and sends a command to a worker. The caller may
-    //  also provide a command option, and a message payload:
+    //  Queue statistics for a service; returns false if there is no such
+    //  service. In sharded mode only the shards know their services, so ask
+    //  them with an mmi.queue request instead.
 
-    void worker_send(worker_t *worker, const char *command, char *option, zmsg_t *msg)
+    bool serviceStats(const std::string &name, service_stats_t *stats) const
     {
-      msg = msg ? zmsg_dup(msg) : zmsg_new();
-
-      //  Stack protocol envelope to start of message
+      service_t *service = _services->lookup((const byte *)name.data(), name.size(),
+                                             IDPTable<service_t>::hash((const byte *)name.data(), name.size()));
+      if (!service)
+        return false;
+      stats->queued = service->requests.size();
+      stats->queued_bytes = service->queued_bytes;
+      stats->workers = service->workers;
+      stats->waiting = service->waiting.size();
+      stats->rejected = service->rejected;
+      stats->dropped = service->dropped;
+      stats->expired = service->expired;
+      stats->cache_hits = service->cache_hits;
+      stats->cache_misses = service->cache_misses;
+      stats->cache_entries = service->cache ? service->cache->size() : 0;
+      stats->cache_bytes = service->cache_bytes;
+      stats->flights = service->flights_started;
+      stats->coalesced = service->coalesced;
+      stats->idempotency_keys = service->idempotency ? service->idempotency->size() : 0;
+      stats->resends = service->resends;
+      stats->reassigned = service->reassigned;
+      stats->hedged = service->hedged;
+      stats->hedge_wins = service->hedge_wins;
+      stats->service_time_p95 = service_latency_percentile(service, 95);
+      stats->ejected = service->ejected;
+      stats->ejections = service->ejections;
+      stats->breaker_open = service->breaker_open;
+      stats->short_circuited = service->short_circuited;
+      stats->fair_queues = 0;
+      for (int priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+      {
+        stats->fair_queues += service->fair[priority].size();
+        stats->queued_class[priority] = service->queued[priority];
+      }
+      memcpy(stats->wait, service->wait, sizeof(stats->wait));
+      return true;
+    }
+
+    //  .split sharding configuration
+    //  With more than one shard, loop() runs a frontend that owns the
+    //  ROUTER sockets and hands every message to one of several dispatcher
+    //  threads, chosen by a hash of the service name. Each shard has its
+    //  own service and worker tables, so nothing is shared or locked. Call
+    //  this, and any other configuration method, before loop():
+
+    void setShards(int shards)
+    {
+      _shard_count = shards > 1 ? shards : 1;
+    }
+
+    int loop(void)
+    {
+      if (_shard_count > 1)
+        return frontend_loop();
+
+      while (true)
+      {
+        zsock_t *which = (zsock_t *)zpoller_wait(_poller, TIMER_INTERVAL * ZMQ_POLL_MSEC);
+
+        //int rc = zmq_poll (items, 1, HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
+        if (which == NULL)
+        {
+          if (zpoller_terminated(_poller))
+          {
+            break; //  Interrupted
+          }
+        }
+        else if (which == _pipe)
+          break; //  Shard told to stop by the frontend
+
+        _now = zclock_time();
+
+        //  Process as many input messages as the budget allows
+        if (which)
+        {
+          size_t handled = 0;
+          if (!broker_drain(&handled))
+            break; //  Interrupted
+          _reactor_stats.wakeups++;
+          _reactor_stats.messages += handled;
+          _reactor_stats.last_batch = handled;
+          if (handled > _reactor_stats.max_batch)
+            _reactor_stats.max_batch = handled;
+        }
+        //  Disconnect and delete any expired workers, send heartbeats to
+        //  idle workers and enforce request deadlines, once per batch
+        _timers->advance(_now);
+      }
+      if (zctx_interrupted)
+        printf("W: interrupt received, shutting down...\n");
+
+      return 0;
+    }
+
+  private:
+    //  .split shard structure
+    //  The frontend's view of one dispatcher shard:
+
+    typedef struct
+    {
+      zactor_t *actor;     //  Thread running the shard
+      zsock_t *clear_pipe; //  Frontend end of the shard's CLEAR pipe
+      zsock_t *curve_pipe; //  Frontend end of the shard's CURVE pipe
+    } shard_t;
+
+    typedef struct
+    {
+      IDPBroker *parent; //  Frontend broker
+      int index;         //  Shard number
+    } shard_args_t;
+
+    //  Shard pipes are unbounded: the frontend and a shard both block on
+    //  send into a full pipe, which could deadlock the pair of them
+
+    static zsock_t *shard_pipe(const IDPBroker *parent, int index, const char *channel, bool bind)
+    {
+      char endpoint[128];
+      snprintf(endpoint, sizeof(endpoint), "inproc://idpbroker-%p-%d-%s", (void *)parent, index, channel);
+      zsock_t *pipe = zsock_new(ZMQ_PAIR);
+      assert(pipe);
+      zsock_set_sndhwm(pipe, 0);
+      zsock_set_rcvhwm(pipe, 0);
+      int rc = bind ? zsock_bind(pipe, "%s", endpoint) : zsock_connect(pipe, "%s", endpoint);
+      assert(rc != -1);
+      return pipe;
+    }
+
+    static void shard_actor(zsock_t *pipe, void *args)
+    {
+      shard_args_t *shard_args = (shard_args_t *)args;
+      IDPBroker *shard = new IDPBroker(shard_args->parent, shard_args->index, pipe);
+      zsock_signal(pipe, 0);
+      shard->loop();
+      delete shard;
+    }
+
+    //  .split sharded frontend
+    //  In sharded mode the calling thread only moves messages. Requests and
+    //  worker commands go from the ROUTER sockets to the shard that owns
+    //  their service, and whatever the shards send comes back out through
+    //  the ROUTER socket it belongs to:
+
+    int frontend_loop(void)
+    {
+      std::vector<shard_t> shards(_shard_count);
+      for (int index = 0; index < _shard_count; index++)
+      {
+        shard_args_t args = {this, index};
+        shards[index].actor = zactor_new(shard_actor, &args);
+        shards[index].clear_pipe = shard_pipe(this, index, "clear", false);
+        shards[index].curve_pipe = _curve_socket ? shard_pipe(this, index, "curve", false) : NULL;
+        zpoller_add(_poller, shards[index].clear_pipe);
+        if (shards[index].curve_pipe)
+          zpoller_add(_poller, shards[index].curve_pipe);
+      }
+      zclock_log("I: IDP broker running %d dispatcher shards", _shard_count);
+
+      //  Which shard owns each worker, keyed by routing id
+      IDPTable<shard_t> owners;
+
+      while (true)
+      {
+        void *which = zpoller_wait(_poller, -1);
+        if (which == NULL && zpoller_terminated(_poller))
+          break; //  Interrupted
+        _now = zclock_time();
+
+        //  Same batching as the single-threaded loop, over every socket
+        size_t handled = 0;
+        for (size_t round = 0; round < _batch_budget; round++)
+        {
+          bool progress = false;
+          for (int index = -1; index < _shard_count; index++)
+          {
+            void *inputs[2] = {index < 0 ? _clear_socket : shards[index].clear_pipe,
+                               index < 0 ? _curve_socket : shards[index].curve_pipe};
+            for (int channel = 0; channel < 2; channel++)
+            {
+              if (inputs[channel] == NULL || !(zsock_events(inputs[channel]) & ZMQ_POLLIN))
+                continue;
+              zmsg_t *msg = zmsg_recv(inputs[channel]);
+              if (!msg)
+                continue;
+              if (index < 0)
+                frontend_route(msg, channel == 0, shards, owners);
+              else
+                frontend_reply(msg, channel == 0, &shards[index], owners);
+              handled++;
+              progress = true;
+            }
+          }
+          if (!progress)
+            break;
+        }
+        _reactor_stats.wakeups++;
+        _reactor_stats.messages += handled;
+        _reactor_stats.last_batch = handled;
+        if (handled > _reactor_stats.max_batch)
+          _reactor_stats.max_batch = handled;
+      }
+      if (zctx_interrupted)
+        printf("W: interrupt received, shutting down...\n");
+
+      for (int index = 0; index < _shard_count; index++)
+      {
+        zpoller_remove(_poller, shards[index].clear_pipe);
+        if (shards[index].curve_pipe)
+          zpoller_remove(_poller, shards[index].curve_pipe);
+        zactor_destroy(&shards[index].actor);
+        zsock_destroy(&shards[index].clear_pipe);
+        if (shards[index].curve_pipe)
+          zsock_destroy(&shards[index].curve_pipe);
+      }
+      return 0;
+    }
+
+    //  Route one message from a ROUTER socket to its shard. Client requests
+    //  go by service name, and MMI queries by the name they ask about, so
+    //  the shard that owns a service also answers questions about it.
+    //  Workers are pinned to the shard of the service they registered for:
+
+    void frontend_route(zmsg_t *msg, bool clear, std::vector<shard_t> &shards, IDPTable<shard_t> &owners)
+    {
+      zframe_t *sender = zmsg_first(msg);
+      zmsg_next(msg); //  Empty delimiter
+      zframe_t *header = zmsg_next(msg);
+      zframe_t *command = zmsg_next(msg);
+      shard_t *shard = NULL;
+
+      if (header && command && (zframe_streq(header, IDPC_CLIENT) || zframe_streq(header, IDPC_CLIENT_PROPS)))
+      {
+        if (!client_admit(sender, clear))
+        {
+          bool props = zframe_streq(header, IDPC_CLIENT_PROPS);
+          zframe_t *address = zmsg_pop(msg);
+          for (int index = 0; index < 2; index++)
+          {
+            zframe_t *frame = zmsg_pop(msg); //  Empty delimiter, header
+            zframe_destroy(&frame);
+          }
+          zframe_t *service = zmsg_pop(msg);
+          client_refuse(&address, &service, clear, props);
+          zmsg_destroy(&msg);
+          return;
+        }
+        zframe_t *key = command; //  Service name
+        if (zframe_size(key) >= 4 && memcmp(zframe_data(key), "mmi.", 4) == 0)
+          key = zmsg_last(msg);
+        shard = &shards[IDPTable<shard_t>::hash(key) % _shard_count];
+      }
+      else if (header && command && (zframe_streq(header, IDPW_WORKER) || zframe_streq(header, IDPW_WORKER_PROPS)))
+      {
+        uint32_t hash = IDPTable<shard_t>::hash(sender);
+        shard_t *owner = owners.lookup(zframe_data(sender), zframe_size(sender), hash);
+        zframe_t *service = zframe_streq(command, IDPW_READY) ? zmsg_next(msg) : NULL;
+        if (service)
+        {
+          shard = &shards[IDPTable<shard_t>::hash(service) % _shard_count];
+          if (owner && owner != shard)
+          {
+            //  Worker moved to another service; its old shard lets go
+            zmsg_t *disconnect = zmsg_new();
+            zframe_t *address = zframe_dup(sender);
+            zmsg_append(disconnect, &address);
+            zmsg_addstr(disconnect, "");
+            zmsg_addstr(disconnect, IDPW_WORKER);
+            zmsg_addstr(disconnect, IDPW_DISCONNECT);
+            zmsg_send(&disconnect, clear ? owner->clear_pipe : owner->curve_pipe);
+            owners.remove(zframe_data(sender), zframe_size(sender), hash);
+            owner = NULL;
+          }
+          if (!owner)
+            owners.insert(zframe_data(sender), zframe_size(sender), hash, shard);
+        }
+        else
+          //  Unknown workers go anywhere, to be told to disconnect
+          shard = owner ? owner : &shards[hash % _shard_count];
+      }
+      if (shard == NULL)
+      {
+        zclock_log("E: invalid message:");
+        zmsg_dump(msg);
+        zmsg_destroy(&msg);
+        return;
+      }
+      zmsg_send(&msg, clear ? shard->clear_pipe : shard->curve_pipe);
+    }
+
+    //  Pass one message from a shard back out through its ROUTER socket.
+    //  Messages starting with an empty frame are notices from the shard;
+    //  at present the only one is FORGET, sent when it deletes a worker:
+
+    void frontend_reply(zmsg_t *msg, bool clear, shard_t *shard, IDPTable<shard_t> &owners)
+    {
+      if (zframe_size(zmsg_first(msg)) == 0)
+      {
+        zframe_t *address = zmsg_last(msg);
+        uint32_t hash = IDPTable<shard_t>::hash(address);
+        if (owners.lookup(zframe_data(address), zframe_size(address), hash) == shard)
+          owners.remove(zframe_data(address), zframe_size(address), hash);
+        zmsg_destroy(&msg);
+      }
+      else
+        zmsg_send(&msg, clear ? _clear_socket : _curve_socket);
+    }
+
+    //  .split broker drain method
+    //  The drain method reads from both sockets in turn, skipping any socket
+    //  that has nothing pending, until both are empty or the budget is used
+    //  up. Returns false if we were interrupted:
+
+    bool broker_drain(size_t *handled)
+    {
+      void *sockets[2] = {_clear_socket, _curve_socket};
+      for (size_t round = 0; round < _batch_budget; round++)
+      {
+        bool progress = false;
+        for (int index = 0; index < 2; index++)
+        {
+          if (sockets[index] == NULL || !(zsock_events(sockets[index]) & ZMQ_POLLIN))
+            continue;
+          if (!broker_recv(sockets[index]))
+            return false;
+          (*handled)++;
+          progress = true;
+        }
+        if (!progress)
+          break;
+      }
+      return true;
+    }
+
+    //  .split broker recv method
+    //  Receive and route one message from the given socket:
+
+    bool broker_recv(void *which)
+    {
+      bool clear = (which == _clear_socket);
+
+      zmsg_t *msg = zmsg_recv(which);
+      if (!msg)
+        return false; //  Interrupted
+      if (_verbose)
+      {
+        zclock_log("I: received message:");
+        zmsg_dump(msg);
+      }
+      zframe_t *sender = zmsg_pop(msg);
+      zframe_t *empty = zmsg_pop(msg);
+      zframe_t *header = zmsg_pop(msg);
+
+      if (!header)
+      {
+        if (_verbose)
+          zclock_log("W: message without header, dropped");
+        zmsg_destroy(&msg);
+      }
+      else if (zframe_streq(header, IDPC_CLIENT))
+        broker_client_msg(&sender, msg, clear, false);
+      else if (zframe_streq(header, IDPC_CLIENT_PROPS))
+        broker_client_msg(&sender, msg, clear, true);
+      else if (zframe_streq(header, IDPW_WORKER))
+        broker_worker_msg(&sender, msg, clear, false);
+      else if (zframe_streq(header, IDPW_WORKER_PROPS))
+        broker_worker_msg(&sender, msg, clear, true);
+      else
+      {
+        zclock_log("E: invalid message:");
+        zmsg_dump(msg);
+        zmsg_destroy(&msg);
+      }
+      zframe_destroy(&sender);
+      zframe_destroy(&empty);
+      zframe_destroy(&header);
+      return true;
+    }
+
+    //  Check that a message from a peer has at least the given number of
+    //  frames and, in IDPC02 and IDPW02, a whole properties frame second.
+    //  Peers are not trusted, so we drop bad messages rather than assert.
+
+    bool broker_valid(zmsg_t *msg, size_t frames, bool props)
+    {
+      bool valid = zmsg_size(msg) >= frames;
+      if (valid && props)
+      {
+        zmsg_first(msg);
+        valid = IDPProps::valid(zmsg_next(msg));
+      }
+      if (!valid && _verbose)
+      {
+        zclock_log("W: malformed message, dropped:");
+        zmsg_dump(msg);
+      }
+      return valid;
+    }
+
+    //  .split broker worker_msg method
+    //  The worker_msg method processes one READY, REPLY, HEARTBEAT or
+    //  DISCONNECT message sent to the broker by a worker. A worker may
+    //  advertise credit in READY, to have that many requests in flight,
+    //  and change it later with an IDPW02 HEARTBEAT. IDPW02 replies name
+    //  the request they answer, so they may come back in any order:
+
+    void broker_worker_msg(zframe_t **sender_p, zmsg_t *msg, bool clear, bool props)
+    {
+      //  At least, command and properties; replies carry a client envelope
+      zframe_t *first = zmsg_first(msg);
+      bool reply = first && (zframe_streq(first, IDPW_REPLY) || zframe_streq(first, IDPW_REPLY_CURVE));
+      if (!broker_valid(msg, (props ? 2 : 1) + reply, props))
+      {
+        zmsg_destroy(&msg);
+        return;
+      }
+
+      zframe_t *command = zmsg_pop(msg);
+      zframe_t *props_frame = props ? zmsg_pop(msg) : NULL;
+      uint32_t hash = IDPTable<worker_t>::hash(*sender_p);
+      worker_t *worker = _workers->lookup(zframe_data(*sender_p), zframe_size(*sender_p), hash);
+      int worker_ready = (worker != NULL);
+      if (!worker)
+        worker = worker_require(sender_p, hash, clear);
+
+      if (zframe_streq(command, IDPW_READY))
+      {
+        zframe_t *ready_props = zmsg_first(msg) ? zmsg_next(msg) : NULL;
+        if (worker_ready) //  Not first command in session
+          worker_delete(worker, 1);
+        else if (zmsg_first(msg) == NULL //  Missing or reserved service name
+                 || (zframe_size(zmsg_first(msg)) >= 4 && memcmp(zframe_data(zmsg_first(msg)), "mmi.", 4) == 0)
+                 || (ready_props && !IDPProps::valid(ready_props))) //  Malformed properties
+          worker_delete(worker, 1);
+        else
+        {
+          //  Attach worker to service and mark as idle. Workers that
+          //  send properties after the service name take IDPW02.
+          zframe_t *service_frame = zmsg_pop(msg);
+          worker->props = zmsg_first(msg) != NULL;
+          worker->credit = 1;
+          if (worker->props)
+            worker_credit(worker, zmsg_first(msg));
+          worker->service = service_require(service_frame);
+          worker->service->workers++;
+          _idle_services.remove(&worker->service->idle_link);
+          service_breaker_close(worker->service);
+          worker_admit(worker);
+          worker_waiting(worker);
+          zframe_destroy(&service_frame);
+        }
+      }
+      else if (zframe_streq(command, IDPW_REPLY) || zframe_streq(command, IDPW_REPLY_CURVE))
+      {
+        request_t *request = worker_ready ? worker_answered(worker, props_frame) : NULL;
+        if (request && request->discard)
+        {
+          //  Late reply to a hedged request; the twin answered already
+          request_release(request);
+          worker_waiting(worker);
+        }
+        else if (request)
+        {
+          //  The original of a hedged request holds what the reply
+          //  answers besides the client, whichever copy came back first
+          request_t *owner = request->hedge ? request->twin : request;
+          if (request->twin)
+            service_hedge_settle(worker->service, request);
+
+          //  Remove & save client return envelope and insert the
+          //  protocol header and service name, then rewrap envelope.
+          zframe_t *client = zmsg_unwrap(msg);
+          service_flight_end(worker->service, owner);
+          service_flight_answer(worker->service, owner, msg);
+          service_idempotency_record(worker->service, owner, msg);
+          uint64_t max_age;
+          if (owner->key && props_frame && IDPProps::get_uint(props_frame, IDP_PROP_MAX_AGE, &max_age) && max_age)
+            service_cache_insert(worker->service, &owner->key, msg, (int64_t)max_age);
+          service_reply_envelope(worker->service, msg);
+          zmsg_wrap(msg, client);
+          zmsg_send(&msg, zframe_streq(command, IDPW_REPLY) ? _clear_socket : _curve_socket);
+          zmsg_destroy(&request->msg);
+          request_release(request);
+          service_breaker_count(worker->service, 1, 0);
+          worker_waiting(worker);
+        }
+        else if (worker_ready)
+          zclock_log("W: reply to unknown request, dropped");
+        else
+          worker_delete(worker, 1);
+      }
+      else if (zframe_streq(command, IDPW_HEARTBEAT))
+      {
+        if (worker_ready)
+        {
+          //  Only idle workers expire; busy ones have a request deadline
+          if (worker->expiry_timer.armed())
+            _timers->arm(&worker->expiry_timer, _now + HEARTBEAT_EXPIRY);
+          if (props_frame && worker->service && worker_credit(worker, props_frame))
+            worker_waiting(worker);
+        }
+        else
+          worker_delete(worker, 1);
+      }
+      else if (zframe_streq(command, IDPW_DISCONNECT))
+        worker_delete(worker, 0);
+      else
+      {
+        zclock_log("E: invalid input message");
+        zmsg_dump(msg);
+        if (!worker_ready) //  Nothing would ever delete it
+          worker_delete(worker, 1);
+      }
+      zframe_destroy(&command);
+      zframe_destroy(&props_frame);
+      zmsg_destroy(&msg);
+    }
+
+    //  .split rate limiting
+    //  Each client has a token bucket that fills at its rate up to its
+    //  burst, and every request takes a token from it. The check runs
+    //  before anything else looks at the request, so a client over its
+    //  limit costs us one lookup and a short reply. Buckets count what
+    //  each client sends even when it has no limit. They are kept least
+    //  recently used first; past CLIENT_MAX_BUCKETS the first is forgotten,
+    //  and the client starts over with a full bucket if it comes back:
+
+    bool client_admit(zframe_t *sender, bool clear)
+    {
+      size_t size;
+      const byte *client = client_name(sender, clear, &size);
+      uint32_t hash = IDPTable<bucket_t>::hash(client, size);
+      bucket_t *bucket = _buckets->lookup(client, size, hash);
+      if (!bucket)
+        bucket = client_bucket_new(client, size, hash);
+      _buckets_lru.remove(&bucket->link);
+      _buckets_lru.append(&bucket->link);
+      if (bucket->generation != _rate_generation)
+        client_bucket_limit(bucket);
+      if (bucket->rate)
+      {
+        //  A rate per second is that many thousandths per msec
+        bucket->tokens += (_now - bucket->refilled) * bucket->rate;
+        bucket->refilled = _now;
+        if (bucket->tokens > (int64_t)bucket->burst * 1000)
+          bucket->tokens = (int64_t)bucket->burst * 1000;
+        if (bucket->tokens < 1000)
+        {
+          bucket->rejected++;
+          return false;
+        }
+        bucket->tokens -= 1000;
+      }
+      bucket->admitted++;
+      return true;
+    }
+
+    bucket_t *client_bucket_new(const byte *client, size_t size, uint32_t hash)
+    {
+      if (_buckets->size() >= CLIENT_MAX_BUCKETS)
+      {
+        bucket_t *oldest = _buckets_lru.pop();
+        _buckets->remove(zframe_data(oldest->client), zframe_size(oldest->client), oldest->hash);
+        bucket_destroy(oldest);
+      }
+      bucket_t *bucket = _bucket_pool.alloc();
+      bucket->broker = this;
+      bucket->link.init(bucket);
+      bucket->client = zframe_new(client, size);
+      bucket->hash = hash;
+      client_bucket_limit(bucket);
+      _buckets->insert(client, size, hash, bucket);
+      return bucket;
+    }
+
+    //  The name we know a client by: its public key in Z85 on the CURVE
+    //  socket if the broker authenticates clients, else its routing id.
+    //  Shards only see routing ids.
+
+    static const byte *client_name(zframe_t *sender, bool clear, size_t *size_p)
+    {
+      const char *public_key = clear ? NULL : zframe_meta(sender, "User-Id");
+      if (public_key && *public_key)
+      {
+        *size_p = strlen(public_key);
+        return (const byte *)public_key;
+      }
+      *size_p = zframe_size(sender);
+      return zframe_data(sender);
+    }
+
+    //  Take the limit in force for the client of a bucket, its own or the
+    //  default, and fill the bucket
+
+    void client_bucket_limit(bucket_t *bucket)
+    {
+      rate_limit_t *limit = &_client_rate;
+      if (zhash_size(_client_rates))
+      {
+        char *name = zframe_strdup(bucket->client);
+        rate_limit_t *named = (rate_limit_t *)zhash_lookup(_client_rates, name);
+        free(name);
+        if (named)
+          limit = named;
+      }
+      bucket->rate = limit->rate;
+      bucket->burst = limit->burst;
+      bucket->tokens = (int64_t)bucket->burst * 1000;
+      bucket->refilled = _now;
+      bucket->generation = _rate_generation;
+    }
+
+    //  Answer a request over the rate limit with status 429, so the client
+    //  can back off; IDPC01 clients get nothing, as in service_reject.
+    //  Takes over the sender and service name frames
+
+    void client_refuse(zframe_t **sender_p, zframe_t **service_p, bool clear, bool props)
+    {
+      if (!props)
+      {
+        zframe_destroy(sender_p);
+        zframe_destroy(service_p);
+        return;
+      }
+      zmsg_t *reply = status_reply(*service_p, IDP_STATUS_RATE_LIMITED);
+      *service_p = NULL;
+      zmsg_wrap(reply, *sender_p);
+      *sender_p = NULL;
+      zmsg_send(&reply, clear ? _clear_socket : _curve_socket);
+    }
+
+    //  Bucket destructor is called when a bucket is forgotten, and for
+    //  every bucket when the broker is destroyed.
+
+    static void bucket_destroy(bucket_t *bucket)
+    {
+      zframe_destroy(&bucket->client);
+      bucket->broker->_bucket_pool.release(bucket);
+    }
+
+    //  .split broker client_msg method
+    //  Process a request coming from a client. We implement MMI requests
+    //  directly here: mmi.service, and mmi.queue, which answers "200" and
+    //  then queue statistics as name and value pairs.
+    //  We take over the sender frame as the reply envelope, so the request
+    //  frames travel on to the worker without being copied. MMI queries only
+    //  look services up, they never create them:
+
+    void broker_client_msg(zframe_t **sender_p, zmsg_t *msg, bool clear, bool props)
+    {
+      if (!broker_valid(msg, props ? 3 : 2, props)) //  Service name + properties + body
+      {
+        zmsg_destroy(&msg);
+        return;
+      }
+
+      zframe_t *service_frame = zmsg_pop(msg);
+      if (!_pipe && !client_admit(*sender_p, clear))
+      {
+        client_refuse(sender_p, &service_frame, clear, props);
+        zmsg_destroy(&msg);
+        return;
+      }
+      int64_t deadline = 0;
+      int priority = IDP_PRIORITY_NORMAL;
+      zframe_t *idempotency_key = NULL;
+      if (props)
+      {
+        //  IDPC02 requests carry properties after the service name. A TTL
+        //  becomes the request deadline, counted from when we received it
+        //  and cut to REQUEST_MAX_TTL so the deadline cannot overflow, and
+        //  a priority picks the class the request queues in
+        zframe_t *props_frame = zmsg_pop(msg);
+        uint64_t value;
+        size_t size;
+        const byte *data = IDPProps::get(props_frame, IDP_PROP_IDEMPOTENCY_KEY, &size);
+        if (data && size)
+          idempotency_key = idempotency_scope(*sender_p, clear, data, size);
+        if (IDPProps::get_uint(props_frame, IDP_PROP_TTL, &value))
+          deadline = _now + (int64_t)(value < REQUEST_MAX_TTL ? value : REQUEST_MAX_TTL);
+        if (IDPProps::get_uint(props_frame, IDP_PROP_PRIORITY, &value))
+          priority = value < IDP_PRIORITY_CLASSES ? (int)value : IDP_PRIORITY_LOW;
+        zframe_destroy(&props_frame);
+      }
+
+      //  Set reply return address to client sender
+      zmsg_wrap(msg, *sender_p);
+      *sender_p = NULL;
+
+      //  If we got a MMI service request, process that internally
+      if (zframe_size(service_frame) >= 4 && memcmp(zframe_data(service_frame), "mmi.", 4) == 0)
+      {
+        char const *return_code;
+        service_t *queue = NULL; //  Service to report queue stats for
+        if (zframe_streq(service_frame, "mmi.service"))
+        {
+          service_t *service = service_lookup(zmsg_last(msg));
+          return_code = service && service->workers ? "200" : "404";
+        }
+        else if (zframe_streq(service_frame, "mmi.queue"))
+        {
+          queue = service_lookup(zmsg_last(msg));
+          return_code = queue ? "200" : "404";
+        }
+        else
+          return_code = "501";
+
+        zframe_reset(zmsg_last(msg), return_code, strlen(return_code));
+        if (queue)
+        {
+          //  Queue statistics as name and value frame pairs. Clients skip
+          //  names they do not know, so counters can be added freely
+          mmi_stat(msg, "queued", queue->requests.size());
+          mmi_stat(msg, "queued_bytes", queue->queued_bytes);
+          mmi_stat(msg, "rejected", queue->rejected);
+          mmi_stat(msg, "workers", queue->workers);
+          mmi_stat(msg, "dropped", queue->dropped);
+          mmi_stat(msg, "expired", queue->expired);
+          mmi_stat(msg, "cache_hits", queue->cache_hits);
+          mmi_stat(msg, "cache_misses", queue->cache_misses);
+          mmi_stat(msg, "cache_bytes", queue->cache_bytes);
+          mmi_stat(msg, "flights", queue->flights_started);
+          mmi_stat(msg, "coalesced", queue->coalesced);
+          mmi_stat(msg, "resends", queue->resends);
+          mmi_stat(msg, "reassigned", queue->reassigned);
+          mmi_stat(msg, "hedged", queue->hedged);
+          mmi_stat(msg, "hedge_wins", queue->hedge_wins);
+          mmi_stat(msg, "ejected", queue->ejected);
+          mmi_stat(msg, "ejections", queue->ejections);
+          mmi_stat(msg, "breaker_open", queue->breaker_open);
+          mmi_stat(msg, "short_circuited", queue->short_circuited);
+          size_t fair_queues = 0;
+          for (int priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+            fair_queues += queue->fair[priority].size();
+          mmi_stat(msg, "fair_queues", fair_queues);
+        }
+
+        //  Remove & save client return envelope and insert the
+        //  protocol header and service name, then rewrap envelope.
+        zframe_t *client = zmsg_unwrap(msg);
+        zmsg_push(msg, service_frame);
+        zmsg_pushstr(msg, IDPC_CLIENT);
+        zmsg_wrap(msg, client);
+        zmsg_send(&msg, clear ? _clear_socket : _curve_socket);
+        zframe_destroy(&idempotency_key);
+      }
+      else
+      {
+        //  Else treat it as a resend, answer from the cache, join a
+        //  flight, or dispatch the message to the requested service
+        service_t *service = service_require(service_frame);
+        zframe_destroy(&service_frame);
+        if (idempotency_key && !service->limits.idempotency_keys)
+          zframe_destroy(&idempotency_key);
+        //  A request whose idempotency key we know is a resend: it waits
+        //  for the request that first carried the key, or gets its reply
+        if (idempotency_key && service_idempotency_answer(service, idempotency_key, msg, clear, props, deadline, priority))
+        {
+          zframe_destroy(&idempotency_key);
+          return;
+        }
+        //  A cached fresh reply answers the request right here; in single
+        //  flight mode it parks on an identical request already queued or
+        //  with a worker
+        zframe_t *key = NULL;
+        if (service->limits.cache_max_bytes || service->limits.coalesce)
+        {
+          key = service_request_key(msg);
+          if ((service->limits.cache_max_bytes && service_cache_answer(service, key, msg, clear)) ||
+              (service->limits.coalesce && service_flight_join(service, key, msg, clear, props, deadline, priority)))
+          {
+            zframe_destroy(&key);
+            zframe_destroy(&idempotency_key);
+            return;
+          }
+        }
+        service_dispatch(service, msg, clear, props, deadline, priority, key, idempotency_key);
+      }
+    }
+
+    //  Append one mmi.queue statistic to a reply
+
+    static void mmi_stat(zmsg_t *msg, const char *name, uint64_t value)
+    {
+      zmsg_addstr(msg, name);
+      zmsg_addstrf(msg, "%llu", (unsigned long long)value);
+    }
+
+    //  .split service methods
+    //  Here is the implementation of the methods that work on a service:
+
+    //  Locates a service by the raw bytes of its name frame, without
+    //  allocating; returns NULL if there is no such service.
+
+    service_t *service_lookup(zframe_t *service_frame)
+    {
+      assert(service_frame);
+      return _services->lookup(zframe_data(service_frame), zframe_size(service_frame),
+                               IDPTable<service_t>::hash(service_frame));
+    }
+
+    //  Lazy constructor that locates a service by name, or creates a new
+    //  service if there is no service already with that name. Only creating
+    //  a service allocates: its name string and the frames replies reuse.
+
+    service_t *service_require(zframe_t *service_frame)
+    {
+      assert(service_frame);
+      uint32_t hash = IDPTable<service_t>::hash(service_frame);
+      service_t *service = _services->lookup(zframe_data(service_frame), zframe_size(service_frame), hash);
+      if (service == NULL)
+      {
+        service = _service_pool.alloc();
+        service->broker = this;
+        service->name = zframe_strdup(service_frame);
+        service->hash = hash;
+        service->name_frame = zframe_dup(service_frame);
+        service->header_frame = zframe_new(IDPC_CLIENT, strlen(IDPC_CLIENT));
+        service_limits_t *limits = (service_limits_t *)zhash_lookup(_service_limits, service->name);
+        service->limits = limits ? *limits : _service_defaults;
+        service->breaker_timer.init(service_breaker_expired, service);
+        service_breaker_arm(service);
+        service->idle_link.init(service);
+        _services->insert(zframe_data(service_frame), zframe_size(service_frame), hash, service);
+        if (_verbose)
+          zclock_log("I: added service: %s", service->name);
+        service_idle(service);
+        services_trim();
+      }
+      else if (service->workers == 0)
+        service_idle(service);
+      return service;
+    }
+
+    //  .split idle services
+    //  Services without workers are kept on a list, the one clients asked
+    //  for least recently first. A timer forgets them once they have been
+    //  idle for the timeout, and creating a service past the limit forgets
+    //  the first:
+
+    void service_idle(service_t *service)
+    {
+      _idle_services.remove(&service->idle_link);
+      service->idle_since = _now;
+      _idle_services.append(&service->idle_link);
+      services_reap_arm();
+    }
+
+    void services_reap_arm()
+    {
+      service_t *service = _idle_services.first();
+      if (service && _service_idle_timeout && !_idle_timer.armed())
+        _timers->arm(&_idle_timer, service->idle_since + _service_idle_timeout);
+    }
+
+    //  Called by the timer wheel when the first idle service may have timed
+    //  out; one that still has requests queued gets another timeout
+
+    static void services_reap(IDPTimer *, void *arg)
+    {
+      IDPBroker *self = (IDPBroker *)arg;
+      service_t *service;
+      while ((service = self->_idle_services.first())
+             && service->idle_since + self->_service_idle_timeout <= self->_now)
+      {
+        if (service->requests.size())
+          self->service_idle(service);
+        else
+          self->service_evict(service);
+      }
+      self->services_reap_arm();
+    }
+
+    void services_trim()
+    {
+      while (_max_idle_services && _idle_services.size() > _max_idle_services)
+        service_evict(_idle_services.first());
+    }
+
+    //  Forget a service that has no workers
+
+    void service_evict(service_t *service)
+    {
+      assert(service->workers == 0);
+      if (_verbose)
+        zclock_log("I: removed idle service: %s", service->name);
+      service_flush(service);
+      _idle_services.remove(&service->idle_link);
+      _services->remove(zframe_data(service->name_frame), zframe_size(service->name_frame), service->hash);
+      service_destroy(service);
+    }
+
+    //  Put the protocol header and service name in front of a reply. Names
+    //  and header fit in a ZeroMQ very small message, so duplicating the
+    //  prebuilt frames is a fixed size copy with no lookup or strlen.
+
+    static void service_reply_envelope(service_t *service, zmsg_t *msg)
+    {
+      zmsg_push(msg, zframe_dup(service->name_frame));
+      zmsg_push(msg, zframe_dup(service->header_frame));
+    }
+
+    //  Service destructor is called for every service when the broker is
+    //  destroyed, and when an idle service is evicted.
+
+    static void service_destroy(void *argument)
+    {
+      service_t *service = (service_t *)argument;
+      IDPBroker *broker = service->broker;
+      broker->_timers->cancel(&service->breaker_timer);
+      request_t *request;
+      while ((request = service->requests.pop()))
+      {
+        zmsg_destroy(&request->msg);
+        broker->request_release(request);
+      }
+      cache_entry_t *entry;
+      while ((entry = service->cache_lru.first()))
+        broker->service_cache_evict(service, entry);
+      delete service->cache;
+      delete service->flights;
+      idempotency_entry_t *idempotency;
+      while ((idempotency = service->idempotency_age.first()))
+        broker->service_idempotency_evict(service, idempotency);
+      delete service->idempotency;
+      if (service->outliers)
+        service->outliers->foreach(outlier_destroy);
+      delete service->outliers;
+      for (int priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+        if (service->flows[priority])
+        {
+          service->flows[priority]->foreach(flow_destroy);
+          delete service->flows[priority];
+        }
+      zframe_destroy(&service->name_frame);
+      zframe_destroy(&service->header_frame);
+      free(service->name);
+      broker->_service_pool.release(service);
+    }
+
+    //  Limits set for a named service, created from the defaults if the
+    //  service has none yet
+
+    service_limits_t *service_limits_require(const char *name)
+    {
+      service_limits_t *limits = (service_limits_t *)zhash_lookup(_service_limits, name);
+      if (!limits)
+      {
+        limits = (service_limits_t *)zmalloc(sizeof(service_limits_t));
+        *limits = _service_defaults;
+        zhash_insert(_service_limits, name, limits);
+        zhash_freefn(_service_limits, name, free);
+      }
+      return limits;
+    }
+
+    void service_limits_apply(const std::string &name, const service_limits_t *limits)
+    {
+      service_t *service = _services->lookup((const byte *)name.data(), name.size(),
+                                             IDPTable<service_t>::hash((const byte *)name.data(), name.size()));
+      if (service)
+      {
+        bool fair = service->limits.fair;
+        service->limits = *limits;
+        if (service->limits.fair != fair)
+          service_queues_rebuild(service);
+        service_cache_trim(service, 0);
+        service_idempotency_trim(service, 0);
+        //  A breaker waiting for a worker closes if the grace period is
+        //  turned off; a closed one restarts its grace period
+        if (!service->breaker_open || (!service->breaker_timer.armed() && !service->limits.breaker_grace))
+          service_breaker_close(service);
+      }
+    }
+
+    //  .split service dispatch method
+    //  The dispatch method sends requests to waiting workers. A request
+    //  that would have to queue past the service limits is refused, and
+    //  CoDel may drop the oldest requests before we hand any out. Requests
+    //  whose client has stopped waiting are dropped without a reply, and
+    //  IDPW02 workers get the msecs the client has left. Each priority
+    //  class queues earliest deadline first; requests without a deadline
+    //  follow those with one, in arrival order. A request that queues
+    //  takes its idempotency key along, so resends can find it:
+
+    void service_dispatch(service_t *service, zmsg_t *msg, bool clear, bool props = false, int64_t deadline = 0, int priority = IDP_PRIORITY_NORMAL, zframe_t *key = NULL, zframe_t *idempotency_key = NULL)
+    {
+      assert(service);
+      if (msg) //  Queue message if any
+      {
+        size_t size = zmsg_content_size(msg);
+        if (service->breaker_open)
+        {
+          service->short_circuited++;
+          service_reject(service, msg, clear, props);
+          zframe_destroy(&key);
+          zframe_destroy(&idempotency_key);
+          return;
+        }
+        if (service->waiting.size() == 0 && service_full(service, size))
+        {
+          service->rejected++;
+          service_reject(service, msg, clear, props);
+          zframe_destroy(&key);
+          zframe_destroy(&idempotency_key);
+          return;
+        }
+        request_t *request = request_new(msg, size, clear, props, deadline, priority);
+        request->key = key;
+        service_enqueue(service, request);
+        if (key && service->limits.coalesce)
+          service_flight_start(service, request);
+        if (idempotency_key)
+          service_idempotency_start(service, request, &idempotency_key);
+      }
+      if (service->limits.codel_target)
+        service_codel(service);
+
+      while (service->waiting.size() && service->requests.size())
+      {
+        request_t *request = service_dequeue(service);
+        if (request->deadline && request->deadline <= _now)
+        {
+          service->expired++;
+          service_flight_retry(service, request);
+          zmsg_destroy(&request->msg);
+          request_release(request);
+          continue;
+        }
+        service->wait[request->priority][wait_bucket(_now - request->enqueued)]++;
+        worker_dispatch(balancer(service->limits.balance)(service), request);
+      }
+    }
+
+    //  Send a request to one of the service's waiting workers. While the
+    //  request has attempts left or the service hedges, we keep a copy of
+    //  it to send to another worker; hedge copies are never copied again.
+
+    void worker_dispatch(worker_t *worker, request_t *request)
+    {
+      service_t *service = worker->service;
+      service->waiting.remove(&worker->service_link);
+      if (worker->in_flight.size() == 0)
+      {
+        _timers->cancel(&worker->expiry_timer);
+        _timers->cancel(&worker->heartbeat_timer);
+        if (_request_timeout)
+          _timers->arm(&worker->request_timer, _now + _request_timeout);
+      }
+      request->worker = worker;
+      request->id = worker->next_id++;
+      request->dispatched = _now;
+      request->sent = zclock_usecs();
+      request->attempts++;
+      zmsg_t *copy = !request->hedge && (request->attempts < service->limits.max_attempts || service->limits.hedge_budget)
+                         ? zmsg_dup(request->msg)
+                         : NULL;
+      if (worker->props)
+      {
+        IDPProps props;
+        if (request->deadline)
+          props.put_uint(IDP_PROP_TTL, request->deadline - _now);
+        props.put_uint(IDP_PROP_REQUEST_ID, request->id);
+        zmsg_push(request->msg, props.frame());
+      }
+      worker_send(worker, (request->clear ? IDPW_REQUEST : IDPW_REQUEST_CURVE), NULL, &request->msg);
+      request->msg = copy;
+      worker->in_flight.append(&request->link);
+      if (worker->in_flight.size() < worker_capacity(worker))
+        service->waiting.append(&worker->service_link);
+      if (service->limits.hedge_budget && !request->hedge)
+        service_hedge_arm(service, request);
+    }
+
+    //  Put a request on the service queues
+
+    void service_enqueue(service_t *service, request_t *request)
+    {
+      request->queue_link.init(request);
+      request->queue_link.key = request->deadline ? request->deadline : INT64_MAX;
+      service_queue(service, request);
+    }
+
+    //  Put a request from a lost worker back at the front of its class,
+    //  ahead of requests that never reached a worker; rank keeps those
+    //  from the same worker oldest first. It counts as queued from now,
+    //  so CoDel does not hold the lost worker's time against it.
+
+    void service_requeue(service_t *service, request_t *request, size_t rank)
+    {
+      request->queue_link.init(request);
+      request->queue_link.key = INT64_MIN + (int64_t)rank;
+      service_queue(service, request);
+      request->enqueued = _now;
+      service->reassigned++;
+    }
+
+    //  Put a request whose queue key is set on the queue of its class, or
+    //  of its client in fair queuing mode
+
+    void service_queue(service_t *service, request_t *request)
+    {
+      service->requests.append(&request->link);
+      service->queued_bytes += request->size;
+      service->queued[request->priority]++;
+      if (service->limits.fair)
+        service_fair_queue(service, request);
+      else
+        service->queues[request->priority].push(&request->queue_link);
+    }
+
+    //  Move every queued request to the queues the service uses now,
+    //  oldest first, keeping their keys
+
+    void service_queues_rebuild(service_t *service)
+    {
+      IDPList<request_t> moving;
+      request_t *request;
+      while ((request = service->requests.first()))
+      {
+        service_unqueue(service, request);
+        moving.append(&request->link);
+      }
+      while ((request = moving.pop()))
+        service_queue(service, request);
+    }
+
+    //  Take the next request off the service queues: the most urgent one
+    //  of the highest class that has any, unless a lower class has been
+    //  passed over PRIORITY_MAX_PASSED times while it had requests waiting.
+    //  That bounds how long a stream of high priority work can starve it.
+
+    request_t *service_dequeue(service_t *service)
+    {
+      int chosen = -1;
+      for (int priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+      {
+        if (service->queued[priority] == 0)
+          continue;
+        if (chosen < 0)
+          chosen = priority;
+        else if (service->passed[priority] >= PRIORITY_MAX_PASSED)
+        {
+          chosen = priority;
+          break;
+        }
+      }
+      if (chosen < 0)
+        return NULL;
+      for (int priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+        if (priority != chosen && service->queued[priority])
+          service->passed[priority]++;
+      service->passed[chosen] = 0;
+
+      request_t *request = service->limits.fair ? service_fair_top(service, chosen) : service->queues[chosen].top();
+      service_unqueue(service, request);
+      return request;
+    }
+
+    //  .split fair queuing
+    //  In fair queuing mode each class keeps a queue per client, earliest
+    //  deadline first like the class queues, and serves the clients that
+    //  have requests queued by deficit round robin: the client whose turn
+    //  it is sends as many requests as its weight, then goes to the back.
+    //  Every request costs the same, since what clients share is worker
+    //  time, not bytes. A client that sends a burst only delays the others
+    //  by its weight per turn. Clients are told apart by routing id, or on
+    //  the CURVE socket by public key when the ZAP handler reports one, so
+    //  a tenant gets one share however many connections it opens. Shards
+    //  only see routing ids:
+
+    void service_fair_queue(service_t *service, request_t *request)
+    {
+      int priority = request->priority;
+      if (!request->clear && !request->client)
+      {
+        const char *public_key = zframe_meta(zmsg_first(request->msg), "User-Id");
+        if (public_key && *public_key)
+          request->client = zframe_new(public_key, strlen(public_key));
+      }
+      zframe_t *client = request->client ? request->client : zmsg_first(request->msg);
+      uint32_t hash = IDPTable<flow_t>::hash(client);
+      if (!service->flows[priority])
+        service->flows[priority] = new IDPTable<flow_t>();
+      flow_t *flow = service->flows[priority]->lookup(zframe_data(client), zframe_size(client), hash);
+      if (!flow)
+      {
+        flow = _flow_pool.alloc();
+        flow->link.init(flow);
+        flow->service = service;
+        flow->client = zframe_dup(client);
+        flow->hash = hash;
+        flow->weight = client_weight(client);
+        service->flows[priority]->insert(zframe_data(client), zframe_size(client), hash, flow);
+        service->fair[priority].append(&flow->link);
+      }
+      flow->queue.push(&request->queue_link);
+      request->flow = flow;
+    }
+
+    //  The most urgent request of the client whose turn it is. Taking it
+    //  uses up one request of the turn; the last one sends the client to
+    //  the back.
+
+    request_t *service_fair_top(service_t *service, int priority)
+    {
+      flow_t *flow = service->fair[priority].first();
+      if (flow->deficit == 0)
+        flow->deficit = flow->weight;
+      if (--flow->deficit == 0)
+      {
+        service->fair[priority].remove(&flow->link);
+        service->fair[priority].append(&flow->link);
+      }
+      return flow->queue.top();
+    }
+
+    //  Take a request out of its client queue, and forget the client queue
+    //  once it is empty
+
+    void service_fair_unqueue(service_t *service, request_t *request)
+    {
+      flow_t *flow = request->flow;
+      flow->queue.remove(&request->queue_link);
+      request->flow = NULL;
+      if (flow->queue.size() == 0)
+      {
+        service->fair[request->priority].remove(&flow->link);
+        service->flows[request->priority]->remove(zframe_data(flow->client), zframe_size(flow->client), flow->hash);
+        flow_destroy(flow);
+      }
+    }
+
+    uint32_t client_weight(zframe_t *client)
+    {
+      if (zhash_size(_client_weights) == 0)
+        return 1;
+      char *name = zframe_strdup(client);
+      uint32_t *weight = (uint32_t *)zhash_lookup(_client_weights, name);
+      free(name);
+      return weight ? *weight : 1;
+    }
+
+    //  Flow destructor is called when a client queue empties, and for
+    //  every flow when its service is destroyed.
+
+    static void flow_destroy(flow_t *flow)
+    {
+      zframe_destroy(&flow->client);
+      flow->service->broker->_flow_pool.release(flow);
+    }
+
+    //  .split balancing strategies
+    //  Each strategy picks one of the waiting workers of a service, which
+    //  is never empty when we ask. Only waiting workers are candidates, so
+    //  a slow worker still gets requests whenever the faster ones are all
+    //  busy, and its service time gets measured again. Ties go to the
+    //  worker that has waited longest:
+
+    typedef worker_t *(*balancer_t)(service_t *service);
+
+    static balancer_t balancer(int balance)
+    {
+      static const balancer_t balancers[BALANCE_STRATEGIES] = {
+          balance_round_robin, balance_lifo, balance_least_outstanding, balance_ewma};
+      return balancers[balance];
+    }
+
+    static worker_t *balance_round_robin(service_t *service)
+    {
+      return service->waiting.first();
+    }
+
+    //  Workers rejoin the waiting list at the tail, so the last one has
+    //  just finished a request. With credit it also keeps getting requests
+    //  until its credit runs out, instead of each going to another worker.
+
+    static worker_t *balance_lifo(service_t *service)
+    {
+      return service->waiting.last();
+    }
+
+    static worker_t *balance_least_outstanding(service_t *service)
+    {
+      worker_t *chosen = service->waiting.first();
+      for (worker_t *worker = chosen; worker; worker = IDPList<worker_t>::next(&worker->service_link))
+        if (worker->in_flight.size() < chosen->in_flight.size())
+          chosen = worker;
+      return chosen;
+    }
+
+    //  Expected wait for a new request on each worker is its service time
+    //  times the requests it already holds, plus one. Workers not yet
+    //  measured count as fastest, so they get tried.
+
+    static worker_t *balance_ewma(service_t *service)
+    {
+      worker_t *chosen = NULL;
+      int64_t best = 0;
+      for (worker_t *worker = service->waiting.first(); worker; worker = IDPList<worker_t>::next(&worker->service_link))
+      {
+        int64_t cost = worker->service_time * (int64_t)(worker->in_flight.size() + 1);
+        if (!chosen || cost < best)
+        {
+          chosen = worker;
+          best = cost;
+        }
+      }
+      return chosen;
+    }
+
+    //  Take a request off the service queues, wherever it is in them
+
+    void service_unqueue(service_t *service, request_t *request)
+    {
+      service->requests.remove(&request->link);
+      service->queued_bytes -= request->size;
+      service->queued[request->priority]--;
+      if (request->flow)
+        service_fair_unqueue(service, request);
+      else
+        service->queues[request->priority].remove(&request->queue_link);
+    }
+
+    //  Histogram bucket for a queue wait in msecs
+
+    static size_t wait_bucket(int64_t wait)
+    {
+      size_t bucket = 0;
+      while (wait > 0 && bucket < SERVICE_WAIT_BUCKETS - 1)
+      {
+        wait >>= 1;
+        bucket++;
+      }
+      return bucket;
+    }
+
+    //  .split service CoDel method
+    //  CoDel looks at how long the oldest request has waited. Waits over
+    //  target are fine for one interval, to absorb bursts; after that we
+    //  drop the oldest request, then keep dropping at intervals that
+    //  shrink with the square root of the drop count, until the wait is
+    //  back under target:
+
+    void service_codel(service_t *service)
+    {
+      request_t *request;
+      while ((request = service->requests.first()))
+      {
+        bool too_long = false;
+        if (_now - request->enqueued < service->limits.codel_target)
+          service->first_above = 0;
+        else if (service->first_above == 0)
+          service->first_above = _now + service->limits.codel_interval;
+        else
+          too_long = _now >= service->first_above;
+
+        if (service->dropping)
+        {
+          if (!too_long)
+          {
+            service->dropping = false;
+            break;
+          }
+          if (_now < service->drop_next)
+            break;
+          service->drop_count++;
+        }
+        else if (too_long)
+        {
+          //  Start dropping; if we stopped only recently, pick up near
+          //  the rate we had reached
+          service->dropping = true;
+          service->drop_count = service->drop_count > 2 && _now - service->drop_next < 16 * service->limits.codel_interval
+                                    ? service->drop_count - 2
+                                    : 1;
+          service->drop_next = _now;
+        }
+        else
+          break;
+
+        service_unqueue(service, request);
+        service->dropped++;
+        service_flight_end(service, request);
+        service_flight_reject(service, request);
+        service_reject(service, request->msg, request->clear, request->props);
+        request_release(request);
+        service->drop_next += service->limits.codel_interval / isqrt(service->drop_count);
+      }
+    }
+
+    //  Integer square root, at least 1
+
+    static uint32_t isqrt(uint32_t value)
+    {
+      uint32_t root = 0;
+      uint32_t bit = 1u << 30;
+      while (bit > value)
+        bit >>= 2;
+      while (bit)
+      {
+        if (value >= root + bit)
+        {
+          value -= root + bit;
+          root = (root >> 1) + bit;
+        }
+        else
+          root >>= 1;
+        bit >>= 2;
+      }
+      return root ? root : 1;
+    }
+
+    //  .split circuit breaker
+    //  A service whose last worker is gone arms the breaker for the grace
+    //  period. If no worker registers in time, the breaker opens: queued
+    //  requests are flushed with status 503, like CoDel drops, and new ones get
+    //  it at once, until a worker registers. Workers' answers and lost
+    //  requests count toward an error rate over roughly the last
+    //  SERVICE_BREAKER_WINDOW requests, which opens the breaker for a
+    //  cooldown when it passes the limit:
+
+    void service_breaker_arm(service_t *service)
+    {
+      if (service->workers == 0 && service->limits.breaker_grace && !service->breaker_open && !service->breaker_timer.armed())
+        _timers->arm(&service->breaker_timer, _now + service->limits.breaker_grace);
+    }
+
+    //  Open the breaker until the given time, or until a worker registers
+    //  if that is 0
+
+    void service_breaker_open(service_t *service, int64_t until)
+    {
+      service->breaker_open = true;
+      if (until)
+        _timers->arm(&service->breaker_timer, until);
+      else
+        _timers->cancel(&service->breaker_timer);
+      if (_verbose)
+        zclock_log("I: breaker open for service: %s", service->name);
+      service->short_circuited += service->requests.size();
+      service_flush(service);
+    }
+
+    //  Close the breaker if it is open, which starts the error rate
+    //  over, and stop the grace period if the service has workers again
+
+    void service_breaker_close(service_t *service)
+    {
+      if (service->breaker_open)
+      {
+        if (_verbose)
+          zclock_log("I: breaker closed for service: %s", service->name);
+        service->breaker_open = false;
+        service->breaker_requests = 0;
+        service->breaker_errors = 0;
+      }
+      _timers->cancel(&service->breaker_timer);
+      service_breaker_arm(service);
+    }
+
+    //  Count requests workers answered and requests lost with them
+
+    void service_breaker_count(service_t *service, uint64_t answered, uint64_t lost)
+    {
+      int rate = service->limits.breaker_error_rate;
+      if (!rate || service->breaker_open)
+        return;
+      service->breaker_requests += answered + lost;
+      service->breaker_errors += lost;
+      if (service->breaker_requests >= SERVICE_BREAKER_MIN_REQUESTS
+          && service->breaker_errors * 100 >= service->breaker_requests * rate)
+        service_breaker_open(service, _now + SERVICE_BREAKER_COOLDOWN);
+      else if (service->breaker_requests >= SERVICE_BREAKER_WINDOW)
+      {
+        service->breaker_requests /= 2;
+        service->breaker_errors /= 2;
+      }
+    }
+
+    //  Called by the timer wheel when the grace period or the cooldown
+    //  ends
+
+    static void service_breaker_expired(IDPTimer *, void *arg)
+    {
+      service_t *service = (service_t *)arg;
+      if (service->breaker_open)
+        service->broker->service_breaker_close(service);
+      else
+        service->broker->service_breaker_open(service, 0);
+    }
+
+    //  .split service cache
+    //  A service with a cache keys replies by the request frames, each
+    //  prefixed by its size so different splits of the same bytes do not
+    //  collide. The table is per service, so the service name is part of
+    //  the key too. Stale replies stay until a request finds them or the
+    //  least recently used replies are evicted to make room:
+
+    static zframe_t *service_request_key(zmsg_t *msg)
+    {
+      //  Skip the client envelope, address and empty delimiter
+      size_t size = 0;
+      zmsg_first(msg);
+      zmsg_next(msg);
+      for (zframe_t *frame = zmsg_next(msg); frame; frame = zmsg_next(msg))
+        size += 4 + zframe_size(frame);
+
+      zframe_t *key = zframe_new(NULL, size);
+      byte *data = zframe_data(key);
+      zmsg_first(msg);
+      zmsg_next(msg);
+      for (zframe_t *frame = zmsg_next(msg); frame; frame = zmsg_next(msg))
+      {
+        uint32_t length = (uint32_t)zframe_size(frame);
+        data[0] = (byte)(length >> 24);
+        data[1] = (byte)(length >> 16);
+        data[2] = (byte)(length >> 8);
+        data[3] = (byte)length;
+        memcpy(data + 4, zframe_data(frame), length);
+        data += 4 + length;
+      }
+      return key;
+    }
+
+    //  Answer a request from the cache if it holds a fresh reply; takes
+    //  the request message if it does
+
+    bool service_cache_answer(service_t *service, zframe_t *key, zmsg_t *msg, bool clear)
+    {
+      cache_entry_t *entry = service->cache
+                                 ? service->cache->lookup(zframe_data(key), zframe_size(key), IDPTable<cache_entry_t>::hash(key))
+                                 : NULL;
+      if (entry && entry->expires <= _now)
+      {
+        service_cache_evict(service, entry);
+        entry = NULL;
+      }
+      if (!entry)
+      {
+        service->cache_misses++;
+        return false;
+      }
+      service->cache_hits++;
+      service->cache_lru.remove(&entry->link);
+      service->cache_lru.append(&entry->link);
+
+      zframe_t *client = zmsg_unwrap(msg);
+      zmsg_destroy(&msg);
+      zmsg_t *reply = zmsg_dup(entry->reply);
+      service_reply_envelope(service, reply);
+      zmsg_wrap(reply, client);
+      zmsg_send(&reply, clear ? _clear_socket : _curve_socket);
+      return true;
+    }
+
+    //  Keep a copy of a reply for max_age msecs; takes the key. Replies
+    //  too big for the whole cache are not kept.
+
+    void service_cache_insert(service_t *service, zframe_t **key_p, zmsg_t *reply, int64_t max_age)
+    {
+      zframe_t *key = *key_p;
+      size_t size = zframe_size(key) + zmsg_content_size(reply);
+      if (size > service->limits.cache_max_bytes)
+        return;
+      if (!service->cache)
+        service->cache = new IDPTable<cache_entry_t>();
+      uint32_t hash = IDPTable<cache_entry_t>::hash(key);
+      cache_entry_t *entry = service->cache->lookup(zframe_data(key), zframe_size(key), hash);
+      if (entry)
+        service_cache_evict(service, entry);
+      service_cache_trim(service, size);
+
+      entry = _cache_pool.alloc();
+      entry->link.init(entry);
+      entry->key = key;
+      *key_p = NULL;
+      entry->hash = hash;
+      entry->reply = zmsg_dup(reply);
+      entry->size = size;
+      entry->expires = _now + max_age;
+      service->cache->insert(zframe_data(key), zframe_size(key), hash, entry);
+      service->cache_lru.append(&entry->link);
+      service->cache_bytes += size;
+    }
+
+    //  Evict least recently used replies until size more bytes fit
+
+    void service_cache_trim(service_t *service, size_t size)
+    {
+      while (service->cache_lru.size() && service->cache_bytes + size > service->limits.cache_max_bytes)
+        service_cache_evict(service, service->cache_lru.first());
+    }
+
+    void service_cache_evict(service_t *service, cache_entry_t *entry)
+    {
+      service->cache->remove(zframe_data(entry->key), zframe_size(entry->key), entry->hash);
+      service->cache_lru.remove(&entry->link);
+      service->cache_bytes -= entry->size;
+      zframe_destroy(&entry->key);
+      zmsg_destroy(&entry->reply);
+      _cache_pool.release(entry);
+    }
+
+    //  .split single flight
+    //  In single flight mode the first of a set of identical requests leads
+    //  a flight: it queues and goes to a worker as usual, and identical
+    //  requests that arrive meanwhile park on it as followers. When the
+    //  worker replies, each follower gets a copy of the reply. If the
+    //  leader is dropped by CoDel, its followers get status 503 with it; if its
+    //  client stopped waiting, the first follower whose client still waits
+    //  takes over its place in the queue. Resends park on the request
+    //  they repeat the same way, so all of this applies to them too:
+
+    bool service_flight_join(service_t *service, zframe_t *key, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority)
+    {
+      request_t *leader = service->flights
+                              ? service->flights->lookup(zframe_data(key), zframe_size(key), IDPTable<request_t>::hash(key))
+                              : NULL;
+      if (!leader)
+        return false;
+      request_t *follower = request_new(msg, zmsg_content_size(msg), clear, props, deadline, priority);
+      leader->followers.append(&follower->link);
+      service->coalesced++;
+      return true;
+    }
+
+    void service_flight_start(service_t *service, request_t *leader)
+    {
+      if (!service->flights)
+        service->flights = new IDPTable<request_t>();
+      service->flights->insert(zframe_data(leader->key), zframe_size(leader->key), IDPTable<request_t>::hash(leader->key), leader);
+      leader->leads = true;
+      service->flights_started++;
+    }
+
+    //  The leader is done, one way or another; identical requests that
+    //  arrive from now on start a new flight
+
+    void service_flight_end(service_t *service, request_t *leader)
+    {
+      if (!leader->leads)
+        return;
+      service->flights->remove(zframe_data(leader->key), zframe_size(leader->key), IDPTable<request_t>::hash(leader->key));
+      leader->leads = false;
+    }
+
+    //  Send each follower a copy of the reply, which has no envelope yet
+
+    void service_flight_answer(service_t *service, request_t *leader, zmsg_t *reply)
+    {
+      request_t *follower;
+      while ((follower = leader->followers.pop()))
+      {
+        zmsg_t *copy = zmsg_dup(reply);
+        service_reply_envelope(service, copy);
+        zmsg_wrap(copy, zmsg_unwrap(follower->msg));
+        zmsg_send(&copy, follower->clear ? _clear_socket : _curve_socket);
+        zmsg_destroy(&follower->msg);
+        request_release(follower);
+      }
+    }
+
+    void service_flight_reject(service_t *service, request_t *leader)
+    {
+      request_t *follower;
+      while ((follower = leader->followers.pop()))
+      {
+        service->dropped++;
+        service_reject(service, follower->msg, follower->clear, follower->props);
+        request_release(follower);
+      }
+    }
+
+    //  The leader expired before it reached a worker. The first follower
+    //  that has not expired too leads from now on, queued as when it came,
+    //  and takes over the flight and idempotency key of the leader.
+
+    void service_flight_retry(service_t *service, request_t *leader)
+    {
+      request_t *successor;
+      while ((successor = leader->followers.pop()) && successor->deadline && successor->deadline <= _now)
+      {
+        service->expired++;
+        zmsg_destroy(&successor->msg);
+        request_release(successor);
+      }
+      if (!successor)
+      {
+        service_flight_end(service, leader);
+        return;
+      }
+      request_handover(service, leader, successor);
+      service_enqueue(service, successor);
+    }
+
+    //  .split idempotency keys
+    //  Clients that resend a request after a timeout put the same key on
+    //  every copy. The first copy to queue is remembered under its key.
+    //  Later copies park on it while it is queued or with a worker, and
+    //  get a copy of its reply until the window closes. Entries are kept
+    //  oldest first, and the oldest go once the service remembers too
+    //  many keys.
+    //  A key belongs to the client that sent it, so we keep it under the
+    //  client's name as well: another client that sends the same key runs
+    //  its own request, and can neither join nor read the first one's:
+
+    static zframe_t *idempotency_scope(zframe_t *sender, bool clear, const byte *value, size_t size)
+    {
+      size_t name_size;
+      const byte *name = client_name(sender, clear, &name_size);
+      assert(name_size <= 255); //  Routing ids and Z85 keys are that short
+      zframe_t *key = zframe_new(NULL, 1 + name_size + size);
+      byte *data = zframe_data(key);
+      data[0] = (byte)name_size;
+      memcpy(data + 1, name, name_size);
+      memcpy(data + 1 + name_size, value, size);
+      return key;
+    }
+
+    bool service_idempotency_answer(service_t *service, zframe_t *key, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority)
+    {
+      idempotency_entry_t *entry = service->idempotency
+                                       ? service->idempotency->lookup(zframe_data(key), zframe_size(key), IDPTable<idempotency_entry_t>::hash(key))
+                                       : NULL;
+      if (entry && !entry->request && (!entry->reply || entry->expires <= _now))
+      {
+        service_idempotency_evict(service, entry);
+        entry = NULL;
+      }
+      if (!entry)
+        return false;
+      service->resends++;
+      if (entry->request)
+      {
+        request_t *follower = request_new(msg, zmsg_content_size(msg), clear, props, deadline, priority);
+        entry->request->followers.append(&follower->link);
+        return true;
+      }
+      zframe_t *client = zmsg_unwrap(msg);
+      zmsg_destroy(&msg);
+      zmsg_t *reply = zmsg_dup(entry->reply);
+      service_reply_envelope(service, reply);
+      zmsg_wrap(reply, client);
+      zmsg_send(&reply, clear ? _clear_socket : _curve_socket);
+      return true;
+    }
+
+    //  Remember a request under its key; takes the key
+
+    void service_idempotency_start(service_t *service, request_t *request, zframe_t **key_p)
+    {
+      zframe_t *key = *key_p;
+      *key_p = NULL;
+      if (!service->idempotency)
+        service->idempotency = new IDPTable<idempotency_entry_t>();
+      uint32_t hash = IDPTable<idempotency_entry_t>::hash(key);
+      idempotency_entry_t *entry = service->idempotency->lookup(zframe_data(key), zframe_size(key), hash);
+      if (entry)
+        service_idempotency_evict(service, entry);
+      service_idempotency_trim(service, 1);
+
+      entry = _idempotency_pool.alloc();
+      entry->link.init(entry);
+      entry->key = key;
+      entry->hash = hash;
+      entry->request = request;
+      service->idempotency->insert(zframe_data(key), zframe_size(key), hash, entry);
+      service->idempotency_age.append(&entry->link);
+      request->idempotency = entry;
+    }
+
+    //  The request got its reply, which has no envelope yet; keep a copy
+    //  for the window
+
+    void service_idempotency_record(service_t *service, request_t *request, zmsg_t *reply)
+    {
+      idempotency_entry_t *entry = request->idempotency;
+      if (!entry)
+        return;
+      request->idempotency = NULL;
+      entry->request = NULL;
+      if (service->limits.idempotency_window == 0)
+      {
+        service_idempotency_evict(service, entry);
+        return;
+      }
+      entry->reply = zmsg_dup(reply);
+      entry->expires = _now + service->limits.idempotency_window;
+      service->idempotency_age.remove(&entry->link);
+      service->idempotency_age.append(&entry->link);
+    }
+
+    //  Forget the oldest keys until count more fit
+
+    void service_idempotency_trim(service_t *service, size_t count)
+    {
+      while (service->idempotency_age.size() && service->idempotency_age.size() + count > service->limits.idempotency_keys)
+        service_idempotency_evict(service, service->idempotency_age.first());
+    }
+
+    void service_idempotency_evict(service_t *service, idempotency_entry_t *entry)
+    {
+      if (entry->request)
+        entry->request->idempotency = NULL;
+      service->idempotency->remove(zframe_data(entry->key), zframe_size(entry->key), entry->hash);
+      service->idempotency_age.remove(&entry->link);
+      zframe_destroy(&entry->key);
+      zmsg_destroy(&entry->reply);
+      _idempotency_pool.release(entry);
+    }
+
+    //  .split hedging
+    //  Every service keeps a histogram of recent service times, halved
+    //  every SERVICE_LATENCY_WINDOW samples so it follows changes in load.
+    //  A service that hedges arms a timer on each request it sends, due
+    //  when the request has taken longer than 95% of recent ones. If it
+    //  is still unanswered then, and an idle worker and the budget allow,
+    //  a copy goes to that worker. The budget grows by hedge_budget
+    //  hundredths of a hedge per request sent, and saves up to
+    //  SERVICE_HEDGE_BURST hedges:
+
+    static void service_latency(service_t *service, int64_t sample)
+    {
+      size_t bucket = 0;
+      while (sample > 0 && bucket < SERVICE_LATENCY_BUCKETS - 1)
+      {
+        sample >>= 1;
+        bucket++;
+      }
+      service->latency[bucket]++;
+      if (++service->latency_samples >= SERVICE_LATENCY_WINDOW)
+      {
+        service->latency_samples = 0;
+        for (bucket = 0; bucket < SERVICE_LATENCY_BUCKETS; bucket++)
+        {
+          service->latency[bucket] /= 2;
+          service->latency_samples += service->latency[bucket];
+        }
+      }
+    }
+
+    //  Service time under which percent of recent requests were answered,
+    //  in usecs, interpolated within its bucket; 0 until there are enough
+    //  samples
+
+    static int64_t service_latency_percentile(service_t *service, int percent)
+    {
+      if (service->latency_samples < SERVICE_LATENCY_MIN_SAMPLES)
+        return 0;
+      uint64_t target = (service->latency_samples * percent + 99) / 100;
+      uint64_t seen = 0;
+      for (size_t bucket = 0; bucket < SERVICE_LATENCY_BUCKETS; bucket++)
+      {
+        uint64_t count = service->latency[bucket];
+        if (seen + count >= target)
+        {
+          int64_t low = bucket ? (int64_t)1 << (bucket - 1) : 0;
+          int64_t high = (int64_t)1 << bucket;
+          return low + (int64_t)((uint64_t)(high - low) * (target - seen) / count);
+        }
+        seen += count;
+      }
+      return 0;
+    }
+
+    void service_hedge_arm(service_t *service, request_t *request)
+    {
+      service->hedge_credit += service->limits.hedge_budget;
+      if (service->hedge_credit > 100 * SERVICE_HEDGE_BURST)
+        service->hedge_credit = 100 * SERVICE_HEDGE_BURST;
+      int64_t p95 = service_latency_percentile(service, 95);
+      if (p95)
+        _timers->arm(&request->hedge_timer, _now + (p95 + 999) / 1000);
+    }
+
+    static void request_hedge(IDPTimer *, void *arg)
+    {
+      request_t *request = (request_t *)arg;
+      request->worker->broker->service_hedge(request->worker->service, request);
+    }
+
+    void service_hedge(service_t *service, request_t *request)
+    {
+      if (request->twin || !request->msg || service->hedge_credit < 100 || (request->deadline && request->deadline <= _now))
+        return;
+      worker_t *idle = service->waiting.first();
+      while (idle && (idle == request->worker || idle->in_flight.size() || idle->health != WORKER_HEALTHY))
+        idle = IDPList<worker_t>::next(&idle->service_link);
+      if (!idle)
+        return;
+      request_t *hedge = request_new(zmsg_dup(request->msg), request->size, request->clear, request->props, request->deadline, request->priority);
+      hedge->hedge = true;
+      hedge->attempts = request->attempts;
+      hedge->twin = request;
+      request->twin = hedge;
+      service->hedge_credit -= 100;
+      service->hedged++;
+      worker_dispatch(idle, hedge);
+    }
+
+    //  One copy of a hedged request got its reply. The other stays with
+    //  its worker until that worker answers too, so credit and replies
+    //  without a request id still line up, but its reply is dropped.
+
+    void service_hedge_settle(service_t *service, request_t *winner)
+    {
+      request_t *loser = winner->twin;
+      winner->twin = NULL;
+      loser->twin = NULL;
+      loser->discard = true;
+      _timers->cancel(&loser->hedge_timer);
+      zmsg_destroy(&loser->msg);
+      if (winner->hedge)
+        service->hedge_wins++;
+    }
+
+    //  .split request records
+    //  Requests come from a pool. Releasing one releases the followers
+    //  parked on it too, which only happens when their flight is lost with
+    //  a worker or the broker shuts down. A request released unanswered
+    //  leaves its idempotency key stale, so the next resend runs again:
+
+    request_t *request_new(zmsg_t *msg, size_t size, bool clear, bool props, int64_t deadline, int priority)
+    {
+      request_t *request = _request_pool.alloc();
+      request->link.init(request);
+      request->msg = msg;
+      request->size = size;
+      request->enqueued = _now;
+      request->deadline = deadline;
+      request->priority = priority;
+      request->clear = clear;
+      request->props = props;
+      request->hedge_timer.init(request_hedge, request);
+      return request;
+    }
+
+    //  Hand the followers, keys and flight of a request over to another
+    //  request for the same thing, which answers them from now on
+
+    void request_handover(service_t *service, request_t *from, request_t *to)
+    {
+      request_t *follower;
+      while ((follower = from->followers.pop()))
+        to->followers.append(&follower->link);
+      to->key = from->key;
+      from->key = NULL;
+      to->idempotency = from->idempotency;
+      from->idempotency = NULL;
+      if (to->idempotency)
+        to->idempotency->request = to;
+      if (from->leads)
+      {
+        uint32_t hash = IDPTable<request_t>::hash(to->key);
+        service->flights->remove(zframe_data(to->key), zframe_size(to->key), hash);
+        service->flights->insert(zframe_data(to->key), zframe_size(to->key), hash, to);
+        from->leads = false;
+        to->leads = true;
+      }
+    }
+
+    void request_release(request_t *request)
+    {
+      request_t *follower;
+      while ((follower = request->followers.pop()))
+      {
+        zmsg_destroy(&follower->msg);
+        request_release(follower);
+      }
+      if (request->idempotency)
+        request->idempotency->request = NULL;
+      _timers->cancel(&request->hedge_timer);
+      zframe_destroy(&request->key);
+      zframe_destroy(&request->client);
+      _request_pool.release(request);
+    }
+
+    //  Would one more request of this size go over the service limits?
+
+    static bool service_full(service_t *service, size_t size)
+    {
+      return (service->limits.max_requests && service->requests.size() >= service->limits.max_requests) ||
+             (service->limits.max_bytes && service->queued_bytes + size > service->limits.max_bytes);
+    }
+
+    //  Build a reply the broker makes itself: IDPC02, the status in the
+    //  properties frame and no body, so the client cannot take it for a
+    //  worker reply. Takes over the service name frame.
+
+    static zmsg_t *status_reply(zframe_t *service_name, uint64_t status)
+    {
+      IDPProps props;
+      props.put_uint(IDP_PROP_STATUS, status);
+      zmsg_t *reply = zmsg_new();
+      zmsg_push(reply, props.frame());
+      zmsg_push(reply, service_name);
+      zmsg_pushstr(reply, IDPC_CLIENT_PROPS);
+      return reply;
+    }
+
+    //  Answer a request we will not queue with status 503, so the client
+    //  can back off instead of timing out and retrying. IDPC01 clients
+    //  cannot tell a status from data, so they time out as they always did
+
+    void service_reject(service_t *service, zmsg_t *msg, bool clear, bool props)
+    {
+      if (!props)
+      {
+        zmsg_destroy(&msg);
+        return;
+      }
+      zframe_t *client = zmsg_unwrap(msg);
+      zmsg_destroy(&msg);
+      msg = status_reply(zframe_dup(service->name_frame), IDP_STATUS_UNAVAILABLE);
+      zmsg_wrap(msg, client);
+      zmsg_send(&msg, clear ? _clear_socket : _curve_socket);
+    }
+
+    //  Refuse every queued request, and whoever follows it, with status 503
+
+    void service_flush(service_t *service)
+    {
+      request_t *request;
+      while ((request = service->requests.first()))
+      {
+        service_unqueue(service, request);
+        service_flight_end(service, request);
+        service_flight_reject(service, request);
+        service_reject(service, request->msg, request->clear, request->props);
+        request_release(request);
+      }
+    }
+
+    //  .split worker methods
+    //  Here is the implementation of the methods that work on a worker:
+
+    //  Lazy constructor that locates a worker by routing id, or creates a
+    //  new worker if there is no worker already with that routing id. The
+    //  caller passes the routing id hash so we only compute it once. A new
+    //  worker takes over the caller's routing id frame as its address.
+
+    worker_t *worker_require(zframe_t **address_p, uint32_t hash, bool clear)
+    {
+      assert(address_p && *address_p);
+      zframe_t *address = *address_p;
+
+      //  self->workers is keyed off the raw routing id bytes
+      worker_t *worker = _workers->lookup(zframe_data(address), zframe_size(address), hash);
+
+      if (worker == NULL)
+      {
+        worker = _worker_pool.alloc();
+        worker->broker = this;
+        worker->hash = hash;
+        worker->address = address;
+        *address_p = NULL;
+        worker->socket = clear ? &_clear_socket : &_curve_socket;
+        worker->service_link.init(worker);
+        worker->expiry_timer.init(worker_expired, worker);
+        worker->heartbeat_timer.init(worker_heartbeat, worker);
+        worker->request_timer.init(worker_request_expired, worker);
+        worker->outlier_timer.init(worker_outlier_expired, worker);
+        _workers->insert(zframe_data(address), zframe_size(address), hash, worker);
+        if (_verbose)
+        {
+          char *identity = zframe_strhex(address);
+          zclock_log("I: registering new worker: %s", identity);
+          free(identity);
+        }
+      }
+      return worker;
+    }
+
+    //  The delete method deletes the current worker. An idle worker is
+    //  deleted once it has sent nothing for HEARTBEAT_EXPIRY; a busy one
+    //  only by the request timeout, and its requests are requeued then.
+
+    void worker_delete(worker_t *worker, int disconnect)
+    {
+      assert(worker);
+      if (disconnect)
+        worker_send(worker, IDPW_DISCONNECT, NULL, NULL);
+
+      service_t *service = worker->service;
+      if (service)
+      {
+        service->waiting.remove(&worker->service_link);
+        service->workers--;
+        if (worker->health != WORKER_HEALTHY)
+          service->ejected--;
+        if (worker->outlier)
+          service_outlier_lose(service, worker->outlier);
+
+        //  Requests the worker held go back to the queue while they have
+        //  attempts left and a client still waiting, with their followers
+        //  and idempotency keys; the rest are lost with the worker. A hedged
+        //  request carries on with its twin
+        bool requeued = false;
+        uint64_t lost = 0;
+        request_t *request;
+        while ((request = worker->in_flight.last()))
+        {
+          worker->in_flight.remove(&request->link);
+          _timers->cancel(&request->hedge_timer);
+          lost += !request->discard && !request->twin; //  Lost only if no copy is left in flight
+          if (request->discard)
+            ; //  Already answered by its twin
+          else if (request->twin)
+          {
+            //  The other copy is still with a worker, and answers for
+            //  both from now on
+            request_t *twin = request->twin;
+            twin->twin = NULL;
+            if (!request->hedge)
+            {
+              request_handover(service, request, twin);
+              twin->hedge = false;
+              twin->msg = request->msg;
+              request->msg = NULL;
+            }
+          }
+          else if (request->msg && request->deadline && request->deadline <= _now)
+          {
+            service->expired++;
+            service_flight_retry(service, request);
+            requeued = true;
+          }
+          else if (request->msg && request->attempts < service->limits.max_attempts)
+          {
+            service_requeue(service, request, worker->in_flight.size());
+            requeued = true;
+            continue;
+          }
+          else
+            service_flight_end(service, request);
+          zmsg_destroy(&request->msg);
+          request_release(request);
+        }
+        service_breaker_count(service, 0, lost);
+        service_breaker_arm(service);
+        if (requeued)
+          service_dispatch(service, NULL, true);
+        if (service->workers == 0)
+          service_idle(service);
+      }
+      _timers->cancel(&worker->expiry_timer);
+      _timers->cancel(&worker->heartbeat_timer);
+      _timers->cancel(&worker->request_timer);
+      _timers->cancel(&worker->outlier_timer);
+      if (_pipe)
+      {
+        //  Let the frontend forget which shard owned this worker
+        zmsg_t *notice = zmsg_new();
+        zmsg_addstr(notice, "");
+        zmsg_addstr(notice, "FORGET");
+        zframe_t *address = zframe_dup(worker->address);
+        zmsg_append(notice, &address);
+        zmsg_send(&notice, _clear_socket);
+      }
+      _workers->remove(zframe_data(worker->address), zframe_size(worker->address), worker->hash);
+      worker_destroy(worker);
+    }
+
+    //  Worker destructor is called by worker_delete, and for any remaining
+    //  workers when the broker is destroyed.
+
+    static void worker_destroy(worker_t *self)
+    {
+      request_t *request;
+      while ((request = self->in_flight.pop()))
+      {
+        zmsg_destroy(&request->msg);
+        self->broker->request_release(request);
+      }
+      zframe_destroy(&self->address);
+      self->broker->_worker_pool.release(self);
+    }
+
+    //  .split worker send method
+    //  The send method formats and sends a command to a worker. The caller may
+    //  also provide a command option, and a message payload. We take ownership
+    //  of the payload and only stack envelope frames onto it, so its frames go
+    //  out on the worker socket without being copied:
+
+    void worker_send(worker_t *worker, const char *command, char *option, zmsg_t **msg_p)
+    {
+      zmsg_t *msg = msg_p && *msg_p ? *msg_p : zmsg_new();
+      if (msg_p)
+        *msg_p = NULL;
+
+      //  Stack protocol envelope to start of message
       if (option)
         zmsg_pushstr(msg, option);
       zmsg_pushstr(msg, command);
-      zmsg_pushstr(msg, IDPW_WORKER);
+      bool request = *command == *IDPW_REQUEST || *command == *IDPW_REQUEST_CURVE;
+      zmsg_pushstr(msg, worker->props && request ? IDPW_WORKER_PROPS : IDPW_WORKER);
 
       //  Stack routing envelope to start of message
       zmsg_wrap(msg, zframe_dup(worker->address));
@@ -497,26 +3121,342 @@ namespace IDP
 
     void worker_waiting(worker_t *worker)
     {
-      //  Queue to broker and service waiting lists
+      //  Queue to service waiting list if the worker has credit left, at
+      //  the tail even if the worker was already waiting. Start the idle
+      //  worker timers once it has nothing in flight; until then the
+      //  request deadline follows its oldest request.
       assert(worker->broker);
-      zlist_append(worker->broker->_waiting, worker);
-      zlist_append(worker->service->waiting, worker);
-      worker->expiry = zclock_time() + HEARTBEAT_EXPIRY;
+      worker->service->waiting.remove(&worker->service_link);
+      if (worker->in_flight.size() < worker_capacity(worker))
+        worker->service->waiting.append(&worker->service_link);
+      if (worker->in_flight.size() == 0)
+      {
+        _timers->cancel(&worker->request_timer);
+        _timers->arm(&worker->expiry_timer, _now + HEARTBEAT_EXPIRY);
+        _timers->arm(&worker->heartbeat_timer, _now + _heartbeat_interval);
+      }
+      else if (_request_timeout)
+        _timers->arm(&worker->request_timer, worker->in_flight.first()->dispatched + _request_timeout);
       service_dispatch(worker->service, NULL, true);
     }
 
+    //  Take the request a reply answers off the worker's in flight list,
+    //  and measure how long the worker took. IDPW02 replies carry the
+    //  request id; others answer the oldest request, as a worker without
+    //  credit only ever has one. Returns NULL if the worker holds no such
+    //  request.
+
+    request_t *worker_answered(worker_t *worker, zframe_t *props_frame)
+    {
+      request_t *request = worker->in_flight.first();
+      uint64_t id;
+      if (props_frame && IDPProps::get_uint(props_frame, IDP_PROP_REQUEST_ID, &id))
+        while (request && request->id != (uint32_t)id)
+          request = IDPList<request_t>::next(&request->link);
+      if (request)
+      {
+        worker->in_flight.remove(&request->link);
+        int64_t sample = zclock_usecs() - request->sent;
+        worker_service_time(worker, sample);
+        service_latency(worker->service, sample);
+        worker_judge(worker, sample);
+      }
+      return request;
+    }
+
+    //  Requests the worker may hold at once: its credit when healthy, one
+    //  on probation unless it is resting between probes, none when ejected
+
+    static uint32_t worker_capacity(worker_t *worker)
+    {
+      if (worker->health == WORKER_HEALTHY)
+        return worker->credit;
+      if (worker->health == WORKER_PROBING && !worker->outlier_timer.armed())
+        return 1;
+      return 0;
+    }
+
+    //  Fold one request's service time into the worker's moving average
+
+    static void worker_service_time(worker_t *worker, int64_t sample)
+    {
+      if (worker->service_time == 0)
+        worker->service_time = sample > 0 ? sample : 1;
+      else
+        worker->service_time += (sample - worker->service_time) / WORKER_EWMA_WEIGHT;
+      if (worker->service_time < 1)
+        worker->service_time = 1;
+    }
+
+    //  Take the credit a worker advertises, if any; returns true if it
+    //  did advertise credit
+
+    static bool worker_credit(worker_t *worker, zframe_t *props_frame)
+    {
+      uint64_t credit;
+      if (!IDPProps::get_uint(props_frame, IDP_PROP_CREDIT, &credit))
+        return false;
+      worker->credit = credit < 1 ? 1 : credit > WORKER_MAX_CREDIT ? WORKER_MAX_CREDIT : (uint32_t)credit;
+      return true;
+    }
+
+    //  .split outlier ejection
+    //  A healthy worker is judged by its average service time once it has
+    //  given SERVICE_OUTLIER_MIN_SAMPLES replies, and ejected if that is
+    //  outlier_factor times the service median. A worker on probation is
+    //  judged by each reply instead: a slow one ejects it again, for twice
+    //  as long, and SERVICE_PROBE_REQUESTS good ones make it healthy and
+    //  wipe its strikes. Workers lost to a timeout get a strike too, which
+    //  waits for them under their routing id in case they register again:
+
+    void worker_judge(worker_t *worker, int64_t sample)
+    {
+      service_t *service = worker->service;
+      int64_t factor = service->limits.outlier_factor;
+      if (!factor)
+      {
+        if (worker->health == WORKER_PROBING)
+          worker_restore(worker); //  Ejection was turned off meanwhile
+        return;
+      }
+      int64_t median = service_latency_percentile(service, 50);
+      if (worker->health == WORKER_PROBING)
+      {
+        if (median && sample > factor * median)
+          worker_eject(worker);
+        else if (++worker->answered >= SERVICE_PROBE_REQUESTS)
+          worker_restore(worker);
+        else
+          _timers->arm(&worker->outlier_timer, _now + SERVICE_PROBE_INTERVAL);
+      }
+      else if (worker->health == WORKER_HEALTHY && ++worker->answered >= SERVICE_OUTLIER_MIN_SAMPLES
+               && median && worker->service_time > factor * median)
+        worker_eject(worker);
+    }
+
+    //  Take a worker out of rotation, unless that would leave less than
+    //  half of the service's workers healthy
+
+    void worker_eject(worker_t *worker)
+    {
+      service_t *service = worker->service;
+      if (worker->health == WORKER_HEALTHY)
+      {
+        if ((service->ejected + 1) * 2 > service->workers)
+          return;
+        service->ejected++;
+      }
+      outlier_t *outlier = service_outlier_strike(service, worker);
+      service->ejections++;
+      worker->health = WORKER_EJECTED;
+      service->waiting.remove(&worker->service_link);
+      _timers->arm(&worker->outlier_timer, outlier->until);
+      if (_verbose)
+      {
+        char *identity = zframe_strhex(worker->address);
+        zclock_log("I: ejecting worker for %lld msecs: %s", (long long)(outlier->until - _now), identity);
+        free(identity);
+      }
+    }
+
+    void worker_restore(worker_t *worker)
+    {
+      service_t *service = worker->service;
+      worker->health = WORKER_HEALTHY;
+      service->ejected--;
+      _timers->cancel(&worker->outlier_timer);
+      service_outlier_forget(service, worker->outlier);
+      worker->outlier = NULL;
+    }
+
+    //  A worker registering for a service picks up the strikes against
+    //  its routing id: still ejected, or on probation if that has ended
+
+    void worker_admit(worker_t *worker)
+    {
+      service_t *service = worker->service;
+      if (!service->outliers || !service->limits.outlier_factor)
+        return;
+      uint32_t hash = IDPTable<outlier_t>::hash(worker->address);
+      outlier_t *outlier = service->outliers->lookup(zframe_data(worker->address), zframe_size(worker->address), hash);
+      if (!outlier || outlier->worker)
+        return;
+      service->outliers_lost.remove(&outlier->link);
+      outlier->worker = worker;
+      worker->outlier = outlier;
+      if ((service->ejected + 1) * 2 > service->workers)
+        return;
+      service->ejected++;
+      if (outlier->until > _now)
+      {
+        worker->health = WORKER_EJECTED;
+        _timers->arm(&worker->outlier_timer, outlier->until);
+      }
+      else
+        worker->health = WORKER_PROBING;
+    }
+
+    //  Add a strike against a worker; each one doubles the ejection
+
+    outlier_t *service_outlier_strike(service_t *service, worker_t *worker)
+    {
+      outlier_t *outlier = worker->outlier;
+      if (!outlier)
+      {
+        if (!service->outliers)
+          service->outliers = new IDPTable<outlier_t>();
+        outlier = _outlier_pool.alloc();
+        outlier->link.init(outlier);
+        outlier->service = service;
+        outlier->address = zframe_dup(worker->address);
+        outlier->hash = IDPTable<outlier_t>::hash(outlier->address);
+        outlier->worker = worker;
+        service->outliers->insert(zframe_data(outlier->address), zframe_size(outlier->address), outlier->hash, outlier);
+        worker->outlier = outlier;
+      }
+      int64_t backoff = service->limits.outlier_backoff;
+      for (uint32_t strike = 0; strike < outlier->strikes && backoff < SERVICE_OUTLIER_MAX_BACKOFF; strike++)
+        backoff *= 2;
+      outlier->strikes++;
+      outlier->until = _now + (backoff < SERVICE_OUTLIER_MAX_BACKOFF ? backoff : SERVICE_OUTLIER_MAX_BACKOFF);
+      return outlier;
+    }
+
+    //  The worker is gone; keep its strikes for a while, and forget those
+    //  of workers lost too long ago
+
+    void service_outlier_lose(service_t *service, outlier_t *outlier)
+    {
+      outlier->worker = NULL;
+      outlier->lost = _now;
+      service->outliers_lost.append(&outlier->link);
+      while ((outlier = service->outliers_lost.first())
+             && (outlier->lost + SERVICE_OUTLIER_MEMORY <= _now || service->outliers_lost.size() > SERVICE_OUTLIERS))
+        service_outlier_forget(service, outlier);
+    }
+
+    void service_outlier_forget(service_t *service, outlier_t *outlier)
+    {
+      service->outliers->remove(zframe_data(outlier->address), zframe_size(outlier->address), outlier->hash);
+      service->outliers_lost.remove(&outlier->link);
+      zframe_destroy(&outlier->address);
+      _outlier_pool.release(outlier);
+    }
+
+    //  Outlier destructor is called for every outlier when its service is
+    //  destroyed.
+
+    static void outlier_destroy(outlier_t *outlier)
+    {
+      zframe_destroy(&outlier->address);
+      outlier->service->broker->_outlier_pool.release(outlier);
+    }
+
+    //  .split worker timers
+    //  These are called by the timer wheel when a worker deadline comes
+    //  due. An idle worker that stopped sending heartbeats is deleted:
+
+    static void worker_expired(IDPTimer *, void *arg)
+    {
+      worker_t *worker = (worker_t *)arg;
+      if (worker->broker->_verbose)
+      {
+        char *identity = zframe_strhex(worker->address);
+        zclock_log("I: deleting expired worker: %s", identity);
+        free(identity);
+      }
+      worker->broker->worker_lost(worker);
+      worker->broker->worker_delete(worker, 0);
+    }
+
+    //  An idle worker gets a HEARTBEAT every heartbeat interval:
+
+    static void worker_heartbeat(IDPTimer *timer, void *arg)
+    {
+      worker_t *worker = (worker_t *)arg;
+      IDPBroker *broker = worker->broker;
+      broker->worker_send(worker, IDPW_HEARTBEAT, NULL, NULL);
+      broker->_timers->arm(timer, broker->_now + broker->_heartbeat_interval);
+    }
+
+    //  A worker that held a request past the request timeout is presumed
+    //  stuck, so we disconnect it:
+
+    static void worker_request_expired(IDPTimer *, void *arg)
+    {
+      worker_t *worker = (worker_t *)arg;
+      if (worker->broker->_verbose)
+      {
+        char *identity = zframe_strhex(worker->address);
+        zclock_log("I: deleting worker past request deadline: %s", identity);
+        free(identity);
+      }
+      worker->broker->worker_lost(worker);
+      worker->broker->worker_delete(worker, 1);
+    }
+
+    //  A worker that timed out counts as an outlier, if its service
+    //  ejects them
+
+    void worker_lost(worker_t *worker)
+    {
+      if (worker->service && worker->service->limits.outlier_factor)
+        service_outlier_strike(worker->service, worker);
+    }
+
+    //  An ejected worker goes on probation when its ejection ends, and a
+    //  worker on probation takes its next probe:
+
+    static void worker_outlier_expired(IDPTimer *, void *arg)
+    {
+      worker_t *worker = (worker_t *)arg;
+      if (worker->health == WORKER_EJECTED)
+      {
+        worker->health = WORKER_PROBING;
+        worker->answered = 0;
+        worker->service_time = 0;
+      }
+      worker->broker->worker_waiting(worker);
+    }
+
     void *_clear_socket;                               //  Socket for clients & workers
     void *_curve_socket;                               //  Socket for clients & workers
+    zpoller_t *_poller;                                //  Persistent poll set on both sockets
+    size_t _batch_budget;                              //  Max messages per socket per wakeup
+    reactor_stats_t _reactor_stats;                    //  Batch accounting
     std::pair<std::string, std::string> *_credentials; // Server keys
     int _verbose;                                      //  Print activity to stdout
     char *_clear_endpoint;                             //  Broker binds to this endpoint for clear channel
     char *_curve_endpoint;                             //  Broker binds to this endpoint for curve channel
-    zhash_t *_services;                                //  Hash of known services
-    zhash_t *_workers;                                 //  Hash of known workers
-    zlist_t *_waiting;                                 //  List of waiting workers
-    uint64_t _heartbeat_at;                            //  When to send HEARTBEAT
+    IDPTable<service_t> *_services;                    //  Known services, keyed by name
+    zhash_t *_service_limits;                          //  Limits set for named services
+    service_limits_t _service_defaults;                //  Limits for all other services
+    IDPPool<worker_t> _worker_pool;                    //  Worker records
+    IDPPool<service_t> _service_pool;                  //  Service records
+    IDPPool<request_t> _request_pool;                  //  Queued request records
+    IDPPool<cache_entry_t> _cache_pool;                //  Cached reply records
+    IDPPool<idempotency_entry_t> _idempotency_pool;    //  Idempotency key records
+    IDPPool<outlier_t> _outlier_pool;                  //  Worker strike records
+    IDPPool<flow_t> _flow_pool;                        //  Client queue records
+    zhash_t *_client_weights;                          //  Fair queuing weights set for clients
+    IDPPool<bucket_t> _bucket_pool;                    //  Client rate limit records
+    IDPTable<bucket_t> *_buckets;                      //  Client rate limits and counters, by client
+    IDPList<bucket_t> _buckets_lru;                    //  Same, least recently seen first
+    rate_limit_t _client_rate;                         //  Rate limit for all other clients
+    zhash_t *_client_rates;                            //  Rate limits set for named clients
+    uint64_t _rate_generation;                         //  Bumped whenever a rate limit changes
+    IDPTable<worker_t> *_workers;                      //  Known workers, keyed by routing id
+    IDPTimerWheel *_timers;                            //  Worker expiry, heartbeat and request deadlines
+    IDPList<service_t> _idle_services;                 //  Services without workers, least recently asked for first
+    IDPTimer _idle_timer;                              //  When the first of them times out
+    int64_t _service_idle_timeout;                     //  Msecs a service without workers or clients is kept, 0 = forever
+    size_t _max_idle_services;                         //  Most services without workers, 0 = no limit
+    int64_t _now;                                      //  Coarse clock, read once per loop iteration
+    int64_t _request_timeout;                          //  Max msecs a worker may hold a request, 0 = no limit
     uint64_t _heartbeat_interval;                      //  Interval between HEARTBEATs
     int _heartbeat_liveness;
+    zsock_t *_pipe;   //  Actor pipe, if we are a shard
+    int _shard_count; //  Dispatcher shards, 1 runs everything in loop()
     bool _authenticate; // Should we look for CURVE keys in keys archive for authentication, or accept all keys?
   };
 } // namespace IDP
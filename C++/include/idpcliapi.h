@@ -10,6 +10,7 @@
 
 #include "czmq.h"
 #include "idp_common.h"
+#include "idpprops.h"
 
 namespace IDP
 {
@@ -24,6 +25,22 @@ class IDPClient
     void startClient();
     void setTimeout(int timeout);
     void setRetries(int retries);
+    //  Send each request with the timeout as its TTL, so the broker drops
+    //  it instead of dispatching it once we have given up. Needs a broker
+    //  that speaks IDPC02.
+    void setSendTtl(bool sendTtl);
+    //  Priority class of our requests, one of IDP_PRIORITY_*; the broker
+    //  serves higher classes first. Other than IDP_PRIORITY_NORMAL needs a
+    //  broker that speaks IDPC02.
+    void setPriority(int priority);
+    //  Put a fresh idempotency key on each request, the same on every
+    //  retry of it, so the broker runs it once however often we resend
+    //  it. Needs a broker that speaks IDPC02.
+    void setIdempotent(bool idempotent);
+    //  Return the reply body; throw statusException if the broker refused
+    //  the request, sendFailedException if no reply came. The broker only
+    //  reports refusals of requests sent as IDPC02, with one of the
+    //  settings above; others just get no reply
     std::vector<std::string> send(const std::string &service, const std::vector<std::string> &parts);
     std::vector<std::string> sendraw(const std::string &service, const std::vector<std::pair<unsigned char *, size_t>> &parts);
 
@@ -41,5 +58,8 @@ class IDPClient
     int _verbose; //  Print activity to stdout
     int _timeout; //  Request timeout
     int _retries; //  Request retries
+    bool _sendTtl; //  Tell the broker how long we wait, with IDPC02
+    int _priority; //  Priority class, sent with IDPC02 unless normal
+    bool _idempotent; //  Put an idempotency key on requests
 };
 }
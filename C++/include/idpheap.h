@@ -0,0 +1,163 @@
+/*  =====================================================================
+ *  idpheap.h - Irondomo intrusive binary min-heap
+ *  Items embed one IDPHeapLink per heap they can belong to, holding the
+ *  key they are ordered by and their position in the heap, so push, pop
+ *  and removal of any item are O(log n). Items with equal keys come out
+ *  in the order they went in.
+ *  ===================================================================== */
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+namespace IDP
+{
+
+  template <typename T>
+  struct IDPHeapLink
+  {
+    int64_t key;   //  Smallest key comes out first
+    uint64_t seq;  //  Insertion order, breaks ties between equal keys
+    size_t index;  //  Position in the heap, 0 if not in a heap
+    T *owner;      //  Item that embeds this link
+
+    void init(T *item)
+    {
+      key = 0;
+      seq = 0;
+      index = 0;
+      owner = item;
+    }
+
+    bool linked() const
+    {
+      return index != 0;
+    }
+  };
+
+  template <typename T>
+  class IDPHeap
+  {
+  public:
+    IDPHeap()
+    {
+      _items = NULL;
+      _size = 0;
+      _capacity = 0;
+      _seq = 0;
+    }
+
+    ~IDPHeap()
+    {
+      free(_items);
+    }
+
+    size_t size() const
+    {
+      return _size;
+    }
+
+    //  Add an item with the key already set in its link
+
+    void push(IDPHeapLink<T> *link)
+    {
+      assert(!link->linked());
+      if (_size + 1 >= _capacity)
+      {
+        //  Slot 0 is unused, so positions start at 1
+        _capacity = _capacity ? _capacity * 2 : 16;
+        _items = (IDPHeapLink<T> **)realloc(_items, _capacity * sizeof(IDPHeapLink<T> *));
+        assert(_items);
+      }
+      link->seq = _seq++;
+      link->index = ++_size;
+      _items[link->index] = link;
+      sift_up(link->index);
+    }
+
+    //  Returns the item with the smallest key, or NULL if the heap is empty
+
+    T *top() const
+    {
+      return _size ? _items[1]->owner : NULL;
+    }
+
+    //  Removes and returns the item with the smallest key, or NULL
+
+    T *pop()
+    {
+      if (_size == 0)
+        return NULL;
+      IDPHeapLink<T> *link = _items[1];
+      remove(link);
+      return link->owner;
+    }
+
+    //  Take an item out of the heap; does nothing if it is not in one
+
+    void remove(IDPHeapLink<T> *link)
+    {
+      if (!link->linked())
+        return;
+      size_t index = link->index;
+      IDPHeapLink<T> *last = _items[_size--];
+      link->index = 0;
+      if (last != link)
+      {
+        _items[index] = last;
+        last->index = index;
+        sift_up(index);
+        sift_down(last->index);
+      }
+    }
+
+  private:
+    IDPHeap(const IDPHeap &);
+    IDPHeap &operator=(const IDPHeap &);
+
+    static bool before(const IDPHeapLink<T> *left, const IDPHeapLink<T> *right)
+    {
+      return left->key < right->key || (left->key == right->key && left->seq < right->seq);
+    }
+
+    void place(size_t index, IDPHeapLink<T> *link)
+    {
+      _items[index] = link;
+      link->index = index;
+    }
+
+    void sift_up(size_t index)
+    {
+      IDPHeapLink<T> *link = _items[index];
+      while (index > 1 && before(link, _items[index / 2]))
+      {
+        place(index, _items[index / 2]);
+        index /= 2;
+      }
+      place(index, link);
+    }
+
+    void sift_down(size_t index)
+    {
+      IDPHeapLink<T> *link = _items[index];
+      while (2 * index <= _size)
+      {
+        size_t child = 2 * index;
+        if (child < _size && before(_items[child + 1], _items[child]))
+          child++;
+        if (!before(_items[child], link))
+          break;
+        place(index, _items[child]);
+        index = child;
+      }
+      place(index, link);
+    }
+
+    IDPHeapLink<T> **_items; //  Links by position, from 1
+    size_t _size;            //  Number of items
+    size_t _capacity;        //  Slots in _items
+    uint64_t _seq;           //  Next insertion sequence number
+  };
+} // namespace IDP
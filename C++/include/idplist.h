@@ -0,0 +1,125 @@
+/*  =====================================================================
+ *  idplist.h - Irondomo intrusive doubly-linked list
+ *  Items embed one IDPListLink per list they can belong to, so append,
+ *  remove and pop are O(1) and never allocate. A zeroed link is unlinked,
+ *  which is what zmalloc gives us for free.
+ *  ===================================================================== */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+
+namespace IDP
+{
+
+  template <typename T>
+  struct IDPListLink
+  {
+    IDPListLink *prev; //  Previous link, NULL if unlinked
+    IDPListLink *next; //  Next link, NULL if unlinked
+    T *owner;          //  Item that embeds this link
+
+    void init(T *item)
+    {
+      prev = NULL;
+      next = NULL;
+      owner = item;
+    }
+
+    bool linked() const
+    {
+      return next != NULL;
+    }
+  };
+
+  template <typename T>
+  class IDPList
+  {
+  public:
+    IDPList()
+    {
+      _head.prev = &_head;
+      _head.next = &_head;
+      _head.owner = NULL;
+      _size = 0;
+    }
+
+    size_t size() const
+    {
+      return _size;
+    }
+
+    void append(IDPListLink<T> *link)
+    {
+      assert(!link->linked());
+      link->prev = _head.prev;
+      link->next = &_head;
+      _head.prev->next = link;
+      _head.prev = link;
+      _size++;
+    }
+
+    void prepend(IDPListLink<T> *link)
+    {
+      assert(!link->linked());
+      link->prev = &_head;
+      link->next = _head.next;
+      _head.next->prev = link;
+      _head.next = link;
+      _size++;
+    }
+
+    //  Unlink an item; does nothing if the item is not on a list
+
+    void remove(IDPListLink<T> *link)
+    {
+      if (!link->linked())
+        return;
+      link->prev->next = link->next;
+      link->next->prev = link->prev;
+      link->prev = NULL;
+      link->next = NULL;
+      _size--;
+    }
+
+    //  Returns the first item, or NULL if the list is empty
+
+    T *first() const
+    {
+      return _head.next->owner;
+    }
+
+    //  Returns the last item, or NULL if the list is empty
+
+    T *last() const
+    {
+      return _head.prev->owner;
+    }
+
+    //  Returns the item after the given link, or NULL at the end of the list
+
+    static T *next(const IDPListLink<T> *link)
+    {
+      return link->next->owner;
+    }
+
+    //  Unlinks and returns the first item, or NULL if the list is empty
+
+    T *pop()
+    {
+      IDPListLink<T> *link = _head.next;
+      if (link == &_head)
+        return NULL;
+      remove(link);
+      return link->owner;
+    }
+
+  private:
+    IDPList(const IDPList &);
+    IDPList &operator=(const IDPList &);
+
+    IDPListLink<T> _head; //  Sentinel, next is first and prev is last
+    size_t _size;         //  Number of linked items
+  };
+} // namespace IDP
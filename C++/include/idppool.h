@@ -0,0 +1,124 @@
+/*  =====================================================================
+ *  idppool.h - Irondomo fixed size record pool
+ *  Records are carved out of slabs of many records each and recycled
+ *  through a freelist, so steady state allocation and release are a
+ *  pointer swap. Slabs are only returned to the heap when the pool is
+ *  destroyed. The pool counts records in use and their high-water mark.
+ *  ===================================================================== */
+
+#pragma once
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+namespace IDP
+{
+
+  typedef struct
+  {
+    size_t in_use;     //  Records handed out and not yet released
+    size_t high_water; //  Most records ever in use at once
+    size_t capacity;   //  Records in all slabs
+  } IDPPoolStats;
+
+  template <typename T>
+  class IDPPool
+  {
+    static const size_t SLAB_ITEMS = 64;
+
+    union item_t
+    {
+      item_t *next; //  Next free record, while on the freelist
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    typedef struct slab_t
+    {
+      struct slab_t *next; //  Next slab
+      item_t *items;       //  Records of this slab
+    } slab_t;
+
+  public:
+    IDPPool(size_t slab_items = SLAB_ITEMS)
+    {
+      _slab_items = slab_items > 0 ? slab_items : SLAB_ITEMS;
+      _free = NULL;
+      _slabs = NULL;
+      _stats.in_use = 0;
+      _stats.high_water = 0;
+      _stats.capacity = 0;
+    }
+
+    //  Releases every slab; records still in use are not destroyed
+
+    ~IDPPool()
+    {
+      while (_slabs)
+      {
+        slab_t *slab = _slabs;
+        _slabs = slab->next;
+        free(slab->items);
+        free(slab);
+      }
+    }
+
+    //  Returns a value-initialized record, like new T()
+
+    T *alloc()
+    {
+      if (!_free)
+        grow();
+      item_t *item = _free;
+      _free = item->next;
+      if (++_stats.in_use > _stats.high_water)
+        _stats.high_water = _stats.in_use;
+      return new (&item->storage) T();
+    }
+
+    //  Destroy a record and return it to the pool; does nothing if NULL
+
+    void release(T *value)
+    {
+      if (!value)
+        return;
+      value->~T();
+      item_t *item = reinterpret_cast<item_t *>(value);
+      item->next = _free;
+      _free = item;
+      _stats.in_use--;
+    }
+
+    IDPPoolStats stats() const
+    {
+      return _stats;
+    }
+
+  private:
+    IDPPool(const IDPPool &);
+    IDPPool &operator=(const IDPPool &);
+
+    //  Add a slab and thread its records onto the freelist
+
+    void grow()
+    {
+      slab_t *slab = (slab_t *)malloc(sizeof(slab_t));
+      slab->items = (item_t *)malloc(_slab_items * sizeof(item_t));
+      assert(slab && slab->items);
+      slab->next = _slabs;
+      _slabs = slab;
+      for (size_t index = 0; index < _slab_items; index++)
+      {
+        slab->items[index].next = _free;
+        _free = &slab->items[index];
+      }
+      _stats.capacity += _slab_items;
+    }
+
+    size_t _slab_items; //  Records per slab
+    item_t *_free;      //  Freelist, linked through the records
+    slab_t *_slabs;     //  All slabs we allocated
+    IDPPoolStats _stats;
+  };
+} // namespace IDP
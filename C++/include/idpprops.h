@@ -0,0 +1,118 @@
+/*  =====================================================================
+ *  idpprops.h - Irondomo request properties
+ *  Builds and parses the properties frame of IDPC02 and IDPW02 messages:
+ *  a run of tag, length, value entries with one byte each for tag and
+ *  length. Readers skip tags they do not know, so peers can add
+ *  properties without breaking each other.
+ *  ===================================================================== */
+
+#pragma once
+
+#include <cstring>
+
+#include "czmq.h"
+#include "idp_common.h"
+
+namespace IDP
+{
+
+  class IDPProps
+  {
+    static const size_t MAX = 512; //  Largest properties frame we build
+
+  public:
+    IDPProps()
+    {
+      _size = 0;
+    }
+
+    //  Append a property; returns false if it does not fit
+
+    bool put(byte tag, const void *value, size_t size)
+    {
+      if (size > 255 || _size + 2 + size > MAX)
+        return false;
+      _data[_size++] = tag;
+      _data[_size++] = (byte)size;
+      memcpy(_data + _size, value, size);
+      _size += size;
+      return true;
+    }
+
+    //  Append an integer property, in four bytes if it fits, else eight
+
+    bool put_uint(byte tag, uint64_t value)
+    {
+      byte buffer[8];
+      size_t size = value >> 32 ? 8 : 4;
+      for (size_t index = 0; index < size; index++)
+        buffer[index] = (byte)(value >> (8 * (size - 1 - index)));
+      return put(tag, buffer, size);
+    }
+
+    size_t size() const
+    {
+      return _size;
+    }
+
+    zframe_t *frame() const
+    {
+      return zframe_new(_data, _size);
+    }
+
+    //  Find a property in a received frame. Returns its value and sets
+    //  size_p, or returns NULL if the frame does not carry the tag.
+
+    static const byte *get(zframe_t *frame, byte tag, size_t *size_p)
+    {
+      const byte *data = zframe_data(frame);
+      size_t size = zframe_size(frame);
+      size_t offset = 0;
+      while (offset + 2 <= size)
+      {
+        size_t length = data[offset + 1];
+        if (offset + 2 + length > size)
+          break; //  Truncated entry
+        if (data[offset] == tag)
+        {
+          *size_p = length;
+          return data + offset + 2;
+        }
+        offset += 2 + length;
+      }
+      return NULL;
+    }
+
+    //  True if a received frame is a whole run of entries. Peers are not
+    //  trusted, so we check before we take a frame as properties.
+
+    static bool valid(zframe_t *frame)
+    {
+      if (!frame)
+        return false;
+      const byte *data = zframe_data(frame);
+      size_t size = zframe_size(frame);
+      size_t offset = 0;
+      while (offset + 2 <= size)
+        offset += 2 + data[offset + 1];
+      return offset == size;
+    }
+
+    static bool get_uint(zframe_t *frame, byte tag, uint64_t *value_p)
+    {
+      size_t size;
+      const byte *data = get(frame, tag, &size);
+      if (!data || size == 0 || size > 8)
+        return false;
+      uint64_t value = 0;
+      for (size_t index = 0; index < size; index++)
+        value = (value << 8) | data[index];
+      *value_p = value;
+      return true;
+    }
+
+  private:
+    byte _data[MAX];
+    size_t _size;
+  };
+} // namespace IDP
@@ -0,0 +1,212 @@
+/*  =====================================================================
+ *  idptable.h - Irondomo flat hash table keyed by raw bytes
+ *  Open addressing with linear probing. Each slot caches the key hash
+ *  and holds short keys (such as ZeroMQ routing ids) inline, so neither
+ *  lookups nor inserts of short keys touch the heap.
+ *  ===================================================================== */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "czmq.h"
+
+namespace IDP
+{
+
+  template <typename T>
+  class IDPTable
+  {
+    //  Keys up to this size are stored inside the slot itself
+    static const size_t INLINE_KEY = 24;
+    static const size_t MIN_SLOTS = 16;
+
+    typedef struct
+    {
+      T *value;      //  Item value, NULL if slot is empty
+      uint32_t hash; //  Cached key hash
+      uint32_t size; //  Key size in bytes
+      union
+      {
+        byte inline_key[INLINE_KEY];
+        byte *heap_key;
+      } key;
+    } slot_t;
+
+  public:
+    IDPTable()
+    {
+      _slots = (slot_t *)zmalloc(MIN_SLOTS * sizeof(slot_t));
+      _mask = MIN_SLOTS - 1;
+      _size = 0;
+      _heap_keys = 0;
+    }
+
+    ~IDPTable()
+    {
+      for (size_t index = 0; index <= _mask; index++)
+        if (_slots[index].value && _slots[index].size > INLINE_KEY)
+          free(_slots[index].key.heap_key);
+      free(_slots);
+    }
+
+    //  FNV-1a hash of a key; callers compute it once per message and pass
+    //  it to every table operation on that key.
+
+    static uint32_t hash(const byte *key, size_t size)
+    {
+      uint32_t hash = 2166136261u;
+      for (size_t index = 0; index < size; index++)
+      {
+        hash ^= key[index];
+        hash *= 16777619u;
+      }
+      return hash;
+    }
+
+    static uint32_t hash(zframe_t *frame)
+    {
+      return hash(zframe_data(frame), zframe_size(frame));
+    }
+
+    //  Returns item value or NULL if the key is not present
+
+    T *lookup(const byte *key, size_t size, uint32_t hash) const
+    {
+      size_t index = hash & _mask;
+      while (_slots[index].value)
+      {
+        if (matches(_slots[index], key, size, hash))
+          return _slots[index].value;
+        index = (index + 1) & _mask;
+      }
+      return NULL;
+    }
+
+    //  Insert a new item; the key must not already be present
+
+    void insert(const byte *key, size_t size, uint32_t hash, T *value)
+    {
+      assert(value);
+      //  Keep load factor under 3/4 so probe sequences stay short
+      if ((_size + 1) * 4 > (_mask + 1) * 3)
+        grow();
+
+      slot_t slot;
+      slot.value = value;
+      slot.hash = hash;
+      slot.size = (uint32_t)size;
+      if (size <= INLINE_KEY)
+        memcpy(slot.key.inline_key, key, size);
+      else
+      {
+        slot.key.heap_key = (byte *)malloc(size);
+        memcpy(slot.key.heap_key, key, size);
+        _heap_keys += size;
+      }
+      place(slot);
+      _size++;
+    }
+
+    //  Delete an item, returns its value or NULL if the key was not present.
+    //  We shift later members of the probe run back so lookups never need
+    //  tombstones.
+
+    T *remove(const byte *key, size_t size, uint32_t hash)
+    {
+      size_t index = hash & _mask;
+      while (_slots[index].value && !matches(_slots[index], key, size, hash))
+        index = (index + 1) & _mask;
+
+      T *value = _slots[index].value;
+      if (!value)
+        return NULL;
+      if (_slots[index].size > INLINE_KEY)
+      {
+        free(_slots[index].key.heap_key);
+        _heap_keys -= _slots[index].size;
+      }
+      _slots[index].value = NULL;
+      _size--;
+
+      size_t hole = index;
+      size_t next = (index + 1) & _mask;
+      while (_slots[next].value)
+      {
+        size_t home = _slots[next].hash & _mask;
+        //  Move the item back if its home is not in (hole, next]
+        if (((next - home) & _mask) >= ((next - hole) & _mask))
+        {
+          _slots[hole] = _slots[next];
+          _slots[next].value = NULL;
+          hole = next;
+        }
+        next = (next + 1) & _mask;
+      }
+      return value;
+    }
+
+    //  Calls fn on every value; fn must not modify the table
+
+    template <typename F>
+    void foreach(F fn) const
+    {
+      for (size_t index = 0; index <= _mask; index++)
+        if (_slots[index].value)
+          fn(_slots[index].value);
+    }
+
+    size_t size() const
+    {
+      return _size;
+    }
+
+    //  Bytes of memory held by the table, not counting the values
+
+    size_t memory() const
+    {
+      return sizeof(*this) + (_mask + 1) * sizeof(slot_t) + _heap_keys;
+    }
+
+  private:
+    IDPTable(const IDPTable &);
+    IDPTable &operator=(const IDPTable &);
+
+    static const byte *slot_key(const slot_t &slot)
+    {
+      return slot.size <= INLINE_KEY ? slot.key.inline_key : slot.key.heap_key;
+    }
+
+    static bool matches(const slot_t &slot, const byte *key, size_t size, uint32_t hash)
+    {
+      return slot.hash == hash && slot.size == size && memcmp(slot_key(slot), key, size) == 0;
+    }
+
+    void place(const slot_t &slot)
+    {
+      size_t index = slot.hash & _mask;
+      while (_slots[index].value)
+        index = (index + 1) & _mask;
+      _slots[index] = slot;
+    }
+
+    void grow()
+    {
+      slot_t *slots = _slots;
+      size_t limit = _mask + 1;
+      _slots = (slot_t *)zmalloc(limit * 2 * sizeof(slot_t));
+      _mask = limit * 2 - 1;
+      for (size_t index = 0; index < limit; index++)
+        if (slots[index].value)
+          place(slots[index]);
+      free(slots);
+    }
+
+    slot_t *_slots;    //  Slot array, power of two
+    size_t _mask;      //  Number of slots - 1
+    size_t _size;      //  Number of items
+    size_t _heap_keys; //  Bytes of keys held out of line
+  };
+} // namespace IDP
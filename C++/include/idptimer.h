@@ -0,0 +1,151 @@
+/*  =====================================================================
+ *  idptimer.h - Irondomo hierarchical timer wheel
+ *  Four levels of 64 slots each. Timers are embedded in their owners and
+ *  linked into slot lists, so arming, re-arming and cancelling are O(1).
+ *  Timers further out than the first level are cascaded down as the
+ *  wheel turns, which makes expiry amortized O(1) per timer.
+ *  ===================================================================== */
+
+#pragma once
+
+#include <cstdint>
+
+#include "idplist.h"
+
+namespace IDP
+{
+
+  struct IDPTimer
+  {
+    typedef void(handler_fn)(IDPTimer *timer, void *arg);
+
+    IDPListLink<IDPTimer> link; //  Hook for the slot we are in
+    IDPList<IDPTimer> *slot;    //  Slot we are in, NULL if not armed
+    uint64_t expires;           //  Tick at which we fire
+    handler_fn *handler;
+    void *arg;
+
+    //  Set up a timer; it starts out unarmed
+
+    void init(handler_fn *timer_handler, void *timer_arg)
+    {
+      link.init(this);
+      slot = NULL;
+      expires = 0;
+      handler = timer_handler;
+      arg = timer_arg;
+    }
+
+    bool armed() const
+    {
+      return slot != NULL;
+    }
+  };
+
+  class IDPTimerWheel
+  {
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+  public:
+    static const int RESOLUTION = 10; //  msecs per tick
+
+    //  The wheel starts turning at the given clock time, in msecs
+
+    IDPTimerWheel(int64_t now, int resolution = RESOLUTION)
+    {
+      _resolution = resolution > 0 ? resolution : RESOLUTION;
+      _tick = (uint64_t)now / _resolution;
+      _armed = 0;
+    }
+
+    //  Cancel a timer; does nothing if the timer is not armed
+
+    void cancel(IDPTimer *timer)
+    {
+      if (timer->slot)
+      {
+        timer->slot->remove(&timer->link);
+        timer->slot = NULL;
+        _armed--;
+      }
+    }
+
+    //  Arm or re-arm a timer to fire at the given clock time, in msecs.
+    //  Deadlines in the past fire on the next tick; deadlines beyond the
+    //  wheel's range (about 46 hours at 10 msecs per tick) fire at its edge.
+
+    void arm(IDPTimer *timer, int64_t when)
+    {
+      cancel(timer);
+      uint64_t expires = ((uint64_t)when + _resolution - 1) / _resolution;
+      timer->expires = expires > _tick ? expires : _tick + 1;
+      place(timer);
+      _armed++;
+    }
+
+    //  Turn the wheel up to the given clock time, in msecs, calling the
+    //  handler of every timer that comes due. Handlers may arm and cancel
+    //  any timer, including the one that fired.
+
+    void advance(int64_t now)
+    {
+      uint64_t target = (uint64_t)now / _resolution;
+      while (_tick < target)
+      {
+        _tick++;
+
+        //  Cascade timers from outer levels whenever an inner level wraps
+        for (int level = 1; level < LEVELS; level++)
+        {
+          if (_tick & (((uint64_t)1 << (SLOT_BITS * level)) - 1))
+            break;
+          IDPList<IDPTimer> &slot = _slots[level][(_tick >> (SLOT_BITS * level)) & SLOT_MASK];
+          while (IDPTimer *timer = slot.pop())
+            place(timer);
+        }
+
+        IDPList<IDPTimer> &slot = _slots[0][_tick & SLOT_MASK];
+        while (IDPTimer *timer = slot.pop())
+        {
+          timer->slot = NULL;
+          _armed--;
+          timer->handler(timer, timer->arg);
+        }
+      }
+    }
+
+    size_t armed() const
+    {
+      return _armed;
+    }
+
+  private:
+    IDPTimerWheel(const IDPTimerWheel &);
+    IDPTimerWheel &operator=(const IDPTimerWheel &);
+
+    //  Put a timer in the slot that matches its distance from now
+
+    void place(IDPTimer *timer)
+    {
+      uint64_t delta = timer->expires - _tick;
+      int level = 0;
+      while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+        level++;
+      if (delta >= ((uint64_t)1 << (SLOT_BITS * LEVELS)))
+        //  Beyond the wheel's range, park in the furthest slot
+        timer->expires = _tick + ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+
+      IDPList<IDPTimer> *slot = &_slots[level][(timer->expires >> (SLOT_BITS * level)) & SLOT_MASK];
+      slot->append(&timer->link);
+      timer->slot = slot;
+    }
+
+    IDPList<IDPTimer> _slots[LEVELS][SLOTS];
+    uint64_t _tick;  //  Last tick we processed
+    int _resolution; //  Msecs per tick
+    size_t _armed;   //  Number of armed timers
+  };
+} // namespace IDP
@@ -10,6 +10,7 @@
 
 #include "czmq.h"
 #include "idp_common.h"
+#include "idpprops.h"
 
 
 
@@ -27,14 +28,45 @@ class IDPWorker
     void setHeartbeat(int heartbeat);
     void setRetries(int retries);
     void setReconnectTimeout(int reconnect_timeout);
+    //  Requests the broker may send us before we reply to the first, 1 by
+    //  default. With more, the next requests are already queued here while
+    //  the callback runs, instead of each waiting a round trip to the
+    //  broker. Takes effect at once if the broker has spoken IDPW02 to us,
+    //  otherwise when we next connect.
+    void setCredit(int credit);
 
     void loop(void);
     
 
+  protected:
+    //  Msecs left before the client stops waiting for the request being
+    //  handled, 0 if it already has, or -1 if the client did not say. A
+    //  callback can use it to skip work nobody will read the reply to.
+    int64_t remaining() const;
+    //  Let the broker answer the same request with the reply being built
+    //  for max_age msecs, if the service has a cache. Only works with
+    //  brokers that speak IDPW02.
+    void setMaxAge(int64_t max_age);
+
   private:
+    //  Where the reply to one request goes: the client address, the socket
+    //  the client used, and with IDPW02 the request id. Each request has
+    //  its own, so replies need not follow the order of requests.
+    typedef struct
+    {
+      zframe_t *address; //  Client return address
+      bool curve;        //  Client is on the CURVE socket
+      bool props;        //  Came as IDPW02, so the reply goes back that way
+      uint32_t id;       //  Request id, with IDPW02
+      int64_t deadline;  //  When the client stops waiting, 0 if unknown
+      int64_t max_age;   //  Msecs the broker may cache the reply, 0 = not cacheable
+    } envelope_t;
+
     virtual std::vector<std::pair<unsigned char *, size_t>> callback(const std::vector<std::pair<unsigned char *, size_t>> &parts) = 0;
     void send_to_broker (char const *command, char const *option, zmsg_t *msg);
-    zmsg_t *receive (zmsg_t **reply_p);
+    void send_to_broker_props (char const *command, zframe_t *props, zmsg_t *msg);
+    zmsg_t *receive (envelope_t **envelope_p);
+    void send_reply (envelope_t **envelope_p, zmsg_t **reply_p);
     
     std::string _zmqHost;
     std::string _service;
@@ -51,10 +83,11 @@ class IDPWorker
     int _retries; //  Max Retries
     int _liveness; // Remaining Retries
     int _reconnect_timeout; // Waiting time before reconnecting
-    uint64_t _heartbeat_at;      //  When to send HEARTBEAT
-    bool _expect_reply;
-    zframe_t *_reply_to_clear;
-    zframe_t *_reply_to_curve;
+    int64_t _heartbeat_at;       //  When to send HEARTBEAT
+    int64_t _deadline; //  When the client stops waiting, 0 if unknown
+    int64_t _maxAge; //  Msecs the broker may cache the reply being built
+    int _credit; //  Requests we let the broker send us at once
+    bool _brokerProps; //  Broker has spoken IDPW02 to us
 };
 }
 
@@ -0,0 +1,184 @@
+//
+//  Irondomo worker credit benchmark
+//  For worker credit 1, 4 and 16, starts a broker in a fresh process, an
+//  echo worker behind a proxy that delays every message by 1 msec each
+//  way, and a client that keeps WINDOW requests outstanding, then reports
+//  round trips per second. With credit 1 each request waits a full round
+//  trip between broker and worker; with more, the worker already holds
+//  the next requests when it sends a reply.
+//
+
+//  Lets us build this source without creating a library
+#include "idbrokerapi.h"
+#include "idwrkapi.h"
+#include "idcliapi.h"
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BROKER_CLEAR "tcp://127.0.0.1:5700"
+#define BROKER_CURVE "tcp://127.0.0.1:5701"
+#define PROXY "tcp://127.0.0.1:5702"
+#define LATENCY 1000 //  Usecs added each way between broker and worker
+#define WINDOW 64    //  Requests the client keeps outstanding
+#define SECONDS 5
+
+static void
+s_broker_task(zsock_t *pipe, void *args)
+{
+    const char public_key[] = ".8Q^k*3E/4-Wg4()r^(4yTk2>qvZFDW?mXUyRPvr";
+    const char secret_key[] = "3vup%:I!lF>^QWT@[[g]dwa>1:(B-^3RWw^7tIMf";
+    broker_t *broker = s_broker_new(BROKER_CLEAR, BROKER_CURVE, public_key, secret_key, NULL, 0);
+    zsock_signal(pipe, 0);
+    s_broker_loop(broker);
+}
+
+//  .split delay proxy
+//  The worker connects to the proxy, which forwards each message to the
+//  broker and back once it has held it for LATENCY usecs. Every message
+//  is held equally long, so the first one queued is always due first. The
+//  proxy stops when its pipe tells it to:
+
+typedef struct
+{
+    int64_t _due;   //  When to forward, usecs
+    zmsg_t *_msg;   //  Message to forward
+    zsock_t *_to;   //  Socket to forward it on
+} s_delayed_t;
+
+static void
+s_proxy_task(zsock_t *pipe, void *args)
+{
+    zsock_t *frontend = zsock_new(ZMQ_DEALER);
+    zsock_bind(frontend, PROXY);
+    zsock_t *backend = zsock_new(ZMQ_DEALER);
+    zsock_set_identity(backend, "CreditWorker");
+    zsock_connect(backend, BROKER_CLEAR);
+    zpoller_t *poller = zpoller_new(pipe, frontend, backend, NULL);
+    zlist_t *delayed = zlist_new();
+    zsock_signal(pipe, 0);
+
+    while (1)
+    {
+        int timeout = -1;
+        s_delayed_t *entry = (s_delayed_t *)zlist_first(delayed);
+        if (entry)
+        {
+            int64_t wait = entry->_due - zclock_usecs();
+            timeout = wait > 0 ? (int)((wait + 999) / 1000) : 0;
+        }
+        zsock_t *which = (zsock_t *)zpoller_wait(poller, timeout);
+        if (which == pipe)
+            break; //  $TERM
+        if (which)
+        {
+            entry = (s_delayed_t *)zmalloc(sizeof(s_delayed_t));
+            entry->_due = zclock_usecs() + LATENCY;
+            entry->_msg = zmsg_recv(which);
+            entry->_to = which == frontend ? backend : frontend;
+            if (!entry->_msg)
+            {
+                free(entry);
+                break; //  Interrupted
+            }
+            zlist_append(delayed, entry);
+        }
+        else if (zpoller_terminated(poller))
+            break; //  Interrupted
+
+        int64_t now = zclock_usecs();
+        while ((entry = (s_delayed_t *)zlist_first(delayed)) && entry->_due <= now)
+        {
+            zlist_pop(delayed);
+            zmsg_send(&entry->_msg, entry->_to);
+            free(entry);
+        }
+    }
+    s_delayed_t *entry;
+    while ((entry = (s_delayed_t *)zlist_pop(delayed)))
+    {
+        zmsg_destroy(&entry->_msg);
+        free(entry);
+    }
+    zlist_destroy(&delayed);
+    zpoller_destroy(&poller);
+    zsock_destroy(&backend);
+    zsock_destroy(&frontend);
+}
+
+//  Echo worker; answers through the envelope API so it holds as many
+//  requests as the broker sends it
+
+static void
+s_worker_task(zsock_t *pipe, void *args)
+{
+    idwrk_t *session = idwrk_new(PROXY, "echo", "CreditWorker", 0);
+    idwrk_set_credit(session, *(int *)args);
+    idwrk_connect_to_broker(session);
+    zsock_signal(pipe, 0);
+
+    while (1)
+    {
+        idwrk_envelope_t *envelope = NULL;
+        zmsg_t *request = idwrk_recv_request(session, &envelope);
+        if (request == NULL)
+            break; //  Worker was interrupted
+        idwrk_send_reply(session, &envelope, &request);
+    }
+    idwrk_destroy(&session);
+}
+
+static void
+s_run(int credit)
+{
+    zactor_t *broker = zactor_new(s_broker_task, NULL);
+    zactor_t *proxy = zactor_new(s_proxy_task, NULL);
+    zactor_t *worker = zactor_new(s_worker_task, &credit);
+    zclock_sleep(500); //  Let the worker register
+
+    idcli_t *session = idcli_new2(BROKER_CLEAR, "CreditClient", 0);
+    idcli_connect_to_broker(session);
+    int count;
+    for (count = 0; count < WINDOW; count++)
+    {
+        zmsg_t *request = zmsg_new();
+        zmsg_pushstr(request, "Hello world");
+        idcli_send2(session, "echo", &request);
+    }
+    int64_t start = zclock_usecs();
+    int64_t end = start + SECONDS * 1000000LL;
+    for (count = 0; zclock_usecs() < end; count++)
+    {
+        zmsg_t *reply = idcli_recv2(session);
+        if (!reply)
+            break; //  Interrupt or failure
+        idcli_send2(session, "echo", &reply);
+    }
+    double seconds = (zclock_usecs() - start) / 1000000.0;
+    printf("credit %2d: %8d requests %9.1f req/s\n", credit, count, count / seconds);
+    fflush(stdout);
+    idcli_destroy(&session);
+
+    //  The broker and worker loops only stop when interrupted, so we stop
+    //  them the way an interrupt would; they give up on their next poll
+    zsys_interrupted = 1;
+    zactor_destroy(&worker);
+    zactor_destroy(&proxy);
+    zactor_destroy(&broker);
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int credits[] = {1, 4, 16};
+    printf("%d usecs added each way between broker and worker, %d requests outstanding, %d seconds per run\n",
+           LATENCY, WINDOW, SECONDS);
+    size_t index;
+    for (index = 0; index < sizeof(credits) / sizeof(credits[0]); index++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            s_run(credits[index]);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+//
+//  Irondomo fair queuing benchmark
+//  Starts a broker in a fresh process with WORKERS echo workers that take
+//  SERVICE_TIME usecs per request, one heavy client that keeps
+//  HEAVY_WINDOW requests outstanding and LIGHT_CLIENTS light clients that
+//  send one request at a time, then reports the round trip times of the
+//  light clients. With a single FIFO queue every light request waits
+//  behind the heavy client's backlog; with fair queuing it waits for one
+//  request of each other client at most.
+//
+
+//  Lets us build this source without creating a library
+#include "idbrokerapi.h"
+#include "idwrkapi.h"
+#include "idcliapi.h"
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BROKER_CLEAR "tcp://127.0.0.1:5710"
+#define BROKER_CURVE "tcp://127.0.0.1:5711"
+#define WORKERS 4
+#define SERVICE_TIME 1000 //  Usecs each worker spends on a request
+#define HEAVY_WINDOW 4000 //  Requests the heavy client keeps outstanding
+#define LIGHT_CLIENTS 50
+#define SECONDS 5
+#define MAX_SAMPLES 100000
+
+static void
+s_broker_task(zsock_t *pipe, void *args)
+{
+    const char public_key[] = ".8Q^k*3E/4-Wg4()r^(4yTk2>qvZFDW?mXUyRPvr";
+    const char secret_key[] = "3vup%:I!lF>^QWT@[[g]dwa>1:(B-^3RWw^7tIMf";
+    broker_t *broker = s_broker_new(BROKER_CLEAR, BROKER_CURVE, public_key, secret_key, NULL, 0);
+    s_broker_set_default_service_fair(broker, *(bool *)args);
+    zsock_signal(pipe, 0);
+    s_broker_loop(broker);
+}
+
+//  Echo worker that takes SERVICE_TIME usecs per request
+
+static void
+s_worker_task(zsock_t *pipe, void *args)
+{
+    char identity[32];
+    snprintf(identity, sizeof(identity), "FairWorker%d", *(int *)args);
+    idwrk_t *session = idwrk_new(BROKER_CLEAR, "echo", identity, 0);
+    idwrk_connect_to_broker(session);
+    zsock_signal(pipe, 0);
+
+    while (1)
+    {
+        idwrk_envelope_t *envelope = NULL;
+        zmsg_t *request = idwrk_recv_request(session, &envelope);
+        if (request == NULL)
+            break; //  Worker was interrupted
+        usleep(SERVICE_TIME);
+        idwrk_send_reply(session, &envelope, &request);
+    }
+    idwrk_destroy(&session);
+}
+
+//  Heavy client; keeps its window full until the process exits
+
+static void
+s_heavy_task(zsock_t *pipe, void *args)
+{
+    idcli_t *session = idcli_new2(BROKER_CLEAR, "HeavyClient", 0);
+    idcli_connect_to_broker(session);
+    int count;
+    for (count = 0; count < HEAVY_WINDOW; count++)
+    {
+        zmsg_t *request = zmsg_new();
+        zmsg_pushstr(request, "Heavy");
+        idcli_send2(session, "echo", &request);
+    }
+    zsock_signal(pipe, 0);
+    while (1)
+    {
+        zmsg_t *reply = idcli_recv2(session);
+        if (!reply)
+            continue; //  Timed out while the light clients went first
+        idcli_send2(session, "echo", &reply);
+    }
+}
+
+static int
+s_compare(const void *left, const void *right)
+{
+    int64_t difference = *(const int64_t *)left - *(const int64_t *)right;
+    return difference < 0 ? -1 : difference > 0;
+}
+
+static void
+s_run(bool fair)
+{
+    zactor_new(s_broker_task, &fair);
+    int index;
+    int ids[WORKERS];
+    for (index = 0; index < WORKERS; index++)
+    {
+        ids[index] = index;
+        zactor_new(s_worker_task, &ids[index]);
+    }
+    zclock_sleep(500); //  Let the workers register
+    zactor_new(s_heavy_task, NULL);
+
+    //  The light clients share this thread; each has one request out
+    idcli_t *sessions[LIGHT_CLIENTS];
+    int64_t sent[LIGHT_CLIENTS];
+    zpoller_t *poller = zpoller_new(NULL);
+    for (index = 0; index < LIGHT_CLIENTS; index++)
+    {
+        char identity[32];
+        snprintf(identity, sizeof(identity), "LightClient%02d", index);
+        sessions[index] = idcli_new2(BROKER_CLEAR, identity, 0);
+        idcli_connect_to_broker(sessions[index]);
+        zpoller_add(poller, sessions[index]->_client);
+    }
+    zclock_sleep(100);
+    for (index = 0; index < LIGHT_CLIENTS; index++)
+    {
+        zmsg_t *request = zmsg_new();
+        zmsg_pushstr(request, "Light");
+        sent[index] = zclock_usecs();
+        idcli_send2(sessions[index], "echo", &request);
+    }
+
+    static int64_t samples[MAX_SAMPLES];
+    size_t count = 0;
+    int64_t end = zclock_usecs() + SECONDS * 1000000LL;
+    while (zclock_usecs() < end)
+    {
+        zsock_t *which = (zsock_t *)zpoller_wait(poller, 100);
+        if (!which)
+        {
+            if (zpoller_terminated(poller))
+                break; //  Interrupted
+            continue;
+        }
+        for (index = 0; index < LIGHT_CLIENTS; index++)
+            if (sessions[index]->_client == which)
+                break;
+        zmsg_t *reply = idcli_recv2(sessions[index]);
+        if (!reply)
+            continue;
+        int64_t now = zclock_usecs();
+        if (count < MAX_SAMPLES)
+            samples[count++] = now - sent[index];
+        sent[index] = now;
+        idcli_send2(sessions[index], "echo", &reply);
+    }
+    qsort(samples, count, sizeof(int64_t), s_compare);
+    printf("%-4s: %6zu light requests, p50 %8.1f msecs, p99 %8.1f msecs\n", fair ? "fair" : "fifo", count,
+           count ? samples[count / 2] / 1000.0 : 0.0, count ? samples[count * 99 / 100] / 1000.0 : 0.0);
+    fflush(stdout);
+
+    //  Broker, workers and heavy client loop forever; the process exit
+    //  tears them down
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("%d workers at %d usecs per request, 1 client with %d requests outstanding, %d clients with 1, %d seconds per run\n",
+           WORKERS, SERVICE_TIME, HEAVY_WINDOW, LIGHT_CLIENTS, SECONDS);
+    bool modes[] = {false, true};
+    size_t index;
+    for (index = 0; index < sizeof(modes) / sizeof(modes[0]); index++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            s_run(modes[index]);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
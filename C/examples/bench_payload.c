@@ -0,0 +1,44 @@
+//
+//  Irondomo payload forwarding benchmark
+//  Sends echo requests of 1 KB, 64 KB and 1 MB through the broker on the
+//  CLEAR socket and reports round trips and megabytes per second. Start
+//  broker and worker_clear first; run it against brokers built before
+//  and after a change to compare forwarding cost.
+//
+
+#include "idcliapi.h"
+
+static void
+s_bench(idcli_t *session, size_t size, int requests)
+{
+    byte *payload = (byte *)zmalloc(size);
+    int64_t start = zclock_usecs();
+    int count;
+    for (count = 0; count < requests; count++)
+    {
+        zmsg_t *request = zmsg_new();
+        zmsg_addmem(request, payload, size);
+        zmsg_t *reply = idcli_send(session, "echo", &request);
+        if (!reply)
+            break; //  Interrupt or failure
+        zmsg_destroy(&reply);
+    }
+    double seconds = (zclock_usecs() - start) / 1000000.0;
+    printf("%8zu bytes: %6d requests %9.1f req/s %9.1f MB/s\n", size, count,
+           count / seconds, 2.0 * count * size / seconds / (1024 * 1024));
+    free(payload);
+}
+
+int main(int argc, char *argv[])
+{
+    int verbose = (argc > 1 && streq(argv[1], "-v"));
+    idcli_t *session = idcli_new("tcp://localhost:5000", "BenchClient", verbose);
+    idcli_connect_to_broker(session);
+
+    s_bench(session, 1024, 10000);
+    s_bench(session, 64 * 1024, 2000);
+    s_bench(session, 1024 * 1024, 200);
+
+    idcli_destroy(&session);
+    return 0;
+}
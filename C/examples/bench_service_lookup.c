@@ -0,0 +1,121 @@
+//
+//  Irondomo service lookup benchmark
+//  Sends one million distinct short requests through the broker's service
+//  lookup and reply envelope code, spread over 10 and then over 10,000
+//  services. Times the old way (strdup the service frame, look it up in a
+//  zhash, push name and header as strings on the reply) against interned
+//  services (idtable lookup on the raw frame bytes, prebuilt frames on
+//  the reply).
+//
+
+#include "czmq.h"
+#include "idp.h"
+#include "idtable.h"
+
+#define REQUESTS 1000000
+
+typedef struct
+{
+    char *name;
+    zframe_t *name_frame;
+    zframe_t *header_frame;
+} service_t;
+
+static int64_t
+s_bench_zhash(zframe_t **names, int services)
+{
+    zhash_t *table = zhash_new();
+    int index;
+    for (index = 0; index < services; index++)
+    {
+        service_t *service = (service_t *)zmalloc(sizeof(service_t));
+        service->name = zframe_strdup(names[index]);
+        zhash_insert(table, service->name, service);
+    }
+    int64_t start = zclock_usecs();
+    for (index = 0; index < REQUESTS; index++)
+    {
+        zmsg_t *msg = zmsg_new();
+        zmsg_addstrf(msg, "request %d", index);
+        char *name = zframe_strdup(names[index % services]);
+        service_t *service = (service_t *)zhash_lookup(table, name);
+        free(name);
+        zmsg_pushstr(msg, service->name);
+        zmsg_pushstr(msg, IDPC_CLIENT);
+        zmsg_destroy(&msg);
+    }
+    int64_t usecs = zclock_usecs() - start;
+    service_t *service = (service_t *)zhash_first(table);
+    while (service)
+    {
+        free(service->name);
+        free(service);
+        service = (service_t *)zhash_next(table);
+    }
+    zhash_destroy(&table);
+    return usecs;
+}
+
+static int64_t
+s_bench_idtable(zframe_t **names, int services)
+{
+    idtable_t *table = idtable_new();
+    service_t *all = (service_t *)zmalloc(services * sizeof(service_t));
+    int index;
+    for (index = 0; index < services; index++)
+    {
+        all[index].name_frame = zframe_dup(names[index]);
+        all[index].header_frame = zframe_new(IDPC_CLIENT, strlen(IDPC_CLIENT));
+        idtable_insert(table, zframe_data(names[index]), zframe_size(names[index]),
+                       idtable_hash(zframe_data(names[index]), zframe_size(names[index])), &all[index]);
+    }
+    int64_t start = zclock_usecs();
+    for (index = 0; index < REQUESTS; index++)
+    {
+        zmsg_t *msg = zmsg_new();
+        zmsg_addstrf(msg, "request %d", index);
+        zframe_t *name = names[index % services];
+        service_t *service = (service_t *)idtable_lookup(table, zframe_data(name), zframe_size(name),
+                                                         idtable_hash(zframe_data(name), zframe_size(name)));
+        zmsg_push(msg, zframe_dup(service->name_frame));
+        zmsg_push(msg, zframe_dup(service->header_frame));
+        zmsg_destroy(&msg);
+    }
+    int64_t usecs = zclock_usecs() - start;
+    for (index = 0; index < services; index++)
+    {
+        zframe_destroy(&all[index].name_frame);
+        zframe_destroy(&all[index].header_frame);
+    }
+    free(all);
+    idtable_destroy(&table);
+    return usecs;
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[] = {10, 10000};
+    size_t run;
+    for (run = 0; run < sizeof(counts) / sizeof(counts[0]); run++)
+    {
+        int services = counts[run];
+        zframe_t **names = (zframe_t **)zmalloc(services * sizeof(zframe_t *));
+        int index;
+        for (index = 0; index < services; index++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "service.%d", index);
+            names[index] = zframe_new(name, strlen(name));
+        }
+        int64_t zhash_usecs = s_bench_zhash(names, services);
+        int64_t idtable_usecs = s_bench_idtable(names, services);
+        printf("%d requests over %d services\n", REQUESTS, services);
+        printf("  zhash + strdup:    %6.1f ns/request\n", zhash_usecs * 1000.0 / REQUESTS);
+        printf("  interned services: %6.1f ns/request\n", idtable_usecs * 1000.0 / REQUESTS);
+
+        for (index = 0; index < services; index++)
+            zframe_destroy(&names[index]);
+        free(names);
+    }
+    return 0;
+}
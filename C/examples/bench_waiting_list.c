@@ -0,0 +1,170 @@
+//
+//  Irondomo waiting list benchmark
+//  Puts 1k, 10k and then 50k idle workers on one service and times the
+//  waiting list work the broker does per dispatch, heartbeat refresh and
+//  delete, first the old way (zlist, where remove scans the list) and
+//  then with intrusive idlist hooks. The zlist costs grow with the pool;
+//  the idlist costs must stay flat, and the benchmark fails if they grow
+//  more than SCALING_LIMIT times from the smallest pool to the largest.
+//
+
+#include "czmq.h"
+#include "idlist.h"
+
+#define ZLIST_OPERATIONS 20000    //  Each one scans, so fewer
+#define IDLIST_OPERATIONS 2000000 //  Enough to time constant work
+#define STRIDE 7919 //  Prime, so workers are picked all over the list
+#define SCALING_LIMIT 10 //  Allows for cache misses on large pools, not for a scan
+
+typedef struct
+{
+    idlist_link_t _broker_link;  //  Hook for the broker waiting list
+    idlist_link_t _service_link; //  Hook for the service waiting list
+} worker_t;
+
+typedef struct
+{
+    double dispatch; //  Nsecs per operation
+    double heartbeat;
+    double delete;
+} costs_t;
+
+//  Before: a worker is on a zlist for the broker and one for its service
+
+static costs_t
+s_bench_zlist(worker_t *workers, int count)
+{
+    zlist_t *broker_waiting = zlist_new();
+    zlist_t *service_waiting = zlist_new();
+    int index;
+    for (index = 0; index < count; index++)
+    {
+        zlist_append(broker_waiting, &workers[index]);
+        zlist_append(service_waiting, &workers[index]);
+    }
+    costs_t costs;
+
+    //  A heartbeat moves the worker to the tail of the broker list. We
+    //  time these first, so the broker list is no longer in the order of
+    //  the service list when we dispatch
+    int64_t start = zclock_usecs();
+    for (index = 0; index < ZLIST_OPERATIONS; index++)
+    {
+        worker_t *worker = &workers[(size_t)index * STRIDE % count];
+        zlist_remove(broker_waiting, worker);
+        zlist_append(broker_waiting, worker);
+    }
+    costs.heartbeat = (zclock_usecs() - start) * 1000.0 / ZLIST_OPERATIONS;
+
+    //  Dispatch takes the longest idle worker off both lists; it goes
+    //  back at the tail when it answers
+    start = zclock_usecs();
+    for (index = 0; index < ZLIST_OPERATIONS; index++)
+    {
+        worker_t *worker = (worker_t *)zlist_pop(service_waiting);
+        zlist_remove(broker_waiting, worker);
+        zlist_append(broker_waiting, worker);
+        zlist_append(service_waiting, worker);
+    }
+    costs.dispatch = (zclock_usecs() - start) * 1000.0 / ZLIST_OPERATIONS;
+
+    //  Delete takes the worker off both lists; it registers again at once
+    //  so the pool keeps its size
+    start = zclock_usecs();
+    for (index = 0; index < ZLIST_OPERATIONS; index++)
+    {
+        worker_t *worker = &workers[(size_t)index * STRIDE % count];
+        zlist_remove(broker_waiting, worker);
+        zlist_remove(service_waiting, worker);
+        zlist_append(broker_waiting, worker);
+        zlist_append(service_waiting, worker);
+    }
+    costs.delete = (zclock_usecs() - start) * 1000.0 / ZLIST_OPERATIONS;
+
+    zlist_destroy(&service_waiting);
+    zlist_destroy(&broker_waiting);
+    return costs;
+}
+
+//  After: the same work on intrusive lists
+
+static costs_t
+s_bench_idlist(worker_t *workers, int count)
+{
+    idlist_t broker_waiting;
+    idlist_t service_waiting;
+    idlist_init(&broker_waiting);
+    idlist_init(&service_waiting);
+    int index;
+    for (index = 0; index < count; index++)
+    {
+        idlist_link_init(&workers[index]._broker_link, &workers[index]);
+        idlist_link_init(&workers[index]._service_link, &workers[index]);
+        idlist_append(&broker_waiting, &workers[index]._broker_link);
+        idlist_append(&service_waiting, &workers[index]._service_link);
+    }
+    costs_t costs;
+
+    int64_t start = zclock_usecs();
+    for (index = 0; index < IDLIST_OPERATIONS; index++)
+    {
+        worker_t *worker = &workers[(size_t)index * STRIDE % count];
+        idlist_remove(&broker_waiting, &worker->_broker_link);
+        idlist_append(&broker_waiting, &worker->_broker_link);
+    }
+    costs.heartbeat = (zclock_usecs() - start) * 1000.0 / IDLIST_OPERATIONS;
+
+    start = zclock_usecs();
+    for (index = 0; index < IDLIST_OPERATIONS; index++)
+    {
+        worker_t *worker = (worker_t *)idlist_pop(&service_waiting);
+        idlist_remove(&broker_waiting, &worker->_broker_link);
+        idlist_append(&broker_waiting, &worker->_broker_link);
+        idlist_append(&service_waiting, &worker->_service_link);
+    }
+    costs.dispatch = (zclock_usecs() - start) * 1000.0 / IDLIST_OPERATIONS;
+
+    start = zclock_usecs();
+    for (index = 0; index < IDLIST_OPERATIONS; index++)
+    {
+        worker_t *worker = &workers[(size_t)index * STRIDE % count];
+        idlist_remove(&broker_waiting, &worker->_broker_link);
+        idlist_remove(&service_waiting, &worker->_service_link);
+        idlist_append(&broker_waiting, &worker->_broker_link);
+        idlist_append(&service_waiting, &worker->_service_link);
+    }
+    costs.delete = (zclock_usecs() - start) * 1000.0 / IDLIST_OPERATIONS;
+    return costs;
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[] = {1000, 10000, 50000};
+    costs_t first, last;
+    size_t run;
+    for (run = 0; run < sizeof(counts) / sizeof(counts[0]); run++)
+    {
+        int count = counts[run];
+        worker_t *workers = (worker_t *)zmalloc(count * sizeof(worker_t));
+        costs_t before = s_bench_zlist(workers, count);
+        costs_t after = s_bench_idlist(workers, count);
+        if (run == 0)
+            first = after;
+        last = after;
+        printf("%d idle workers on one service\n", count);
+        printf("  zlist:  dispatch %9.1f  heartbeat %9.1f  delete %9.1f ns/op\n",
+               before.dispatch, before.heartbeat, before.delete);
+        printf("  idlist: dispatch %9.1f  heartbeat %9.1f  delete %9.1f ns/op\n",
+               after.dispatch, after.heartbeat, after.delete);
+        free(workers);
+    }
+    if (last.dispatch > first.dispatch * SCALING_LIMIT
+        || last.heartbeat > first.heartbeat * SCALING_LIMIT
+        || last.delete > first.delete * SCALING_LIMIT)
+    {
+        printf("FAIL: idlist costs grew more than %dx with the pool\n", SCALING_LIMIT);
+        return 1;
+    }
+    printf("OK: idlist costs stay flat\n");
+    return 0;
+}
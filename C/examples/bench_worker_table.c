@@ -0,0 +1,93 @@
+//
+//  Irondomo worker table benchmark
+//  Registers 100k workers with ZeroMQ-style 5-byte routing ids and times
+//  the per-message lookup done by the broker, first the old way (hex
+//  encode the routing id and look it up in a zhash, twice) and then with
+//  the idtable keyed by raw routing id bytes.
+//
+
+#include "czmq.h"
+#include "idtable.h"
+#include <malloc.h>
+
+#define WORKERS 100000
+#define ROUNDS 10
+
+static size_t
+s_heap_in_use(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+int main(int argc, char *argv[])
+{
+    zframe_t **ids = (zframe_t **)zmalloc(WORKERS * sizeof(zframe_t *));
+    uint32_t index;
+    for (index = 0; index < WORKERS; index++)
+    {
+        //  ROUTER sockets generate a zero byte followed by a 32-bit counter
+        byte id[5] = {0, (byte)(index >> 24), (byte)(index >> 16), (byte)(index >> 8), (byte)index};
+        ids[index] = zframe_new(id, sizeof(id));
+    }
+    int *worker = (int *)zmalloc(WORKERS * sizeof(int));
+
+    //  Before: zhash keyed by hex strings
+    size_t heap_before = s_heap_in_use();
+    zhash_t *hash = zhash_new();
+    for (index = 0; index < WORKERS; index++)
+    {
+        char *identity = zframe_strhex(ids[index]);
+        zhash_insert(hash, identity, &worker[index]);
+        free(identity);
+    }
+    size_t hash_memory = s_heap_in_use() - heap_before;
+
+    int64_t start = zclock_usecs();
+    int round;
+    for (round = 0; round < ROUNDS; round++)
+        for (index = 0; index < WORKERS; index++)
+        {
+            char *identity = zframe_strhex(ids[index]);
+            int ready = (zhash_lookup(hash, identity) != NULL);
+            free(identity);
+            identity = zframe_strhex(ids[index]);
+            void *found = zhash_lookup(hash, identity);
+            free(identity);
+            assert(ready && found);
+        }
+    int64_t hash_usecs = zclock_usecs() - start;
+    zhash_destroy(&hash);
+
+    //  After: idtable keyed by raw routing id bytes
+    heap_before = s_heap_in_use();
+    idtable_t *table = idtable_new();
+    for (index = 0; index < WORKERS; index++)
+        idtable_insert(table, zframe_data(ids[index]), zframe_size(ids[index]),
+                       idtable_hash(zframe_data(ids[index]), zframe_size(ids[index])), &worker[index]);
+    size_t table_memory = s_heap_in_use() - heap_before;
+
+    start = zclock_usecs();
+    for (round = 0; round < ROUNDS; round++)
+        for (index = 0; index < WORKERS; index++)
+        {
+            uint32_t key_hash = idtable_hash(zframe_data(ids[index]), zframe_size(ids[index]));
+            void *found = idtable_lookup(table, zframe_data(ids[index]), zframe_size(ids[index]), key_hash);
+            assert(found);
+        }
+    int64_t table_usecs = zclock_usecs() - start;
+    idtable_destroy(&table);
+
+    double lookups = (double)WORKERS * ROUNDS;
+    printf("%d workers, %d lookups each\n", WORKERS, ROUNDS);
+    printf("zhash + strhex: %7.1f ns/message %6.1f bytes/worker\n",
+           hash_usecs * 1000.0 / lookups, (double)hash_memory / WORKERS);
+    printf("idtable:        %7.1f ns/message %6.1f bytes/worker\n",
+           table_usecs * 1000.0 / lookups, (double)table_memory / WORKERS);
+
+    for (index = 0; index < WORKERS; index++)
+        zframe_destroy(&ids[index]);
+    free(ids);
+    free(worker);
+    return 0;
+}
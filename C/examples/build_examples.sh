@@ -7,3 +7,11 @@ gcc -g -I . -I ../include/  client_curve.c -lczmq -lzmq -o client_curve
 gcc -g -I . -I ../include/  client_curve2.c -lczmq -lzmq -o client_curve2
 gcc -g -I . -I ../include/  worker_clear.c -lczmq -lzmq -o worker_clear
 gcc -g -I . -I ../include/  worker_curve.c -lczmq -lzmq -o worker_curve
+gcc -O2 -I . -I ../include/  bench_worker_table.c -lczmq -lzmq -o bench_worker_table
+gcc -O2 -I . -I ../include/  bench_payload.c -lczmq -lzmq -o bench_payload
+gcc -O2 -I . -I ../include/  bench_service_lookup.c -lczmq -lzmq -o bench_service_lookup
+gcc -O2 -I . -I ../include/  bench_credit.c -lczmq -lzmq -o bench_credit
+gcc -O2 -I . -I ../include/  bench_fair.c -lczmq -lzmq -o bench_fair
+gcc -O2 -I . -I ../include/  bench_waiting_list.c -lczmq -lzmq -o bench_waiting_list
+gcc -O2 -I . -I ../include/  test_ttl.c -lczmq -lzmq -o test_ttl
+gcc -O2 -I . -I ../include/  test_idempotency.c -lczmq -lzmq -o test_idempotency
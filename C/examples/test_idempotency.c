@@ -0,0 +1,117 @@
+//
+//  Irondomo idempotency key test
+//  Starts a broker and a worker that answers each request with its body
+//  and how many requests it has run. Client A sends a request with an
+//  idempotency key, then client B sends a different request with the
+//  same key, then A resends its request. B must get its own request run,
+//  not A's reply, and A's resend must get A's recorded reply without a
+//  second run. Fails otherwise.
+//
+
+//  Lets us build this source without creating a library
+#include "idbrokerapi.h"
+#include "idwrkapi.h"
+#include <unistd.h>
+
+#define BROKER_CLEAR "tcp://127.0.0.1:5730"
+#define BROKER_CURVE "tcp://127.0.0.1:5731"
+#define REPLY_TIMEOUT 2000 //  Msecs we wait for each reply
+#define KEY "same-key-on-purpose"
+
+static void
+s_broker_task(zsock_t *pipe, void *args)
+{
+    const char public_key[] = ".8Q^k*3E/4-Wg4()r^(4yTk2>qvZFDW?mXUyRPvr";
+    const char secret_key[] = "3vup%:I!lF>^QWT@[[g]dwa>1:(B-^3RWw^7tIMf";
+    broker_t *broker = s_broker_new(BROKER_CLEAR, BROKER_CURVE, public_key, secret_key, NULL, 0);
+    zsock_signal(pipe, 0);
+    s_broker_loop(broker);
+}
+
+static void
+s_worker_task(zsock_t *pipe, void *args)
+{
+    idwrk_t *session = idwrk_new(BROKER_CLEAR, "run", "IdempotencyWorker", 0);
+    idwrk_connect_to_broker(session);
+    zsock_signal(pipe, 0);
+
+    int runs = 0;
+    while (1)
+    {
+        idwrk_envelope_t *envelope = NULL;
+        zmsg_t *request = idwrk_recv_request(session, &envelope);
+        if (request == NULL)
+            break; //  Worker was interrupted
+        zmsg_addstrf(request, "%d", ++runs);
+        idwrk_send_reply(session, &envelope, &request);
+    }
+    idwrk_destroy(&session);
+}
+
+//  Send a request with our key and check the reply is the body we expect,
+//  from the run we expect
+
+static bool
+s_request(zsock_t *client, const char *body, const char *expect_body, const char *expect_run)
+{
+    idprops_t props;
+    idprops_init(&props);
+    idprops_put(&props, IDP_PROP_IDEMPOTENCY_KEY, KEY, strlen(KEY));
+    zmsg_t *request = zmsg_new();
+    zmsg_pushstr(request, body);
+    zmsg_push(request, idprops_frame(&props));
+    zmsg_pushstr(request, "run");
+    zmsg_pushstr(request, IDPC_CLIENT_PROPS);
+    zmsg_pushstr(request, "");
+    zmsg_send(&request, client);
+
+    zpoller_t *poller = zpoller_new(client, NULL);
+    bool answered = zpoller_wait(poller, REPLY_TIMEOUT) == client;
+    zpoller_destroy(&poller);
+    if (!answered)
+    {
+        printf("%s: FAIL: no reply\n", body);
+        return false;
+    }
+    //  Empty delimiter, header, service, body, run
+    zmsg_t *reply = zmsg_recv(client);
+    bool passed = zmsg_size(reply) == 5 && zframe_streq(zmsg_last(reply), expect_run);
+    zframe_t *frame = zmsg_first(reply);
+    int index;
+    for (index = 0; frame && index < 3; index++)
+        frame = zmsg_next(reply);
+    passed = passed && frame && zframe_streq(frame, expect_body);
+    printf("%s: %s\n", body, passed ? "OK" : "FAIL: wrong reply");
+    if (!passed)
+        zmsg_dump(reply);
+    zmsg_destroy(&reply);
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    zactor_t *broker = zactor_new(s_broker_task, NULL);
+    zactor_t *worker = zactor_new(s_worker_task, NULL);
+    zclock_sleep(500); //  Let the worker register
+
+    zsock_t *client_a = zsock_new(ZMQ_DEALER);
+    zsock_set_identity(client_a, "ClientA");
+    zsock_connect(client_a, BROKER_CLEAR);
+    zsock_t *client_b = zsock_new(ZMQ_DEALER);
+    zsock_set_identity(client_b, "ClientB");
+    zsock_connect(client_b, BROKER_CLEAR);
+
+    bool passed = s_request(client_a, "request from A", "request from A", "1");
+    passed = s_request(client_b, "request from B", "request from B", "2") && passed;
+    passed = s_request(client_a, "request from A", "request from A", "1") && passed;
+    fflush(stdout);
+    zsock_destroy(&client_b);
+    zsock_destroy(&client_a);
+
+    //  The broker and worker loops only stop when interrupted, so we stop
+    //  them the way an interrupt would; they give up on their next poll
+    zsys_interrupted = 1;
+    zactor_destroy(&worker);
+    zactor_destroy(&broker);
+    _exit(passed ? 0 : 1);
+}
@@ -0,0 +1,100 @@
+//
+//  Irondomo request TTL test
+//  Starts a broker and an echo worker, then sends IDPC02 requests whose
+//  TTL is far too large to add to a clock: 2^31, 2^62, 2^63 and
+//  UINT64_MAX msecs. The broker must queue and answer each of them like
+//  a request without a TTL, not take the deadline as already past and
+//  drop the request. Fails if any request goes unanswered.
+//
+
+//  Lets us build this source without creating a library
+#include "idbrokerapi.h"
+#include "idwrkapi.h"
+#include <unistd.h>
+
+#define BROKER_CLEAR "tcp://127.0.0.1:5720"
+#define BROKER_CURVE "tcp://127.0.0.1:5721"
+#define REPLY_TIMEOUT 2000 //  Msecs we wait for each reply
+
+static void
+s_broker_task(zsock_t *pipe, void *args)
+{
+    const char public_key[] = ".8Q^k*3E/4-Wg4()r^(4yTk2>qvZFDW?mXUyRPvr";
+    const char secret_key[] = "3vup%:I!lF>^QWT@[[g]dwa>1:(B-^3RWw^7tIMf";
+    broker_t *broker = s_broker_new(BROKER_CLEAR, BROKER_CURVE, public_key, secret_key, NULL, 0);
+    zsock_signal(pipe, 0);
+    s_broker_loop(broker);
+}
+
+static void
+s_worker_task(zsock_t *pipe, void *args)
+{
+    idwrk_t *session = idwrk_new(BROKER_CLEAR, "echo", "TtlWorker", 0);
+    idwrk_connect_to_broker(session);
+    zsock_signal(pipe, 0);
+
+    while (1)
+    {
+        idwrk_envelope_t *envelope = NULL;
+        zmsg_t *request = idwrk_recv_request(session, &envelope);
+        if (request == NULL)
+            break; //  Worker was interrupted
+        idwrk_send_reply(session, &envelope, &request);
+    }
+    idwrk_destroy(&session);
+}
+
+//  Send one echo request with the given TTL and wait for its reply
+
+static bool
+s_request(zsock_t *client, uint64_t ttl)
+{
+    idprops_t props;
+    idprops_init(&props);
+    idprops_put_uint(&props, IDP_PROP_TTL, ttl);
+    zmsg_t *request = zmsg_new();
+    zmsg_pushstr(request, "Hello world");
+    zmsg_push(request, idprops_frame(&props));
+    zmsg_pushstr(request, "echo");
+    zmsg_pushstr(request, IDPC_CLIENT_PROPS);
+    zmsg_pushstr(request, "");
+    zmsg_send(&request, client);
+
+    zpoller_t *poller = zpoller_new(client, NULL);
+    bool answered = zpoller_wait(poller, REPLY_TIMEOUT) == client;
+    zpoller_destroy(&poller);
+    if (!answered)
+        return false;
+    zmsg_t *reply = zmsg_recv(client);
+    answered = zmsg_size(reply) == 4 && zframe_streq(zmsg_last(reply), "Hello world");
+    zmsg_destroy(&reply);
+    return answered;
+}
+
+int main(int argc, char *argv[])
+{
+    zactor_t *broker = zactor_new(s_broker_task, NULL);
+    zactor_t *worker = zactor_new(s_worker_task, NULL);
+    zclock_sleep(500); //  Let the worker register
+
+    zsock_t *client = zsock_new(ZMQ_DEALER);
+    zsock_connect(client, BROKER_CLEAR);
+    uint64_t ttls[] = {(uint64_t)1 << 31, (uint64_t)1 << 62, (uint64_t)1 << 63, UINT64_MAX};
+    int failed = 0;
+    size_t index;
+    for (index = 0; index < sizeof(ttls) / sizeof(ttls[0]); index++)
+    {
+        bool answered = s_request(client, ttls[index]);
+        printf("TTL %20llu msecs: %s\n", (unsigned long long)ttls[index], answered ? "answered" : "FAIL: no reply");
+        failed += !answered;
+    }
+    fflush(stdout);
+    zsock_destroy(&client);
+
+    //  The broker and worker loops only stop when interrupted, so we stop
+    //  them the way an interrupt would; they give up on their next poll
+    zsys_interrupted = 1;
+    zactor_destroy(&worker);
+    zactor_destroy(&broker);
+    _exit(failed ? 1 : 0);
+}
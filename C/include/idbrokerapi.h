@@ -6,12 +6,137 @@
 #pragma once
 #include "czmq.h"
 #include "idp.h"
+#include "idtable.h"
+#include "idlist.h"
+#include "idheap.h"
+#include "idwheel.h"
+#include "idpool.h"
+#include "idprops.h"
 
 //  We'd normally pull these from config data
 
 #define HEARTBEAT_LIVENESS 3    //  3-5 is reasonable
 #define HEARTBEAT_INTERVAL 2500 //  msecs
 #define HEARTBEAT_EXPIRY HEARTBEAT_INTERVAL *HEARTBEAT_LIVENESS
+#define TIMER_INTERVAL 100      //  msecs, longest wait between timer checks
+#define SERVICE_MAX_REQUESTS 0  //  Default queued requests per service, 0 = no limit
+#define SERVICE_MAX_BYTES 0     //  Default queued bytes per service, 0 = no limit
+#define SERVICE_CODEL_TARGET 0  //  Default msecs of acceptable queue wait, 0 = no CoDel
+#define SERVICE_CODEL_INTERVAL 100 //  Default msecs wait may exceed target before dropping
+#define PRIORITY_MAX_PASSED 8   //  Dispatches a waiting priority class may be passed over
+#define REQUEST_MAX_TTL INT32_MAX //  Longest TTL we honour, in msecs; longer ones are cut to it
+#define SERVICE_WAIT_BUCKETS 16 //  Queue wait histogram buckets, log2 msecs
+#define WORKER_MAX_CREDIT 256   //  Most requests we keep in flight to one worker
+#define WORKER_EWMA_WEIGHT 8    //  Service time samples in the worker moving average
+#define SERVICE_IDEMPOTENCY_KEYS 1024   //  Default idempotency keys per service, 0 = ignore them
+#define SERVICE_IDEMPOTENCY_WINDOW 10000 //  Default msecs a reply stays recorded under its key
+#define SERVICE_MAX_ATTEMPTS 1  //  Default workers a request may be sent to, 1 = never reassigned
+#define SERVICE_LATENCY_BUCKETS 32   //  Service time histogram buckets, log2 usecs
+#define SERVICE_LATENCY_WINDOW 1024  //  Service time samples before the histogram is halved
+#define SERVICE_LATENCY_MIN_SAMPLES 20 //  Service time samples needed before we trust percentiles
+#define SERVICE_HEDGE_BURST 10       //  Hedges a service may save up budget for
+#define SERVICE_OUTLIER_BACKOFF 1000      //  Default msecs of a first ejection, doubling with each strike
+#define SERVICE_OUTLIER_MAX_BACKOFF 60000 //  Longest ejection, in msecs
+#define SERVICE_OUTLIER_MIN_SAMPLES 5     //  Replies a worker gives before we judge its service time
+#define SERVICE_OUTLIER_MEMORY 300000     //  Msecs the strikes of a lost worker are remembered
+#define SERVICE_OUTLIERS 1024             //  Most lost workers a service remembers strikes for
+#define SERVICE_PROBE_REQUESTS 5          //  Good replies that end a worker's probation
+#define SERVICE_PROBE_INTERVAL 100        //  Msecs between requests to a worker on probation
+#define SERVICE_BREAKER_MIN_REQUESTS 20   //  Outcomes needed before the error rate can open the breaker
+#define SERVICE_BREAKER_WINDOW 100        //  Outcomes before the error counts are halved
+#define SERVICE_BREAKER_COOLDOWN 5000     //  Msecs the error rate keeps the breaker open
+#define SERVICE_IDLE_TIMEOUT 600000       //  Default msecs a service without workers or clients is kept
+#define SERVICE_MAX_IDLE 0                //  Default services without workers kept at once, 0 = no limit
+#define CLIENT_MAX_BUCKETS 65536          //  Most clients we keep a rate limit and counters for
+
+//  How a service picks among its waiting workers
+#define BALANCE_ROUND_ROBIN 0       //  Longest idle first, spreads work evenly
+#define BALANCE_LIFO 1              //  Most recently idle first, caches still warm
+#define BALANCE_LEAST_OUTSTANDING 2 //  Fewest requests in flight first
+#define BALANCE_EWMA 3              //  Lowest service time times requests in flight
+#define BALANCE_STRATEGIES 4
+
+//  How far a service trusts a worker
+#define WORKER_HEALTHY 0 //  Takes its full credit
+#define WORKER_EJECTED 1 //  Takes nothing until its ejection ends
+#define WORKER_PROBING 2 //  Takes one request at a time, now and then
+
+//  .split service limits
+//  How a service queues and dispatches its requests. Past either queue
+//  limit new requests get a status 503 reply at once. Each setting has a
+//  setter, for services without settings of their own and for one
+//  service, that tells what it does:
+
+typedef struct
+{
+    size_t _max_requests;    //  Queued requests, 0 = no limit
+    size_t _max_bytes;       //  Queued request bytes, 0 = no limit
+    int64_t _codel_target;   //  Acceptable queue wait in msecs, 0 = no CoDel
+    int64_t _codel_interval; //  Msecs wait may stay above target
+    int _balance;            //  Balancing strategy, one of BALANCE_*
+    size_t _cache_max_bytes; //  Bytes of cached replies, 0 = no cache
+    bool _coalesce;          //  Single flight for identical requests
+    size_t _idempotency_keys;    //  Idempotency keys remembered, 0 = ignore them
+    int64_t _idempotency_window; //  Msecs a reply stays recorded under its key
+    int _max_attempts;       //  Workers a request may be sent to, 1 = never reassigned
+    int _hedge_budget;       //  Hedges per hundred requests, 0 = no hedging
+    int _outlier_factor;     //  Eject workers this many times slower than the median, 0 = never
+    int64_t _outlier_backoff; //  Msecs of a first ejection
+    int64_t _breaker_grace;  //  Msecs without workers before the breaker opens, 0 = never
+    int _breaker_error_rate; //  Percent of requests lost with their worker that opens it, 0 = never
+    bool _fair;              //  Queue per client and serve clients in turn
+} service_limits_t;
+
+typedef struct
+{
+    size_t _queued;       //  Requests waiting for a worker
+    size_t _queued_bytes; //  Bytes of those requests
+    size_t _workers;      //  Workers registered for the service
+    size_t _waiting;      //  Workers free for a request
+    uint64_t _rejected;   //  Requests refused with status 503 by the queue limits
+    uint64_t _dropped;    //  Requests dropped with status 503 by CoDel
+    uint64_t _expired;    //  Requests dropped unanswered past their deadline
+    uint64_t _cache_hits;   //  Requests answered from the reply cache
+    uint64_t _cache_misses; //  Requests the cache had no fresh reply for
+    size_t _cache_entries;  //  Replies in the cache
+    size_t _cache_bytes;    //  Bytes of those replies and their keys
+    uint64_t _flights;      //  Requests sent on to a worker in single flight mode
+    uint64_t _coalesced;    //  Requests that shared the reply of such a flight
+    size_t _idempotency_keys; //  Idempotency keys remembered
+    uint64_t _resends;      //  Requests whose idempotency key was already known
+    uint64_t _reassigned;   //  Requests requeued because their worker was lost
+    uint64_t _hedged;       //  Copies of slow requests sent to a second worker
+    uint64_t _hedge_wins;   //  Hedged requests the copy answered first
+    int64_t _service_time_p95; //  Usecs under which 95% of recent requests were answered, 0 if unknown
+    size_t _ejected;        //  Workers ejected or on probation
+    uint64_t _ejections;    //  Times a worker was ejected
+    bool _breaker_open;     //  Requests are refused with status 503 at once
+    uint64_t _short_circuited; //  Requests refused or flushed by the open breaker
+    size_t _fair_queues;    //  Client queues with requests in them, in fair queuing mode
+    size_t _queued_class[IDP_PRIORITY_CLASSES]; //  Queued requests by priority class
+    //  Dispatched requests by priority class and time spent queued. Bucket
+    //  0 counts waits under 1 msec, bucket n waits of 2^(n-1) up to 2^n
+    //  msecs; the last bucket also counts anything longer.
+    uint64_t _wait[IDP_PRIORITY_CLASSES][SERVICE_WAIT_BUCKETS];
+} service_stats_t;
+
+//  Requests one client sent past the rate limit check
+
+typedef struct
+{
+    uint64_t _admitted;     //  Requests let through
+    uint64_t _rejected;     //  Requests refused with status 429
+    int _rate;              //  Requests per second it may send, 0 = no limit
+    int _burst;             //  Requests it may send at once
+} client_stats_t;
+
+//  Rate limit for a client
+
+typedef struct
+{
+    int _rate;              //  Requests per second, 0 = no limit
+    int _burst;             //  Requests the bucket holds
+} rate_limit_t;
 
 //  .split broker class structure
 //  The broker class defines a single broker instance:
@@ -27,10 +152,31 @@ typedef struct
     char *_curve_publickey; //  Broker binds to this endpoint for curve channel
     zpoller_t *_poller;
     zactor_t *_auth;
-    zhash_t *_services;           //  Hash of known services
-    zhash_t *_workers;            //  Hash of known workers
-    zlist_t *_waiting;            //  List of waiting workers
-    uint64_t _heartbeat_at;       //  When to send HEARTBEAT
+    idtable_t *_services;         //  Known services, keyed by name
+    zhash_t *_service_limits;     //  Limits set for named services
+    service_limits_t _service_defaults; //  Limits for all other services
+    idpool_t *_service_pool;      //  Service records
+    idpool_t *_worker_pool;       //  Worker records
+    idpool_t *_request_pool;      //  Queued request records
+    idpool_t *_cache_pool;        //  Cached reply records
+    idpool_t *_idempotency_pool;  //  Idempotency key records
+    idpool_t *_outlier_pool;      //  Worker strike records
+    idpool_t *_flow_pool;         //  Client queue records
+    zhash_t *_client_weights;     //  Fair queuing weights set for clients
+    idpool_t *_bucket_pool;       //  Client rate limit records
+    idtable_t *_buckets;          //  Client rate limits and counters, by client
+    idlist_t _buckets_lru;        //  Same, least recently seen first
+    rate_limit_t _client_rate;    //  Rate limit for all other clients
+    zhash_t *_client_rates;       //  Rate limits set for named clients
+    uint64_t _rate_generation;    //  Bumped whenever a rate limit changes
+    idtable_t *_workers;          //  Known workers, keyed by routing id
+    idwheel_t *_timers;           //  Worker expiry, heartbeat and request deadlines
+    idlist_t _idle_services;      //  Services without workers, least recently asked for first
+    idtimer_t _idle_timer;        //  When the first of them times out
+    int64_t _service_idle_timeout; //  Msecs a service without workers or clients is kept, 0 = forever
+    size_t _max_idle_services;    //  Most services without workers, 0 = no limit
+    int64_t _now;                 //  Coarse clock, read once per loop iteration
+    int64_t _request_timeout;     //  Max msecs a worker may hold a request, 0 = no limit
     uint64_t _heartbeat_interval; //  Interval between HEARTBEATs
     int _heartbeat_liveness;
     bool _authenticate; // Should we look for CURVE keys in keys archive for authentication, or accept all keys?
@@ -41,63 +187,441 @@ s_broker_new(const char *clear_endpoint, const char *curve_endpoint, const char
 static void
 s_broker_destroy(broker_t **self_p);
 
+static bool
+s_broker_valid(broker_t *self, zmsg_t *msg, size_t frames, bool props);
+static void
+s_broker_worker_msg(broker_t *self, zframe_t **sender_p, zmsg_t *msg, bool clear, bool props);
+static void
+s_broker_client_msg(broker_t *self, zframe_t **sender_p, zmsg_t *msg, bool clear, bool props);
+static void
+s_broker_set_request_timeout(broker_t *self, int timeout);
+static void
+s_broker_set_service_idle_timeout(broker_t *self, int64_t timeout);
+static void
+s_broker_set_max_idle_services(broker_t *self, size_t max_services);
+static void
+s_broker_set_default_service_limits(broker_t *self, size_t max_requests, size_t max_bytes);
+static void
+s_broker_set_service_limits(broker_t *self, const char *name, size_t max_requests, size_t max_bytes);
+static void
+s_broker_set_default_service_codel(broker_t *self, int64_t target, int64_t interval);
+static void
+s_broker_set_service_codel(broker_t *self, const char *name, int64_t target, int64_t interval);
+static void
+s_broker_set_default_service_balance(broker_t *self, int balance);
+static void
+s_broker_set_service_balance(broker_t *self, const char *name, int balance);
+static void
+s_broker_set_default_service_cache(broker_t *self, size_t max_bytes);
+static void
+s_broker_set_service_cache(broker_t *self, const char *name, size_t max_bytes);
+static void
+s_broker_set_default_service_coalesce(broker_t *self, bool coalesce);
+static void
+s_broker_set_service_coalesce(broker_t *self, const char *name, bool coalesce);
+static void
+s_broker_set_default_service_idempotency(broker_t *self, size_t max_keys, int64_t window);
+static void
+s_broker_set_service_idempotency(broker_t *self, const char *name, size_t max_keys, int64_t window);
+static void
+s_broker_set_default_service_attempts(broker_t *self, int attempts);
+static void
+s_broker_set_service_attempts(broker_t *self, const char *name, int attempts);
 static void
-s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg, bool clear);
+s_broker_set_default_service_hedge(broker_t *self, int budget);
 static void
-s_broker_client_msg(broker_t *self, zframe_t *sender, zmsg_t *msg, bool clear);
+s_broker_set_service_hedge(broker_t *self, const char *name, int budget);
 static void
-s_broker_purge(broker_t *self);
+s_broker_set_default_service_outliers(broker_t *self, int factor, int64_t backoff);
+static void
+s_broker_set_service_outliers(broker_t *self, const char *name, int factor, int64_t backoff);
+static void
+s_broker_set_default_service_breaker(broker_t *self, int64_t grace, int error_rate);
+static void
+s_broker_set_service_breaker(broker_t *self, const char *name, int64_t grace, int error_rate);
+static void
+s_broker_set_default_service_fair(broker_t *self, bool fair);
+static void
+s_broker_set_service_fair(broker_t *self, const char *name, bool fair);
+static void
+s_broker_set_client_weight(broker_t *self, const char *client, int weight);
+static void
+s_broker_set_default_client_rate(broker_t *self, int rate, int burst);
+static void
+s_broker_set_client_rate(broker_t *self, const char *client, int rate, int burst);
+static bool
+s_broker_service_stats(broker_t *self, const char *name, service_stats_t *stats);
+static bool
+s_broker_client_stats(broker_t *self, const char *client, client_stats_t *stats);
 
 //  .split service class structure
 //  The service class defines a single service instance:
 
 typedef struct
 {
-    broker_t *_broker;  //  Broker instance
-    char *_name;        //  Service name
-    zlist_t *_requests; //  List of client requests
-    zlist_t *_waiting;  //  List of waiting workers
-    size_t _workers;    //  How many workers we have
+    broker_t *_broker;         //  Broker instance
+    char *_name;               //  Service name
+    uint32_t _hash;            //  Hash of name, our key in broker->_services
+    zframe_t *_name_frame;     //  Service name, prebuilt for replies
+    zframe_t *_header_frame;   //  IDPC_CLIENT header, prebuilt for replies
+    idlist_t _requests;        //  List of client requests, oldest first
+    idheap_t _queues[IDP_PRIORITY_CLASSES]; //  Same requests by class, earliest deadline first
+    size_t _queued[IDP_PRIORITY_CLASSES];   //  Queued requests by class
+    idtable_t *_flows[IDP_PRIORITY_CLASSES]; //  In fair queuing mode, same requests by class and client, NULL until the first
+    idlist_t _fair[IDP_PRIORITY_CLASSES];   //  Those clients by class, in the order they take turns
+    uint32_t _passed[IDP_PRIORITY_CLASSES]; //  Dispatches each class was passed over
+    uint64_t _wait[IDP_PRIORITY_CLASSES][SERVICE_WAIT_BUCKETS]; //  Queue wait histograms
+    idlist_t _waiting;         //  List of waiting workers, longest idle first
+    size_t _workers;           //  How many workers we have
+    service_limits_t _limits;  //  How we queue and dispatch requests
+    size_t _queued_bytes;      //  Bytes of queued requests
+    uint64_t _rejected;        //  Requests refused because of limits
+    uint64_t _dropped;         //  Requests dropped by CoDel
+    uint64_t _expired;         //  Requests dropped past their deadline
+    idtable_t *_cache;         //  Cached replies by request key, NULL until the first
+    idlist_t _cache_lru;       //  Same replies, least recently used first
+    size_t _cache_bytes;       //  Bytes of cached replies and their keys
+    uint64_t _cache_hits;      //  Requests answered from the cache
+    uint64_t _cache_misses;    //  Requests the cache could not answer
+    idtable_t *_flights;       //  Requests others may follow, by key, NULL until the first
+    uint64_t _flights_started; //  Requests that led a flight
+    uint64_t _coalesced;       //  Requests that followed one
+    idtable_t *_idempotency;   //  Requests and replies by idempotency key, NULL until the first
+    idlist_t _idempotency_age; //  Same entries, oldest first
+    uint64_t _resends;         //  Requests whose key was already known
+    uint64_t _reassigned;      //  Requests requeued from lost workers
+    uint64_t _latency[SERVICE_LATENCY_BUCKETS]; //  Recent service times, log2 usecs
+    uint64_t _latency_samples; //  Samples in _latency
+    int64_t _hedge_credit;     //  Hedge budget saved up, in hundredths of a hedge
+    uint64_t _hedged;          //  Hedges sent
+    uint64_t _hedge_wins;      //  Hedges that answered first
+    idtable_t *_outliers;      //  Workers with strikes, by routing id, NULL until the first
+    idlist_t _outliers_lost;   //  Those whose worker is gone, earliest lost first
+    size_t _ejected;           //  Workers ejected or on probation
+    uint64_t _ejections;       //  Times a worker was ejected
+    idtimer_t _breaker_timer;  //  End of the grace period, or of the cooldown
+    bool _breaker_open;        //  Refusing requests with status 503
+    uint64_t _breaker_requests; //  Recent requests answered or lost by workers
+    uint64_t _breaker_errors;  //  Those lost
+    uint64_t _short_circuited; //  Requests refused or flushed by the open breaker
+    int64_t _first_above;      //  When wait may count as too long, 0 if under target
+    int64_t _drop_next;        //  When CoDel drops again
+    uint32_t _drop_count;      //  Drops since CoDel started dropping
+    bool _dropping;            //  CoDel is dropping
+    idlist_link_t _idle_link;  //  Hook for broker->_idle_services while we have no workers
+    int64_t _idle_since;       //  When a client last asked for us without workers, in msecs
 } service_t;
 
+//  A client request queued on a service until a worker is free, then kept
+//  on the worker's in flight list until the worker replies. With single
+//  flight, identical requests park on it meanwhile, and so do client
+//  resends that carry its idempotency key. A hedged request has a twin, a
+//  copy sent to a second worker; whichever answers first answers the
+//  client.
+
+typedef struct _request_t
+{
+    idlist_link_t _link; //  Hook for service->_requests, worker->_in_flight or a leader's _followers
+    idheap_link_t _queue_link; //  Hook for service->_queues or our flow, keyed by deadline
+    zmsg_t *_msg;        //  Request, wrapped in the client envelope
+    size_t _size;        //  Bytes of _msg, counted against the service
+    int64_t _enqueued;   //  When the request was queued, in msecs
+    int64_t _deadline;   //  When the client stops waiting, 0 if never
+    int _priority;       //  Priority class
+    zframe_t *_key;      //  Request frames, if the service caches or coalesces
+    idlist_t _followers; //  Identical requests waiting for our reply
+    bool _leads;         //  We are in service->_flights
+    struct _idempotency_entry_t *_idempotency; //  Where to record our reply, if the client sent a key
+    uint32_t _id;        //  Request id, once sent to a worker
+    int64_t _dispatched; //  When we sent it to a worker, in msecs
+    int64_t _sent;       //  Same, in usecs, to measure service time
+    int _attempts;       //  Workers we have sent it to
+    struct _worker_t *_worker; //  Worker that has it, while in flight
+    idtimer_t _hedge_timer;    //  When to hedge, if the service hedges
+    struct _request_t *_twin;  //  Other copy of a hedged request, while both are in flight
+    bool _hedge;         //  We are the copy sent to hedge
+    bool _discard;       //  Our twin was answered; drop our reply
+    struct _flow_t *_flow; //  Client queue we wait in, while queued in fair queuing mode
+    zframe_t *_client;   //  CURVE public key of the client, once fair queuing looked for it
+    bool _clear;         //  Came in on the CLEAR socket
+    bool _props;         //  Came as IDPC02, so a refusal gets a status reply
+} request_t;
+
+//  A reply a worker marked cacheable, kept until it expires or the service
+//  needs its bytes for fresher replies
+
 typedef struct
 {
-    zmsg_t *_msg;
-    bool _clear;
+    idlist_link_t _link; //  Hook for service->_cache_lru
+    zframe_t *_key;      //  Request frames, each prefixed by its size
+    uint32_t _hash;      //  Hash of _key, our key in service->_cache
+    zmsg_t *_reply;      //  Reply frames, without any envelope
+    size_t _size;        //  Bytes of key and reply
+    int64_t _expires;    //  When the reply goes stale, in msecs
+} cache_entry_t;
+
+//  A client idempotency key, with the request that carried it until a
+//  worker answers, then with the reply until the window closes. A key
+//  with neither is stale, its request was lost or dropped.
+
+typedef struct _idempotency_entry_t
+{
+    idlist_link_t _link; //  Hook for service->_idempotency_age
+    zframe_t *_key;      //  Key as the client sent it
+    uint32_t _hash;      //  Hash of _key, our key in service->_idempotency
+    request_t *_request; //  Request being worked on, or NULL
+    zmsg_t *_reply;      //  Reply frames, without any envelope, or NULL
+    int64_t _expires;    //  When the reply is forgotten, in msecs
+} idempotency_entry_t;
 
-} request_t;
+//  The strikes against a worker, kept by routing id so they outlive the
+//  worker if it is lost and registers again
+
+typedef struct
+{
+    idlist_link_t _link;       //  Hook for service->_outliers_lost
+    service_t *_service;       //  Owning service
+    zframe_t *_address;        //  Routing id of the worker
+    uint32_t _hash;            //  Hash of _address, our key in service->_outliers
+    struct _worker_t *_worker; //  Worker with that routing id, NULL if lost
+    uint32_t _strikes;         //  Ejections since the worker last passed probation
+    int64_t _until;            //  When the last ejection ends, in msecs
+    int64_t _lost;             //  When the worker was lost, in msecs
+} outlier_t;
+
+//  In fair queuing mode, the requests one client has queued in one
+//  priority class. A flow lasts as long as it has requests queued.
+
+typedef struct _flow_t
+{
+    idlist_link_t _link;       //  Hook for service->_fair
+    service_t *_service;       //  Owning service
+    zframe_t *_client;         //  Routing id or CURVE public key of the client
+    uint32_t _hash;            //  Hash of _client, our key in service->_flows
+    idheap_t _queue;           //  Our requests, earliest deadline first
+    uint32_t _weight;          //  Requests we send per turn
+    uint32_t _deficit;         //  Requests we may still send this turn
+} flow_t;
+
+//  The token bucket and counters of one client, by routing id or CURVE
+//  public key. Tokens are kept in thousandths of a request.
+
+typedef struct
+{
+    idlist_link_t _link;       //  Hook for broker->_buckets_lru
+    broker_t *_broker;         //  Broker instance
+    zframe_t *_client;         //  Routing id or CURVE public key of the client
+    uint32_t _hash;            //  Hash of _client, our key in broker->_buckets
+    int _rate;                 //  Requests per second, 0 = no limit
+    int _burst;                //  Requests the bucket holds
+    int64_t _tokens;           //  Thousandths of a request left
+    int64_t _refilled;         //  When tokens were last added, in msecs
+    uint64_t _admitted;        //  Requests let through
+    uint64_t _rejected;        //  Requests refused
+    uint64_t _generation;      //  Limits in force when _rate and _burst were set
+} bucket_t;
 
+static service_t *
+s_service_lookup(broker_t *self, zframe_t *service_frame);
 static service_t *
 s_service_require(broker_t *self, zframe_t *service_frame);
 static void
+s_service_reply_envelope(service_t *self, zmsg_t *msg);
+static void
 s_service_destroy(void *argument);
 static void
-s_service_dispatch(service_t *service, zmsg_t *msg, bool clear);
+s_service_idle(service_t *self);
+static void
+s_service_evict(service_t *self);
+static void
+s_service_flush(service_t *self);
+static void
+s_broker_services_reap_arm(broker_t *self);
+static void
+s_broker_services_reap(idtimer_t *timer, void *argument);
+static void
+s_broker_services_trim(broker_t *self);
+static void
+s_service_dispatch(service_t *service, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority, zframe_t *key, zframe_t *idempotency_key);
+static bool
+s_service_full(service_t *self, size_t size);
+static zmsg_t *
+s_status_reply(zframe_t *service_name, uint64_t status);
+static void
+s_service_reject(service_t *self, zmsg_t *msg, bool clear, bool props);
+static request_t *
+s_service_dequeue(service_t *self);
+static void
+s_service_unqueue(service_t *self, request_t *req);
+static void
+s_service_queue(service_t *self, request_t *req);
+static void
+s_service_queues_rebuild(service_t *self);
+static void
+s_service_fair_queue(service_t *self, request_t *req);
+static request_t *
+s_service_fair_top(service_t *self, int priority);
+static void
+s_service_fair_unqueue(service_t *self, request_t *req);
+static uint32_t
+s_broker_client_weight(broker_t *self, zframe_t *client);
+static void
+s_flow_destroy(void *argument);
+static bool
+s_broker_client_admit(broker_t *self, zframe_t *sender, bool clear);
+static bucket_t *
+s_broker_bucket_new(broker_t *self, const byte *client, size_t size, uint32_t hash);
+static void
+s_broker_bucket_limit(broker_t *self, bucket_t *bucket);
+static const byte *
+s_client_name(zframe_t *sender, bool clear, size_t *size_p);
+static zframe_t *
+s_idempotency_scope(zframe_t *sender, bool clear, const byte *value, size_t size);
+static void
+s_broker_client_refuse(broker_t *self, zframe_t **sender_p, zframe_t **service_p, bool clear, bool props);
+static void
+s_bucket_destroy(void *argument);
+static void
+s_service_codel(service_t *self);
+static void
+s_service_breaker_arm(service_t *self);
+static void
+s_service_breaker_open(service_t *self, int64_t until);
+static void
+s_service_breaker_close(service_t *self);
+static void
+s_service_breaker_count(service_t *self, uint64_t answered, uint64_t lost);
+static void
+s_service_breaker_expired(idtimer_t *timer, void *argument);
+static size_t
+s_wait_bucket(int64_t wait);
+static zframe_t *
+s_service_request_key(zmsg_t *msg);
+static bool
+s_service_cache_answer(service_t *self, zframe_t *key, zmsg_t *msg, bool clear);
+static void
+s_service_cache_insert(service_t *self, zframe_t **key_p, zmsg_t *reply, int64_t max_age);
+static void
+s_service_cache_trim(service_t *self, size_t size);
+static void
+s_service_cache_evict(service_t *self, cache_entry_t *entry);
+static void
+s_service_enqueue(service_t *self, request_t *req);
+static void
+s_service_requeue(service_t *self, request_t *req, size_t rank);
+static bool
+s_service_flight_join(service_t *self, zframe_t *key, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority);
+static void
+s_service_flight_start(service_t *self, request_t *leader);
+static void
+s_service_flight_end(service_t *self, request_t *leader);
+static void
+s_service_flight_answer(service_t *self, request_t *leader, zmsg_t *reply);
+static void
+s_service_flight_reject(service_t *self, request_t *leader);
+static void
+s_service_flight_retry(service_t *self, request_t *leader);
+static bool
+s_service_idempotency_answer(service_t *self, zframe_t *key, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority);
+static void
+s_service_idempotency_start(service_t *self, request_t *req, zframe_t **key_p);
+static void
+s_service_idempotency_record(service_t *self, request_t *req, zmsg_t *reply);
+static void
+s_service_idempotency_trim(service_t *self, size_t count);
+static void
+s_service_idempotency_evict(service_t *self, idempotency_entry_t *entry);
+static void
+s_service_latency(service_t *self, int64_t sample);
+static int64_t
+s_service_latency_percentile(service_t *self, int percent);
+static void
+s_service_hedge_arm(service_t *self, request_t *req);
+static void
+s_service_hedge(service_t *self, request_t *req);
+static void
+s_service_hedge_settle(service_t *self, request_t *winner);
+static outlier_t *
+s_service_outlier_strike(service_t *self, struct _worker_t *worker);
+static void
+s_service_outlier_lose(service_t *self, outlier_t *outlier);
+static void
+s_service_outlier_forget(service_t *self, outlier_t *outlier);
+static void
+s_outlier_destroy(void *argument);
+static request_t *
+s_request_new(broker_t *self, zmsg_t *msg, size_t size, bool clear, bool props, int64_t deadline, int priority);
+static void
+s_request_free(broker_t *self, request_t *req);
+static void
+s_request_handover(service_t *self, request_t *from, request_t *to);
+static void
+s_request_hedge(idtimer_t *timer, void *argument);
 
 //  .split worker class structure
 //  The worker class defines a single worker, idle or active:
 
-typedef struct
+typedef struct _worker_t
 {
-    broker_t *_broker;   //  Broker instance
-    void **_socket;      //  Worker socket
-    char *_identity;     //  Identity of worker
-    zframe_t *_address;  //  Address frame to route to
-    service_t *_service; //  Owning service, if known
-    int64_t _expiry;     //  Expires at unless heartbeat
+    broker_t *_broker;           //  Broker instance
+    void **_socket;              //  Worker socket
+    uint32_t _hash;              //  Hash of routing id, our key in broker->_workers
+    zframe_t *_address;          //  Address frame to route to
+    service_t *_service;         //  Owning service, if known
+    bool _props;                 //  Takes IDPW02 requests, with properties
+    uint32_t _credit;            //  Requests the worker will take at once
+    uint32_t _next_id;           //  Id of the next request we send it
+    int64_t _service_time;       //  Moving average usecs from request to reply, 0 until measured
+    uint32_t _answered;          //  Replies measured since registering or probation
+    int _health;                 //  One of WORKER_*
+    outlier_t *_outlier;         //  Strikes against us, if any
+    idlist_t _in_flight;         //  Requests sent and not answered, oldest first
+    idlist_link_t _service_link; //  Hook for service->_waiting
+    idtimer_t _expiry_timer;     //  Idle worker expires unless heartbeat
+    idtimer_t _heartbeat_timer;  //  Next HEARTBEAT to idle worker
+    idtimer_t _request_timer;    //  Deadline for the request in flight
+    idtimer_t _outlier_timer;    //  End of ejection, or next probe
 } worker_t;
 
 static worker_t *
-s_worker_require(broker_t *self, zframe_t *address, bool clear);
+s_worker_require(broker_t *self, zframe_t **address_p, uint32_t hash, bool clear);
 static void
 s_worker_delete(worker_t *self, int disconnect);
 static void
+s_worker_dispatch(worker_t *self, request_t *req);
+static void
 s_worker_destroy(void *argument);
 static void
 s_worker_send(worker_t *self, char *command, char *option,
-              zmsg_t *msg);
+              zmsg_t **msg_p);
 static void
 s_worker_waiting(worker_t *self);
+static request_t *
+s_worker_answered(worker_t *self, zframe_t *props_frame);
+static bool
+s_worker_credit(worker_t *self, zframe_t *props_frame);
+static void
+s_worker_service_time(worker_t *self, int64_t sample);
+static uint32_t
+s_worker_capacity(worker_t *self);
+static void
+s_worker_judge(worker_t *self, int64_t sample);
+static void
+s_worker_eject(worker_t *self);
+static void
+s_worker_restore(worker_t *self);
+static void
+s_worker_admit(worker_t *self);
+static void
+s_worker_lost(worker_t *self);
+static void
+s_worker_expired(idtimer_t *timer, void *argument);
+static void
+s_worker_heartbeat(idtimer_t *timer, void *argument);
+static void
+s_worker_request_expired(idtimer_t *timer, void *argument);
+static void
+s_worker_outlier_expired(idtimer_t *timer, void *argument);
 
 //  .split broker constructor and destructor
 //  Here are the constructor and destructor for the broker:
@@ -144,12 +668,52 @@ s_broker_new(const char *clear_endpoint, const char *curve_endpoint, const char
     zsock_bind((zsock_t *)self->_clear_socket, "%s", self->_clear_endpoint);
 
     self->_verbose = _verbose;
-    self->_services = zhash_new();
-    self->_workers = zhash_new();
-    self->_waiting = zlist_new();
+    self->_service_pool = idpool_new(sizeof(service_t), IDPOOL_SLAB_ITEMS);
+    self->_worker_pool = idpool_new(sizeof(worker_t), IDPOOL_SLAB_ITEMS);
+    self->_request_pool = idpool_new(sizeof(request_t), IDPOOL_SLAB_ITEMS);
+    self->_cache_pool = idpool_new(sizeof(cache_entry_t), IDPOOL_SLAB_ITEMS);
+    self->_idempotency_pool = idpool_new(sizeof(idempotency_entry_t), IDPOOL_SLAB_ITEMS);
+    self->_outlier_pool = idpool_new(sizeof(outlier_t), IDPOOL_SLAB_ITEMS);
+    self->_flow_pool = idpool_new(sizeof(flow_t), IDPOOL_SLAB_ITEMS);
+    self->_bucket_pool = idpool_new(sizeof(bucket_t), IDPOOL_SLAB_ITEMS);
+    self->_buckets = idtable_new();
+    idtable_set_destructor(self->_buckets, s_bucket_destroy);
+    idlist_init(&self->_buckets_lru);
+    self->_client_rates = zhash_new();
+    self->_client_rate._rate = 0;
+    self->_client_rate._burst = 0;
+    self->_rate_generation = 0;
+    self->_services = idtable_new();
+    idtable_set_destructor(self->_services, s_service_destroy);
+    self->_service_limits = zhash_new();
+    self->_client_weights = zhash_new();
+    self->_service_defaults._max_requests = SERVICE_MAX_REQUESTS;
+    self->_service_defaults._max_bytes = SERVICE_MAX_BYTES;
+    self->_service_defaults._codel_target = SERVICE_CODEL_TARGET;
+    self->_service_defaults._codel_interval = SERVICE_CODEL_INTERVAL;
+    self->_service_defaults._balance = BALANCE_ROUND_ROBIN;
+    self->_service_defaults._cache_max_bytes = 0;
+    self->_service_defaults._coalesce = false;
+    self->_service_defaults._idempotency_keys = SERVICE_IDEMPOTENCY_KEYS;
+    self->_service_defaults._idempotency_window = SERVICE_IDEMPOTENCY_WINDOW;
+    self->_service_defaults._max_attempts = SERVICE_MAX_ATTEMPTS;
+    self->_service_defaults._hedge_budget = 0;
+    self->_service_defaults._outlier_factor = 0;
+    self->_service_defaults._outlier_backoff = SERVICE_OUTLIER_BACKOFF;
+    self->_service_defaults._breaker_grace = 0;
+    self->_service_defaults._breaker_error_rate = 0;
+    self->_service_defaults._fair = false;
+    self->_workers = idtable_new();
+    idtable_set_destructor(self->_workers, s_worker_destroy);
+    self->_now = zclock_time();
+    self->_timers = idwheel_new(self->_now, IDWHEEL_RESOLUTION);
+    self->_request_timeout = 0;
+    idlist_init(&self->_idle_services);
+    idtimer_init(&self->_idle_timer, s_broker_services_reap, self);
+    self->_service_idle_timeout = SERVICE_IDLE_TIMEOUT;
+    self->_max_idle_services = SERVICE_MAX_IDLE;
     self->_heartbeat_interval = HEARTBEAT_INTERVAL;
     self->_heartbeat_liveness = HEARTBEAT_LIVENESS;
-    self->_heartbeat_at = zclock_time() + HEARTBEAT_INTERVAL;
 
     self->_poller = zpoller_new(NULL);
 
@@ -172,9 +736,21 @@ s_broker_destroy(broker_t **self_p)
     if (*self_p)
     {
         broker_t *self = *self_p;
-        zhash_destroy(&self->_services);
-        zhash_destroy(&self->_workers);
-        zlist_destroy(&self->_waiting);
+        idtable_destroy(&self->_services);
+        zhash_destroy(&self->_service_limits);
+        zhash_destroy(&self->_client_weights);
+        idtable_destroy(&self->_buckets);
+        zhash_destroy(&self->_client_rates);
+        idtable_destroy(&self->_workers);
+        idwheel_destroy(&self->_timers);
+        idpool_destroy(&self->_outlier_pool);
+        idpool_destroy(&self->_flow_pool);
+        idpool_destroy(&self->_bucket_pool);
+        idpool_destroy(&self->_idempotency_pool);
+        idpool_destroy(&self->_cache_pool);
+        idpool_destroy(&self->_request_pool);
+        idpool_destroy(&self->_worker_pool);
+        idpool_destroy(&self->_service_pool);
         if (self->_clear_socket)
             zsock_destroy((zsock_t **)&self->_clear_socket);
         if (self->_curve_socket)
@@ -208,51 +784,117 @@ s_broker_destroy(broker_t **self_p)
     }
 }
 
+//  Check that a message from a peer has at least the given number of
+//  frames and, in IDPC02 and IDPW02, a whole properties frame second.
+//  Peers are not trusted, so we drop bad messages rather than assert.
+
+static bool
+s_broker_valid(broker_t *self, zmsg_t *msg, size_t frames, bool props)
+{
+    bool valid = zmsg_size(msg) >= frames;
+    if (valid && props)
+    {
+        zmsg_first(msg);
+        valid = idprops_valid(zmsg_next(msg));
+    }
+    if (!valid && self->_verbose)
+    {
+        zclock_log("W: malformed message, dropped:");
+        zmsg_dump(msg);
+    }
+    return valid;
+}
+
 //  .split broker worker_msg method
 //  The worker_msg method processes one READY, REPLY, HEARTBEAT or
-//  DISCONNECT message sent to the broker by a worker:
+//  DISCONNECT message sent to the broker by a worker. A worker may
+//  advertise credit in READY, to have that many requests in flight, and
+//  change it later with an IDPW02 HEARTBEAT. IDPW02 replies name the
+//  request they answer, so they may come back in any order:
 
 static void
-s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg, bool clear)
+s_broker_worker_msg(broker_t *self, zframe_t **sender_p, zmsg_t *msg, bool clear, bool props)
 {
-    assert(zmsg_size(msg) >= 1); //  At least, command
+    //  At least, command and properties; replies carry a client envelope
+    zframe_t *first = zmsg_first(msg);
+    bool reply = first && (zframe_streq(first, IDPW_REPLY) || zframe_streq(first, IDPW_REPLY_CURVE));
+    if (!s_broker_valid(self, msg, (props ? 2 : 1) + reply, props))
+    {
+        zmsg_destroy(&msg);
+        return;
+    }
 
     zframe_t *command = zmsg_pop(msg);
-    char *identity = zframe_strhex(sender);
-    int worker_ready = (zhash_lookup(self->_workers, identity) != NULL);
-    free(identity);
-    worker_t *worker = s_worker_require(self, sender, clear);
+    zframe_t *props_frame = props ? zmsg_pop(msg) : NULL;
+    uint32_t hash = idtable_hash(zframe_data(*sender_p), zframe_size(*sender_p));
+    worker_t *worker = (worker_t *)idtable_lookup(self->_workers, zframe_data(*sender_p), zframe_size(*sender_p), hash);
+    int worker_ready = (worker != NULL);
+    if (!worker)
+        worker = s_worker_require(self, sender_p, hash, clear);
 
     if (zframe_streq(command, IDPW_READY))
     {
+        zframe_t *ready_props = zmsg_first(msg) ? zmsg_next(msg) : NULL;
         if (worker_ready) //  Not first command in session
             s_worker_delete(worker, 1);
-        else if (zframe_size(sender) >= 4 //  Reserved service name
-                 && memcmp(zframe_data(sender), "mmi.", 4) == 0)
+        else if (zmsg_first(msg) == NULL //  Missing or reserved service name
+                 || (zframe_size(zmsg_first(msg)) >= 4 && memcmp(zframe_data(zmsg_first(msg)), "mmi.", 4) == 0)
+                 || (ready_props && !idprops_valid(ready_props))) //  Malformed properties
             s_worker_delete(worker, 1);
         else
         {
-            //  Attach worker to service and mark as idle
+            //  Attach worker to service and mark as idle. Workers that
+            //  send properties after the service name take IDPW02.
             zframe_t *service_frame = zmsg_pop(msg);
+            worker->_props = zmsg_first(msg) != NULL;
+            worker->_credit = 1;
+            if (worker->_props)
+                s_worker_credit(worker, zmsg_first(msg));
             worker->_service = s_service_require(self, service_frame);
             worker->_service->_workers++;
+            idlist_remove(&self->_idle_services, &worker->_service->_idle_link);
+            s_service_breaker_close(worker->_service);
+            s_worker_admit(worker);
             s_worker_waiting(worker);
             zframe_destroy(&service_frame);
         }
     }
     else if (zframe_streq(command, IDPW_REPLY) || zframe_streq(command, IDPW_REPLY_CURVE))
     {
-        if (worker_ready)
+        request_t *req = worker_ready ? s_worker_answered(worker, props_frame) : NULL;
+        if (req && req->_discard)
+        {
+            //  Late reply to a hedged request; the twin answered already
+            s_request_free(self, req);
+            s_worker_waiting(worker);
+        }
+        else if (req)
         {
+            //  The original of a hedged request holds what the reply
+            //  answers besides the client, whichever copy came back first
+            request_t *owner = req->_hedge ? req->_twin : req;
+            if (req->_twin)
+                s_service_hedge_settle(worker->_service, req);
+
             //  Remove & save client return envelope and insert the
             //  protocol header and service name, then rewrap envelope.
             zframe_t *client = zmsg_unwrap(msg);
-            zmsg_pushstr(msg, worker->_service->_name);
-            zmsg_pushstr(msg, IDPC_CLIENT);
+            s_service_flight_end(worker->_service, owner);
+            s_service_flight_answer(worker->_service, owner, msg);
+            s_service_idempotency_record(worker->_service, owner, msg);
+            uint64_t max_age;
+            if (owner->_key && props_frame && idprops_get_uint(props_frame, IDP_PROP_MAX_AGE, &max_age) && max_age)
+                s_service_cache_insert(worker->_service, &owner->_key, msg, (int64_t)max_age);
+            s_service_reply_envelope(worker->_service, msg);
             zmsg_wrap(msg, client);
             zmsg_send(&msg, zframe_streq(command, IDPW_REPLY) ? self->_clear_socket : self->_curve_socket);
+            zmsg_destroy(&req->_msg);
+            s_request_free(self, req);
+            s_service_breaker_count(worker->_service, 1, 0);
             s_worker_waiting(worker);
         }
+        else if (worker_ready)
+            zclock_log("W: reply to unknown request, dropped");
         else
             s_worker_delete(worker, 1);
     }
@@ -260,17 +902,14 @@ s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg, bool clear)
     {
         if (worker_ready)
         {
-            if (zlist_size(self->_waiting) > 1)
-            {
-                // Move worker to the end of the waiting queue,
-                // so s_broker_purge will only check old worker(s)
-                zlist_remove(self->_waiting, worker);
-                zlist_append(self->_waiting, worker);
-            }
-            worker->_expiry = zclock_time() + HEARTBEAT_EXPIRY;
+            //  Only idle workers expire; busy ones have a request deadline
+            if (idtimer_armed(&worker->_expiry_timer))
+                idwheel_arm(self->_timers, &worker->_expiry_timer, self->_now + HEARTBEAT_EXPIRY);
+            if (props_frame && worker->_service && s_worker_credit(worker, props_frame))
+                s_worker_waiting(worker);
         }
-        
-        else s_worker_delete(worker, 1);
+        else
+            s_worker_delete(worker, 1);
     }
     else if (zframe_streq(command, IDPW_DISCONNECT))
         s_worker_delete(worker, 0);
@@ -278,264 +917,2562 @@ s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg, bool clear)
     {
         zclock_log("E: invalid input message");
         zmsg_dump(msg);
+        if (!worker_ready) //  Nothing would ever delete it
+            s_worker_delete(worker, 1);
     }
     zframe_destroy(&command);
+    zframe_destroy(&props_frame);
     zmsg_destroy(&msg);
 }
 
+//  Append one mmi.queue statistic to a reply
+
+static void
+s_mmi_stat(zmsg_t *msg, const char *name, uint64_t value)
+{
+    zmsg_addstr(msg, name);
+    zmsg_addstrf(msg, "%llu", (unsigned long long)value);
+}
+
 //  .split broker client_msg method
 //  Process a request coming from a client. We implement MMI requests
-//  directly here (at present, we implement only the mmi.service request):
+//  directly here: mmi.service, and mmi.queue, which answers "200" and then
+//  queue statistics as name and value pairs.
+//  We take over the sender frame as the reply envelope, so the request
+//  frames travel on to the worker without being copied. MMI queries only
+//  look services up, they never create them:
 
 static void
-s_broker_client_msg(broker_t *self, zframe_t *sender, zmsg_t *msg, bool clear)
+s_broker_client_msg(broker_t *self, zframe_t **sender_p, zmsg_t *msg, bool clear, bool props)
 {
-    assert(zmsg_size(msg) >= 2); //  Service name + body
+    if (!s_broker_valid(self, msg, props ? 3 : 2, props)) //  Service name + properties + body
+    {
+        zmsg_destroy(&msg);
+        return;
+    }
 
     zframe_t *service_frame = zmsg_pop(msg);
-    service_t *service = s_service_require(self, service_frame);
+    if (!s_broker_client_admit(self, *sender_p, clear))
+    {
+        s_broker_client_refuse(self, sender_p, &service_frame, clear, props);
+        zmsg_destroy(&msg);
+        return;
+    }
+    int64_t deadline = 0;
+    int priority = IDP_PRIORITY_NORMAL;
+    zframe_t *idempotency_key = NULL;
+    if (props)
+    {
+        //  IDPC02 requests carry properties after the service name. A TTL
+        //  becomes the request deadline, counted from when we received it
+        //  and cut to REQUEST_MAX_TTL so the deadline cannot overflow, and
+        //  a priority picks the class the request queues in
+        zframe_t *props_frame = zmsg_pop(msg);
+        uint64_t value;
+        size_t size;
+        const byte *data = idprops_get(props_frame, IDP_PROP_IDEMPOTENCY_KEY, &size);
+        if (data && size)
+            idempotency_key = s_idempotency_scope(*sender_p, clear, data, size);
+        if (idprops_get_uint(props_frame, IDP_PROP_TTL, &value))
+            deadline = self->_now + (int64_t)(value < REQUEST_MAX_TTL ? value : REQUEST_MAX_TTL);
+        if (idprops_get_uint(props_frame, IDP_PROP_PRIORITY, &value))
+            priority = value < IDP_PRIORITY_CLASSES ? (int)value : IDP_PRIORITY_LOW;
+        zframe_destroy(&props_frame);
+    }
 
     //  Set reply return address to client sender
-    zmsg_wrap(msg, zframe_dup(sender));
+    zmsg_wrap(msg, *sender_p);
+    *sender_p = NULL;
 
     //  If we got a MMI service request, process that internally
     if (zframe_size(service_frame) >= 4 && memcmp(zframe_data(service_frame), "mmi.", 4) == 0)
     {
         char *return_code;
+        service_t *queue = NULL; //  Service to report queue stats for
         if (zframe_streq(service_frame, "mmi.service"))
         {
-            char *name = zframe_strdup(zmsg_last(msg));
-            service_t *service =
-                (service_t *)zhash_lookup(self->_services, name);
+            service_t *service = s_service_lookup(self, zmsg_last(msg));
             return_code = service && service->_workers ? "200" : "404";
-            free(name);
+        }
+        else if (zframe_streq(service_frame, "mmi.queue"))
+        {
+            queue = s_service_lookup(self, zmsg_last(msg));
+            return_code = queue ? "200" : "404";
         }
         else
             return_code = "501";
 
         zframe_reset(zmsg_last(msg), return_code, strlen(return_code));
+        if (queue)
+        {
+            //  Queue statistics as name and value frame pairs. Clients skip
+            //  names they do not know, so counters can be added freely
+            s_mmi_stat(msg, "queued", idlist_size(&queue->_requests));
+            s_mmi_stat(msg, "queued_bytes", queue->_queued_bytes);
+            s_mmi_stat(msg, "rejected", queue->_rejected);
+            s_mmi_stat(msg, "workers", queue->_workers);
+            s_mmi_stat(msg, "dropped", queue->_dropped);
+            s_mmi_stat(msg, "expired", queue->_expired);
+            s_mmi_stat(msg, "cache_hits", queue->_cache_hits);
+            s_mmi_stat(msg, "cache_misses", queue->_cache_misses);
+            s_mmi_stat(msg, "cache_bytes", queue->_cache_bytes);
+            s_mmi_stat(msg, "flights", queue->_flights_started);
+            s_mmi_stat(msg, "coalesced", queue->_coalesced);
+            s_mmi_stat(msg, "resends", queue->_resends);
+            s_mmi_stat(msg, "reassigned", queue->_reassigned);
+            s_mmi_stat(msg, "hedged", queue->_hedged);
+            s_mmi_stat(msg, "hedge_wins", queue->_hedge_wins);
+            s_mmi_stat(msg, "ejected", queue->_ejected);
+            s_mmi_stat(msg, "ejections", queue->_ejections);
+            s_mmi_stat(msg, "breaker_open", queue->_breaker_open);
+            s_mmi_stat(msg, "short_circuited", queue->_short_circuited);
+            size_t fair_queues = 0;
+            int priority;
+            for (priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+                fair_queues += idlist_size(&queue->_fair[priority]);
+            s_mmi_stat(msg, "fair_queues", fair_queues);
+        }
 
         //  Remove & save client return envelope and insert the
         //  protocol header and service name, then rewrap envelope.
         zframe_t *client = zmsg_unwrap(msg);
-        zmsg_push(msg, zframe_dup(service_frame));
+        zmsg_push(msg, service_frame);
         zmsg_pushstr(msg, IDPC_CLIENT);
         zmsg_wrap(msg, client);
         zmsg_send(&msg, clear ? self->_clear_socket : self->_curve_socket);
+        zframe_destroy(&idempotency_key);
     }
     else
-        //  Else dispatch the message to the requested service
-        s_service_dispatch(service, msg, clear);
-    zframe_destroy(&service_frame);
+    {
+        //  Else treat it as a resend, answer from the cache, join a
+        //  flight, or dispatch the message to the requested service
+        service_t *service = s_service_require(self, service_frame);
+        zframe_destroy(&service_frame);
+        if (idempotency_key && !service->_limits._idempotency_keys)
+            zframe_destroy(&idempotency_key);
+        //  A request whose idempotency key we know is a resend: it waits
+        //  for the request that first carried the key, or gets its reply
+        if (idempotency_key && s_service_idempotency_answer(service, idempotency_key, msg, clear, props, deadline, priority))
+        {
+            zframe_destroy(&idempotency_key);
+            return;
+        }
+        //  A cached fresh reply answers the request right here; in single
+        //  flight mode it parks on an identical request already queued or
+        //  with a worker
+        zframe_t *key = NULL;
+        if (service->_limits._cache_max_bytes || service->_limits._coalesce)
+        {
+            key = s_service_request_key(msg);
+            if ((service->_limits._cache_max_bytes && s_service_cache_answer(service, key, msg, clear)) ||
+                (service->_limits._coalesce && s_service_flight_join(service, key, msg, clear, props, deadline, priority)))
+            {
+                zframe_destroy(&key);
+                zframe_destroy(&idempotency_key);
+                return;
+            }
+        }
+        s_service_dispatch(service, msg, clear, props, deadline, priority, key, idempotency_key);
+    }
 }
 
-//  .split broker purge method
-//  The purge method deletes any idle workers that haven't pinged us in a
-//  while. We hold workers from oldest to most recent, so we can stop
-//  scanning whenever we find a live worker. This means we'll mainly stop
-//  at the first worker, which is essential when we have large numbers of
-//  workers (since we call this method in our critical path):
+//  .split broker configuration
+//  By default a worker may hold a request for as long as it likes; worker
+//  APIs send no heartbeats while a request runs, so busy workers do not
+//  expire. A request timeout makes the broker drop workers that sit on a
+//  request for longer than that, in msecs, which is also how the requests
+//  of a worker that died busy get requeued. With credit, that is the
+//  oldest of the requests the worker holds:
 
 static void
-s_broker_purge(broker_t *self)
+s_broker_set_request_timeout(broker_t *self, int timeout)
 {
-    worker_t *worker = (worker_t *)zlist_first(self->_waiting);
-    while (worker)
-    {
-        if (zclock_time() < worker->_expiry)
-            break; //  Worker is alive, we're done here
-        if (self->_verbose)
-            zclock_log("I: deleting expired worker: %s",
-                       worker->_identity);
-
-        s_worker_delete(worker, 0);
-        worker = (worker_t *)zlist_first(self->_waiting);
-    }
+    assert(self);
+    self->_request_timeout = timeout > 0 ? timeout : 0;
 }
 
-//  .split service methods
-//  Here is the implementation of the methods that work on a service:
-
-//  Lazy constructor that locates a service by name, or creates a new
-//  service if there is no service already with that name.
+//  Every name a client sends creates a service, typos included. A service
+//  that has no workers is forgotten once no client has asked for it for
+//  the idle timeout, in msecs, unless requests are still queued on it; 0
+//  keeps services forever. With a limit on services without workers,
+//  creating one more forgets the one clients asked for least recently,
+//  refusing its queued requests with status 503.
 
-static service_t *
-s_service_require(broker_t *self, zframe_t *service_frame)
+static void
+s_broker_set_service_idle_timeout(broker_t *self, int64_t timeout)
 {
-    assert(service_frame);
-    char *name = zframe_strdup(service_frame);
-
-    service_t *service =
-        (service_t *)zhash_lookup(self->_services, name);
-    if (service == NULL)
-    {
-        service = (service_t *)zmalloc(sizeof(service_t));
-        service->_broker = self;
-        service->_name = name;
-        service->_requests = zlist_new();
-        service->_waiting = zlist_new();
-        zhash_insert(self->_services, name, service);
-        zhash_freefn(self->_services, name, s_service_destroy);
-        if (self->_verbose)
-            zclock_log("I: added service: %s", name);
-    }
-    else
-        free(name);
-
-    return service;
+    assert(self);
+    self->_service_idle_timeout = timeout > 0 ? timeout : 0;
 }
 
-//  Service destructor is called automatically whenever the service is
-//  removed from broker->_services.
-
 static void
-s_service_destroy(void *argument)
+s_broker_set_max_idle_services(broker_t *self, size_t max_services)
 {
-    service_t *service = (service_t *)argument;
-    while (zlist_size(service->_requests))
-    {
-        request_t *req = zlist_pop(service->_requests);
-        zmsg_t *msg = req->_msg;
-        zmsg_destroy(&msg);
-        free(req);
-    }
-    zlist_destroy(&service->_requests);
-    zlist_destroy(&service->_waiting);
-    free(service->_name);
-    free(service);
+    assert(self);
+    self->_max_idle_services = max_services;
 }
 
-//  .split service dispatch method
-//  The dispatch method sends requests to waiting workers:
+//  Set the queue limits for services that have none of their own. This
+//  applies to services created from now on.
 
 static void
-s_service_dispatch(service_t *self, zmsg_t *msg, bool clear)
+s_broker_set_default_service_limits(broker_t *self, size_t max_requests, size_t max_bytes)
 {
     assert(self);
-    if (msg) //  Queue message if any
-    {
-        request_t *req = (request_t *)malloc(sizeof(request_t));
-        req->_msg = msg;
-        req->_clear = clear;
-        zlist_append(self->_requests, req);
-    }
-
-    s_broker_purge(self->_broker);
-    while (zlist_size(self->_waiting) && zlist_size(self->_requests))
-    {
-        worker_t *worker = zlist_pop(self->_waiting);
-        zlist_remove(self->_broker->_waiting, worker);
-        request_t *req = zlist_pop(self->_requests);
-        ;
-        zmsg_t *msg = req->_msg;
-        s_worker_send(worker, (req->_clear ? IDPW_REQUEST : IDPW_REQUEST_CURVE), NULL, msg);
-        zmsg_destroy(&msg);
-        free(req);
-    }
+    self->_service_defaults._max_requests = max_requests;
+    self->_service_defaults._max_bytes = max_bytes;
 }
 
-//  .split worker methods
-//  Here is the implementation of the methods that work on a worker:
-
-//  Lazy constructor that locates a worker by identity, or creates a new
-//  worker if there is no worker already with that identity.
+//  Limits set for a named service, created from the defaults if the
+//  service has none yet
 
-static worker_t *
-s_worker_require(broker_t *self, zframe_t *address, bool clear)
+static service_limits_t *
+s_broker_service_limits_require(broker_t *self, const char *name)
 {
-    assert(address);
-
-    //  self->_workers is keyed off worker identity
-    char *identity = zframe_strhex(address);
-    worker_t *worker =
-        (worker_t *)zhash_lookup(self->_workers, identity);
-
-    if (worker == NULL)
+    service_limits_t *limits = (service_limits_t *)zhash_lookup(self->_service_limits, name);
+    if (!limits)
     {
-        worker = (worker_t *)zmalloc(sizeof(worker_t));
-        worker->_broker = self;
-        worker->_identity = identity;
-        worker->_address = zframe_dup(address);
-        worker->_socket = clear ? &self->_clear_socket : &self->_curve_socket;
-        zhash_insert(self->_workers, identity, worker);
-        zhash_freefn(self->_workers, identity, s_worker_destroy);
-        if (self->_verbose)
-            zclock_log("I: registering new worker: %s", identity);
+        limits = (service_limits_t *)zmalloc(sizeof(service_limits_t));
+        *limits = self->_service_defaults;
+        zhash_insert(self->_service_limits, name, limits);
+        zhash_freefn(self->_service_limits, name, free);
     }
-    else
-        free(identity);
-    return worker;
+    return limits;
 }
 
-//  The delete method deletes the current worker.
-
 static void
-s_worker_delete(worker_t *self, int disconnect)
+s_broker_service_limits_apply(broker_t *self, const char *name, service_limits_t *limits)
 {
-    assert(self);
-    if (disconnect)
-        s_worker_send(self, IDPW_DISCONNECT, NULL, NULL);
-
-    if (self->_service)
+    service_t *service = (service_t *)idtable_lookup(self->_services, (const byte *)name, strlen(name),
+                                                     idtable_hash((const byte *)name, strlen(name)));
+    if (service)
     {
-        zlist_remove(self->_service->_waiting, self);
-        self->_service->_workers--;
+        bool fair = service->_limits._fair;
+        service->_limits = *limits;
+        if (service->_limits._fair != fair)
+            s_service_queues_rebuild(service);
+        s_service_cache_trim(service, 0);
+        s_service_idempotency_trim(service, 0);
+        //  A breaker waiting for a worker closes if the grace period is
+        //  turned off; a closed one restarts its grace period
+        if (!service->_breaker_open || (!idtimer_armed(&service->_breaker_timer) && !service->_limits._breaker_grace))
+            s_service_breaker_close(service);
     }
-    zlist_remove(self->_broker->_waiting, self);
-    //  This implicitly calls s_worker_destroy
-    zhash_delete(self->_broker->_workers, self->_identity);
 }
 
-//  Worker destructor is called automatically whenever the worker is
-//  removed from broker->_workers.
+//  Set the queue limits for one service, whether or not it exists yet
 
 static void
-s_worker_destroy(void *argument)
+s_broker_set_service_limits(broker_t *self, const char *name, size_t max_requests, size_t max_bytes)
 {
-    worker_t *self = (worker_t *)argument;
-    zframe_destroy(&self->_address);
-    free(self->_identity);
-    free(self);
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_max_requests = max_requests;
+    limits->_max_bytes = max_bytes;
+    s_broker_service_limits_apply(self, name, limits);
 }
 
-//  .split worker send method
-//  The send method formats and sends a command to a worker. The caller may
-//  also provide a command option, and a message payload:
+//  Set the CoDel target and interval, in msecs, for services that have
+//  none of their own, or for one service. Requests CoDel drops get a
+//  status 503 reply. A target of 0 turns CoDel off.
 
 static void
-s_worker_send(worker_t *self, char *command, char *option, zmsg_t *msg)
+s_broker_set_default_service_codel(broker_t *self, int64_t target, int64_t interval)
 {
-    msg = msg ? zmsg_dup(msg) : zmsg_new();
+    assert(self);
+    self->_service_defaults._codel_target = target > 0 ? target : 0;
+    self->_service_defaults._codel_interval = interval > 0 ? interval : SERVICE_CODEL_INTERVAL;
+}
 
-    //  Stack protocol envelope to start of message
-    if (option)
-        zmsg_pushstr(msg, option);
-    zmsg_pushstr(msg, command);
-    zmsg_pushstr(msg, IDPW_WORKER);
+static void
+s_broker_set_service_codel(broker_t *self, const char *name, int64_t target, int64_t interval)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_codel_target = target > 0 ? target : 0;
+    limits->_codel_interval = interval > 0 ? interval : SERVICE_CODEL_INTERVAL;
+    s_broker_service_limits_apply(self, name, limits);
+}
 
-    //  Stack routing envelope to start of message
-    zmsg_wrap(msg, zframe_dup(self->_address));
+//  Set the balancing strategy, one of BALANCE_*, for services that have
+//  none of their own, or for one service. A service that exists switches
+//  strategy from its next dispatch on.
 
-    if (self->_broker->_verbose)
-    {
-        zclock_log("I: sending %s to worker",
-                   idps_commands[(int)*command]);
-        zmsg_dump(msg);
-    }
-    zmsg_send(&msg, *(self->_socket));
+static void
+s_broker_set_default_service_balance(broker_t *self, int balance)
+{
+    assert(self);
+    self->_service_defaults._balance = balance >= 0 && balance < BALANCE_STRATEGIES ? balance : BALANCE_ROUND_ROBIN;
 }
 
-//  This worker is now waiting for work
-
 static void
-s_worker_waiting(worker_t *self)
+s_broker_set_service_balance(broker_t *self, const char *name, int balance)
 {
-    //  Queue to broker and service waiting lists
-    assert(self->_broker);
-    zlist_append(self->_broker->_waiting, self);
-    zlist_append(self->_service->_waiting, self);
-    self->_expiry = zclock_time() + HEARTBEAT_EXPIRY;
-    s_service_dispatch(self->_service, NULL, true);
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_balance = balance >= 0 && balance < BALANCE_STRATEGIES ? balance : BALANCE_ROUND_ROBIN;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Let services that have no setting of their own, or one service, cache
+//  replies their workers mark cacheable, up to max_bytes of replies and
+//  request keys. 0 turns the cache off. Shrinking the cache of a service
+//  evicts its least recently used replies at once.
+
+static void
+s_broker_set_default_service_cache(broker_t *self, size_t max_bytes)
+{
+    assert(self);
+    self->_service_defaults._cache_max_bytes = max_bytes;
+}
+
+static void
+s_broker_set_service_cache(broker_t *self, const char *name, size_t max_bytes)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_cache_max_bytes = max_bytes;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Turn single flight on or off for services that have no setting of
+//  their own, or for one service. While a request is queued or with a
+//  worker, identical requests wait for its reply instead of queueing. Only
+//  for services whose replies depend on the request alone.
+
+static void
+s_broker_set_default_service_coalesce(broker_t *self, bool coalesce)
+{
+    assert(self);
+    self->_service_defaults._coalesce = coalesce;
+}
+
+static void
+s_broker_set_service_coalesce(broker_t *self, const char *name, bool coalesce)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_coalesce = coalesce;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Set how many idempotency keys services that have no setting of their
+//  own, or one service, remember, and for how many msecs after the reply.
+//  0 keys makes the service ignore them. Past the limit the oldest keys
+//  are forgotten, answered or not.
+
+static void
+s_broker_set_default_service_idempotency(broker_t *self, size_t max_keys, int64_t window)
+{
+    assert(self);
+    self->_service_defaults._idempotency_keys = max_keys;
+    self->_service_defaults._idempotency_window = window > 0 ? window : 0;
+}
+
+static void
+s_broker_set_service_idempotency(broker_t *self, const char *name, size_t max_keys, int64_t window)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_idempotency_keys = max_keys;
+    limits->_idempotency_window = window > 0 ? window : 0;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Set how many workers a request may be sent to, for services that have
+//  no setting of their own, or for one service. When a worker holding a
+//  request disconnects, expires or passes the request timeout, the
+//  request goes back to the front of the queue until it has been sent
+//  this many times. Above 1, the broker keeps a copy of each request
+//  while a worker has it.
+
+static void
+s_broker_set_default_service_attempts(broker_t *self, int attempts)
+{
+    assert(self);
+    self->_service_defaults._max_attempts = attempts > 1 ? attempts : 1;
+}
+
+static void
+s_broker_set_service_attempts(broker_t *self, const char *name, int attempts)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_max_attempts = attempts > 1 ? attempts : 1;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Let services that have no setting of their own, or one service, hedge
+//  up to budget requests in a hundred: a request with a worker for longer
+//  than 95% of recent requests took gets a copy sent to an idle worker,
+//  and the first reply wins. 0 turns hedging off. Only for services whose
+//  requests may safely run twice; the broker keeps a copy of each request
+//  while a worker has it.
+
+static void
+s_broker_set_default_service_hedge(broker_t *self, int budget)
+{
+    assert(self);
+    self->_service_defaults._hedge_budget = budget > 0 ? budget : 0;
+}
+
+static void
+s_broker_set_service_hedge(broker_t *self, const char *name, int budget)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_hedge_budget = budget > 0 ? budget : 0;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Let services that have no setting of their own, or one service, eject
+//  workers whose average service time grows to factor times the median
+//  of the service, or that are lost to the heartbeat or request timeout.
+//  An ejected worker gets no requests for backoff msecs, doubling with
+//  each strike, then one request at a time until it has answered
+//  SERVICE_PROBE_REQUESTS of them in time. At most half of the workers of
+//  a service are ejected at once. A factor of 0 turns ejection off, and a
+//  backoff of 0 takes SERVICE_OUTLIER_BACKOFF.
+
+static void
+s_broker_set_default_service_outliers(broker_t *self, int factor, int64_t backoff)
+{
+    assert(self);
+    self->_service_defaults._outlier_factor = factor > 0 ? factor : 0;
+    self->_service_defaults._outlier_backoff = backoff > 0 ? backoff : SERVICE_OUTLIER_BACKOFF;
+}
+
+static void
+s_broker_set_service_outliers(broker_t *self, const char *name, int factor, int64_t backoff)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_outlier_factor = factor > 0 ? factor : 0;
+    limits->_outlier_backoff = backoff > 0 ? backoff : SERVICE_OUTLIER_BACKOFF;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Give services that have no setting of their own, or one service, a
+//  circuit breaker. It opens once the service has had no workers for grace
+//  msecs, and stays open until a worker registers. With an error rate, it
+//  also opens when that percent of the requests workers took were lost
+//  with them, for SERVICE_BREAKER_COOLDOWN msecs or until a worker
+//  registers. While open, queued requests and new ones get status 503 at once
+//  instead of waiting out the client timeout. 0 turns either trigger off.
+
+static void
+s_broker_set_default_service_breaker(broker_t *self, int64_t grace, int error_rate)
+{
+    assert(self);
+    self->_service_defaults._breaker_grace = grace > 0 ? grace : 0;
+    self->_service_defaults._breaker_error_rate = error_rate > 0 ? error_rate : 0;
+}
+
+static void
+s_broker_set_service_breaker(broker_t *self, const char *name, int64_t grace, int error_rate)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_breaker_grace = grace > 0 ? grace : 0;
+    limits->_breaker_error_rate = error_rate > 0 ? error_rate : 0;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  Turn fair queuing on or off for services that have no setting of their
+//  own, or for one service. Each client gets a queue of its own in every
+//  priority class, and clients take turns. Requests already queued move to
+//  the new queues, oldest first.
+
+static void
+s_broker_set_default_service_fair(broker_t *self, bool fair)
+{
+    assert(self);
+    self->_service_defaults._fair = fair;
+}
+
+static void
+s_broker_set_service_fair(broker_t *self, const char *name, bool fair)
+{
+    assert(self);
+    assert(name);
+    service_limits_t *limits = s_broker_service_limits_require(self, name);
+    limits->_fair = fair;
+    s_broker_service_limits_apply(self, name, limits);
+}
+
+//  In fair queuing mode a client sends as many requests per turn as its
+//  weight, 1 unless set here. A client is named by its identity, or on the
+//  CURVE socket by its public key in Z85 if the broker authenticates
+//  clients. Weights apply to client queues created from now on; a weight
+//  of 0 or less goes back to 1.
+
+static void
+s_broker_set_client_weight(broker_t *self, const char *client, int weight)
+{
+    assert(self);
+    assert(client);
+    zhash_delete(self->_client_weights, client);
+    if (weight > 1)
+    {
+        uint32_t *value = (uint32_t *)zmalloc(sizeof(uint32_t));
+        *value = (uint32_t)weight;
+        zhash_insert(self->_client_weights, client, value);
+        zhash_freefn(self->_client_weights, client, free);
+    }
+}
+
+//  Limit how many requests each client may send, in requests per second,
+//  with bursts of up to burst requests; a burst of 0 allows one second's
+//  worth. Requests past the limit get status 429 before we look at the service
+//  they name. Clients are named as for s_broker_set_client_weight. A rate
+//  of 0 turns the limit off, for every client or for the one named;
+//  limits apply from each client's next request, with a full bucket.
+
+static void
+s_broker_set_default_client_rate(broker_t *self, int rate, int burst)
+{
+    assert(self);
+    self->_rate_generation++;
+    self->_client_rate._rate = rate > 0 ? rate : 0;
+    self->_client_rate._burst = burst > 0 ? burst : self->_client_rate._rate;
+}
+
+static void
+s_broker_set_client_rate(broker_t *self, const char *client, int rate, int burst)
+{
+    assert(self);
+    assert(client);
+    self->_rate_generation++;
+    rate_limit_t *limit = (rate_limit_t *)zhash_lookup(self->_client_rates, client);
+    if (!limit)
+    {
+        limit = (rate_limit_t *)zmalloc(sizeof(rate_limit_t));
+        zhash_insert(self->_client_rates, client, limit);
+        zhash_freefn(self->_client_rates, client, free);
+    }
+    limit->_rate = rate > 0 ? rate : 0;
+    limit->_burst = burst > 0 ? burst : limit->_rate;
+}
+
+//  Queue statistics for a service; returns false if there is no such
+//  service.
+
+static bool
+s_broker_service_stats(broker_t *self, const char *name, service_stats_t *stats)
+{
+    assert(self);
+    assert(name);
+    service_t *service = (service_t *)idtable_lookup(self->_services, (const byte *)name, strlen(name),
+                                                     idtable_hash((const byte *)name, strlen(name)));
+    if (!service)
+        return false;
+    stats->_queued = idlist_size(&service->_requests);
+    stats->_queued_bytes = service->_queued_bytes;
+    stats->_workers = service->_workers;
+    stats->_waiting = idlist_size(&service->_waiting);
+    stats->_rejected = service->_rejected;
+    stats->_dropped = service->_dropped;
+    stats->_expired = service->_expired;
+    stats->_cache_hits = service->_cache_hits;
+    stats->_cache_misses = service->_cache_misses;
+    stats->_cache_entries = service->_cache ? idtable_size(service->_cache) : 0;
+    stats->_cache_bytes = service->_cache_bytes;
+    stats->_flights = service->_flights_started;
+    stats->_coalesced = service->_coalesced;
+    stats->_idempotency_keys = service->_idempotency ? idtable_size(service->_idempotency) : 0;
+    stats->_resends = service->_resends;
+    stats->_reassigned = service->_reassigned;
+    stats->_hedged = service->_hedged;
+    stats->_hedge_wins = service->_hedge_wins;
+    stats->_service_time_p95 = s_service_latency_percentile(service, 95);
+    stats->_ejected = service->_ejected;
+    stats->_ejections = service->_ejections;
+    stats->_breaker_open = service->_breaker_open;
+    stats->_short_circuited = service->_short_circuited;
+    stats->_fair_queues = 0;
+    int priority;
+    for (priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+    {
+        stats->_fair_queues += idlist_size(&service->_fair[priority]);
+        stats->_queued_class[priority] = service->_queued[priority];
+    }
+    memcpy(stats->_wait, service->_wait, sizeof(stats->_wait));
+    return true;
+}
+
+//  Rate limit counters for a client, named as for s_broker_set_client_rate;
+//  returns false if we have not seen it or forgot it. We remember the
+//  CLIENT_MAX_BUCKETS clients seen most recently.
+
+static bool
+s_broker_client_stats(broker_t *self, const char *client, client_stats_t *stats)
+{
+    assert(self);
+    assert(client);
+    bucket_t *bucket = (bucket_t *)idtable_lookup(self->_buckets, (const byte *)client, strlen(client),
+                                                  idtable_hash((const byte *)client, strlen(client)));
+    if (!bucket)
+        return false;
+    stats->_admitted = bucket->_admitted;
+    stats->_rejected = bucket->_rejected;
+    stats->_rate = bucket->_rate;
+    stats->_burst = bucket->_burst;
+    return true;
+}
+
+//  .split service methods
+//  Here is the implementation of the methods that work on a service:
+
+//  Locates a service by the raw bytes of its name frame, without
+//  allocating; returns NULL if there is no such service.
+
+static service_t *
+s_service_lookup(broker_t *self, zframe_t *service_frame)
+{
+    assert(service_frame);
+    return (service_t *)idtable_lookup(self->_services, zframe_data(service_frame), zframe_size(service_frame),
+                                       idtable_hash(zframe_data(service_frame), zframe_size(service_frame)));
+}
+
+//  Lazy constructor that locates a service by name, or creates a new
+//  service if there is no service already with that name. Only creating
+//  a service allocates: its name string and the frames replies reuse.
+
+static service_t *
+s_service_require(broker_t *self, zframe_t *service_frame)
+{
+    assert(service_frame);
+    uint32_t hash = idtable_hash(zframe_data(service_frame), zframe_size(service_frame));
+    service_t *service =
+        (service_t *)idtable_lookup(self->_services, zframe_data(service_frame), zframe_size(service_frame), hash);
+    if (service == NULL)
+    {
+        service = (service_t *)idpool_alloc(self->_service_pool);
+        service->_broker = self;
+        service->_name = zframe_strdup(service_frame);
+        service->_hash = hash;
+        service->_name_frame = zframe_dup(service_frame);
+        service->_header_frame = zframe_new(IDPC_CLIENT, strlen(IDPC_CLIENT));
+        service_limits_t *limits = (service_limits_t *)zhash_lookup(self->_service_limits, service->_name);
+        service->_limits = limits ? *limits : self->_service_defaults;
+        idlist_init(&service->_requests);
+        idlist_init(&service->_waiting);
+        idlist_init(&service->_cache_lru);
+        idlist_init(&service->_idempotency_age);
+        idlist_init(&service->_outliers_lost);
+        int priority;
+        for (priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+            idlist_init(&service->_fair[priority]);
+        idtimer_init(&service->_breaker_timer, s_service_breaker_expired, service);
+        s_service_breaker_arm(service);
+        idlist_link_init(&service->_idle_link, service);
+        idtable_insert(self->_services, zframe_data(service_frame), zframe_size(service_frame), hash, service);
+        if (self->_verbose)
+            zclock_log("I: added service: %s", service->_name);
+        s_service_idle(service);
+        s_broker_services_trim(self);
+    }
+    else if (service->_workers == 0)
+        s_service_idle(service);
+    return service;
+}
+
+//  Put the protocol header and service name in front of a reply. Names
+//  and header fit in a ZeroMQ very small message, so duplicating the
+//  prebuilt frames is a fixed size copy with no lookup or strlen.
+
+static void
+s_service_reply_envelope(service_t *self, zmsg_t *msg)
+{
+    zmsg_push(msg, zframe_dup(self->_name_frame));
+    zmsg_push(msg, zframe_dup(self->_header_frame));
+}
+
+//  Service destructor is called for every service when broker->_services
+//  is destroyed, and when an idle service is evicted.
+
+static void
+s_service_destroy(void *argument)
+{
+    service_t *service = (service_t *)argument;
+    broker_t *broker = service->_broker;
+    idwheel_cancel(broker->_timers, &service->_breaker_timer);
+    request_t *req;
+    while ((req = (request_t *)idlist_pop(&service->_requests)))
+    {
+        zmsg_destroy(&req->_msg);
+        s_request_free(broker, req);
+    }
+    cache_entry_t *entry;
+    while ((entry = (cache_entry_t *)idlist_first(&service->_cache_lru)))
+        s_service_cache_evict(service, entry);
+    idtable_destroy(&service->_cache);
+    idtable_destroy(&service->_flights);
+    idempotency_entry_t *idempotency;
+    while ((idempotency = (idempotency_entry_t *)idlist_first(&service->_idempotency_age)))
+        s_service_idempotency_evict(service, idempotency);
+    idtable_destroy(&service->_idempotency);
+    idtable_destroy(&service->_outliers);
+    int priority;
+    for (priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+    {
+        idheap_release(&service->_queues[priority]);
+        idtable_destroy(&service->_flows[priority]);
+    }
+    zframe_destroy(&service->_name_frame);
+    zframe_destroy(&service->_header_frame);
+    free(service->_name);
+    idpool_free(broker->_service_pool, service);
+}
+
+//  .split idle services
+//  Services without workers are kept on a list, the one clients asked for
+//  least recently first. A timer forgets them once they have been idle for
+//  the timeout, and creating a service past the limit forgets the first:
+
+static void
+s_service_idle(service_t *self)
+{
+    broker_t *broker = self->_broker;
+    idlist_remove(&broker->_idle_services, &self->_idle_link);
+    self->_idle_since = broker->_now;
+    idlist_append(&broker->_idle_services, &self->_idle_link);
+    s_broker_services_reap_arm(broker);
+}
+
+static void
+s_broker_services_reap_arm(broker_t *self)
+{
+    service_t *service = (service_t *)idlist_first(&self->_idle_services);
+    if (service && self->_service_idle_timeout && !idtimer_armed(&self->_idle_timer))
+        idwheel_arm(self->_timers, &self->_idle_timer, service->_idle_since + self->_service_idle_timeout);
+}
+
+//  Called by the timer wheel when the first idle service may have timed
+//  out; one that still has requests queued gets another timeout
+
+static void
+s_broker_services_reap(idtimer_t *timer, void *argument)
+{
+    (void)timer;
+    broker_t *self = (broker_t *)argument;
+    service_t *service;
+    while ((service = (service_t *)idlist_first(&self->_idle_services))
+           && service->_idle_since + self->_service_idle_timeout <= self->_now)
+    {
+        if (idlist_size(&service->_requests))
+            s_service_idle(service);
+        else
+            s_service_evict(service);
+    }
+    s_broker_services_reap_arm(self);
+}
+
+static void
+s_broker_services_trim(broker_t *self)
+{
+    while (self->_max_idle_services && idlist_size(&self->_idle_services) > self->_max_idle_services)
+        s_service_evict((service_t *)idlist_first(&self->_idle_services));
+}
+
+//  Forget a service that has no workers
+
+static void
+s_service_evict(service_t *self)
+{
+    broker_t *broker = self->_broker;
+    assert(self->_workers == 0);
+    if (broker->_verbose)
+        zclock_log("I: removed idle service: %s", self->_name);
+    s_service_flush(self);
+    idlist_remove(&broker->_idle_services, &self->_idle_link);
+    idtable_delete(broker->_services, zframe_data(self->_name_frame), zframe_size(self->_name_frame), self->_hash);
+    s_service_destroy(self);
+}
+
+//  .split balancing strategies
+//  Each strategy picks one of the waiting workers of a service, which is
+//  never empty when we ask. Only waiting workers are candidates, so a slow
+//  worker still gets requests whenever the faster ones are all busy, and
+//  its service time gets measured again. Ties go to the worker that has
+//  waited longest:
+
+static worker_t *
+s_balance_round_robin(service_t *self)
+{
+    return (worker_t *)idlist_first(&self->_waiting);
+}
+
+//  Workers rejoin the waiting list at the tail, so the last one has just
+//  finished a request. With credit it also keeps getting requests until
+//  its credit runs out, instead of each going to another worker.
+
+static worker_t *
+s_balance_lifo(service_t *self)
+{
+    return (worker_t *)idlist_last(&self->_waiting);
+}
+
+static worker_t *
+s_balance_least_outstanding(service_t *self)
+{
+    worker_t *chosen = (worker_t *)idlist_first(&self->_waiting);
+    worker_t *worker;
+    for (worker = chosen; worker; worker = (worker_t *)idlist_next(&worker->_service_link))
+        if (idlist_size(&worker->_in_flight) < idlist_size(&chosen->_in_flight))
+            chosen = worker;
+    return chosen;
+}
+
+//  Expected wait for a new request on each worker is its service time
+//  times the requests it already holds, plus one. Workers not yet measured
+//  count as fastest, so they get tried.
+
+static worker_t *
+s_balance_ewma(service_t *self)
+{
+    worker_t *chosen = NULL;
+    int64_t best = 0;
+    worker_t *worker;
+    for (worker = (worker_t *)idlist_first(&self->_waiting); worker; worker = (worker_t *)idlist_next(&worker->_service_link))
+    {
+        int64_t cost = worker->_service_time * (int64_t)(idlist_size(&worker->_in_flight) + 1);
+        if (!chosen || cost < best)
+        {
+            chosen = worker;
+            best = cost;
+        }
+    }
+    return chosen;
+}
+
+static worker_t *(*const s_balancers[BALANCE_STRATEGIES])(service_t *self) = {
+    s_balance_round_robin, s_balance_lifo, s_balance_least_outstanding, s_balance_ewma};
+
+//  .split service dispatch method
+//  The dispatch method sends requests to waiting workers. A request that
+//  would have to queue past the service limits is refused, and CoDel may
+//  drop the oldest requests before we hand any out. Requests whose client
+//  has stopped waiting are dropped without a reply, and IDPW02 workers get
+//  the msecs the client has left. Each priority class queues earliest
+//  deadline first; requests without a deadline follow those with one, in
+//  arrival order. A request that queues takes its idempotency key along,
+//  so resends can find it:
+
+static void
+s_service_dispatch(service_t *self, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority, zframe_t *key, zframe_t *idempotency_key)
+{
+    assert(self);
+    broker_t *broker = self->_broker;
+    if (msg) //  Queue message if any
+    {
+        size_t size = zmsg_content_size(msg);
+        if (self->_breaker_open)
+        {
+            self->_short_circuited++;
+            s_service_reject(self, msg, clear, props);
+            zframe_destroy(&key);
+            zframe_destroy(&idempotency_key);
+            return;
+        }
+        if (idlist_size(&self->_waiting) == 0 && s_service_full(self, size))
+        {
+            self->_rejected++;
+            s_service_reject(self, msg, clear, props);
+            zframe_destroy(&key);
+            zframe_destroy(&idempotency_key);
+            return;
+        }
+        request_t *req = s_request_new(broker, msg, size, clear, props, deadline, priority);
+        req->_key = key;
+        s_service_enqueue(self, req);
+        if (key && self->_limits._coalesce)
+            s_service_flight_start(self, req);
+        if (idempotency_key)
+            s_service_idempotency_start(self, req, &idempotency_key);
+    }
+    if (self->_limits._codel_target)
+        s_service_codel(self);
+
+    while (idlist_size(&self->_waiting) && idlist_size(&self->_requests))
+    {
+        request_t *req = s_service_dequeue(self);
+        if (req->_deadline && req->_deadline <= broker->_now)
+        {
+            self->_expired++;
+            s_service_flight_retry(self, req);
+            zmsg_destroy(&req->_msg);
+            s_request_free(broker, req);
+            continue;
+        }
+        self->_wait[req->_priority][s_wait_bucket(broker->_now - req->_enqueued)]++;
+        s_worker_dispatch(s_balancers[self->_limits._balance](self), req);
+    }
+}
+
+//  Send a request to one of the service's waiting workers. While the
+//  request has attempts left or the service hedges, we keep a copy of it
+//  to send to another worker; hedge copies are never copied again.
+
+static void
+s_worker_dispatch(worker_t *self, request_t *req)
+{
+    service_t *service = self->_service;
+    broker_t *broker = self->_broker;
+    idlist_remove(&service->_waiting, &self->_service_link);
+    if (idlist_size(&self->_in_flight) == 0)
+    {
+        idwheel_cancel(broker->_timers, &self->_expiry_timer);
+        idwheel_cancel(broker->_timers, &self->_heartbeat_timer);
+        if (broker->_request_timeout)
+            idwheel_arm(broker->_timers, &self->_request_timer, broker->_now + broker->_request_timeout);
+    }
+    req->_worker = self;
+    req->_id = self->_next_id++;
+    req->_dispatched = broker->_now;
+    req->_sent = zclock_usecs();
+    req->_attempts++;
+    zmsg_t *copy = !req->_hedge && (req->_attempts < service->_limits._max_attempts || service->_limits._hedge_budget)
+                       ? zmsg_dup(req->_msg)
+                       : NULL;
+    if (self->_props)
+    {
+        idprops_t props;
+        idprops_init(&props);
+        if (req->_deadline)
+            idprops_put_uint(&props, IDP_PROP_TTL, req->_deadline - broker->_now);
+        idprops_put_uint(&props, IDP_PROP_REQUEST_ID, req->_id);
+        zmsg_push(req->_msg, idprops_frame(&props));
+    }
+    s_worker_send(self, (req->_clear ? IDPW_REQUEST : IDPW_REQUEST_CURVE), NULL, &req->_msg);
+    req->_msg = copy;
+    idlist_append(&self->_in_flight, &req->_link);
+    if (idlist_size(&self->_in_flight) < s_worker_capacity(self))
+        idlist_append(&service->_waiting, &self->_service_link);
+    if (service->_limits._hedge_budget && !req->_hedge)
+        s_service_hedge_arm(service, req);
+}
+
+//  .split service cache
+//  A service with a cache keys replies by the request frames, each
+//  prefixed by its size so different splits of the same bytes do not
+//  collide. The table is per service, so the service name is part of the
+//  key too. Stale replies stay until a request finds them or the least
+//  recently used replies are evicted to make room:
+
+static zframe_t *
+s_service_request_key(zmsg_t *msg)
+{
+    //  Skip the client envelope, address and empty delimiter
+    size_t size = 0;
+    zframe_t *frame;
+    zmsg_first(msg);
+    zmsg_next(msg);
+    for (frame = zmsg_next(msg); frame; frame = zmsg_next(msg))
+        size += 4 + zframe_size(frame);
+
+    zframe_t *key = zframe_new(NULL, size);
+    byte *data = zframe_data(key);
+    zmsg_first(msg);
+    zmsg_next(msg);
+    for (frame = zmsg_next(msg); frame; frame = zmsg_next(msg))
+    {
+        uint32_t length = (uint32_t)zframe_size(frame);
+        data[0] = (byte)(length >> 24);
+        data[1] = (byte)(length >> 16);
+        data[2] = (byte)(length >> 8);
+        data[3] = (byte)length;
+        memcpy(data + 4, zframe_data(frame), length);
+        data += 4 + length;
+    }
+    return key;
+}
+
+//  Answer a request from the cache if it holds a fresh reply; takes the
+//  request message if it does
+
+static bool
+s_service_cache_answer(service_t *self, zframe_t *key, zmsg_t *msg, bool clear)
+{
+    broker_t *broker = self->_broker;
+    cache_entry_t *entry = self->_cache
+                               ? (cache_entry_t *)idtable_lookup(self->_cache, zframe_data(key), zframe_size(key),
+                                                                 idtable_hash(zframe_data(key), zframe_size(key)))
+                               : NULL;
+    if (entry && entry->_expires <= broker->_now)
+    {
+        s_service_cache_evict(self, entry);
+        entry = NULL;
+    }
+    if (!entry)
+    {
+        self->_cache_misses++;
+        return false;
+    }
+    self->_cache_hits++;
+    idlist_remove(&self->_cache_lru, &entry->_link);
+    idlist_append(&self->_cache_lru, &entry->_link);
+
+    zframe_t *client = zmsg_unwrap(msg);
+    zmsg_destroy(&msg);
+    zmsg_t *reply = zmsg_dup(entry->_reply);
+    s_service_reply_envelope(self, reply);
+    zmsg_wrap(reply, client);
+    zmsg_send(&reply, clear ? broker->_clear_socket : broker->_curve_socket);
+    return true;
+}
+
+//  Keep a copy of a reply for max_age msecs; takes the key. Replies too
+//  big for the whole cache are not kept.
+
+static void
+s_service_cache_insert(service_t *self, zframe_t **key_p, zmsg_t *reply, int64_t max_age)
+{
+    broker_t *broker = self->_broker;
+    zframe_t *key = *key_p;
+    size_t size = zframe_size(key) + zmsg_content_size(reply);
+    if (size > self->_limits._cache_max_bytes)
+        return;
+    if (!self->_cache)
+        self->_cache = idtable_new();
+    uint32_t hash = idtable_hash(zframe_data(key), zframe_size(key));
+    cache_entry_t *entry = (cache_entry_t *)idtable_lookup(self->_cache, zframe_data(key), zframe_size(key), hash);
+    if (entry)
+        s_service_cache_evict(self, entry);
+    s_service_cache_trim(self, size);
+
+    entry = (cache_entry_t *)idpool_alloc(broker->_cache_pool);
+    idlist_link_init(&entry->_link, entry);
+    entry->_key = key;
+    *key_p = NULL;
+    entry->_hash = hash;
+    entry->_reply = zmsg_dup(reply);
+    entry->_size = size;
+    entry->_expires = broker->_now + max_age;
+    idtable_insert(self->_cache, zframe_data(key), zframe_size(key), hash, entry);
+    idlist_append(&self->_cache_lru, &entry->_link);
+    self->_cache_bytes += size;
+}
+
+//  Evict least recently used replies until size more bytes fit
+
+static void
+s_service_cache_trim(service_t *self, size_t size)
+{
+    while (idlist_size(&self->_cache_lru) && self->_cache_bytes + size > self->_limits._cache_max_bytes)
+        s_service_cache_evict(self, (cache_entry_t *)idlist_first(&self->_cache_lru));
+}
+
+static void
+s_service_cache_evict(service_t *self, cache_entry_t *entry)
+{
+    idtable_delete(self->_cache, zframe_data(entry->_key), zframe_size(entry->_key), entry->_hash);
+    idlist_remove(&self->_cache_lru, &entry->_link);
+    self->_cache_bytes -= entry->_size;
+    zframe_destroy(&entry->_key);
+    zmsg_destroy(&entry->_reply);
+    idpool_free(self->_broker->_cache_pool, entry);
+}
+
+//  .split single flight
+//  In single flight mode the first of a set of identical requests leads a
+//  flight: it queues and goes to a worker as usual, and identical requests
+//  that arrive meanwhile park on it as followers. When the worker replies,
+//  each follower gets a copy of the reply. If the leader is dropped by
+//  CoDel, its followers get status 503 with it; if its client stopped waiting,
+//  the first follower whose client still waits takes over its place in
+//  the queue. Resends park on the request they repeat the same way, so
+//  all of this applies to them too:
+
+static bool
+s_service_flight_join(service_t *self, zframe_t *key, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority)
+{
+    request_t *leader = self->_flights
+                            ? (request_t *)idtable_lookup(self->_flights, zframe_data(key), zframe_size(key),
+                                                          idtable_hash(zframe_data(key), zframe_size(key)))
+                            : NULL;
+    if (!leader)
+        return false;
+    request_t *follower = s_request_new(self->_broker, msg, zmsg_content_size(msg), clear, props, deadline, priority);
+    idlist_append(&leader->_followers, &follower->_link);
+    self->_coalesced++;
+    return true;
+}
+
+static void
+s_service_flight_start(service_t *self, request_t *leader)
+{
+    if (!self->_flights)
+        self->_flights = idtable_new();
+    idtable_insert(self->_flights, zframe_data(leader->_key), zframe_size(leader->_key),
+                   idtable_hash(zframe_data(leader->_key), zframe_size(leader->_key)), leader);
+    leader->_leads = true;
+    self->_flights_started++;
+}
+
+//  The leader is done, one way or another; identical requests that arrive
+//  from now on start a new flight
+
+static void
+s_service_flight_end(service_t *self, request_t *leader)
+{
+    if (!leader->_leads)
+        return;
+    idtable_delete(self->_flights, zframe_data(leader->_key), zframe_size(leader->_key),
+                   idtable_hash(zframe_data(leader->_key), zframe_size(leader->_key)));
+    leader->_leads = false;
+}
+
+//  Send each follower a copy of the reply, which has no envelope yet
+
+static void
+s_service_flight_answer(service_t *self, request_t *leader, zmsg_t *reply)
+{
+    broker_t *broker = self->_broker;
+    request_t *follower;
+    while ((follower = (request_t *)idlist_pop(&leader->_followers)))
+    {
+        zmsg_t *copy = zmsg_dup(reply);
+        s_service_reply_envelope(self, copy);
+        zmsg_wrap(copy, zmsg_unwrap(follower->_msg));
+        zmsg_send(&copy, follower->_clear ? broker->_clear_socket : broker->_curve_socket);
+        zmsg_destroy(&follower->_msg);
+        s_request_free(broker, follower);
+    }
+}
+
+static void
+s_service_flight_reject(service_t *self, request_t *leader)
+{
+    request_t *follower;
+    while ((follower = (request_t *)idlist_pop(&leader->_followers)))
+    {
+        self->_dropped++;
+        s_service_reject(self, follower->_msg, follower->_clear, follower->_props);
+        s_request_free(self->_broker, follower);
+    }
+}
+
+//  The leader expired before it reached a worker. The first follower that
+//  has not expired too leads from now on, queued as when it came, and
+//  takes over the flight and idempotency key of the leader.
+
+static void
+s_service_flight_retry(service_t *self, request_t *leader)
+{
+    broker_t *broker = self->_broker;
+    request_t *successor;
+    while ((successor = (request_t *)idlist_pop(&leader->_followers))
+           && successor->_deadline && successor->_deadline <= broker->_now)
+    {
+        self->_expired++;
+        zmsg_destroy(&successor->_msg);
+        s_request_free(broker, successor);
+    }
+    if (!successor)
+    {
+        s_service_flight_end(self, leader);
+        return;
+    }
+    s_request_handover(self, leader, successor);
+    s_service_enqueue(self, successor);
+}
+
+//  .split idempotency keys
+//  Clients that resend a request after a timeout put the same key on every
+//  copy. The first copy to queue is remembered under its key. Later copies
+//  park on it while it is queued or with a worker, and get a copy of its
+//  reply until the window closes. Entries are kept oldest first, and the
+//  oldest go once the service remembers too many keys.
+//  A key belongs to the client that sent it, so we keep it under the
+//  client's name as well: another client that sends the same key runs its
+//  own request, and can neither join nor read the first one's:
+
+static zframe_t *
+s_idempotency_scope(zframe_t *sender, bool clear, const byte *value, size_t size)
+{
+    size_t name_size;
+    const byte *name = s_client_name(sender, clear, &name_size);
+    assert(name_size <= 255); //  Routing ids and Z85 keys are that short
+    zframe_t *key = zframe_new(NULL, 1 + name_size + size);
+    byte *data = zframe_data(key);
+    data[0] = (byte)name_size;
+    memcpy(data + 1, name, name_size);
+    memcpy(data + 1 + name_size, value, size);
+    return key;
+}
+
+static bool
+s_service_idempotency_answer(service_t *self, zframe_t *key, zmsg_t *msg, bool clear, bool props, int64_t deadline, int priority)
+{
+    broker_t *broker = self->_broker;
+    idempotency_entry_t *entry = self->_idempotency
+                                     ? (idempotency_entry_t *)idtable_lookup(self->_idempotency, zframe_data(key), zframe_size(key),
+                                                                             idtable_hash(zframe_data(key), zframe_size(key)))
+                                     : NULL;
+    if (entry && !entry->_request && (!entry->_reply || entry->_expires <= broker->_now))
+    {
+        s_service_idempotency_evict(self, entry);
+        entry = NULL;
+    }
+    if (!entry)
+        return false;
+    self->_resends++;
+    if (entry->_request)
+    {
+        request_t *follower = s_request_new(broker, msg, zmsg_content_size(msg), clear, props, deadline, priority);
+        idlist_append(&entry->_request->_followers, &follower->_link);
+        return true;
+    }
+    zframe_t *client = zmsg_unwrap(msg);
+    zmsg_destroy(&msg);
+    zmsg_t *reply = zmsg_dup(entry->_reply);
+    s_service_reply_envelope(self, reply);
+    zmsg_wrap(reply, client);
+    zmsg_send(&reply, clear ? broker->_clear_socket : broker->_curve_socket);
+    return true;
+}
+
+//  Remember a request under its key; takes the key
+
+static void
+s_service_idempotency_start(service_t *self, request_t *req, zframe_t **key_p)
+{
+    zframe_t *key = *key_p;
+    *key_p = NULL;
+    if (!self->_idempotency)
+        self->_idempotency = idtable_new();
+    uint32_t hash = idtable_hash(zframe_data(key), zframe_size(key));
+    idempotency_entry_t *entry = (idempotency_entry_t *)idtable_lookup(self->_idempotency, zframe_data(key), zframe_size(key), hash);
+    if (entry)
+        s_service_idempotency_evict(self, entry);
+    s_service_idempotency_trim(self, 1);
+
+    entry = (idempotency_entry_t *)idpool_alloc(self->_broker->_idempotency_pool);
+    idlist_link_init(&entry->_link, entry);
+    entry->_key = key;
+    entry->_hash = hash;
+    entry->_request = req;
+    idtable_insert(self->_idempotency, zframe_data(key), zframe_size(key), hash, entry);
+    idlist_append(&self->_idempotency_age, &entry->_link);
+    req->_idempotency = entry;
+}
+
+//  The request got its reply, which has no envelope yet; keep a copy for
+//  the window
+
+static void
+s_service_idempotency_record(service_t *self, request_t *req, zmsg_t *reply)
+{
+    idempotency_entry_t *entry = req->_idempotency;
+    if (!entry)
+        return;
+    req->_idempotency = NULL;
+    entry->_request = NULL;
+    if (self->_limits._idempotency_window == 0)
+    {
+        s_service_idempotency_evict(self, entry);
+        return;
+    }
+    entry->_reply = zmsg_dup(reply);
+    entry->_expires = self->_broker->_now + self->_limits._idempotency_window;
+    idlist_remove(&self->_idempotency_age, &entry->_link);
+    idlist_append(&self->_idempotency_age, &entry->_link);
+}
+
+//  Forget the oldest keys until count more fit
+
+static void
+s_service_idempotency_trim(service_t *self, size_t count)
+{
+    while (idlist_size(&self->_idempotency_age) && idlist_size(&self->_idempotency_age) + count > self->_limits._idempotency_keys)
+        s_service_idempotency_evict(self, (idempotency_entry_t *)idlist_first(&self->_idempotency_age));
+}
+
+static void
+s_service_idempotency_evict(service_t *self, idempotency_entry_t *entry)
+{
+    if (entry->_request)
+        entry->_request->_idempotency = NULL;
+    idtable_delete(self->_idempotency, zframe_data(entry->_key), zframe_size(entry->_key), entry->_hash);
+    idlist_remove(&self->_idempotency_age, &entry->_link);
+    zframe_destroy(&entry->_key);
+    zmsg_destroy(&entry->_reply);
+    idpool_free(self->_broker->_idempotency_pool, entry);
+}
+
+//  .split hedging
+//  Every service keeps a histogram of recent service times, halved every
+//  SERVICE_LATENCY_WINDOW samples so it follows changes in load. A service
+//  that hedges arms a timer on each request it sends, due when the
+//  request has taken longer than 95% of recent ones. If it is still
+//  unanswered then, and an idle worker and the budget allow, a copy goes
+//  to that worker. The budget grows by _hedge_budget hundredths of a
+//  hedge per request sent, and saves up to SERVICE_HEDGE_BURST hedges:
+
+static void
+s_service_latency(service_t *self, int64_t sample)
+{
+    size_t bucket = 0;
+    while (sample > 0 && bucket < SERVICE_LATENCY_BUCKETS - 1)
+    {
+        sample >>= 1;
+        bucket++;
+    }
+    self->_latency[bucket]++;
+    if (++self->_latency_samples >= SERVICE_LATENCY_WINDOW)
+    {
+        self->_latency_samples = 0;
+        for (bucket = 0; bucket < SERVICE_LATENCY_BUCKETS; bucket++)
+        {
+            self->_latency[bucket] /= 2;
+            self->_latency_samples += self->_latency[bucket];
+        }
+    }
+}
+
+//  Service time under which percent of recent requests were answered, in
+//  usecs, interpolated within its bucket; 0 until there are enough samples
+
+static int64_t
+s_service_latency_percentile(service_t *self, int percent)
+{
+    if (self->_latency_samples < SERVICE_LATENCY_MIN_SAMPLES)
+        return 0;
+    uint64_t target = (self->_latency_samples * percent + 99) / 100;
+    uint64_t seen = 0;
+    size_t bucket;
+    for (bucket = 0; bucket < SERVICE_LATENCY_BUCKETS; bucket++)
+    {
+        uint64_t count = self->_latency[bucket];
+        if (seen + count >= target)
+        {
+            int64_t low = bucket ? (int64_t)1 << (bucket - 1) : 0;
+            int64_t high = (int64_t)1 << bucket;
+            return low + (int64_t)((uint64_t)(high - low) * (target - seen) / count);
+        }
+        seen += count;
+    }
+    return 0;
+}
+
+static void
+s_service_hedge_arm(service_t *self, request_t *req)
+{
+    broker_t *broker = self->_broker;
+    self->_hedge_credit += self->_limits._hedge_budget;
+    if (self->_hedge_credit > 100 * SERVICE_HEDGE_BURST)
+        self->_hedge_credit = 100 * SERVICE_HEDGE_BURST;
+    int64_t p95 = s_service_latency_percentile(self, 95);
+    if (p95)
+        idwheel_arm(broker->_timers, &req->_hedge_timer, broker->_now + (p95 + 999) / 1000);
+}
+
+static void
+s_service_hedge(service_t *self, request_t *req)
+{
+    broker_t *broker = self->_broker;
+    if (req->_twin || !req->_msg || self->_hedge_credit < 100 || (req->_deadline && req->_deadline <= broker->_now))
+        return;
+    worker_t *idle = (worker_t *)idlist_first(&self->_waiting);
+    while (idle && (idle == req->_worker || idlist_size(&idle->_in_flight) || idle->_health != WORKER_HEALTHY))
+        idle = (worker_t *)idlist_next(&idle->_service_link);
+    if (!idle)
+        return;
+    request_t *hedge = s_request_new(broker, zmsg_dup(req->_msg), req->_size, req->_clear, req->_props, req->_deadline, req->_priority);
+    hedge->_hedge = true;
+    hedge->_attempts = req->_attempts;
+    hedge->_twin = req;
+    req->_twin = hedge;
+    self->_hedge_credit -= 100;
+    self->_hedged++;
+    s_worker_dispatch(idle, hedge);
+}
+
+//  One copy of a hedged request got its reply. The other stays with its
+//  worker until that worker answers too, so credit and replies without a
+//  request id still line up, but its reply is dropped.
+
+static void
+s_service_hedge_settle(service_t *self, request_t *winner)
+{
+    request_t *loser = winner->_twin;
+    winner->_twin = NULL;
+    loser->_twin = NULL;
+    loser->_discard = true;
+    idwheel_cancel(self->_broker->_timers, &loser->_hedge_timer);
+    zmsg_destroy(&loser->_msg);
+    if (winner->_hedge)
+        self->_hedge_wins++;
+}
+
+//  .split request records
+//  Requests come from a pool. Freeing one frees the followers parked on it
+//  too, which only happens when their flight is lost with a worker or the
+//  broker shuts down. A request freed unanswered leaves its idempotency
+//  key stale, so the next resend runs again:
+
+static request_t *
+s_request_new(broker_t *self, zmsg_t *msg, size_t size, bool clear, bool props, int64_t deadline, int priority)
+{
+    request_t *req = (request_t *)idpool_alloc(self->_request_pool);
+    idlist_link_init(&req->_link, req);
+    idlist_init(&req->_followers);
+    req->_msg = msg;
+    req->_size = size;
+    req->_enqueued = self->_now;
+    req->_deadline = deadline;
+    req->_priority = priority;
+    req->_clear = clear;
+    req->_props = props;
+    idtimer_init(&req->_hedge_timer, s_request_hedge, req);
+    return req;
+}
+
+static void
+s_request_free(broker_t *self, request_t *req)
+{
+    request_t *follower;
+    while ((follower = (request_t *)idlist_pop(&req->_followers)))
+    {
+        zmsg_destroy(&follower->_msg);
+        s_request_free(self, follower);
+    }
+    if (req->_idempotency)
+        req->_idempotency->_request = NULL;
+    idwheel_cancel(self->_timers, &req->_hedge_timer);
+    zframe_destroy(&req->_key);
+    zframe_destroy(&req->_client);
+    idpool_free(self->_request_pool, req);
+}
+
+//  Hand the followers, keys and flight of a request over to another
+//  request for the same thing, which answers them from now on
+
+static void
+s_request_handover(service_t *self, request_t *from, request_t *to)
+{
+    request_t *follower;
+    while ((follower = (request_t *)idlist_pop(&from->_followers)))
+        idlist_append(&to->_followers, &follower->_link);
+    to->_key = from->_key;
+    from->_key = NULL;
+    to->_idempotency = from->_idempotency;
+    from->_idempotency = NULL;
+    if (to->_idempotency)
+        to->_idempotency->_request = to;
+    if (from->_leads)
+    {
+        uint32_t hash = idtable_hash(zframe_data(to->_key), zframe_size(to->_key));
+        idtable_delete(self->_flights, zframe_data(to->_key), zframe_size(to->_key), hash);
+        idtable_insert(self->_flights, zframe_data(to->_key), zframe_size(to->_key), hash, to);
+        from->_leads = false;
+        to->_leads = true;
+    }
+}
+
+static void
+s_request_hedge(idtimer_t *timer, void *argument)
+{
+    (void)timer;
+    request_t *req = (request_t *)argument;
+    s_service_hedge(req->_worker->_service, req);
+}
+
+//  Would one more request of this size go over the service limits?
+
+static bool
+s_service_full(service_t *self, size_t size)
+{
+    return (self->_limits._max_requests && idlist_size(&self->_requests) >= self->_limits._max_requests) ||
+           (self->_limits._max_bytes && self->_queued_bytes + size > self->_limits._max_bytes);
+}
+
+//  Build a reply the broker makes itself: IDPC02, the status in the
+//  properties frame and no body, so the client cannot take it for a
+//  worker reply. Takes over the service name frame.
+
+static zmsg_t *
+s_status_reply(zframe_t *service_name, uint64_t status)
+{
+    idprops_t props;
+    idprops_init(&props);
+    idprops_put_uint(&props, IDP_PROP_STATUS, status);
+    zmsg_t *reply = zmsg_new();
+    zmsg_push(reply, idprops_frame(&props));
+    zmsg_push(reply, service_name);
+    zmsg_pushstr(reply, IDPC_CLIENT_PROPS);
+    return reply;
+}
+
+//  Answer a request we will not queue with status 503, so the client can
+//  back off instead of timing out and retrying. IDPC01 clients cannot
+//  tell a status from data, so they time out as they always did
+
+static void
+s_service_reject(service_t *self, zmsg_t *msg, bool clear, bool props)
+{
+    broker_t *broker = self->_broker;
+    if (!props)
+    {
+        zmsg_destroy(&msg);
+        return;
+    }
+    zframe_t *client = zmsg_unwrap(msg);
+    zmsg_destroy(&msg);
+    msg = s_status_reply(zframe_dup(self->_name_frame), IDP_STATUS_UNAVAILABLE);
+    zmsg_wrap(msg, client);
+    zmsg_send(&msg, clear ? broker->_clear_socket : broker->_curve_socket);
+}
+
+//  Refuse every queued request, and whoever follows it, with status 503
+
+static void
+s_service_flush(service_t *self)
+{
+    request_t *req;
+    while ((req = (request_t *)idlist_first(&self->_requests)))
+    {
+        s_service_unqueue(self, req);
+        s_service_flight_end(self, req);
+        s_service_flight_reject(self, req);
+        s_service_reject(self, req->_msg, req->_clear, req->_props);
+        s_request_free(self->_broker, req);
+    }
+}
+
+//  Queue a request in its priority class, by deadline
+
+static void
+s_service_enqueue(service_t *self, request_t *req)
+{
+    idheap_link_init(&req->_queue_link, req);
+    req->_queue_link._key = req->_deadline ? req->_deadline : INT64_MAX;
+    s_service_queue(self, req);
+}
+
+//  Put a request from a lost worker back at the front of its class, ahead
+//  of requests that never reached a worker; rank keeps those from the
+//  same worker oldest first. It counts as queued from now, so CoDel does
+//  not hold the lost worker's time against it.
+
+static void
+s_service_requeue(service_t *self, request_t *req, size_t rank)
+{
+    idheap_link_init(&req->_queue_link, req);
+    req->_queue_link._key = INT64_MIN + (int64_t)rank;
+    s_service_queue(self, req);
+    req->_enqueued = self->_broker->_now;
+    self->_reassigned++;
+}
+
+//  Put a request whose queue key is set on the queue of its class, or of
+//  its client in fair queuing mode
+
+static void
+s_service_queue(service_t *self, request_t *req)
+{
+    idlist_append(&self->_requests, &req->_link);
+    self->_queued_bytes += req->_size;
+    self->_queued[req->_priority]++;
+    if (self->_limits._fair)
+        s_service_fair_queue(self, req);
+    else
+        idheap_push(&self->_queues[req->_priority], &req->_queue_link);
+}
+
+//  Move every queued request to the queues the service uses now, oldest
+//  first, keeping their keys
+
+static void
+s_service_queues_rebuild(service_t *self)
+{
+    idlist_t moving;
+    idlist_init(&moving);
+    request_t *req;
+    while ((req = (request_t *)idlist_first(&self->_requests)))
+    {
+        s_service_unqueue(self, req);
+        idlist_append(&moving, &req->_link);
+    }
+    while ((req = (request_t *)idlist_pop(&moving)))
+        s_service_queue(self, req);
+}
+
+//  Take the next request off the service queues: the most urgent one of
+//  the highest class that has any, unless a lower class has been passed
+//  over PRIORITY_MAX_PASSED times while it had requests waiting. That
+//  bounds how long a stream of high priority work can starve it.
+
+static request_t *
+s_service_dequeue(service_t *self)
+{
+    int chosen = -1;
+    int priority;
+    for (priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+    {
+        if (self->_queued[priority] == 0)
+            continue;
+        if (chosen < 0)
+            chosen = priority;
+        else if (self->_passed[priority] >= PRIORITY_MAX_PASSED)
+        {
+            chosen = priority;
+            break;
+        }
+    }
+    if (chosen < 0)
+        return NULL;
+    for (priority = 0; priority < IDP_PRIORITY_CLASSES; priority++)
+        if (priority != chosen && self->_queued[priority])
+            self->_passed[priority]++;
+    self->_passed[chosen] = 0;
+
+    request_t *req = self->_limits._fair ? s_service_fair_top(self, chosen)
+                                         : (request_t *)idheap_top(&self->_queues[chosen]);
+    s_service_unqueue(self, req);
+    return req;
+}
+
+//  Take a request off the service queues, wherever it is in them
+
+static void
+s_service_unqueue(service_t *self, request_t *req)
+{
+    idlist_remove(&self->_requests, &req->_link);
+    self->_queued_bytes -= req->_size;
+    self->_queued[req->_priority]--;
+    if (req->_flow)
+        s_service_fair_unqueue(self, req);
+    else
+        idheap_remove(&self->_queues[req->_priority], &req->_queue_link);
+}
+
+//  .split fair queuing
+//  In fair queuing mode each class keeps a queue per client, earliest
+//  deadline first like the class queues, and serves the clients that have
+//  requests queued by deficit round robin: the client whose turn it is
+//  sends as many requests as its weight, then goes to the back. Every
+//  request costs the same, since what clients share is worker time, not
+//  bytes. A client that sends a burst only delays the others by its weight
+//  per turn. Clients are told apart by routing id, or on the CURVE socket
+//  by public key when the ZAP handler reports one, so a tenant gets one
+//  share however many connections it opens:
+
+static void
+s_service_fair_queue(service_t *self, request_t *req)
+{
+    broker_t *broker = self->_broker;
+    int priority = req->_priority;
+    if (!req->_clear && !req->_client)
+    {
+        const char *public_key = zframe_meta(zmsg_first(req->_msg), "User-Id");
+        if (public_key && *public_key)
+            req->_client = zframe_new(public_key, strlen(public_key));
+    }
+    zframe_t *client = req->_client ? req->_client : zmsg_first(req->_msg);
+    uint32_t hash = idtable_hash(zframe_data(client), zframe_size(client));
+    if (!self->_flows[priority])
+    {
+        self->_flows[priority] = idtable_new();
+        idtable_set_destructor(self->_flows[priority], s_flow_destroy);
+    }
+    flow_t *flow = (flow_t *)idtable_lookup(self->_flows[priority], zframe_data(client), zframe_size(client), hash);
+    if (!flow)
+    {
+        flow = (flow_t *)idpool_alloc(broker->_flow_pool);
+        idlist_link_init(&flow->_link, flow);
+        flow->_service = self;
+        flow->_client = zframe_dup(client);
+        flow->_hash = hash;
+        flow->_weight = s_broker_client_weight(broker, client);
+        idtable_insert(self->_flows[priority], zframe_data(client), zframe_size(client), hash, flow);
+        idlist_append(&self->_fair[priority], &flow->_link);
+    }
+    idheap_push(&flow->_queue, &req->_queue_link);
+    req->_flow = flow;
+}
+
+//  The most urgent request of the client whose turn it is. Taking it uses
+//  up one request of the turn; the last one sends the client to the back.
+
+static request_t *
+s_service_fair_top(service_t *self, int priority)
+{
+    flow_t *flow = (flow_t *)idlist_first(&self->_fair[priority]);
+    if (flow->_deficit == 0)
+        flow->_deficit = flow->_weight;
+    if (--flow->_deficit == 0)
+    {
+        idlist_remove(&self->_fair[priority], &flow->_link);
+        idlist_append(&self->_fair[priority], &flow->_link);
+    }
+    return (request_t *)idheap_top(&flow->_queue);
+}
+
+//  Take a request out of its client queue, and forget the client queue
+//  once it is empty
+
+static void
+s_service_fair_unqueue(service_t *self, request_t *req)
+{
+    flow_t *flow = req->_flow;
+    idheap_remove(&flow->_queue, &req->_queue_link);
+    req->_flow = NULL;
+    if (idheap_size(&flow->_queue) == 0)
+    {
+        idlist_remove(&self->_fair[req->_priority], &flow->_link);
+        idtable_delete(self->_flows[req->_priority], zframe_data(flow->_client), zframe_size(flow->_client), flow->_hash);
+        s_flow_destroy(flow);
+    }
+}
+
+static uint32_t
+s_broker_client_weight(broker_t *self, zframe_t *client)
+{
+    if (zhash_size(self->_client_weights) == 0)
+        return 1;
+    char *name = zframe_strdup(client);
+    uint32_t *weight = (uint32_t *)zhash_lookup(self->_client_weights, name);
+    free(name);
+    return weight ? *weight : 1;
+}
+
+//  Flow destructor is called when a client queue empties, and for every
+//  flow when its service is destroyed.
+
+static void
+s_flow_destroy(void *argument)
+{
+    flow_t *flow = (flow_t *)argument;
+    zframe_destroy(&flow->_client);
+    idheap_release(&flow->_queue);
+    idpool_free(flow->_service->_broker->_flow_pool, flow);
+}
+
+//  .split rate limiting
+//  Each client has a token bucket that fills at its rate up to its burst,
+//  and every request takes a token from it. The check runs before anything
+//  else looks at the request, so a client over its limit costs us one
+//  lookup and a short reply. Buckets count what each client sends even
+//  when it has no limit. They are kept least recently used first; past
+//  CLIENT_MAX_BUCKETS the first is forgotten, and the client starts over
+//  with a full bucket if it comes back:
+
+static bool
+s_broker_client_admit(broker_t *self, zframe_t *sender, bool clear)
+{
+    size_t size;
+    const byte *client = s_client_name(sender, clear, &size);
+    uint32_t hash = idtable_hash(client, size);
+    bucket_t *bucket = (bucket_t *)idtable_lookup(self->_buckets, client, size, hash);
+    if (!bucket)
+        bucket = s_broker_bucket_new(self, client, size, hash);
+    idlist_remove(&self->_buckets_lru, &bucket->_link);
+    idlist_append(&self->_buckets_lru, &bucket->_link);
+    if (bucket->_generation != self->_rate_generation)
+        s_broker_bucket_limit(self, bucket);
+    if (bucket->_rate)
+    {
+        //  A rate per second is that many thousandths per msec
+        bucket->_tokens += (self->_now - bucket->_refilled) * bucket->_rate;
+        bucket->_refilled = self->_now;
+        if (bucket->_tokens > (int64_t)bucket->_burst * 1000)
+            bucket->_tokens = (int64_t)bucket->_burst * 1000;
+        if (bucket->_tokens < 1000)
+        {
+            bucket->_rejected++;
+            return false;
+        }
+        bucket->_tokens -= 1000;
+    }
+    bucket->_admitted++;
+    return true;
+}
+
+static bucket_t *
+s_broker_bucket_new(broker_t *self, const byte *client, size_t size, uint32_t hash)
+{
+    if (idtable_size(self->_buckets) >= CLIENT_MAX_BUCKETS)
+    {
+        bucket_t *oldest = (bucket_t *)idlist_pop(&self->_buckets_lru);
+        idtable_delete(self->_buckets, zframe_data(oldest->_client), zframe_size(oldest->_client), oldest->_hash);
+        s_bucket_destroy(oldest);
+    }
+    bucket_t *bucket = (bucket_t *)idpool_alloc(self->_bucket_pool);
+    idlist_link_init(&bucket->_link, bucket);
+    bucket->_broker = self;
+    bucket->_client = zframe_new(client, size);
+    bucket->_hash = hash;
+    s_broker_bucket_limit(self, bucket);
+    idtable_insert(self->_buckets, client, size, hash, bucket);
+    return bucket;
+}
+
+//  The name we know a client by: its public key in Z85 on the CURVE socket
+//  if the broker authenticates clients, else its routing id
+
+static const byte *
+s_client_name(zframe_t *sender, bool clear, size_t *size_p)
+{
+    const char *public_key = clear ? NULL : zframe_meta(sender, "User-Id");
+    if (public_key && *public_key)
+    {
+        *size_p = strlen(public_key);
+        return (const byte *)public_key;
+    }
+    *size_p = zframe_size(sender);
+    return zframe_data(sender);
+}
+
+//  Take the limit in force for the client of a bucket, its own or the
+//  default, and fill the bucket
+
+static void
+s_broker_bucket_limit(broker_t *self, bucket_t *bucket)
+{
+    rate_limit_t *limit = &self->_client_rate;
+    if (zhash_size(self->_client_rates))
+    {
+        char *name = zframe_strdup(bucket->_client);
+        rate_limit_t *named = (rate_limit_t *)zhash_lookup(self->_client_rates, name);
+        free(name);
+        if (named)
+            limit = named;
+    }
+    bucket->_rate = limit->_rate;
+    bucket->_burst = limit->_burst;
+    bucket->_tokens = (int64_t)bucket->_burst * 1000;
+    bucket->_refilled = self->_now;
+    bucket->_generation = self->_rate_generation;
+}
+
+//  Answer a request over the rate limit with status 429, so the client
+//  can back off; IDPC01 clients get nothing, as in s_service_reject.
+//  Takes over the sender and service name frames
+
+static void
+s_broker_client_refuse(broker_t *self, zframe_t **sender_p, zframe_t **service_p, bool clear, bool props)
+{
+    if (!props)
+    {
+        zframe_destroy(sender_p);
+        zframe_destroy(service_p);
+        return;
+    }
+    zmsg_t *reply = s_status_reply(*service_p, IDP_STATUS_RATE_LIMITED);
+    *service_p = NULL;
+    zmsg_wrap(reply, *sender_p);
+    *sender_p = NULL;
+    zmsg_send(&reply, clear ? self->_clear_socket : self->_curve_socket);
+}
+
+static void
+s_bucket_destroy(void *argument)
+{
+    bucket_t *bucket = (bucket_t *)argument;
+    zframe_destroy(&bucket->_client);
+    idpool_free(bucket->_broker->_bucket_pool, bucket);
+}
+
+//  Histogram bucket for a queue wait in msecs
+
+static size_t
+s_wait_bucket(int64_t wait)
+{
+    size_t bucket = 0;
+    while (wait > 0 && bucket < SERVICE_WAIT_BUCKETS - 1)
+    {
+        wait >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+//  Integer square root, at least 1
+
+static uint32_t
+s_isqrt(uint32_t value)
+{
+    uint32_t root = 0;
+    uint32_t bit = 1u << 30;
+    while (bit > value)
+        bit >>= 2;
+    while (bit)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return root ? root : 1;
+}
+
+//  .split service CoDel method
+//  CoDel looks at how long the oldest request has waited. Waits over
+//  target are fine for one interval, to absorb bursts; after that we drop
+//  the oldest request, then keep dropping at intervals that shrink with
+//  the square root of the drop count, until the wait is back under
+//  target:
+
+static void
+s_service_codel(service_t *self)
+{
+    broker_t *broker = self->_broker;
+    int64_t now = broker->_now;
+    request_t *req;
+    while ((req = (request_t *)idlist_first(&self->_requests)))
+    {
+        bool too_long = false;
+        if (now - req->_enqueued < self->_limits._codel_target)
+            self->_first_above = 0;
+        else if (self->_first_above == 0)
+            self->_first_above = now + self->_limits._codel_interval;
+        else
+            too_long = now >= self->_first_above;
+
+        if (self->_dropping)
+        {
+            if (!too_long)
+            {
+                self->_dropping = false;
+                break;
+            }
+            if (now < self->_drop_next)
+                break;
+            self->_drop_count++;
+        }
+        else if (too_long)
+        {
+            //  Start dropping; if we stopped only recently, pick up near
+            //  the rate we had reached
+            self->_dropping = true;
+            self->_drop_count = self->_drop_count > 2 && now - self->_drop_next < 16 * self->_limits._codel_interval
+                                    ? self->_drop_count - 2
+                                    : 1;
+            self->_drop_next = now;
+        }
+        else
+            break;
+
+        s_service_unqueue(self, req);
+        self->_dropped++;
+        s_service_flight_end(self, req);
+        s_service_flight_reject(self, req);
+        s_service_reject(self, req->_msg, req->_clear, req->_props);
+        s_request_free(broker, req);
+        self->_drop_next += self->_limits._codel_interval / s_isqrt(self->_drop_count);
+    }
+}
+
+//  .split circuit breaker
+//  A service whose last worker is gone arms the breaker for the grace
+//  period. If no worker registers in time, the breaker opens: queued
+//  requests are flushed with status 503, like CoDel drops, and new ones get it
+//  at once, until a worker registers. Workers' answers and lost requests
+//  count toward an error rate over roughly the last SERVICE_BREAKER_WINDOW
+//  requests, which opens the breaker for a cooldown when it passes the
+//  limit:
+
+static void
+s_service_breaker_arm(service_t *self)
+{
+    broker_t *broker = self->_broker;
+    if (self->_workers == 0 && self->_limits._breaker_grace && !self->_breaker_open && !idtimer_armed(&self->_breaker_timer))
+        idwheel_arm(broker->_timers, &self->_breaker_timer, broker->_now + self->_limits._breaker_grace);
+}
+
+//  Open the breaker until the given time, or until a worker registers if
+//  that is 0
+
+static void
+s_service_breaker_open(service_t *self, int64_t until)
+{
+    broker_t *broker = self->_broker;
+    self->_breaker_open = true;
+    if (until)
+        idwheel_arm(broker->_timers, &self->_breaker_timer, until);
+    else
+        idwheel_cancel(broker->_timers, &self->_breaker_timer);
+    if (broker->_verbose)
+        zclock_log("I: breaker open for service: %s", self->_name);
+    self->_short_circuited += idlist_size(&self->_requests);
+    s_service_flush(self);
+}
+
+//  Close the breaker if it is open, which starts the error rate over, and
+//  stop the grace period if the service has workers again
+
+static void
+s_service_breaker_close(service_t *self)
+{
+    broker_t *broker = self->_broker;
+    if (self->_breaker_open)
+    {
+        if (broker->_verbose)
+            zclock_log("I: breaker closed for service: %s", self->_name);
+        self->_breaker_open = false;
+        self->_breaker_requests = 0;
+        self->_breaker_errors = 0;
+    }
+    idwheel_cancel(broker->_timers, &self->_breaker_timer);
+    s_service_breaker_arm(self);
+}
+
+//  Count requests workers answered and requests lost with them
+
+static void
+s_service_breaker_count(service_t *self, uint64_t answered, uint64_t lost)
+{
+    int rate = self->_limits._breaker_error_rate;
+    if (!rate || self->_breaker_open)
+        return;
+    self->_breaker_requests += answered + lost;
+    self->_breaker_errors += lost;
+    if (self->_breaker_requests >= SERVICE_BREAKER_MIN_REQUESTS
+        && self->_breaker_errors * 100 >= self->_breaker_requests * rate)
+        s_service_breaker_open(self, self->_broker->_now + SERVICE_BREAKER_COOLDOWN);
+    else if (self->_breaker_requests >= SERVICE_BREAKER_WINDOW)
+    {
+        self->_breaker_requests /= 2;
+        self->_breaker_errors /= 2;
+    }
+}
+
+//  Called by the timer wheel when the grace period or the cooldown ends
+
+static void
+s_service_breaker_expired(idtimer_t *timer, void *argument)
+{
+    (void)timer;
+    service_t *self = (service_t *)argument;
+    if (self->_breaker_open)
+        s_service_breaker_close(self);
+    else
+        s_service_breaker_open(self, 0);
+}
+
+//  .split worker methods
+//  Here is the implementation of the methods that work on a worker:
+
+//  Lazy constructor that locates a worker by routing id, or creates a new
+//  worker if there is no worker already with that routing id. The caller
+//  passes the routing id hash so we only compute it once per message. A
+//  new worker takes over the caller's routing id frame as its address.
+
+static worker_t *
+s_worker_require(broker_t *self, zframe_t **address_p, uint32_t hash, bool clear)
+{
+    assert(address_p && *address_p);
+    zframe_t *address = *address_p;
+
+    //  self->_workers is keyed off the raw routing id bytes
+    worker_t *worker =
+        (worker_t *)idtable_lookup(self->_workers, zframe_data(address), zframe_size(address), hash);
+
+    if (worker == NULL)
+    {
+        worker = (worker_t *)idpool_alloc(self->_worker_pool);
+        worker->_broker = self;
+        worker->_hash = hash;
+        worker->_address = address;
+        *address_p = NULL;
+        worker->_socket = clear ? &self->_clear_socket : &self->_curve_socket;
+        idlist_init(&worker->_in_flight);
+        idlist_link_init(&worker->_service_link, worker);
+        idtimer_init(&worker->_expiry_timer, s_worker_expired, worker);
+        idtimer_init(&worker->_heartbeat_timer, s_worker_heartbeat, worker);
+        idtimer_init(&worker->_request_timer, s_worker_request_expired, worker);
+        idtimer_init(&worker->_outlier_timer, s_worker_outlier_expired, worker);
+        idtable_insert(self->_workers, zframe_data(address), zframe_size(address), hash, worker);
+        if (self->_verbose)
+        {
+            char *identity = zframe_strhex(address);
+            zclock_log("I: registering new worker: %s", identity);
+            free(identity);
+        }
+    }
+    return worker;
+}
+
+//  The delete method deletes the current worker. An idle worker is
+//  deleted once it has sent nothing for HEARTBEAT_EXPIRY; a busy one only
+//  by the request timeout, and its requests are requeued then.
+
+static void
+s_worker_delete(worker_t *self, int disconnect)
+{
+    assert(self);
+    if (disconnect)
+        s_worker_send(self, IDPW_DISCONNECT, NULL, NULL);
+
+    service_t *service = self->_service;
+    if (service)
+    {
+        idlist_remove(&service->_waiting, &self->_service_link);
+        service->_workers--;
+        if (self->_health != WORKER_HEALTHY)
+            service->_ejected--;
+        if (self->_outlier)
+            s_service_outlier_lose(service, self->_outlier);
+
+        //  Requests the worker held go back to the queue while they have
+        //  attempts left and a client still waiting, with their followers
+        //  and idempotency keys; the rest are lost with the worker. A hedged
+        //  request carries on with its twin
+        bool requeued = false;
+        uint64_t lost = 0;
+        request_t *req;
+        while ((req = (request_t *)idlist_last(&self->_in_flight)))
+        {
+            idlist_remove(&self->_in_flight, &req->_link);
+            idwheel_cancel(self->_broker->_timers, &req->_hedge_timer);
+            lost += !req->_discard && !req->_twin; //  Lost only if no copy is left in flight
+            if (req->_discard)
+                ; //  Already answered by its twin
+            else if (req->_twin)
+            {
+                //  The other copy is still with a worker, and answers for
+                //  both from now on
+                request_t *twin = req->_twin;
+                twin->_twin = NULL;
+                if (!req->_hedge)
+                {
+                    s_request_handover(service, req, twin);
+                    twin->_hedge = false;
+                    twin->_msg = req->_msg;
+                    req->_msg = NULL;
+                }
+            }
+            else if (req->_msg && req->_deadline && req->_deadline <= self->_broker->_now)
+            {
+                service->_expired++;
+                s_service_flight_retry(service, req);
+                requeued = true;
+            }
+            else if (req->_msg && req->_attempts < service->_limits._max_attempts)
+            {
+                s_service_requeue(service, req, idlist_size(&self->_in_flight));
+                requeued = true;
+                continue;
+            }
+            else
+                s_service_flight_end(service, req);
+            zmsg_destroy(&req->_msg);
+            s_request_free(self->_broker, req);
+        }
+        s_service_breaker_count(service, 0, lost);
+        s_service_breaker_arm(service);
+        if (requeued)
+            s_service_dispatch(service, NULL, true, false, 0, IDP_PRIORITY_NORMAL, NULL, NULL);
+        if (service->_workers == 0)
+            s_service_idle(service);
+    }
+    idwheel_cancel(self->_broker->_timers, &self->_expiry_timer);
+    idwheel_cancel(self->_broker->_timers, &self->_heartbeat_timer);
+    idwheel_cancel(self->_broker->_timers, &self->_request_timer);
+    idwheel_cancel(self->_broker->_timers, &self->_outlier_timer);
+    idtable_delete(self->_broker->_workers, zframe_data(self->_address), zframe_size(self->_address), self->_hash);
+    s_worker_destroy(self);
+}
+
+//  Worker destructor is called by s_worker_delete, and for any remaining
+//  workers when the broker is destroyed.
+
+static void
+s_worker_destroy(void *argument)
+{
+    worker_t *self = (worker_t *)argument;
+    request_t *req;
+    while ((req = (request_t *)idlist_pop(&self->_in_flight)))
+    {
+        zmsg_destroy(&req->_msg);
+        s_request_free(self->_broker, req);
+    }
+    zframe_destroy(&self->_address);
+    idpool_free(self->_broker->_worker_pool, self);
+}
+
+//  .split worker send method
+//  The send method formats and sends a command to a worker. The caller may
+//  also provide a command option, and a message payload. We take ownership
+//  of the payload and only stack envelope frames onto it, so its frames go
+//  out on the worker socket without being copied:
+
+static void
+s_worker_send(worker_t *self, char *command, char *option, zmsg_t **msg_p)
+{
+    zmsg_t *msg = msg_p && *msg_p ? *msg_p : zmsg_new();
+    if (msg_p)
+        *msg_p = NULL;
+
+    //  Stack protocol envelope to start of message
+    if (option)
+        zmsg_pushstr(msg, option);
+    zmsg_pushstr(msg, command);
+    bool request = *command == *IDPW_REQUEST || *command == *IDPW_REQUEST_CURVE;
+    zmsg_pushstr(msg, self->_props && request ? IDPW_WORKER_PROPS : IDPW_WORKER);
+
+    //  Stack routing envelope to start of message
+    zmsg_wrap(msg, zframe_dup(self->_address));
+
+    if (self->_broker->_verbose)
+    {
+        zclock_log("I: sending %s to worker",
+                   idps_commands[(int)*command]);
+        zmsg_dump(msg);
+    }
+    zmsg_send(&msg, *(self->_socket));
+}
+
+//  This worker is now waiting for work
+
+static void
+s_worker_waiting(worker_t *self)
+{
+    //  Queue to service waiting list if the worker has credit left, at the
+    //  tail even if the worker was already waiting. Start the idle worker
+    //  timers once it has nothing in flight; until then the request
+    //  deadline follows its oldest request.
+    broker_t *broker = self->_broker;
+    assert(broker);
+    idlist_remove(&self->_service->_waiting, &self->_service_link);
+    if (idlist_size(&self->_in_flight) < s_worker_capacity(self))
+        idlist_append(&self->_service->_waiting, &self->_service_link);
+    if (idlist_size(&self->_in_flight) == 0)
+    {
+        idwheel_cancel(broker->_timers, &self->_request_timer);
+        idwheel_arm(broker->_timers, &self->_expiry_timer, broker->_now + HEARTBEAT_EXPIRY);
+        idwheel_arm(broker->_timers, &self->_heartbeat_timer, broker->_now + broker->_heartbeat_interval);
+    }
+    else if (broker->_request_timeout)
+    {
+        request_t *oldest = (request_t *)idlist_first(&self->_in_flight);
+        idwheel_arm(broker->_timers, &self->_request_timer, oldest->_dispatched + broker->_request_timeout);
+    }
+    s_service_dispatch(self->_service, NULL, true, false, 0, IDP_PRIORITY_NORMAL, NULL, NULL);
+}
+
+//  Take the request a reply answers off the worker's in flight list, and
+//  measure how long the worker took. IDPW02 replies carry the request id;
+//  others answer the oldest request, as a worker without credit only ever
+//  has one. Returns NULL if the worker holds no such request.
+
+static request_t *
+s_worker_answered(worker_t *self, zframe_t *props_frame)
+{
+    request_t *req = (request_t *)idlist_first(&self->_in_flight);
+    uint64_t id;
+    if (props_frame && idprops_get_uint(props_frame, IDP_PROP_REQUEST_ID, &id))
+        while (req && req->_id != (uint32_t)id)
+            req = (request_t *)idlist_next(&req->_link);
+    if (req)
+    {
+        idlist_remove(&self->_in_flight, &req->_link);
+        int64_t sample = zclock_usecs() - req->_sent;
+        s_worker_service_time(self, sample);
+        s_service_latency(self->_service, sample);
+        s_worker_judge(self, sample);
+    }
+    return req;
+}
+
+//  Requests the worker may hold at once: its credit when healthy, one on
+//  probation unless it is resting between probes, none when ejected
+
+static uint32_t
+s_worker_capacity(worker_t *self)
+{
+    if (self->_health == WORKER_HEALTHY)
+        return self->_credit;
+    if (self->_health == WORKER_PROBING && !idtimer_armed(&self->_outlier_timer))
+        return 1;
+    return 0;
+}
+
+//  Fold one request's service time into the worker's moving average
+
+static void
+s_worker_service_time(worker_t *self, int64_t sample)
+{
+    if (self->_service_time == 0)
+        self->_service_time = sample > 0 ? sample : 1;
+    else
+        self->_service_time += (sample - self->_service_time) / WORKER_EWMA_WEIGHT;
+    if (self->_service_time < 1)
+        self->_service_time = 1;
+}
+
+//  Take the credit a worker advertises, if any; returns true if it did
+//  advertise credit
+
+static bool
+s_worker_credit(worker_t *self, zframe_t *props_frame)
+{
+    uint64_t credit;
+    if (!idprops_get_uint(props_frame, IDP_PROP_CREDIT, &credit))
+        return false;
+    self->_credit = credit < 1 ? 1 : credit > WORKER_MAX_CREDIT ? WORKER_MAX_CREDIT : (uint32_t)credit;
+    return true;
+}
+
+//  .split outlier ejection
+//  A healthy worker is judged by its average service time once it has
+//  given SERVICE_OUTLIER_MIN_SAMPLES replies, and ejected if that is
+//  _outlier_factor times the service median. A worker on probation is
+//  judged by each reply instead: a slow one ejects it again, for twice as
+//  long, and SERVICE_PROBE_REQUESTS good ones make it healthy and wipe its
+//  strikes. Workers lost to a timeout get a strike too, which waits for
+//  them under their routing id in case they register again:
+
+static void
+s_worker_judge(worker_t *self, int64_t sample)
+{
+    service_t *service = self->_service;
+    int64_t factor = service->_limits._outlier_factor;
+    if (!factor)
+    {
+        if (self->_health == WORKER_PROBING)
+            s_worker_restore(self); //  Ejection was turned off meanwhile
+        return;
+    }
+    int64_t median = s_service_latency_percentile(service, 50);
+    if (self->_health == WORKER_PROBING)
+    {
+        if (median && sample > factor * median)
+            s_worker_eject(self);
+        else if (++self->_answered >= SERVICE_PROBE_REQUESTS)
+            s_worker_restore(self);
+        else
+            idwheel_arm(self->_broker->_timers, &self->_outlier_timer, self->_broker->_now + SERVICE_PROBE_INTERVAL);
+    }
+    else if (self->_health == WORKER_HEALTHY && ++self->_answered >= SERVICE_OUTLIER_MIN_SAMPLES
+             && median && self->_service_time > factor * median)
+        s_worker_eject(self);
+}
+
+//  Take a worker out of rotation, unless that would leave less than half
+//  of the service's workers healthy
+
+static void
+s_worker_eject(worker_t *self)
+{
+    service_t *service = self->_service;
+    broker_t *broker = self->_broker;
+    if (self->_health == WORKER_HEALTHY)
+    {
+        if ((service->_ejected + 1) * 2 > service->_workers)
+            return;
+        service->_ejected++;
+    }
+    outlier_t *outlier = s_service_outlier_strike(service, self);
+    service->_ejections++;
+    self->_health = WORKER_EJECTED;
+    idlist_remove(&service->_waiting, &self->_service_link);
+    idwheel_arm(broker->_timers, &self->_outlier_timer, outlier->_until);
+    if (broker->_verbose)
+    {
+        char *identity = zframe_strhex(self->_address);
+        zclock_log("I: ejecting worker for %lld msecs: %s", (long long)(outlier->_until - broker->_now), identity);
+        free(identity);
+    }
+}
+
+static void
+s_worker_restore(worker_t *self)
+{
+    service_t *service = self->_service;
+    self->_health = WORKER_HEALTHY;
+    service->_ejected--;
+    idwheel_cancel(self->_broker->_timers, &self->_outlier_timer);
+    s_service_outlier_forget(service, self->_outlier);
+    self->_outlier = NULL;
+}
+
+//  A worker registering for a service picks up the strikes against its
+//  routing id: still ejected, or on probation if that has ended
+
+static void
+s_worker_admit(worker_t *self)
+{
+    service_t *service = self->_service;
+    broker_t *broker = self->_broker;
+    if (!service->_outliers || !service->_limits._outlier_factor)
+        return;
+    uint32_t hash = idtable_hash(zframe_data(self->_address), zframe_size(self->_address));
+    outlier_t *outlier = (outlier_t *)idtable_lookup(service->_outliers, zframe_data(self->_address),
+                                                     zframe_size(self->_address), hash);
+    if (!outlier || outlier->_worker)
+        return;
+    idlist_remove(&service->_outliers_lost, &outlier->_link);
+    outlier->_worker = self;
+    self->_outlier = outlier;
+    if ((service->_ejected + 1) * 2 > service->_workers)
+        return;
+    service->_ejected++;
+    if (outlier->_until > broker->_now)
+    {
+        self->_health = WORKER_EJECTED;
+        idwheel_arm(broker->_timers, &self->_outlier_timer, outlier->_until);
+    }
+    else
+        self->_health = WORKER_PROBING;
+}
+
+//  A worker that timed out counts as an outlier, if its service ejects
+//  them
+
+static void
+s_worker_lost(worker_t *self)
+{
+    if (self->_service && self->_service->_limits._outlier_factor)
+        s_service_outlier_strike(self->_service, self);
+}
+
+//  Add a strike against a worker; each one doubles the ejection
+
+static outlier_t *
+s_service_outlier_strike(service_t *self, worker_t *worker)
+{
+    broker_t *broker = self->_broker;
+    outlier_t *outlier = worker->_outlier;
+    if (!outlier)
+    {
+        if (!self->_outliers)
+        {
+            self->_outliers = idtable_new();
+            idtable_set_destructor(self->_outliers, s_outlier_destroy);
+        }
+        outlier = (outlier_t *)idpool_alloc(broker->_outlier_pool);
+        idlist_link_init(&outlier->_link, outlier);
+        outlier->_service = self;
+        outlier->_address = zframe_dup(worker->_address);
+        outlier->_hash = idtable_hash(zframe_data(outlier->_address), zframe_size(outlier->_address));
+        outlier->_worker = worker;
+        idtable_insert(self->_outliers, zframe_data(outlier->_address), zframe_size(outlier->_address),
+                       outlier->_hash, outlier);
+        worker->_outlier = outlier;
+    }
+    int64_t backoff = self->_limits._outlier_backoff;
+    uint32_t strike;
+    for (strike = 0; strike < outlier->_strikes && backoff < SERVICE_OUTLIER_MAX_BACKOFF; strike++)
+        backoff *= 2;
+    outlier->_strikes++;
+    outlier->_until = broker->_now + (backoff < SERVICE_OUTLIER_MAX_BACKOFF ? backoff : SERVICE_OUTLIER_MAX_BACKOFF);
+    return outlier;
+}
+
+//  The worker is gone; keep its strikes for a while, and forget those of
+//  workers lost too long ago
+
+static void
+s_service_outlier_lose(service_t *self, outlier_t *outlier)
+{
+    broker_t *broker = self->_broker;
+    outlier->_worker = NULL;
+    outlier->_lost = broker->_now;
+    idlist_append(&self->_outliers_lost, &outlier->_link);
+    while ((outlier = (outlier_t *)idlist_first(&self->_outliers_lost))
+           && (outlier->_lost + SERVICE_OUTLIER_MEMORY <= broker->_now
+               || idlist_size(&self->_outliers_lost) > SERVICE_OUTLIERS))
+        s_service_outlier_forget(self, outlier);
+}
+
+static void
+s_service_outlier_forget(service_t *self, outlier_t *outlier)
+{
+    idlist_remove(&self->_outliers_lost, &outlier->_link);
+    idtable_delete(self->_outliers, zframe_data(outlier->_address), zframe_size(outlier->_address), outlier->_hash);
+    s_outlier_destroy(outlier);
+}
+
+//  Outlier destructor is called when we forget an outlier, and for every
+//  remaining outlier when its service is destroyed.
+
+static void
+s_outlier_destroy(void *argument)
+{
+    outlier_t *outlier = (outlier_t *)argument;
+    zframe_destroy(&outlier->_address);
+    idpool_free(outlier->_service->_broker->_outlier_pool, outlier);
+}
+
+//  .split worker timers
+//  These are called by the timer wheel when a worker deadline comes due.
+//  An idle worker that stopped sending heartbeats is deleted:
+
+static void
+s_worker_expired(idtimer_t *timer, void *argument)
+{
+    (void)timer;
+    worker_t *self = (worker_t *)argument;
+    if (self->_broker->_verbose)
+    {
+        char *identity = zframe_strhex(self->_address);
+        zclock_log("I: deleting expired worker: %s", identity);
+        free(identity);
+    }
+    s_worker_lost(self);
+    s_worker_delete(self, 0);
+}
+
+//  An idle worker gets a HEARTBEAT every heartbeat interval:
+
+static void
+s_worker_heartbeat(idtimer_t *timer, void *argument)
+{
+    worker_t *self = (worker_t *)argument;
+    s_worker_send(self, IDPW_HEARTBEAT, NULL, NULL);
+    idwheel_arm(self->_broker->_timers, timer, self->_broker->_now + self->_broker->_heartbeat_interval);
+}
+
+//  A worker that held a request past the request timeout is presumed
+//  stuck, so we disconnect it:
+
+static void
+s_worker_request_expired(idtimer_t *timer, void *argument)
+{
+    (void)timer;
+    worker_t *self = (worker_t *)argument;
+    if (self->_broker->_verbose)
+    {
+        char *identity = zframe_strhex(self->_address);
+        zclock_log("I: deleting worker past request deadline: %s", identity);
+        free(identity);
+    }
+    s_worker_lost(self);
+    s_worker_delete(self, 1);
+}
+
+//  An ejected worker goes on probation when its ejection ends, and a
+//  worker on probation takes its next probe:
+
+static void
+s_worker_outlier_expired(idtimer_t *timer, void *argument)
+{
+    (void)timer;
+    worker_t *self = (worker_t *)argument;
+    if (self->_health == WORKER_EJECTED)
+    {
+        self->_health = WORKER_PROBING;
+        self->_answered = 0;
+        self->_service_time = 0;
+    }
+    s_worker_waiting(self);
 }
 
 //  .split main task
@@ -546,7 +3483,7 @@ int s_broker_loop(broker_t *self)
 {
     while (true)
     {
-        zsock_t *which = (zsock_t *)zpoller_wait(self->_poller, HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
+        zsock_t *which = (zsock_t *)zpoller_wait(self->_poller, TIMER_INTERVAL * ZMQ_POLL_MSEC);
 
         //int rc = zmq_poll (items, 1, HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
         if (which == NULL)
@@ -557,6 +3494,7 @@ int s_broker_loop(broker_t *self)
             }
         }
 
+        self->_now = zclock_time();
         bool clear = (which == self->_clear_socket);
 
         //  Process next input message, if any
@@ -574,10 +3512,20 @@ int s_broker_loop(broker_t *self)
             zframe_t *empty = zmsg_pop(msg);
             zframe_t *header = zmsg_pop(msg);
 
-            if (zframe_streq(header, IDPC_CLIENT))
-                s_broker_client_msg(self, sender, msg, clear);
+            if (!header)
+            {
+                if (self->_verbose)
+                    zclock_log("W: message without header, dropped");
+                zmsg_destroy(&msg);
+            }
+            else if (zframe_streq(header, IDPC_CLIENT))
+                s_broker_client_msg(self, &sender, msg, clear, false);
+            else if (zframe_streq(header, IDPC_CLIENT_PROPS))
+                s_broker_client_msg(self, &sender, msg, clear, true);
             else if (zframe_streq(header, IDPW_WORKER))
-                s_broker_worker_msg(self, sender, msg, clear);
+                s_broker_worker_msg(self, &sender, msg, clear, false);
+            else if (zframe_streq(header, IDPW_WORKER_PROPS))
+                s_broker_worker_msg(self, &sender, msg, clear, true);
             else
             {
                 zclock_log("E: invalid message:");
@@ -588,19 +3536,9 @@ int s_broker_loop(broker_t *self)
             zframe_destroy(&empty);
             zframe_destroy(&header);
         }
-        //  Disconnect and delete any expired workers
-        //  Send heartbeats to idle workers if needed
-        if (zclock_time() > self->_heartbeat_at)
-        {
-            s_broker_purge(self);
-            worker_t *worker = (worker_t *)zlist_first(self->_waiting);
-            while (worker)
-            {
-                s_worker_send(worker, IDPW_HEARTBEAT, NULL, NULL);
-                worker = (worker_t *)zlist_next(self->_waiting);
-            }
-            self->_heartbeat_at = zclock_time() + HEARTBEAT_INTERVAL;
-        }
+        //  Disconnect and delete any expired workers, send heartbeats to
+        //  idle workers and enforce request deadlines, as they come due
+        idwheel_advance(self->_timers, self->_now);
     }
     if (zctx_interrupted)
         printf("W: interrupt received, shutting down...\n");
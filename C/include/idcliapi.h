@@ -7,6 +7,7 @@
 
 #include "czmq.h"
 #include "idp.h"
+#include "idprops.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -26,12 +27,20 @@ extern "C"
     idcli_set_timeout(idcli_t *self, int timeout);
     void
     idcli_set_retries(idcli_t *self, int retries);
+    void
+    idcli_set_send_ttl(idcli_t *self, bool send_ttl);
+    void
+    idcli_set_priority(idcli_t *self, int priority);
+    void
+    idcli_set_idempotent(idcli_t *self, bool idempotent);
     zmsg_t *
     idcli_send(idcli_t *self, char *service, zmsg_t **request_p);
     int
     idcli_send2(idcli_t *self, char *service, zmsg_t **request_p);
     zmsg_t *
     idcli_recv2(idcli_t *self);
+    int
+    idcli_status(idcli_t *self);
 
 #ifdef __cplusplus
 }
@@ -53,6 +62,10 @@ struct _idcli_t
     int _verbose;     //  Print activity to stdout
     int _timeout;     //  Request timeout
     int _retries;     //  Request retries
+    bool _send_ttl;   //  Tell the broker how long we wait, with IDPC02
+    int _priority;    //  Priority class, sent with IDPC02 unless normal
+    bool _idempotent; //  Put an idempotency key on idcli_send requests
+    int _status;      //  Status the broker refused the last request with, or 0
     zcert_t *_client_cert;
     zpoller_t *_poller;
 };
@@ -107,6 +120,7 @@ idcli_new(char *broker_host, char *identity, int verbose)
     self->_identity = strdup(identity);
     self->_timeout = 2500; //  msecs
     self->_retries = 3;    //  Before we abandon
+    self->_priority = IDP_PRIORITY_NORMAL;
     self->_client_cert = NULL;
     self->_client = NULL;
     self->_poller = NULL;
@@ -215,11 +229,72 @@ void idcli_set_retries(idcli_t *self, int retries)
     self->_retries = retries;
 }
 
+//  ---------------------------------------------------------------------
+//  Send each request with our timeout as its TTL, so the broker can drop
+//  it rather than hand it to a worker once we have stopped waiting, and
+//  the worker can see how long it has. Needs a broker that speaks IDPC02.
+
+void idcli_set_send_ttl(idcli_t *self, bool send_ttl)
+{
+    assert(self);
+    self->_send_ttl = send_ttl;
+}
+
+//  ---------------------------------------------------------------------
+//  Set the priority class of our requests, one of IDP_PRIORITY_*. The
+//  broker serves higher classes first. Other than IDP_PRIORITY_NORMAL
+//  needs a broker that speaks IDPC02.
+
+void idcli_set_priority(idcli_t *self, int priority)
+{
+    assert(self);
+    assert(priority >= 0 && priority < IDP_PRIORITY_CLASSES);
+    self->_priority = priority;
+}
+
+//  ---------------------------------------------------------------------
+//  Put a fresh idempotency key on each request idcli_send makes, the same
+//  on every retry of it, so the broker runs a request once however often
+//  we resend it, and answers late retries with the reply it recorded.
+//  Needs a broker that speaks IDPC02.
+
+void idcli_set_idempotent(idcli_t *self, bool idempotent)
+{
+    assert(self);
+    self->_idempotent = idempotent;
+}
+
+//  ---------------------------------------------------------------------
+//  Status the broker refused the last request with, one of IDP_STATUS_*,
+//  or 0 if it did not refuse it. Tells a refusal from a lost reply when
+//  idcli_send or idcli_recv2 returns NULL. The broker only reports
+//  refusals of requests sent as IDPC02; others just get no reply.
+
+int idcli_status(idcli_t *self)
+{
+    assert(self);
+    return self->_status;
+}
+
+//  Take the properties frame off an IDPC02 reply and return the status
+//  the broker refused the request with, or 0
+
+static int
+s_idcli_reply_status(zmsg_t *msg)
+{
+    zframe_t *props = zmsg_pop(msg);
+    uint64_t status = 0;
+    idprops_get_uint(props, IDP_PROP_STATUS, &status);
+    zframe_destroy(&props);
+    return (int)status;
+}
+
 //  .split send request and wait for reply
 //  Here is the send method. It sends a request to the broker and gets a
 //  reply even if it has to retry several times. It takes ownership of the
 //  request message, and destroys it when sent. It returns the reply
-//  message, or NULL if there was no reply after multiple attempts:
+//  message, or NULL if there was no reply after multiple attempts or the
+//  broker refused the request (see idcli_status):
 
 zmsg_t *
 idcli_send(idcli_t *self, char *service, zmsg_t **request_p)
@@ -227,12 +302,28 @@ idcli_send(idcli_t *self, char *service, zmsg_t **request_p)
     assert(self);
     assert(request_p);
     zmsg_t *request = *request_p;
+    self->_status = 0;
 
     //  Prefix request with protocol frames
     //  Frame 1: "IDPCxy" (six bytes, IDP/Client x.y)
     //  Frame 2: Service name (printable string)
+    //  Frame 3: Properties, with IDPC02 only
+    idprops_t props;
+    idprops_init(&props);
+    if (self->_send_ttl)
+        idprops_put_uint(&props, IDP_PROP_TTL, self->_timeout);
+    if (self->_priority != IDP_PRIORITY_NORMAL)
+        idprops_put_uint(&props, IDP_PROP_PRIORITY, self->_priority);
+    if (self->_idempotent)
+    {
+        zuuid_t *key = zuuid_new();
+        idprops_put(&props, IDP_PROP_IDEMPOTENCY_KEY, zuuid_data(key), zuuid_size(key));
+        zuuid_destroy(&key);
+    }
+    if (idprops_size(&props))
+        zmsg_push(request, idprops_frame(&props));
     zmsg_pushstr(request, service);
-    zmsg_pushstr(request, IDPC_CLIENT);
+    zmsg_pushstr(request, idprops_size(&props) ? IDPC_CLIENT_PROPS : IDPC_CLIENT);
     if (self->_verbose)
     {
         zclock_log("I: send request to '%s' service:", service);
@@ -282,7 +373,8 @@ idcli_send(idcli_t *self, char *service, zmsg_t **request_p)
             assert(zmsg_size(msg) >= 3);
 
             zframe_t *header = zmsg_pop(msg);
-            assert(zframe_streq(header, IDPC_CLIENT));
+            bool has_props = zframe_streq(header, IDPC_CLIENT_PROPS);
+            assert(has_props || zframe_streq(header, IDPC_CLIENT));
             zframe_destroy(&header);
 
             zframe_t *reply_service = zmsg_pop(msg);
@@ -290,7 +382,16 @@ idcli_send(idcli_t *self, char *service, zmsg_t **request_p)
             zframe_destroy(&reply_service);
 
             zmsg_destroy(&request);
-            return msg; //  Success
+            //  The broker refuses a request with a status property
+            if (has_props)
+                self->_status = s_idcli_reply_status(msg);
+            if (self->_status)
+            {
+                if (self->_verbose)
+                    zclock_log("W: request refused with status %d", self->_status);
+                zmsg_destroy(&msg);
+            }
+            return msg; //  Success, or NULL if refused
         }
         else if (--retries_left)
         {
@@ -329,8 +430,17 @@ int idcli_send2(idcli_t *self, char *service, zmsg_t **request_p)
     //  Frame 0: empty (REQ emulation)
     //  Frame 1: "IDPCxy" (six bytes, IDP/Client x.y)
     //  Frame 2: Service name (printable string)
+    //  Frame 3: Properties, with IDPC02 only
+    idprops_t props;
+    idprops_init(&props);
+    if (self->_send_ttl)
+        idprops_put_uint(&props, IDP_PROP_TTL, self->_timeout);
+    if (self->_priority != IDP_PRIORITY_NORMAL)
+        idprops_put_uint(&props, IDP_PROP_PRIORITY, self->_priority);
+    if (idprops_size(&props))
+        zmsg_push(request, idprops_frame(&props));
     zmsg_pushstr(request, service);
-    zmsg_pushstr(request, IDPC_CLIENT);
+    zmsg_pushstr(request, idprops_size(&props) ? IDPC_CLIENT_PROPS : IDPC_CLIENT);
     zmsg_pushstr(request, "");
     if (self->_verbose)
     {
@@ -344,14 +454,16 @@ int idcli_send2(idcli_t *self, char *service, zmsg_t **request_p)
 //  .skip
 //  The recv method takes BOOKMARK
 //  ---------------------------------------------------------------------
-//  Returns the reply message or NULL if there was no reply. Does not
-//  attempt to recover from a broker failure, this is not possible
-//  without storing all unanswered requests and resending them all...
+//  Returns the reply message or NULL if there was no reply, or if the
+//  broker refused the request (see idcli_status). Does not attempt to
+//  recover from a broker failure, this is not possible without storing
+//  all unanswered requests and resending them all...
 
 zmsg_t *
 idcli_recv2(idcli_t *self)
 {
     assert(self);
+    self->_status = 0;
 
     zsock_t *which = (zsock_t *)zpoller_wait(self->_poller, self->_timeout * ZMQ_POLL_MSEC);
 
@@ -380,13 +492,22 @@ idcli_recv2(idcli_t *self)
         zframe_destroy(&empty);
 
         zframe_t *header = zmsg_pop(msg);
-        assert(zframe_streq(header, IDPC_CLIENT));
+        bool has_props = zframe_streq(header, IDPC_CLIENT_PROPS);
+        assert(has_props || zframe_streq(header, IDPC_CLIENT));
         zframe_destroy(&header);
 
         zframe_t *service = zmsg_pop(msg);
         zframe_destroy(&service);
 
-        return msg; //  Success
+        if (has_props)
+            self->_status = s_idcli_reply_status(msg);
+        if (self->_status)
+        {
+            if (self->_verbose)
+                zclock_log("W: request refused with status %d", self->_status);
+            zmsg_destroy(&msg);
+        }
+        return msg; //  Success, or NULL if refused
     }
     if (zctx_interrupted)
         printf("W: interrupt received, killing client...\n");
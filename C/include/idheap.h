@@ -0,0 +1,164 @@
+/*  =====================================================================
+ *  idheap.h - Irondomo intrusive binary min-heap
+ *  Items embed one idheap_link_t per heap they can belong to, holding the
+ *  key they are ordered by and their position in the heap, so push, pop
+ *  and removal of any item are O(log n). Items with equal keys come out
+ *  in the order they went in. A zeroed heap is empty and ready to use.
+ *  ===================================================================== */
+
+#pragma once
+
+#include "czmq.h"
+
+typedef struct
+{
+    int64_t _key;  //  Smallest key comes out first
+    uint64_t _seq; //  Insertion order, breaks ties between equal keys
+    size_t _index; //  Position in the heap, 0 if not in a heap
+    void *_owner;  //  Item that embeds this link
+} idheap_link_t;
+
+typedef struct
+{
+    idheap_link_t **_items; //  Links by position, from 1
+    size_t _size;           //  Number of items
+    size_t _capacity;       //  Slots in _items
+    uint64_t _seq;          //  Next insertion sequence number
+} idheap_t;
+
+static inline void
+idheap_init(idheap_t *self)
+{
+    memset(self, 0, sizeof(idheap_t));
+}
+
+//  Free the heap's storage; the items themselves are not touched
+
+static inline void
+idheap_release(idheap_t *self)
+{
+    free(self->_items);
+    idheap_init(self);
+}
+
+static inline void
+idheap_link_init(idheap_link_t *link, void *owner)
+{
+    link->_key = 0;
+    link->_seq = 0;
+    link->_index = 0;
+    link->_owner = owner;
+}
+
+static inline bool
+idheap_linked(idheap_link_t *link)
+{
+    return link->_index != 0;
+}
+
+static inline size_t
+idheap_size(idheap_t *self)
+{
+    return self->_size;
+}
+
+static inline bool
+s_idheap_before(idheap_link_t *left, idheap_link_t *right)
+{
+    return left->_key < right->_key || (left->_key == right->_key && left->_seq < right->_seq);
+}
+
+static inline void
+s_idheap_place(idheap_t *self, size_t index, idheap_link_t *link)
+{
+    self->_items[index] = link;
+    link->_index = index;
+}
+
+static void
+s_idheap_sift_up(idheap_t *self, size_t index)
+{
+    idheap_link_t *link = self->_items[index];
+    while (index > 1 && s_idheap_before(link, self->_items[index / 2]))
+    {
+        s_idheap_place(self, index, self->_items[index / 2]);
+        index /= 2;
+    }
+    s_idheap_place(self, index, link);
+}
+
+static void
+s_idheap_sift_down(idheap_t *self, size_t index)
+{
+    idheap_link_t *link = self->_items[index];
+    while (2 * index <= self->_size)
+    {
+        size_t child = 2 * index;
+        if (child < self->_size && s_idheap_before(self->_items[child + 1], self->_items[child]))
+            child++;
+        if (!s_idheap_before(self->_items[child], link))
+            break;
+        s_idheap_place(self, index, self->_items[child]);
+        index = child;
+    }
+    s_idheap_place(self, index, link);
+}
+
+//  ---------------------------------------------------------------------
+//  Add an item with the key already set in its link
+
+static void
+idheap_push(idheap_t *self, idheap_link_t *link)
+{
+    assert(!idheap_linked(link));
+    if (self->_size + 1 >= self->_capacity)
+    {
+        //  Slot 0 is unused, so positions start at 1
+        self->_capacity = self->_capacity ? self->_capacity * 2 : 16;
+        self->_items = (idheap_link_t **)realloc(self->_items, self->_capacity * sizeof(idheap_link_t *));
+        assert(self->_items);
+    }
+    link->_seq = self->_seq++;
+    link->_index = ++self->_size;
+    self->_items[link->_index] = link;
+    s_idheap_sift_up(self, link->_index);
+}
+
+//  ---------------------------------------------------------------------
+//  Take an item out of the heap; does nothing if it is not in one
+
+static void
+idheap_remove(idheap_t *self, idheap_link_t *link)
+{
+    if (!idheap_linked(link))
+        return;
+    size_t index = link->_index;
+    idheap_link_t *last = self->_items[self->_size--];
+    link->_index = 0;
+    if (last != link)
+    {
+        s_idheap_place(self, index, last);
+        s_idheap_sift_up(self, index);
+        s_idheap_sift_down(self, last->_index);
+    }
+}
+
+//  Returns the item with the smallest key, or NULL if the heap is empty
+
+static inline void *
+idheap_top(idheap_t *self)
+{
+    return self->_size ? self->_items[1]->_owner : NULL;
+}
+
+//  Removes and returns the item with the smallest key, or NULL
+
+static void *
+idheap_pop(idheap_t *self)
+{
+    if (self->_size == 0)
+        return NULL;
+    idheap_link_t *link = self->_items[1];
+    idheap_remove(self, link);
+    return link->_owner;
+}
@@ -0,0 +1,124 @@
+/*  =====================================================================
+ *  idlist.h - Irondomo intrusive doubly-linked list
+ *  Items embed one idlist_link_t per list they can belong to, so append,
+ *  remove and pop are O(1) and never allocate. A zeroed link is unlinked,
+ *  which is what zmalloc gives us for free.
+ *  ===================================================================== */
+
+#pragma once
+
+#include "czmq.h"
+
+typedef struct _idlist_link_t
+{
+    struct _idlist_link_t *_prev; //  Previous link, NULL if unlinked
+    struct _idlist_link_t *_next; //  Next link, NULL if unlinked
+    void *_owner;                 //  Item that embeds this link
+} idlist_link_t;
+
+typedef struct
+{
+    idlist_link_t _head; //  Sentinel, _next is first and _prev is last
+    size_t _size;        //  Number of linked items
+} idlist_t;
+
+static inline void
+idlist_init(idlist_t *self)
+{
+    self->_head._prev = &self->_head;
+    self->_head._next = &self->_head;
+    self->_head._owner = NULL;
+    self->_size = 0;
+}
+
+static inline void
+idlist_link_init(idlist_link_t *link, void *owner)
+{
+    link->_prev = NULL;
+    link->_next = NULL;
+    link->_owner = owner;
+}
+
+static inline bool
+idlist_linked(idlist_link_t *link)
+{
+    return link->_next != NULL;
+}
+
+static inline size_t
+idlist_size(idlist_t *self)
+{
+    return self->_size;
+}
+
+static inline void
+idlist_append(idlist_t *self, idlist_link_t *link)
+{
+    assert(!idlist_linked(link));
+    link->_prev = self->_head._prev;
+    link->_next = &self->_head;
+    self->_head._prev->_next = link;
+    self->_head._prev = link;
+    self->_size++;
+}
+
+static inline void
+idlist_prepend(idlist_t *self, idlist_link_t *link)
+{
+    assert(!idlist_linked(link));
+    link->_prev = &self->_head;
+    link->_next = self->_head._next;
+    self->_head._next->_prev = link;
+    self->_head._next = link;
+    self->_size++;
+}
+
+//  Unlink an item; does nothing if the item is not on a list
+
+static inline void
+idlist_remove(idlist_t *self, idlist_link_t *link)
+{
+    if (!idlist_linked(link))
+        return;
+    link->_prev->_next = link->_next;
+    link->_next->_prev = link->_prev;
+    link->_prev = NULL;
+    link->_next = NULL;
+    self->_size--;
+}
+
+//  Returns the first item, or NULL if the list is empty
+
+static inline void *
+idlist_first(idlist_t *self)
+{
+    return self->_head._next->_owner;
+}
+
+//  Returns the last item, or NULL if the list is empty
+
+static inline void *
+idlist_last(idlist_t *self)
+{
+    return self->_head._prev->_owner;
+}
+
+//  Returns the item after the given link, or NULL at the end of the list
+
+static inline void *
+idlist_next(idlist_link_t *link)
+{
+    return link->_next->_owner;
+}
+
+//  Unlinks and returns the first item, or NULL if the list is empty
+
+static inline void *
+idlist_pop(idlist_t *self)
+{
+    idlist_link_t *link = self->_head._next;
+    if (link == &self->_head)
+        return NULL;
+    idlist_remove(self, link);
+    return link->_owner;
+}
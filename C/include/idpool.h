@@ -0,0 +1,123 @@
+/*  =====================================================================
+ *  idpool.h - Irondomo fixed size record pool
+ *  Records are carved out of slabs of many records each and recycled
+ *  through a freelist, so steady state allocation and release are a
+ *  pointer swap. Slabs are only returned to the heap when the pool is
+ *  destroyed. The pool counts records in use and their high-water mark.
+ *  ===================================================================== */
+
+#pragma once
+
+#include "czmq.h"
+
+#define IDPOOL_SLAB_ITEMS 64 //  Default records per slab
+#define IDPOOL_ALIGN 16      //  Alignment of every record
+
+typedef struct _idpool_slab_t
+{
+    struct _idpool_slab_t *_next; //  Next slab, records follow the header
+} idpool_slab_t;
+
+typedef struct
+{
+    size_t _in_use;     //  Records handed out and not yet released
+    size_t _high_water; //  Most records ever in use at once
+    size_t _capacity;   //  Records in all slabs
+} idpool_stats_t;
+
+typedef struct
+{
+    size_t _item_size;     //  Record size, rounded up to IDPOOL_ALIGN
+    size_t _slab_items;    //  Records per slab
+    void *_free;           //  Freelist, linked through the records
+    idpool_slab_t *_slabs; //  All slabs we allocated
+    idpool_stats_t _stats;
+} idpool_t;
+
+#define IDPOOL_ROUND(size) (((size) + IDPOOL_ALIGN - 1) & ~(size_t)(IDPOOL_ALIGN - 1))
+
+//  ---------------------------------------------------------------------
+//  Constructor and destructor. Destroying the pool releases every slab,
+//  whether or not its records were released.
+
+static idpool_t *
+idpool_new(size_t item_size, size_t slab_items)
+{
+    idpool_t *self = (idpool_t *)zmalloc(sizeof(idpool_t));
+    self->_item_size = IDPOOL_ROUND(item_size > sizeof(void *) ? item_size : sizeof(void *));
+    self->_slab_items = slab_items > 0 ? slab_items : IDPOOL_SLAB_ITEMS;
+    return self;
+}
+
+static void
+idpool_destroy(idpool_t **self_p)
+{
+    assert(self_p);
+    if (*self_p)
+    {
+        idpool_t *self = *self_p;
+        while (self->_slabs)
+        {
+            idpool_slab_t *slab = self->_slabs;
+            self->_slabs = slab->_next;
+            free(slab);
+        }
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+//  Add a slab and thread its records onto the freelist
+
+static void
+s_idpool_grow(idpool_t *self)
+{
+    size_t header = IDPOOL_ROUND(sizeof(idpool_slab_t));
+    idpool_slab_t *slab = (idpool_slab_t *)malloc(header + self->_slab_items * self->_item_size);
+    assert(slab);
+    slab->_next = self->_slabs;
+    self->_slabs = slab;
+
+    byte *item = (byte *)slab + header;
+    size_t index;
+    for (index = 0; index < self->_slab_items; index++, item += self->_item_size)
+    {
+        *(void **)item = self->_free;
+        self->_free = item;
+    }
+    self->_stats._capacity += self->_slab_items;
+}
+
+//  ---------------------------------------------------------------------
+//  Returns a zeroed record, like zmalloc
+
+static void *
+idpool_alloc(idpool_t *self)
+{
+    if (!self->_free)
+        s_idpool_grow(self);
+    void *item = self->_free;
+    self->_free = *(void **)item;
+    memset(item, 0, self->_item_size);
+    if (++self->_stats._in_use > self->_stats._high_water)
+        self->_stats._high_water = self->_stats._in_use;
+    return item;
+}
+
+//  Return a record to the pool; does nothing if item is NULL
+
+static void
+idpool_free(idpool_t *self, void *item)
+{
+    if (!item)
+        return;
+    *(void **)item = self->_free;
+    self->_free = item;
+    self->_stats._in_use--;
+}
+
+static inline idpool_stats_t
+idpool_stats(idpool_t *self)
+{
+    return self->_stats;
+}
@@ -0,0 +1,122 @@
+/*  =====================================================================
+ *  idprops.h - Irondomo request properties
+ *  Builds and parses the properties frame of IDPC02 and IDPW02 messages:
+ *  a run of tag, length, value entries with one byte each for tag and
+ *  length. Readers skip tags they do not know, so peers can add
+ *  properties without breaking each other.
+ *  ===================================================================== */
+
+#pragma once
+
+#include "czmq.h"
+#include "idp.h"
+
+#define IDPROPS_MAX 512 //  Largest properties frame we build
+
+typedef struct
+{
+    byte _data[IDPROPS_MAX];
+    size_t _size;
+} idprops_t;
+
+static inline void
+idprops_init(idprops_t *self)
+{
+    self->_size = 0;
+}
+
+//  ---------------------------------------------------------------------
+//  Append a property; returns false if it does not fit
+
+static bool
+idprops_put(idprops_t *self, byte tag, const void *value, size_t size)
+{
+    if (size > 255 || self->_size + 2 + size > IDPROPS_MAX)
+        return false;
+    self->_data[self->_size++] = tag;
+    self->_data[self->_size++] = (byte)size;
+    memcpy(self->_data + self->_size, value, size);
+    self->_size += size;
+    return true;
+}
+
+//  Append an integer property, in four bytes if it fits, else eight
+
+static bool
+idprops_put_uint(idprops_t *self, byte tag, uint64_t value)
+{
+    byte buffer[8];
+    size_t size = value >> 32 ? 8 : 4;
+    size_t index;
+    for (index = 0; index < size; index++)
+        buffer[index] = (byte)(value >> (8 * (size - 1 - index)));
+    return idprops_put(self, tag, buffer, size);
+}
+
+static inline size_t
+idprops_size(idprops_t *self)
+{
+    return self->_size;
+}
+
+static inline zframe_t *
+idprops_frame(idprops_t *self)
+{
+    return zframe_new(self->_data, self->_size);
+}
+
+//  ---------------------------------------------------------------------
+//  Find a property in a received frame. Returns its value and sets
+//  size_p, or returns NULL if the frame does not carry the tag.
+
+static const byte *
+idprops_get(zframe_t *frame, byte tag, size_t *size_p)
+{
+    const byte *data = zframe_data(frame);
+    size_t size = zframe_size(frame);
+    size_t offset = 0;
+    while (offset + 2 <= size)
+    {
+        size_t length = data[offset + 1];
+        if (offset + 2 + length > size)
+            break; //  Truncated entry
+        if (data[offset] == tag)
+        {
+            *size_p = length;
+            return data + offset + 2;
+        }
+        offset += 2 + length;
+    }
+    return NULL;
+}
+
+//  True if a received frame is a whole run of entries. Peers are not
+//  trusted, so we check before we take a frame as properties.
+
+static bool
+idprops_valid(zframe_t *frame)
+{
+    if (!frame)
+        return false;
+    const byte *data = zframe_data(frame);
+    size_t size = zframe_size(frame);
+    size_t offset = 0;
+    while (offset + 2 <= size)
+        offset += 2 + data[offset + 1];
+    return offset == size;
+}
+
+static bool
+idprops_get_uint(zframe_t *frame, byte tag, uint64_t *value_p)
+{
+    size_t size;
+    const byte *data = idprops_get(frame, tag, &size);
+    if (!data || size == 0 || size > 8)
+        return false;
+    uint64_t value = 0;
+    size_t index;
+    for (index = 0; index < size; index++)
+        value = (value << 8) | data[index];
+    *value_p = value;
+    return true;
+}
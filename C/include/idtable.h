@@ -0,0 +1,235 @@
+/*  =====================================================================
+ *  idtable.h - Irondomo flat hash table keyed by raw bytes
+ *  Open addressing with linear probing. Each slot caches the key hash
+ *  and holds short keys (such as ZeroMQ routing ids) inline, so neither
+ *  lookups nor inserts of short keys touch the heap.
+ *  ===================================================================== */
+
+#pragma once
+
+#include "czmq.h"
+
+//  Keys up to this size are stored inside the slot itself
+#define IDTABLE_INLINE_KEY 24
+#define IDTABLE_MIN_SLOTS 16
+
+typedef void(idtable_destructor_fn)(void *value);
+
+typedef struct
+{
+    void *_value;   //  Item value, NULL if slot is empty
+    uint32_t _hash; //  Cached key hash
+    uint32_t _size; //  Key size in bytes
+    union
+    {
+        byte _inline[IDTABLE_INLINE_KEY];
+        byte *_heap;
+    } _key;
+} idtable_slot_t;
+
+typedef struct
+{
+    idtable_slot_t *_slots;              //  Slot array, power of two
+    size_t _mask;                        //  Number of slots - 1
+    size_t _size;                        //  Number of items
+    size_t _heap_keys;                   //  Bytes of keys held out of line
+    idtable_destructor_fn *_destructor; //  Called on values at destroy
+} idtable_t;
+
+//  ---------------------------------------------------------------------
+//  FNV-1a hash of a key; callers compute it once per message and pass it
+//  to every table operation on that key.
+
+static inline uint32_t
+idtable_hash(const byte *key, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t index;
+    for (index = 0; index < size; index++)
+    {
+        hash ^= key[index];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline const byte *
+s_idtable_slot_key(const idtable_slot_t *slot)
+{
+    return slot->_size <= IDTABLE_INLINE_KEY ? slot->_key._inline : slot->_key._heap;
+}
+
+static inline bool
+s_idtable_slot_matches(const idtable_slot_t *slot, const byte *key, size_t size, uint32_t hash)
+{
+    return slot->_hash == hash && slot->_size == size && memcmp(s_idtable_slot_key(slot), key, size) == 0;
+}
+
+//  ---------------------------------------------------------------------
+//  Constructor and destructor
+
+static idtable_t *
+idtable_new(void)
+{
+    idtable_t *self = (idtable_t *)zmalloc(sizeof(idtable_t));
+    self->_slots = (idtable_slot_t *)zmalloc(IDTABLE_MIN_SLOTS * sizeof(idtable_slot_t));
+    self->_mask = IDTABLE_MIN_SLOTS - 1;
+    return self;
+}
+
+static void
+idtable_set_destructor(idtable_t *self, idtable_destructor_fn *destructor)
+{
+    self->_destructor = destructor;
+}
+
+static void
+idtable_destroy(idtable_t **self_p)
+{
+    assert(self_p);
+    if (*self_p)
+    {
+        idtable_t *self = *self_p;
+        size_t index;
+        for (index = 0; index <= self->_mask; index++)
+        {
+            idtable_slot_t *slot = &self->_slots[index];
+            if (!slot->_value)
+                continue;
+            if (slot->_size > IDTABLE_INLINE_KEY)
+                free(slot->_key._heap);
+            if (self->_destructor)
+                self->_destructor(slot->_value);
+        }
+        free(self->_slots);
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  Lookup, returns item value or NULL if the key is not present
+
+static void *
+idtable_lookup(idtable_t *self, const byte *key, size_t size, uint32_t hash)
+{
+    size_t index = hash & self->_mask;
+    while (self->_slots[index]._value)
+    {
+        if (s_idtable_slot_matches(&self->_slots[index], key, size, hash))
+            return self->_slots[index]._value;
+        index = (index + 1) & self->_mask;
+    }
+    return NULL;
+}
+
+//  Place an already-built slot, used by insert and by rehashing
+
+static void
+s_idtable_place(idtable_t *self, const idtable_slot_t *source)
+{
+    size_t index = source->_hash & self->_mask;
+    while (self->_slots[index]._value)
+        index = (index + 1) & self->_mask;
+    self->_slots[index] = *source;
+}
+
+static void
+s_idtable_grow(idtable_t *self)
+{
+    idtable_slot_t *slots = self->_slots;
+    size_t limit = self->_mask + 1;
+    self->_slots = (idtable_slot_t *)zmalloc(limit * 2 * sizeof(idtable_slot_t));
+    self->_mask = limit * 2 - 1;
+    size_t index;
+    for (index = 0; index < limit; index++)
+        if (slots[index]._value)
+            s_idtable_place(self, &slots[index]);
+    free(slots);
+}
+
+//  ---------------------------------------------------------------------
+//  Insert a new item; the key must not already be present
+
+static void
+idtable_insert(idtable_t *self, const byte *key, size_t size, uint32_t hash, void *value)
+{
+    assert(value);
+    //  Keep load factor under 3/4 so probe sequences stay short
+    if ((self->_size + 1) * 4 > (self->_mask + 1) * 3)
+        s_idtable_grow(self);
+
+    idtable_slot_t slot;
+    slot._value = value;
+    slot._hash = hash;
+    slot._size = (uint32_t)size;
+    if (size <= IDTABLE_INLINE_KEY)
+        memcpy(slot._key._inline, key, size);
+    else
+    {
+        slot._key._heap = (byte *)malloc(size);
+        memcpy(slot._key._heap, key, size);
+        self->_heap_keys += size;
+    }
+    s_idtable_place(self, &slot);
+    self->_size++;
+}
+
+//  ---------------------------------------------------------------------
+//  Delete an item, returns its value or NULL if the key was not present.
+//  We shift later members of the probe run back so lookups never need
+//  tombstones.
+
+static void *
+idtable_delete(idtable_t *self, const byte *key, size_t size, uint32_t hash)
+{
+    size_t index = hash & self->_mask;
+    while (self->_slots[index]._value)
+    {
+        if (s_idtable_slot_matches(&self->_slots[index], key, size, hash))
+            break;
+        index = (index + 1) & self->_mask;
+    }
+    idtable_slot_t *slot = &self->_slots[index];
+    void *value = slot->_value;
+    if (!value)
+        return NULL;
+    if (slot->_size > IDTABLE_INLINE_KEY)
+    {
+        free(slot->_key._heap);
+        self->_heap_keys -= slot->_size;
+    }
+    slot->_value = NULL;
+    self->_size--;
+
+    size_t hole = index;
+    size_t next = (index + 1) & self->_mask;
+    while (self->_slots[next]._value)
+    {
+        size_t home = self->_slots[next]._hash & self->_mask;
+        //  Move the item back if its home is not in (hole, next]
+        if (((next - home) & self->_mask) >= ((next - hole) & self->_mask))
+        {
+            self->_slots[hole] = self->_slots[next];
+            self->_slots[next]._value = NULL;
+            hole = next;
+        }
+        next = (next + 1) & self->_mask;
+    }
+    return value;
+}
+
+//  ---------------------------------------------------------------------
+//  Number of items, and bytes of memory held by the table
+
+static inline size_t
+idtable_size(idtable_t *self)
+{
+    return self->_size;
+}
+
+static inline size_t
+idtable_memory(idtable_t *self)
+{
+    return sizeof(idtable_t) + (self->_mask + 1) * sizeof(idtable_slot_t) + self->_heap_keys;
+}
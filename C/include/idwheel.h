@@ -0,0 +1,174 @@
+/*  =====================================================================
+ *  idwheel.h - Irondomo hierarchical timer wheel
+ *  Four levels of 64 slots each. Timers are embedded in their owners and
+ *  linked into slot lists, so arming, re-arming and cancelling are O(1).
+ *  Timers further out than the first level are cascaded down as the
+ *  wheel turns, which makes expiry amortized O(1) per timer.
+ *  ===================================================================== */
+
+#pragma once
+
+#include "czmq.h"
+#include "idlist.h"
+
+#define IDWHEEL_LEVELS 4
+#define IDWHEEL_SLOT_BITS 6
+#define IDWHEEL_SLOTS (1 << IDWHEEL_SLOT_BITS)
+#define IDWHEEL_SLOT_MASK (IDWHEEL_SLOTS - 1)
+#define IDWHEEL_RESOLUTION 10 //  msecs per tick
+
+typedef struct _idtimer_t idtimer_t;
+typedef void(idtimer_fn)(idtimer_t *timer, void *arg);
+
+struct _idtimer_t
+{
+    idlist_link_t _link; //  Hook for the slot we are in
+    idlist_t *_slot;     //  Slot we are in, NULL if not armed
+    uint64_t _expires;   //  Tick at which we fire
+    idtimer_fn *_handler;
+    void *_arg;
+};
+
+typedef struct
+{
+    idlist_t _slots[IDWHEEL_LEVELS][IDWHEEL_SLOTS];
+    uint64_t _tick;  //  Last tick we processed
+    int _resolution; //  Msecs per tick
+    size_t _armed;   //  Number of armed timers
+} idwheel_t;
+
+//  ---------------------------------------------------------------------
+//  Set up a timer; it starts out unarmed
+
+static inline void
+idtimer_init(idtimer_t *timer, idtimer_fn *handler, void *arg)
+{
+    idlist_link_init(&timer->_link, timer);
+    timer->_slot = NULL;
+    timer->_expires = 0;
+    timer->_handler = handler;
+    timer->_arg = arg;
+}
+
+static inline bool
+idtimer_armed(idtimer_t *timer)
+{
+    return timer->_slot != NULL;
+}
+
+//  ---------------------------------------------------------------------
+//  Constructor and destructor. The wheel starts turning at the given
+//  clock time, in msecs.
+
+static idwheel_t *
+idwheel_new(int64_t now, int resolution)
+{
+    idwheel_t *self = (idwheel_t *)zmalloc(sizeof(idwheel_t));
+    int level, slot;
+    for (level = 0; level < IDWHEEL_LEVELS; level++)
+        for (slot = 0; slot < IDWHEEL_SLOTS; slot++)
+            idlist_init(&self->_slots[level][slot]);
+    self->_resolution = resolution > 0 ? resolution : IDWHEEL_RESOLUTION;
+    self->_tick = (uint64_t)now / self->_resolution;
+    return self;
+}
+
+static void
+idwheel_destroy(idwheel_t **self_p)
+{
+    assert(self_p);
+    if (*self_p)
+    {
+        free(*self_p);
+        *self_p = NULL;
+    }
+}
+
+//  Put a timer in the slot that matches its distance from now
+
+static void
+s_idwheel_place(idwheel_t *self, idtimer_t *timer)
+{
+    uint64_t delta = timer->_expires - self->_tick;
+    int level = 0;
+    while (level < IDWHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (IDWHEEL_SLOT_BITS * (level + 1))))
+        level++;
+    if (delta >= ((uint64_t)1 << (IDWHEEL_SLOT_BITS * IDWHEEL_LEVELS)))
+        //  Beyond the wheel's range, park in the furthest slot
+        timer->_expires = self->_tick + ((uint64_t)1 << (IDWHEEL_SLOT_BITS * IDWHEEL_LEVELS)) - 1;
+
+    idlist_t *slot = &self->_slots[level][(timer->_expires >> (IDWHEEL_SLOT_BITS * level)) & IDWHEEL_SLOT_MASK];
+    idlist_append(slot, &timer->_link);
+    timer->_slot = slot;
+}
+
+//  ---------------------------------------------------------------------
+//  Cancel a timer; does nothing if the timer is not armed
+
+static inline void
+idwheel_cancel(idwheel_t *self, idtimer_t *timer)
+{
+    if (timer->_slot)
+    {
+        idlist_remove(timer->_slot, &timer->_link);
+        timer->_slot = NULL;
+        self->_armed--;
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  Arm or re-arm a timer to fire at the given clock time, in msecs.
+//  Deadlines in the past fire on the next tick; deadlines beyond the
+//  wheel's range (about 46 hours at 10 msecs per tick) fire at its edge.
+
+static void
+idwheel_arm(idwheel_t *self, idtimer_t *timer, int64_t when)
+{
+    idwheel_cancel(self, timer);
+    uint64_t expires = ((uint64_t)when + self->_resolution - 1) / self->_resolution;
+    timer->_expires = expires > self->_tick ? expires : self->_tick + 1;
+    s_idwheel_place(self, timer);
+    self->_armed++;
+}
+
+//  ---------------------------------------------------------------------
+//  Turn the wheel up to the given clock time, in msecs, calling the
+//  handler of every timer that comes due. Handlers may arm and cancel
+//  any timer, including the one that fired.
+
+static void
+idwheel_advance(idwheel_t *self, int64_t now)
+{
+    uint64_t target = (uint64_t)now / self->_resolution;
+    while (self->_tick < target)
+    {
+        self->_tick++;
+
+        //  Cascade timers from outer levels whenever an inner level wraps
+        int level;
+        for (level = 1; level < IDWHEEL_LEVELS; level++)
+        {
+            if (self->_tick & (((uint64_t)1 << (IDWHEEL_SLOT_BITS * level)) - 1))
+                break;
+            idlist_t *slot = &self->_slots[level][(self->_tick >> (IDWHEEL_SLOT_BITS * level)) & IDWHEEL_SLOT_MASK];
+            idtimer_t *timer;
+            while ((timer = (idtimer_t *)idlist_pop(slot)))
+                s_idwheel_place(self, timer);
+        }
+
+        idlist_t *slot = &self->_slots[0][self->_tick & IDWHEEL_SLOT_MASK];
+        idtimer_t *timer;
+        while ((timer = (idtimer_t *)idlist_pop(slot)))
+        {
+            timer->_slot = NULL;
+            self->_armed--;
+            timer->_handler(timer, timer->_arg);
+        }
+    }
+}
+
+static inline size_t
+idwheel_armed(idwheel_t *self)
+{
+    return self->_armed;
+}
@@ -7,6 +7,7 @@
 
 #include "czmq.h"
 #include "idp.h"
+#include "idprops.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -15,6 +16,7 @@ extern "C"
 
     //  Opaque class structure
     typedef struct _idwrk_t idwrk_t;
+    typedef struct _idwrk_envelope_t idwrk_envelope_t;
 
     idwrk_t *
     idwrk_new(char *broker, char *service, char *identity, int verbose);
@@ -26,8 +28,22 @@ extern "C"
     idwrk_set_heartbeat(idwrk_t *self, int heartbeat);
     void
     idwrk_set_reconnect(idwrk_t *self, int reconnect);
+    void
+    idwrk_set_credit(idwrk_t *self, int credit);
     zmsg_t *
     idwrk_recv(idwrk_t *self, zmsg_t **reply_p);
+    zmsg_t *
+    idwrk_recv_request(idwrk_t *self, idwrk_envelope_t **envelope_p);
+    void
+    idwrk_send_reply(idwrk_t *self, idwrk_envelope_t **envelope_p, zmsg_t **reply_p);
+    void
+    idwrk_envelope_destroy(idwrk_envelope_t **envelope_p);
+    void
+    idwrk_envelope_set_max_age(idwrk_envelope_t *envelope, int64_t max_age);
+    int64_t
+    idwrk_remaining(idwrk_t *self);
+    void
+    idwrk_set_max_age(idwrk_t *self, int64_t max_age);
 
 #ifdef __cplusplus
 }
@@ -59,14 +75,16 @@ struct _idwrk_t
     int _verbose; //  Print activity to stdout
 
     //  Heartbeat management
-    uint64_t _heartbeat_at; //  When to send HEARTBEAT
+    int64_t _heartbeat_at;  //  When to send HEARTBEAT
     size_t _liveness;       //  How many attempts left
     int _heartbeat;         //  Heartbeat delay, msecs
     int _reconnect;         //  Reconnect delay, msecs
 
-    int _expect_reply;         //  Zero only at start
-    zframe_t *_reply_to_clear; //  Return address, if any
-    zframe_t *_reply_to_curve; //  Return address, if any
+    int _expect_reply;            //  Zero only at start
+    idwrk_envelope_t *_envelope;  //  Reply envelope of the request idwrk_recv returned
+    int64_t _deadline;            //  When the client stops waiting, 0 if unknown
+    int _credit;                  //  Requests we let the broker send us at once
+    bool _broker_props;           //  Broker has spoken IDPW02 to us
 };
 
 //  .split utility functions
@@ -99,6 +117,27 @@ idwrk_send_to_broker(idwrk_t *self, char *command, char *option,
     zmsg_send(&msg, self->_worker);
 }
 
+//  Send an IDPW02 message, with a properties frame after the command.
+//  Takes ownership of the properties frame.
+
+static void
+s_idwrk_send_props(idwrk_t *self, char *command, zframe_t *props, zmsg_t *msg)
+{
+    msg = msg ? zmsg_dup(msg) : zmsg_new();
+    zmsg_push(msg, props);
+    zmsg_pushstr(msg, command);
+    zmsg_pushstr(msg, IDPW_WORKER_PROPS);
+    zmsg_pushstr(msg, "");
+
+    if (self->_verbose)
+    {
+        zclock_log("I: sending %s to broker",
+                   idps_commands[(int)*command]);
+        zmsg_dump(msg);
+    }
+    zmsg_send(&msg, self->_worker);
+}
+
 //  ---------------------------------------------------------------------
 //  Connect or reconnect to broker
 
@@ -128,8 +167,16 @@ void idwrk_connect_to_broker(idwrk_t *self)
     if (self->_verbose)
         zclock_log("I: connecting to broker at %s...", self->_broker_host);
 
-    //  Register service with broker
-    idwrk_send_to_broker(self, IDPW_READY, self->_service, NULL);
+    //  Register service with broker, asking for request properties and
+    //  telling it our credit
+    idprops_t props;
+    idprops_init(&props);
+    idprops_put_uint(&props, IDP_PROP_CREDIT, self->_credit);
+    zmsg_t *ready = zmsg_new();
+    zmsg_push(ready, idprops_frame(&props));
+    idwrk_send_to_broker(self, IDPW_READY, self->_service, ready);
+    zmsg_destroy(&ready);
+    self->_broker_props = false;
 
     //  If liveness hits zero, queue is considered disconnected
     self->_liveness = HEARTBEAT_LIVENESS;
@@ -159,6 +206,7 @@ idwrk_new(char *broker_host, char *service, char *identity, int verbose)
     self->_reconnect = 2500; //  msecs
 
     self->_expect_reply = 0;
+    self->_credit = 1;
     self->_worker_cert = NULL;
     self->_worker_cert = NULL;
     self->_poller = NULL;
@@ -208,6 +256,7 @@ void idwrk_destroy(idwrk_t **self_p)
             zcert_destroy(&(self->_worker_cert));
             self->_worker_cert = NULL;
         }
+        idwrk_envelope_destroy(&self->_envelope);
 
         if (self->_worker_public_key)
         {
@@ -254,42 +303,100 @@ void idwrk_set_reconnect(idwrk_t *self, int reconnect)
     self->_reconnect = reconnect;
 }
 
-//  .split recv method
-//  This is the recv method; it's a little misnamed since it first sends
-//  any reply and then waits for a new request. If you have a better name
-//  for this, let me know:
+//  ---------------------------------------------------------------------
+//  Set how many requests the broker may send us before we reply to the
+//  first, 1 by default. With more, the next requests are already queued
+//  here while we work, instead of each waiting a round trip to the
+//  broker. Takes effect at once if the broker has spoken IDPW02 to us,
+//  otherwise when we next connect.
+
+void idwrk_set_credit(idwrk_t *self, int credit)
+{
+    assert(self);
+    self->_credit = credit > 0 ? credit : 1;
+    if (self->_worker && self->_broker_props)
+    {
+        idprops_t props;
+        idprops_init(&props);
+        idprops_put_uint(&props, IDP_PROP_CREDIT, self->_credit);
+        s_idwrk_send_props(self, IDPW_HEARTBEAT, idprops_frame(&props), NULL);
+    }
+}
+
+//  .split reply envelopes
+//  Each request comes with the envelope its reply must go back in: the
+//  client address, the socket the client used, and with IDPW02 the
+//  request id. A worker with credit may hold several requests at once
+//  and answer them in any order, one envelope each:
+
+struct _idwrk_envelope_t
+{
+    zframe_t *_address; //  Client return address
+    bool _curve;        //  Client is on the CURVE socket
+    bool _props;        //  Came as IDPW02, so the reply goes back that way
+    uint32_t _id;       //  Request id, with IDPW02
+    int64_t _deadline;  //  When the client stops waiting, 0 if unknown
+    int64_t _max_age;   //  Msecs the broker may cache the reply, 0 = not cacheable
+};
+
+void idwrk_envelope_destroy(idwrk_envelope_t **envelope_p)
+{
+    assert(envelope_p);
+    if (*envelope_p)
+    {
+        zframe_destroy(&(*envelope_p)->_address);
+        free(*envelope_p);
+        *envelope_p = NULL;
+    }
+}
 
 //  ---------------------------------------------------------------------
-//  Send reply, if any, to broker and wait for next request.
+//  Let the broker answer the same request with this reply for max_age
+//  msecs, if the service has a cache. Only IDPW02 replies can say so.
 
-zmsg_t *
-idwrk_recv(idwrk_t *self, zmsg_t **reply_p)
+void idwrk_envelope_set_max_age(idwrk_envelope_t *envelope, int64_t max_age)
 {
-    //  Format and send the reply if we were provided one
-    assert(reply_p);
+    assert(envelope);
+    envelope->_max_age = max_age > 0 ? max_age : 0;
+}
+
+//  ---------------------------------------------------------------------
+//  Send the reply to a request and destroy its envelope. Takes ownership
+//  of the reply message.
+
+void idwrk_send_reply(idwrk_t *self, idwrk_envelope_t **envelope_p, zmsg_t **reply_p)
+{
+    assert(envelope_p && *envelope_p);
+    assert(reply_p && *reply_p);
+    idwrk_envelope_t *envelope = *envelope_p;
     zmsg_t *reply = *reply_p;
-    assert(reply || !self->_expect_reply);
-    if (reply)
-    {
-        if (self->_reply_to_clear)
-        {
-            zmsg_wrap(reply, self->_reply_to_clear);
-            idwrk_send_to_broker(self, IDPW_REPLY, NULL, reply);
-        }
-        else if (self->_reply_to_curve)
-        {
-            zmsg_wrap(reply, self->_reply_to_curve);
-            idwrk_send_to_broker(self, IDPW_REPLY_CURVE, NULL, reply);
-        }
-        else
-        {
-            zclock_log("E: MISSING REPLY!");
-        }
+    char *command = envelope->_curve ? IDPW_REPLY_CURVE : IDPW_REPLY;
 
-        zmsg_destroy(reply_p);
+    zmsg_wrap(reply, envelope->_address);
+    envelope->_address = NULL;
+    if (envelope->_props)
+    {
+        idprops_t props;
+        idprops_init(&props);
+        idprops_put_uint(&props, IDP_PROP_REQUEST_ID, envelope->_id);
+        if (envelope->_max_age)
+            idprops_put_uint(&props, IDP_PROP_MAX_AGE, envelope->_max_age);
+        s_idwrk_send_props(self, command, idprops_frame(&props), reply);
     }
-    self->_expect_reply = 1;
+    else
+        idwrk_send_to_broker(self, command, NULL, reply);
+    zmsg_destroy(reply_p);
+    idwrk_envelope_destroy(envelope_p);
+}
 
+//  ---------------------------------------------------------------------
+//  Wait for the next request, sending heartbeats while we wait. Returns
+//  the request and its reply envelope, or NULL if interrupted.
+
+zmsg_t *
+idwrk_recv_request(idwrk_t *self, idwrk_envelope_t **envelope_p)
+{
+    assert(envelope_p);
     while (1)
     {
         zsock_t *which = (zsock_t *)zpoller_wait(self->_poller, self->_heartbeat * ZMQ_POLL_MSEC);
@@ -323,17 +430,38 @@ idwrk_recv(idwrk_t *self, zmsg_t **reply_p)
             zframe_destroy(&empty);
 
             zframe_t *header = zmsg_pop(msg);
-            assert(zframe_streq(header, IDPW_WORKER));
+            bool props = zframe_streq(header, IDPW_WORKER_PROPS);
+            assert(props || zframe_streq(header, IDPW_WORKER));
             zframe_destroy(&header);
+            if (props)
+                self->_broker_props = true;
 
             zframe_t *command = zmsg_pop(msg);
             if (zframe_streq(command, IDPW_REQUEST) || zframe_streq(command, IDPW_REQUEST_CURVE))
             {
+                idwrk_envelope_t *envelope = (idwrk_envelope_t *)zmalloc(sizeof(idwrk_envelope_t));
+                envelope->_curve = zframe_streq(command, IDPW_REQUEST_CURVE);
+                envelope->_props = props;
+
+                //  IDPW02 requests carry properties before the client
+                //  envelope: the request id, and a TTL that tells us when
+                //  the client gives up
+                if (props)
+                {
+                    zframe_t *props_frame = zmsg_pop(msg);
+                    uint64_t value;
+                    if (idprops_get_uint(props_frame, IDP_PROP_REQUEST_ID, &value))
+                        envelope->_id = (uint32_t)value;
+                    if (idprops_get_uint(props_frame, IDP_PROP_TTL, &value))
+                        envelope->_deadline = zclock_time() + (int64_t)(value < INT32_MAX ? value : INT32_MAX);
+                    zframe_destroy(&props_frame);
+                }
                 //  We should pop and save as many addresses as there are
                 //  up to a null part, but for now, just save one...
-                self->_reply_to_clear = zframe_streq(command, IDPW_REQUEST) ? zmsg_unwrap(msg) : NULL;
-                self->_reply_to_curve = zframe_streq(command, IDPW_REQUEST_CURVE) ? zmsg_unwrap(msg) : NULL;
+                envelope->_address = zmsg_unwrap(msg);
+                self->_deadline = envelope->_deadline;
                 zframe_destroy(&command);
+                *envelope_p = envelope;
                 //  .split process message
                 //  Here is where we actually have a message to process; we
                 //  return it to the caller application:
@@ -369,3 +497,58 @@ idwrk_recv(idwrk_t *self, zmsg_t **reply_p)
         printf("W: interrupt received, killing worker...\n");
     return NULL;
 }
+
+//  .split recv method
+//  This is the recv method; it's a little misnamed since it first sends
+//  any reply and then waits for a new request. If you have a better name
+//  for this, let me know:
+
+//  ---------------------------------------------------------------------
+//  Send reply, if any, to broker and wait for next request.
+
+zmsg_t *
+idwrk_recv(idwrk_t *self, zmsg_t **reply_p)
+{
+    //  Format and send the reply if we were provided one
+    assert(reply_p);
+    zmsg_t *reply = *reply_p;
+    assert(reply || !self->_expect_reply);
+    if (reply)
+    {
+        if (self->_envelope)
+            idwrk_send_reply(self, &self->_envelope, reply_p);
+        else
+        {
+            zclock_log("E: MISSING REPLY!");
+            zmsg_destroy(reply_p);
+        }
+    }
+    self->_expect_reply = 1;
+    return idwrk_recv_request(self, &self->_envelope);
+}
+
+//  ---------------------------------------------------------------------
+//  Msecs left before the client stops waiting for the request we last
+//  returned, 0 if it already has, or -1 if the client did not say. Work
+//  on a request with no time left is wasted, as nobody reads the reply.
+
+int64_t
+idwrk_remaining(idwrk_t *self)
+{
+    assert(self);
+    if (!self->_deadline)
+        return -1;
+    int64_t remaining = self->_deadline - zclock_time();
+    return remaining > 0 ? remaining : 0;
+}
+
+//  ---------------------------------------------------------------------
+//  Mark the reply to the request we last returned cacheable for max_age
+//  msecs; see idwrk_envelope_set_max_age.
+
+void idwrk_set_max_age(idwrk_t *self, int64_t max_age)
+{
+    assert(self);
+    if (self->_envelope)
+        idwrk_envelope_set_max_age(self->_envelope, max_age);
+}
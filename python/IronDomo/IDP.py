@@ -2,6 +2,11 @@
 #  This is the version of IDP/Client we implement
 C_CLIENT = b"IDPC01"
 
+#  Same protocol with a properties frame after the service name. The
+#  broker refuses IDPC02 requests with an IDPC02 reply whose properties
+#  carry PROP_STATUS, and no body
+C_CLIENT_PROPS = b"IDPC02"
+
 #  This is the version of IDP/Worker we implement
 W_WORKER = b"IDPW01"
 
@@ -15,3 +20,24 @@ W_REQUEST_CURVE =   b"\006"
 W_REPLY_CURVE   =   b"\007"
 
 commands = [None, b"READY", b"REQUEST", b"REPLY", b"HEARTBEAT", b"DISCONNECT"]
+
+#  Properties are a run of tag, length, value entries, one byte each for
+#  tag and length. Integer values are unsigned, in network byte order.
+PROP_STATUS = 7
+
+#  Statuses the broker refuses requests with, as in HTTP
+STATUS_RATE_LIMITED = 429
+STATUS_UNAVAILABLE = 503
+
+def prop_uint(frame, tag):
+    """Integer property of a properties frame, or None if it has none"""
+    offset = 0
+    while offset + 2 <= len(frame):
+        length = frame[offset + 1]
+        value = frame[offset + 2:offset + 2 + length]
+        if len(value) < length:
+            break
+        if frame[offset] == tag and 0 < length <= 8:
+            return int.from_bytes(value, 'big')
+        offset += 2 + length
+    return None
@@ -24,6 +24,7 @@ class IronDomoAsyncClient(object):
     retries = 3
     verbose = True
     credentials = None
+    status = None
 
     def __init__(self, broker, verbose=False, credentials=None, identity=None, ctx=None, timeout=2500):
         self.timeout = timeout
@@ -70,7 +71,10 @@ class IronDomoAsyncClient(object):
         self.client.send(request)
 
     def recv(self):
-
+        """Returns the reply message or None if there was no reply, or if
+        the broker refused the request; status then says why.
+        """
+        self.status = None
         try:
             items = self.poller.poll(self.timeout)
         except KeyboardInterrupt:
@@ -87,10 +91,17 @@ class IronDomoAsyncClient(object):
 
             msg.pop(0)
             header = msg.pop(0)
-            assert IDP.C_CLIENT == header
+            assert header in (IDP.C_CLIENT, IDP.C_CLIENT_PROPS)
 
             msg.pop(0)  # popping reply service
-            reply = msg
+            # The broker refuses a request with a status property
+            if header == IDP.C_CLIENT_PROPS:
+                self.status = IDP.prop_uint(msg.pop(0), IDP.PROP_STATUS)
+            if self.status:
+                logging.warn("W: request refused with status %d", self.status)
+                reply = None
+            else:
+                reply = msg
         else:
             reply = None
 
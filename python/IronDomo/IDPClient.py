@@ -23,6 +23,7 @@ class IronDomoClient(object):
     retries = 3
     verbose = True 
     credentials = None
+    status = None
 
     def __init__(self, broker, verbose=False, credentials=None, identity=None, ctx=None, timeout = 2500):
         self.timeout = timeout
@@ -56,11 +57,13 @@ class IronDomoClient(object):
     def send(self, service, request):
         """Send request to broker and get reply by hook or crook.
         Takes ownership of request message and destroys it when sent.
-        Returns the reply message or None if there was no reply.
+        Returns the reply message or None if there was no reply, or if
+        the broker refused the request; status then says why.
         """
         if not isinstance(request, list):
             request = [request]
         request = [IDP.C_CLIENT, service] + request
+        self.status = None
         if self.verbose:
             logging.info("I: send request to '%s' service: ", service)
             dump(request)
@@ -84,12 +87,18 @@ class IronDomoClient(object):
                 assert len(msg) >= 3
 
                 header = msg.pop(0)
-                assert IDP.C_CLIENT == header
+                assert header in (IDP.C_CLIENT, IDP.C_CLIENT_PROPS)
 
                 reply_service = msg.pop(0)
                 assert service == reply_service
 
-                reply = msg
+                # The broker refuses a request with a status property
+                if header == IDP.C_CLIENT_PROPS:
+                    self.status = IDP.prop_uint(msg.pop(0), IDP.PROP_STATUS)
+                if self.status:
+                    logging.warn("W: request refused with status %d", self.status)
+                else:
+                    reply = msg
                 break
             else:
                 if retries: